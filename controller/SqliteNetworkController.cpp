@@ -57,6 +57,7 @@
 #include "../node/InetAddress.hpp"
 #include "../node/MAC.hpp"
 #include "../node/Address.hpp"
+#include "../node/Buffer.hpp"
 
 #include "../osdep/OSUtils.hpp"
 
@@ -138,6 +139,15 @@ static void _ipToBlob(const InetAddress &a,char *ipBlob,int &ipVersion) /* blob[
 	}
 }
 
+// Index of the lowest set bit in a nonzero word
+static inline unsigned int _lowestSetBit(const uint64_t v)
+{
+	unsigned int b = 0;
+	while (((v >> b) & 1) == 0)
+		++b;
+	return b;
+}
+
 // Member.recentHistory is stored in a BLOB as an array of strings containing JSON objects.
 // This is kind of hacky but efficient and quick to parse and send to the client.
 class MemberRecentHistory : public std::list<std::string>
@@ -164,53 +174,6 @@ public:
 	}
 };
 
-struct MemberRecord
-{
-	sqlite3_int64 rowid;
-	char nodeId[16];
-	bool authorized;
-	bool activeBridge;
-	uint64_t lastRequestTime;
-	MemberRecentHistory recentHistory;
-
-	MemberRecord() :
-		rowid(0),
-		authorized(false),
-		activeBridge(false),
-		lastRequestTime(0)
-	{
-		nodeId[0] = (char)0;
-	}
-};
-
-struct NetworkRecord
-{
-	char id[24];
-	const char *name;
-	int flags;
-	bool isPrivate;
-	bool enableBroadcast;
-	bool allowPassiveBridging;
-	int multicastLimit;
-	uint64_t creationTime;
-	uint64_t revision;
-	uint64_t memberRevisionCounter;
-
-	NetworkRecord() :
-		name((const char *)0),
-		flags(0),
-		isPrivate(true),
-		enableBroadcast(false),
-		allowPassiveBridging(false),
-		multicastLimit(0),
-		creationTime(0),
-		revision(0),
-		memberRevisionCounter(0)
-	{
-		id[0] = (char)0;
-	}
-};
-
 #ifdef ZT_NETCONF_SQLITE_TRACE
 static void sqliteTraceFunc(void *ptr,const char *s)
 {
@@ -223,7 +186,9 @@ static void sqliteTraceFunc(void *ptr,const char *s)
 SqliteNetworkController::SqliteNetworkController(Node *node,const char *dbPath,const char *circuitTestPath) :
 	_node(node),
 	_backupThreadRun(true),
+	_requestThreadsRun(true),
 	_backupNeeded(true),
+	_wal(false),
 	_dbPath(dbPath),
 	_circuitTestPath(circuitTestPath),
 	_db((sqlite3 *)0)
@@ -233,7 +198,22 @@ SqliteNetworkController::SqliteNetworkController(Node *node,const char *dbPath,c
 	sqlite3_busy_timeout(_db,10000);
 
 	sqlite3_exec(_db,"PRAGMA synchronous = OFF",0,0,0);
-	sqlite3_exec(_db,"PRAGMA journal_mode = MEMORY",0,0,0);
+
+	// WAL lets request threads read through their own connections while the API and history
+	// writes go through _db, and lets backups run without locking anyone out. In-memory
+	// databases stay in MEMORY mode and everything goes through _db.
+	{
+		sqlite3_stmt *jm = (sqlite3_stmt *)0;
+		if ((sqlite3_prepare_v2(_db,"PRAGMA journal_mode = WAL",-1,&jm,(const char **)0) == SQLITE_OK)&&(jm)) {
+			if (sqlite3_step(jm) == SQLITE_ROW) {
+				const char *mode = (const char *)sqlite3_column_text(jm,0);
+				_wal = ((mode)&&(!strcmp(mode,"wal")));
+			}
+			sqlite3_finalize(jm);
+		}
+		if (!_wal)
+			sqlite3_exec(_db,"PRAGMA journal_mode = MEMORY",0,0,0);
+	}
 
 	sqlite3_stmt *s = (sqlite3_stmt *)0;
 	if ((sqlite3_prepare_v2(_db,"SELECT v FROM Config WHERE k = 'schemaVersion';",-1,&s,(const char **)0) == SQLITE_OK)&&(s)) {
@@ -378,7 +358,7 @@ SqliteNetworkController::SqliteNetworkController(Node *node,const char *dbPath,c
 
 			/* IpAssignment */
 			||(sqlite3_prepare_v2(_db,"SELECT ip,ipNetmaskBits,ipVersion FROM IpAssignment WHERE networkId = ? AND nodeId = ? AND \"type\" = 0 ORDER BY ip ASC",-1,&_sGetIpAssignmentsForNode,(const char **)0) != SQLITE_OK)
-			||(sqlite3_prepare_v2(_db,"SELECT 1 FROM IpAssignment WHERE networkId = ? AND ip = ? AND ipVersion = ? AND \"type\" = ?",-1,&_sCheckIfIpIsAllocated,(const char **)0) != SQLITE_OK)
+			||(sqlite3_prepare_v2(_db,"SELECT ip,ipVersion FROM IpAssignment WHERE networkId = ? AND \"type\" = 0",-1,&_sGetIpAssignmentsForNetwork,(const char **)0) != SQLITE_OK)
 			||(sqlite3_prepare_v2(_db,"INSERT INTO IpAssignment (networkId,nodeId,\"type\",ip,ipNetmaskBits,ipVersion) VALUES (?,?,?,?,?,?)",-1,&_sAllocateIp,(const char **)0) != SQLITE_OK)
 			||(sqlite3_prepare_v2(_db,"DELETE FROM IpAssignment WHERE networkId = ? AND nodeId = ? AND \"type\" = ?",-1,&_sDeleteIpAllocations,(const char **)0) != SQLITE_OK)
 
@@ -437,20 +417,47 @@ SqliteNetworkController::SqliteNetworkController(Node *node,const char *dbPath,c
 			throw std::runtime_error("SqliteNetworkController unable to read instanceId (it's NULL)");
 		_instanceId = iid;
 	}
+	sqlite3_reset(_sGetConfig);
+
+	for(unsigned int i=0;i<ZT_SQLITENETWORKCONTROLLER_REQUEST_THREADS;++i) {
+		if (!_openShard(_shards[i])) {
+			std::string err(std::string("SqliteNetworkController unable to open read connection or prepare statements: ") + ((_shards[i].db) ? sqlite3_errmsg(_shards[i].db) : "sqlite3_open_v2() failed"));
+			for(unsigned int j=0;j<=i;++j)
+				_closeShard(_shards[j]);
+			throw std::runtime_error(err);
+		}
+	}
 
 #ifdef ZT_NETCONF_SQLITE_TRACE
 	sqlite3_trace(_db,sqliteTraceFunc,(void *)0);
 #endif
 
 	_backupThread = Thread::start(this);
+	for(unsigned int i=0;i<ZT_SQLITENETWORKCONTROLLER_REQUEST_THREADS;++i) {
+		_requestThreads[i].parent = this;
+		_requestThreads[i].thread = Thread::start(&(_requestThreads[i]));
+	}
 }
 
 SqliteNetworkController::~SqliteNetworkController()
 {
+	_requestThreadsRun = false;
+	for(unsigned int i=0;i<ZT_SQLITENETWORKCONTROLLER_REQUEST_THREADS;++i) {
+		_requestThreads[i].wake.post();
+		Thread::join(_requestThreads[i].thread);
+	}
+
 	_backupThreadRun = false;
 	Thread::join(_backupThread);
 
-	Mutex::Lock _l(_lock);
+	for(unsigned int i=0;i<ZT_SQLITENETWORKCONTROLLER_REQUEST_THREADS;++i) {
+		_Shard &shard = _shards[i];
+		Mutex::Lock _l(shard.lock);
+		_flushMemberHistory(shard,(unsigned long)shard.membersWithNewHistory.size());
+		_closeShard(shard);
+	}
+
+	Mutex::Lock _l(_dbLock);
 	if (_db) {
 		sqlite3_finalize(_sGetNetworkById);
 		sqlite3_finalize(_sGetMember);
@@ -461,7 +468,7 @@ SqliteNetworkController::~SqliteNetworkController()
 		sqlite3_finalize(_sGetActiveBridges);
 		sqlite3_finalize(_sGetIpAssignmentsForNode);
 		sqlite3_finalize(_sGetIpAssignmentPools);
-		sqlite3_finalize(_sCheckIfIpIsAllocated);
+		sqlite3_finalize(_sGetIpAssignmentsForNetwork);
 		sqlite3_finalize(_sAllocateIp);
 		sqlite3_finalize(_sDeleteIpAllocations);
 		sqlite3_finalize(_sGetRelays);
@@ -496,7 +503,66 @@ SqliteNetworkController::~SqliteNetworkController()
 	}
 }
 
+void SqliteNetworkController::request(NetworkController::Sender *sender,uint64_t requestPacketId,const InetAddress &fromAddr,const Identity &signingId,const Identity &identity,uint64_t nwid,const Dictionary<ZT_NETWORKCONFIG_DICT_CAPACITY> &metaData)
+{
+	// Network numbers are the low 24 bits of the network ID
+	_RequestThread &rt = _requestThreads[(unsigned int)(nwid % ZT_SQLITENETWORKCONTROLLER_REQUEST_THREADS)];
+	{
+		Mutex::Lock _l(rt.queue_m);
+		if (rt.queue.size() >= ZT_SQLITENETWORKCONTROLLER_MAX_QUEUED_REQUESTS) {
+			++rt.dropped;
+			return;
+		}
+		rt.queue.push_back(_QueuedRequest());
+		_QueuedRequest &qr = rt.queue.back();
+		qr.sender = sender;
+		qr.requestPacketId = requestPacketId;
+		qr.fromAddr = fromAddr;
+		qr.signingId = signingId;
+		qr.identity = identity;
+		qr.nwid = nwid;
+		qr.metaData.assign(metaData.data(),metaData.sizeBytes());
+		++rt.received;
+		if (rt.queue.size() > rt.maxQueued)
+			rt.maxQueued = (unsigned long)rt.queue.size();
+	}
+	rt.wake.post();
+}
+
+void SqliteNetworkController::requestQueueStats(RequestQueueStats &s) const
+{
+	memset(&s,0,sizeof(s));
+	for(unsigned int i=0;i<ZT_SQLITENETWORKCONTROLLER_REQUEST_THREADS;++i) {
+		const _RequestThread &rt = _requestThreads[i];
+		Mutex::Lock _l(rt.queue_m);
+		s.queued += (unsigned long)rt.queue.size();
+		s.maxQueued = std::max(s.maxQueued,rt.maxQueued);
+		s.received += rt.received;
+		s.dropped += rt.dropped;
+		s.completed += rt.completed;
+	}
+}
+
+void SqliteNetworkController::configCacheStats(ConfigCacheStats &s) const
+{
+	memset(&s,0,sizeof(s));
+	for(unsigned int i=0;i<ZT_SQLITENETWORKCONTROLLER_REQUEST_THREADS;++i) {
+		const _Shard &shard = _shards[i];
+		Mutex::Lock _l(shard.lock);
+		s.configHits += shard.configCacheStats.configHits;
+		s.configMisses += shard.configCacheStats.configMisses;
+		s.comHits += shard.configCacheStats.comHits;
+		s.comMisses += shard.configCacheStats.comMisses;
+		s.networkLoads += shard.configCacheStats.networkLoads;
+	}
+}
+
 NetworkController::ResultCode SqliteNetworkController::doNetworkConfigRequest(const InetAddress &fromAddr,const Identity &signingId,const Identity &identity,uint64_t nwid,const Dictionary<ZT_NETWORKCONFIG_DICT_CAPACITY> &metaData,NetworkConfig &nc)
+{
+	return _doNetworkConfigRequest(fromAddr,signingId,identity,nwid,metaData,nc,(Dictionary<ZT_NETWORKCONFIG_DICT_CAPACITY> *)0);
+}
+
+NetworkController::ResultCode SqliteNetworkController::_doNetworkConfigRequest(const InetAddress &fromAddr,const Identity &signingId,const Identity &identity,uint64_t nwid,const Dictionary<ZT_NETWORKCONFIG_DICT_CAPACITY> &metaData,NetworkConfig &nc,Dictionary<ZT_NETWORKCONFIG_DICT_CAPACITY> *config)
 {
 	if (((!signingId)||(!signingId.hasPrivate()))||(signingId.address().toInt() != (nwid >> 24))) {
 		return NetworkController::NETCONF_QUERY_INTERNAL_SERVER_ERROR;
@@ -504,318 +570,226 @@ NetworkController::ResultCode SqliteNetworkController::doNetworkConfigRequest(co
 
 	const uint64_t now = OSUtils::now();
 
-	NetworkRecord network;
-	Utils::snprintf(network.id,sizeof(network.id),"%.16llx",(unsigned long long)nwid);
+	char nwids[24];
+	Utils::snprintf(nwids,sizeof(nwids),"%.16llx",(unsigned long long)nwid);
+
+	const uint64_t address = identity.address().toInt();
+	char addrs[16];
+	Utils::snprintf(addrs,sizeof(addrs),"%.10llx",(unsigned long long)address);
 
-	MemberRecord member;
-	Utils::snprintf(member.nodeId,sizeof(member.nodeId),"%.10llx",(unsigned long long)identity.address().toInt());
+	// Do not send relays to 1.1.0 since it had a serious bug in using them
+	// 1.1.0 will still work, it'll just fall back to roots instead of using network preferred relays
+	const bool sendRelays = !((metaData.getUI(ZT_NETWORKCONFIG_REQUEST_METADATA_KEY_NODE_MAJOR_VERSION,0) == 1)&&(metaData.getUI(ZT_NETWORKCONFIG_REQUEST_METADATA_KEY_NODE_MINOR_VERSION,0) == 1)&&(metaData.getUI(ZT_NETWORKCONFIG_REQUEST_METADATA_KEY_NODE_REVISION,0) == 0));
+	const bool sendLegacy = sendLegacyFormatConfig(metaData);
 
+	bool isPrivate = true;
+	bool haveCom = false;
+	int64_t memberRowId = 0;
+
+	_Shard &shard = _shardFor(nwid);
+	if (shard.apiWaiting) { // let a waiting API call go first
+		Mutex::Lock _g(shard.apiLock);
+	}
 	{ // begin lock
-		Mutex::Lock _l(_lock);
+		Mutex::Lock _l(shard.lock);
 
 		// Check rate limit circuit breaker to prevent flooding
 		{
-			uint64_t &lrt = _lastRequestTime[std::pair<uint64_t,uint64_t>(identity.address().toInt(),nwid)];
+			uint64_t &lrt = shard.lastRequestTime[std::pair<uint64_t,uint64_t>(address,nwid)];
 			if ((now - lrt) <= ZT_NETCONF_MIN_REQUEST_PERIOD)
 				return NetworkController::NETCONF_QUERY_IGNORE;
 			lrt = now;
 		}
 
-		_backupNeeded = true;
-
 		// Create Node record or do full identity check if we already have one
 
-		sqlite3_reset(_sGetNodeIdentity);
-		sqlite3_bind_text(_sGetNodeIdentity,1,member.nodeId,10,SQLITE_STATIC);
-		if (sqlite3_step(_sGetNodeIdentity) == SQLITE_ROW) {
-			try {
-				Identity alreadyKnownIdentity((const char *)sqlite3_column_text(_sGetNodeIdentity,0));
-				if (alreadyKnownIdentity != identity)
-					return NetworkController::NETCONF_QUERY_ACCESS_DENIED;
-			} catch ( ... ) { // identity stored in database is not valid or is NULL
+		const Identity *const knownIdentity = shard.nodeIdentityCache.get(address);
+		if (knownIdentity) {
+			if (*knownIdentity != identity)
 				return NetworkController::NETCONF_QUERY_ACCESS_DENIED;
-			}
 		} else {
-			std::string idstr(identity.toString(false));
-			sqlite3_reset(_sCreateOrReplaceNode);
-			sqlite3_bind_text(_sCreateOrReplaceNode,1,member.nodeId,10,SQLITE_STATIC);
-			sqlite3_bind_text(_sCreateOrReplaceNode,2,idstr.c_str(),-1,SQLITE_STATIC);
-			if (sqlite3_step(_sCreateOrReplaceNode) != SQLITE_DONE) {
-				return NetworkController::NETCONF_QUERY_INTERNAL_SERVER_ERROR;
+			bool haveNode = false;
+			bool identityMatches = false;
+			{
+				_ReadLock _rl(shard);
+				sqlite3_reset(shard.sGetNodeIdentity);
+				sqlite3_bind_text(shard.sGetNodeIdentity,1,addrs,10,SQLITE_STATIC);
+				if (sqlite3_step(shard.sGetNodeIdentity) == SQLITE_ROW) {
+					haveNode = true;
+					try {
+						identityMatches = (Identity((const char *)sqlite3_column_text(shard.sGetNodeIdentity,0)) == identity);
+					} catch ( ... ) {} // identity stored in database is not valid or is NULL
+				}
+				sqlite3_reset(shard.sGetNodeIdentity);
+			}
+			if (haveNode) {
+				if (!identityMatches)
+					return NetworkController::NETCONF_QUERY_ACCESS_DENIED;
+			} else {
+				std::string idstr(identity.toString(false));
+				_DbLock _dl(*this);
+				sqlite3_reset(_sCreateOrReplaceNode);
+				sqlite3_bind_text(_sCreateOrReplaceNode,1,addrs,10,SQLITE_STATIC);
+				sqlite3_bind_text(_sCreateOrReplaceNode,2,idstr.c_str(),-1,SQLITE_STATIC);
+				if (sqlite3_step(_sCreateOrReplaceNode) != SQLITE_DONE) {
+					return NetworkController::NETCONF_QUERY_INTERNAL_SERVER_ERROR;
+				}
+				_backupNeeded = true;
 			}
+			shard.nodeIdentityCache.set(address,identity);
 		}
 
-		// Fetch Network record
+		// Get Network and fetch or create Member
 
-		sqlite3_reset(_sGetNetworkById);
-		sqlite3_bind_text(_sGetNetworkById,1,network.id,16,SQLITE_STATIC);
-		if (sqlite3_step(_sGetNetworkById) == SQLITE_ROW) {
-			network.name = (const char *)sqlite3_column_text(_sGetNetworkById,0);
-			network.isPrivate = (sqlite3_column_int(_sGetNetworkById,1) > 0);
-			network.enableBroadcast = (sqlite3_column_int(_sGetNetworkById,2) > 0);
-			network.allowPassiveBridging = (sqlite3_column_int(_sGetNetworkById,3) > 0);
-			network.flags = sqlite3_column_int(_sGetNetworkById,4);
-			network.multicastLimit = sqlite3_column_int(_sGetNetworkById,5);
-			network.creationTime = (uint64_t)sqlite3_column_int64(_sGetNetworkById,6);
-			network.revision = (uint64_t)sqlite3_column_int64(_sGetNetworkById,7);
-			network.memberRevisionCounter = (uint64_t)sqlite3_column_int64(_sGetNetworkById,8);
-		} else {
+		_CachedNetwork *const network = _getCachedNetwork(shard,nwid,nwids);
+		if (!network)
 			return NetworkController::NETCONF_QUERY_OBJECT_NOT_FOUND;
-		}
+		isPrivate = network->isPrivate;
 
-		// Fetch or create Member record
-
-		sqlite3_reset(_sGetMember);
-		sqlite3_bind_text(_sGetMember,1,network.id,16,SQLITE_STATIC);
-		sqlite3_bind_text(_sGetMember,2,member.nodeId,10,SQLITE_STATIC);
-		if (sqlite3_step(_sGetMember) == SQLITE_ROW) {
-			member.rowid = sqlite3_column_int64(_sGetMember,0);
-			member.authorized = (sqlite3_column_int(_sGetMember,1) > 0);
-			member.activeBridge = (sqlite3_column_int(_sGetMember,2) > 0);
-			member.lastRequestTime = (uint64_t)sqlite3_column_int64(_sGetMember,5);
-			const char *rhblob = (const char *)sqlite3_column_blob(_sGetMember,6);
-			if (rhblob)
-				member.recentHistory.fromBlob(rhblob,(unsigned int)sqlite3_column_bytes(_sGetMember,6));
-		} else {
-			member.authorized = (network.isPrivate ? false : true);
-			member.activeBridge = false;
-			sqlite3_reset(_sCreateMember);
-			sqlite3_bind_text(_sCreateMember,1,network.id,16,SQLITE_STATIC);
-			sqlite3_bind_text(_sCreateMember,2,member.nodeId,10,SQLITE_STATIC);
-			sqlite3_bind_int(_sCreateMember,3,(member.authorized ? 1 : 0));
-			sqlite3_bind_text(_sCreateMember,4,network.id,16,SQLITE_STATIC);
-			if (sqlite3_step(_sCreateMember) != SQLITE_DONE) {
-				return NetworkController::NETCONF_QUERY_INTERNAL_SERVER_ERROR;
-			}
-			member.rowid = sqlite3_last_insert_rowid(_db);
-
-			sqlite3_reset(_sIncrementMemberRevisionCounter);
-			sqlite3_bind_text(_sIncrementMemberRevisionCounter,1,network.id,16,SQLITE_STATIC);
-			sqlite3_step(_sIncrementMemberRevisionCounter);
-		}
+		_CachedMember *const member = _getCachedMember(shard,*network,nwid,nwids,address,addrs);
+		if (!member)
+			return NetworkController::NETCONF_QUERY_INTERNAL_SERVER_ERROR;
 
-		// Update Member.history
+		// Add to Member.recentHistory -- these are written to the database later in batches by _flushMemberHistory(),
+		// by the background thread or at the latest by the first request more than ZT_SQLITENETWORKCONTROLLER_HISTORY_MAX_DELAY later
 
 		{
 			char mh[1024];
 			Utils::snprintf(mh,sizeof(mh),
 				"{\"ts\":%llu,\"authorized\":%s,\"clientMajorVersion\":%u,\"clientMinorVersion\":%u,\"clientRevision\":%u,\"fromAddr\":",
 				(unsigned long long)now,
-				((member.authorized) ? "true" : "false"),
+				((member->authorized) ? "true" : "false"),
 				metaData.getUI(ZT_NETWORKCONFIG_REQUEST_METADATA_KEY_NODE_MAJOR_VERSION,0),
 				metaData.getUI(ZT_NETWORKCONFIG_REQUEST_METADATA_KEY_NODE_MINOR_VERSION,0),
 				metaData.getUI(ZT_NETWORKCONFIG_REQUEST_METADATA_KEY_NODE_REVISION,0));
-			member.recentHistory.push_front(std::string(mh));
+			if (member->newHistory.empty()) {
+				if (shard.membersWithNewHistory.empty())
+					shard.newHistorySince = now;
+				shard.membersWithNewHistory.push_back(_MemberKey(nwid,address));
+			}
+			member->newHistory.push_back(std::string(mh));
 			if (fromAddr) {
-				member.recentHistory.front().push_back('"');
-				member.recentHistory.front().append(_jsonEscape(fromAddr.toString()));
-				member.recentHistory.front().append("\"}");
+				member->newHistory.back().push_back('"');
+				member->newHistory.back().append(_jsonEscape(fromAddr.toString()));
+				member->newHistory.back().append("\"}");
 			} else {
-				member.recentHistory.front().append("null}");
+				member->newHistory.back().append("null}");
 			}
-
-			while (member.recentHistory.size() > ZT_NETCONF_DB_MEMBER_HISTORY_LENGTH)
-				member.recentHistory.pop_back();
-			std::string rhblob(member.recentHistory.toBlob());
-
-			sqlite3_reset(_sUpdateMemberHistory);
-			sqlite3_clear_bindings(_sUpdateMemberHistory);
-			sqlite3_bind_int64(_sUpdateMemberHistory,1,(sqlite3_int64)now);
-			sqlite3_bind_blob(_sUpdateMemberHistory,2,(const void *)rhblob.data(),(int)rhblob.length(),SQLITE_STATIC);
-			sqlite3_bind_int64(_sUpdateMemberHistory,3,member.rowid);
-			sqlite3_step(_sUpdateMemberHistory);
+			if (member->newHistory.size() > ZT_NETCONF_DB_MEMBER_HISTORY_LENGTH)
+				member->newHistory.erase(member->newHistory.begin());
+			member->lastRequestTime = now;
 		}
+		if ((now - shard.newHistorySince) >= ZT_SQLITENETWORKCONTROLLER_HISTORY_MAX_DELAY)
+			_flushMemberHistory(shard,(unsigned long)shard.membersWithNewHistory.size());
 
 		// Don't proceed if member is not authorized! ---------------------------
 
-		if (!member.authorized)
+		if (!member->authorized)
 			return NetworkController::NETCONF_QUERY_ACCESS_DENIED;
+		memberRowId = member->rowid;
+
+		// Send the last config again if nothing in it has changed and its COM is still fresh
+		if (config) {
+			if ((!member->config.empty())&&(member->configRevision == network->revision)&&(member->configLegacy == sendLegacy)&&(member->configRelays == sendRelays)&&((now - member->configTimestamp) < ZT_SQLITENETWORKCONTROLLER_CONFIG_REUSE_PERIOD)) {
+				config->load(member->config.c_str());
+				++shard.configCacheStats.configHits;
+				return NetworkController::NETCONF_QUERY_OK;
+			}
+			++shard.configCacheStats.configMisses;
+		}
 
 		// Create network configuration -- we create both legacy and new types and send both for backward compatibility
 
 		// New network config structure
-		nc.networkId = Utils::hexStrToU64(network.id);
-		nc.type = network.isPrivate ? ZT_NETWORK_TYPE_PRIVATE : ZT_NETWORK_TYPE_PUBLIC;
+		nc.networkId = nwid;
+		nc.type = network->isPrivate ? ZT_NETWORK_TYPE_PRIVATE : ZT_NETWORK_TYPE_PUBLIC;
 		nc.timestamp = now;
-		nc.revision = network.revision;
-		nc.issuedTo = member.nodeId;
-		if (network.enableBroadcast) nc.flags |= ZT_NETWORKCONFIG_FLAG_ENABLE_BROADCAST;
-		if (network.allowPassiveBridging) nc.flags |= ZT_NETWORKCONFIG_FLAG_ALLOW_PASSIVE_BRIDGING;
-		memcpy(nc.name,network.name,std::min((unsigned int)ZT_MAX_NETWORK_SHORT_NAME_LENGTH,(unsigned int)strlen(network.name)));
-
-		{	// TODO: right now only etherTypes are supported in rules
-			std::vector<int> allowedEtherTypes;
-			sqlite3_reset(_sGetEtherTypesFromRuleTable);
-			sqlite3_bind_text(_sGetEtherTypesFromRuleTable,1,network.id,16,SQLITE_STATIC);
-			while (sqlite3_step(_sGetEtherTypesFromRuleTable) == SQLITE_ROW) {
-				if (sqlite3_column_type(_sGetEtherTypesFromRuleTable,0) == SQLITE_NULL) {
-					allowedEtherTypes.clear();
-					allowedEtherTypes.push_back(0); // NULL 'allow' matches ANY
-					break;
-				} else {
-					int et = sqlite3_column_int(_sGetEtherTypesFromRuleTable,0);
-					if ((et >= 0)&&(et <= 0xffff))
-						allowedEtherTypes.push_back(et);
-				}
-			}
-			std::sort(allowedEtherTypes.begin(),allowedEtherTypes.end());
-			allowedEtherTypes.erase(std::unique(allowedEtherTypes.begin(),allowedEtherTypes.end()),allowedEtherTypes.end());
-
-			for(long i=0;i<(long)allowedEtherTypes.size();++i) {
-				if ((nc.ruleCount + 2) > ZT_MAX_NETWORK_RULES)
-					break;
-				if (allowedEtherTypes[i] > 0) {
-					nc.rules[nc.ruleCount].t = ZT_NETWORK_RULE_MATCH_ETHERTYPE;
-					nc.rules[nc.ruleCount].v.etherType = (uint16_t)allowedEtherTypes[i];
-					++nc.ruleCount;
-				}
-				nc.rules[nc.ruleCount++].t = ZT_NETWORK_RULE_ACTION_ACCEPT;
+		nc.revision = network->revision;
+		nc.issuedTo = identity.address();
+		if (network->enableBroadcast) nc.flags |= ZT_NETWORKCONFIG_FLAG_ENABLE_BROADCAST;
+		if (network->allowPassiveBridging) nc.flags |= ZT_NETWORKCONFIG_FLAG_ALLOW_PASSIVE_BRIDGING;
+		memcpy(nc.name,network->name.data(),std::min((unsigned int)ZT_MAX_NETWORK_SHORT_NAME_LENGTH,(unsigned int)network->name.length()));
+
+		// TODO: right now only etherTypes are supported in rules
+		for(std::vector<int>::const_iterator et(network->etherTypes.begin());et!=network->etherTypes.end();++et) {
+			if ((nc.ruleCount + 2) > ZT_MAX_NETWORK_RULES)
+				break;
+			if (*et > 0) {
+				nc.rules[nc.ruleCount].t = ZT_NETWORK_RULE_MATCH_ETHERTYPE;
+				nc.rules[nc.ruleCount].v.etherType = (uint16_t)*et;
+				++nc.ruleCount;
 			}
+			nc.rules[nc.ruleCount++].t = ZT_NETWORK_RULE_ACTION_ACCEPT;
 		}
 
-		nc.multicastLimit = network.multicastLimit;
+		nc.multicastLimit = network->multicastLimit;
 
 		bool amActiveBridge = false;
-		{
-			sqlite3_reset(_sGetActiveBridges);
-			sqlite3_bind_text(_sGetActiveBridges,1,network.id,16,SQLITE_STATIC);
-			while (sqlite3_step(_sGetActiveBridges) == SQLITE_ROW) {
-				const char *ab = (const char *)sqlite3_column_text(_sGetActiveBridges,0);
-				if ((ab)&&(strlen(ab) == 10)) {
-					const uint64_t ab2 = Utils::hexStrToU64(ab);
-					nc.addSpecialist(Address(ab2),ZT_NETWORKCONFIG_SPECIALIST_TYPE_ACTIVE_BRIDGE);
-					if (!strcmp(member.nodeId,ab))
-						amActiveBridge = true;
-				}
-			}
+		for(std::vector<Address>::const_iterator ab(network->activeBridges.begin());ab!=network->activeBridges.end();++ab) {
+			nc.addSpecialist(*ab,ZT_NETWORKCONFIG_SPECIALIST_TYPE_ACTIVE_BRIDGE);
+			if (*ab == identity.address())
+				amActiveBridge = true;
 		}
 
-		// Do not send relays to 1.1.0 since it had a serious bug in using them
-		// 1.1.0 will still work, it'll just fall back to roots instead of using network preferred relays
-		if (!((metaData.getUI(ZT_NETWORKCONFIG_REQUEST_METADATA_KEY_NODE_MAJOR_VERSION,0) == 1)&&(metaData.getUI(ZT_NETWORKCONFIG_REQUEST_METADATA_KEY_NODE_MINOR_VERSION,0) == 1)&&(metaData.getUI(ZT_NETWORKCONFIG_REQUEST_METADATA_KEY_NODE_REVISION,0) == 0))) {
-			sqlite3_reset(_sGetRelays);
-			sqlite3_bind_text(_sGetRelays,1,network.id,16,SQLITE_STATIC);
-			while (sqlite3_step(_sGetRelays) == SQLITE_ROW) {
-				const char *n = (const char *)sqlite3_column_text(_sGetRelays,0);
-				const char *a = (const char *)sqlite3_column_text(_sGetRelays,1);
-				if ((n)&&(a)) {
-					Address node(n);
-					InetAddress addr(a);
-					if (node)
-						nc.addSpecialist(node,ZT_NETWORKCONFIG_SPECIALIST_TYPE_NETWORK_PREFERRED_RELAY);
-				}
-			}
+		if (sendRelays) {
+			for(std::vector<Address>::const_iterator r(network->relays.begin());r!=network->relays.end();++r)
+				nc.addSpecialist(*r,ZT_NETWORKCONFIG_SPECIALIST_TYPE_NETWORK_PREFERRED_RELAY);
 		}
 
-		sqlite3_reset(_sGetRoutes);
-		sqlite3_bind_text(_sGetRoutes,1,network.id,16,SQLITE_STATIC);
-		while ((sqlite3_step(_sGetRoutes) == SQLITE_ROW)&&(nc.routeCount < ZT_MAX_NETWORK_ROUTES)) {
-			ZT_VirtualNetworkRoute *r = &(nc.routes[nc.routeCount]);
-			memset(r,0,sizeof(ZT_VirtualNetworkRoute));
-			switch(sqlite3_column_int(_sGetRoutes,3)) { // ipVersion
-				case 4:
-					*(reinterpret_cast<InetAddress *>(&(r->target))) = InetAddress((const void *)((const char *)sqlite3_column_blob(_sGetRoutes,0) + 12),4,(unsigned int)sqlite3_column_int(_sGetRoutes,2));
-					break;
-				case 6:
-					*(reinterpret_cast<InetAddress *>(&(r->target))) = InetAddress((const void *)sqlite3_column_blob(_sGetRoutes,0),16,(unsigned int)sqlite3_column_int(_sGetRoutes,2));
-					break;
-				default:
-					continue;
-			}
-			if (sqlite3_column_type(_sGetRoutes,1) != SQLITE_NULL) {
-				switch(sqlite3_column_int(_sGetRoutes,3)) { // ipVersion
-					case 4:
-						*(reinterpret_cast<InetAddress *>(&(r->via))) = InetAddress((const void *)((const char *)sqlite3_column_blob(_sGetRoutes,1) + 12),4,0);
-						break;
-					case 6:
-						*(reinterpret_cast<InetAddress *>(&(r->via))) = InetAddress((const void *)sqlite3_column_blob(_sGetRoutes,1),16,0);
-						break;
-					default:
-						continue;
-				}
-			}
-			r->flags = (uint16_t)sqlite3_column_int(_sGetRoutes,4);
-			r->metric = (uint16_t)sqlite3_column_int(_sGetRoutes,5);
-			++nc.routeCount;
-		}
+		for(std::vector<ZT_VirtualNetworkRoute>::const_iterator r(network->routes.begin());(r!=network->routes.end())&&(nc.routeCount < ZT_MAX_NETWORK_ROUTES);++r)
+			nc.routes[nc.routeCount++] = *r;
 
 		// Assign special IPv6 addresses if these are enabled
-		if (((network.flags & ZT_DB_NETWORK_FLAG_ZT_MANAGED_V6_RFC4193) != 0)&&(nc.staticIpCount < ZT_MAX_ZT_ASSIGNED_ADDRESSES)) {
-			nc.staticIps[nc.staticIpCount++] = InetAddress::makeIpv6rfc4193(nwid,identity.address().toInt());
+		if (((network->flags & ZT_DB_NETWORK_FLAG_ZT_MANAGED_V6_RFC4193) != 0)&&(nc.staticIpCount < ZT_MAX_ZT_ASSIGNED_ADDRESSES)) {
+			nc.staticIps[nc.staticIpCount++] = InetAddress::makeIpv6rfc4193(nwid,address);
 			nc.flags |= ZT_NETWORKCONFIG_FLAG_ENABLE_IPV6_NDP_EMULATION;
 		}
-		if (((network.flags & ZT_DB_NETWORK_FLAG_ZT_MANAGED_V6_6PLANE) != 0)&&(nc.staticIpCount < ZT_MAX_ZT_ASSIGNED_ADDRESSES)) {
-			nc.staticIps[nc.staticIpCount++] = InetAddress::makeIpv66plane(nwid,identity.address().toInt());
+		if (((network->flags & ZT_DB_NETWORK_FLAG_ZT_MANAGED_V6_6PLANE) != 0)&&(nc.staticIpCount < ZT_MAX_ZT_ASSIGNED_ADDRESSES)) {
+			nc.staticIps[nc.staticIpCount++] = InetAddress::makeIpv66plane(nwid,address);
 			nc.flags |= ZT_NETWORKCONFIG_FLAG_ENABLE_IPV6_NDP_EMULATION;
 		}
 
 		// Get managed addresses that are assigned to this member
 		bool haveManagedIpv4AutoAssignment = false;
 		bool haveManagedIpv6AutoAssignment = false; // "special" NDP-emulated address types do not count
-		sqlite3_reset(_sGetIpAssignmentsForNode);
-		sqlite3_bind_text(_sGetIpAssignmentsForNode,1,network.id,16,SQLITE_STATIC);
-		sqlite3_bind_text(_sGetIpAssignmentsForNode,2,member.nodeId,10,SQLITE_STATIC);
-		while (sqlite3_step(_sGetIpAssignmentsForNode) == SQLITE_ROW) {
-			const unsigned char *const ipbytes = (const unsigned char *)sqlite3_column_blob(_sGetIpAssignmentsForNode,0);
-			if ((!ipbytes)||(sqlite3_column_bytes(_sGetIpAssignmentsForNode,0) != 16))
-				continue;
-			//const int ipNetmaskBits = sqlite3_column_int(_sGetIpAssignmentsForNode,1);
-			const int ipVersion = sqlite3_column_int(_sGetIpAssignmentsForNode,2);
-
-			InetAddress ip;
-			if (ipVersion == 4)
-				ip = InetAddress(ipbytes + 12,4,0);
-			else if (ipVersion == 6)
-				ip = InetAddress(ipbytes,16,0);
-			else continue;
-
+		for(std::vector<InetAddress>::const_iterator a(member->ipAssignments.begin());a!=member->ipAssignments.end();++a) {
 			// IP assignments are only pushed if there is a corresponding local route. We also now get the netmask bits from
 			// this route, ignoring the netmask bits field of the assigned IP itself. Using that was worthless and a source
 			// of user error / poor UX.
 			int routedNetmaskBits = 0;
 			for(unsigned int rk=0;rk<nc.routeCount;++rk) {
-				if ( (!nc.routes[rk].via.ss_family) && (reinterpret_cast<const InetAddress *>(&(nc.routes[rk].target))->containsAddress(ip)) )
+				if ( (!nc.routes[rk].via.ss_family) && (reinterpret_cast<const InetAddress *>(&(nc.routes[rk].target))->containsAddress(*a)) )
 					routedNetmaskBits = reinterpret_cast<const InetAddress *>(&(nc.routes[rk].target))->netmaskBits();
 			}
 
 			if (routedNetmaskBits > 0) {
 				if (nc.staticIpCount < ZT_MAX_ZT_ASSIGNED_ADDRESSES) {
+					InetAddress ip(*a);
 					ip.setPort(routedNetmaskBits);
 					nc.staticIps[nc.staticIpCount++] = ip;
 				}
-				if (ipVersion == 4)
+				if (a->ss_family == AF_INET)
 					haveManagedIpv4AutoAssignment = true;
-				else if (ipVersion == 6)
+				else if (a->ss_family == AF_INET6)
 					haveManagedIpv6AutoAssignment = true;
 			}
 		}
 
 		// Auto-assign IPv6 address if auto-assignment is enabled and it's needed
-		if ( ((network.flags & ZT_DB_NETWORK_FLAG_ZT_MANAGED_V6_AUTO_ASSIGN) != 0) && (!haveManagedIpv6AutoAssignment) && (!amActiveBridge) ) {
-			sqlite3_reset(_sGetIpAssignmentPools);
-			sqlite3_bind_text(_sGetIpAssignmentPools,1,network.id,16,SQLITE_STATIC);
-			sqlite3_bind_int(_sGetIpAssignmentPools,2,6); // 6 == IPv6
-			while (sqlite3_step(_sGetIpAssignmentPools) == SQLITE_ROW) {
-				const uint8_t *const ipRangeStartB = reinterpret_cast<const unsigned char *>(sqlite3_column_blob(_sGetIpAssignmentPools,0));
-				const uint8_t *const ipRangeEndB = reinterpret_cast<const unsigned char *>(sqlite3_column_blob(_sGetIpAssignmentPools,1));
-				if ((!ipRangeStartB)||(!ipRangeEndB)||(sqlite3_column_bytes(_sGetIpAssignmentPools,0) != 16)||(sqlite3_column_bytes(_sGetIpAssignmentPools,1) != 16))
-					continue;
-
-				uint64_t s[2],e[2],x[2],xx[2];
-				memcpy(s,ipRangeStartB,16);
-				memcpy(e,ipRangeEndB,16);
-				s[0] = Utils::ntoh(s[0]);
-				s[1] = Utils::ntoh(s[1]);
-				e[0] = Utils::ntoh(e[0]);
-				e[1] = Utils::ntoh(e[1]);
+		if ( ((network->flags & ZT_DB_NETWORK_FLAG_ZT_MANAGED_V6_AUTO_ASSIGN) != 0) && (!haveManagedIpv6AutoAssignment) && (!amActiveBridge) ) {
+			for(std::vector<_Ipv6Pool>::const_iterator p(network->ipv6Pools.begin());p!=network->ipv6Pools.end();++p) {
+				const uint64_t *const s = p->start;
+				const uint64_t *const e = p->end;
+				uint64_t x[2],xx[2];
 				x[0] = s[0];
 				x[1] = s[1];
 
+				bool assigned = false;
 				for(unsigned int trialCount=0;trialCount<1000;++trialCount) {
 					if ((trialCount == 0)&&(e[1] > s[1])&&((e[1] - s[1]) >= 0xffffffffffULL)) {
 						// First see if we can just cram a ZeroTier ID into the higher 64 bits. If so do that.
-						xx[0] = Utils::hton(x[0]);
-						xx[1] = Utils::hton(x[1] + identity.address().toInt());
+						xx[0] = x[0];
+						xx[1] = x[1] + address;
 					} else {
 						// Otherwise pick random addresses -- this technically doesn't explore the whole range if the lower 64 bit range is >= 1 but that won't matter since that would be huge anyway
 						Utils::getSecureRandom((void *)xx,16);
@@ -825,11 +799,17 @@ NetworkController::ResultCode SqliteNetworkController::doNetworkConfigRequest(co
 						if ((e[1] > s[1]))
 							xx[1] %= (e[1] - s[1]);
 						else xx[1] = 0;
-						xx[0] = Utils::hton(x[0] + xx[0]);
-						xx[1] = Utils::hton(x[1] + xx[1]);
+						xx[0] += x[0];
+						xx[1] += x[1];
 					}
 
-					InetAddress ip6((const void *)xx,16,0);
+					if (network->ipv6Assigned.count(std::pair<uint64_t,uint64_t>(xx[0],xx[1])) > 0)
+						continue;
+
+					uint64_t ip6b[2];
+					ip6b[0] = Utils::hton(xx[0]);
+					ip6b[1] = Utils::hton(xx[1]);
+					InetAddress ip6((const void *)ip6b,16,0);
 
 					// Check if this IP is within a local-to-Ethernet routed network
 					int routedNetmaskBits = 0;
@@ -840,107 +820,89 @@ NetworkController::ResultCode SqliteNetworkController::doNetworkConfigRequest(co
 
 					// If it's routed, then try to claim and assign it and if successful end loop
 					if (routedNetmaskBits > 0) {
-						sqlite3_reset(_sCheckIfIpIsAllocated);
-						sqlite3_bind_text(_sCheckIfIpIsAllocated,1,network.id,16,SQLITE_STATIC);
-						sqlite3_bind_blob(_sCheckIfIpIsAllocated,2,(const void *)ip6.rawIpData(),16,SQLITE_STATIC);
-						sqlite3_bind_int(_sCheckIfIpIsAllocated,3,6); // 6 == IPv6
-						sqlite3_bind_int(_sCheckIfIpIsAllocated,4,(int)0 /*ZT_IP_ASSIGNMENT_TYPE_ADDRESS*/);
-						if (sqlite3_step(_sCheckIfIpIsAllocated) != SQLITE_ROW) {
-							// No rows returned, so the IP is available
-							sqlite3_reset(_sAllocateIp);
-							sqlite3_bind_text(_sAllocateIp,1,network.id,16,SQLITE_STATIC);
-							sqlite3_bind_text(_sAllocateIp,2,member.nodeId,10,SQLITE_STATIC);
-							sqlite3_bind_int(_sAllocateIp,3,(int)0 /*ZT_IP_ASSIGNMENT_TYPE_ADDRESS*/);
-							sqlite3_bind_blob(_sAllocateIp,4,(const void *)ip6.rawIpData(),16,SQLITE_STATIC);
-							sqlite3_bind_int(_sAllocateIp,5,routedNetmaskBits); // IP netmask bits from matching route
-							sqlite3_bind_int(_sAllocateIp,6,6); // 6 == IPv6
-							if (sqlite3_step(_sAllocateIp) == SQLITE_DONE) {
-								ip6.setPort(routedNetmaskBits);
-								if (nc.staticIpCount < ZT_MAX_ZT_ASSIGNED_ADDRESSES)
-									nc.staticIps[nc.staticIpCount++] = ip6;
-								break;
-							}
+						_DbLock _dl(*this);
+						sqlite3_reset(_sAllocateIp);
+						sqlite3_bind_text(_sAllocateIp,1,nwids,16,SQLITE_STATIC);
+						sqlite3_bind_text(_sAllocateIp,2,addrs,10,SQLITE_STATIC);
+						sqlite3_bind_int(_sAllocateIp,3,(int)0 /*ZT_IP_ASSIGNMENT_TYPE_ADDRESS*/);
+						sqlite3_bind_blob(_sAllocateIp,4,(const void *)ip6.rawIpData(),16,SQLITE_STATIC);
+						sqlite3_bind_int(_sAllocateIp,5,routedNetmaskBits); // IP netmask bits from matching route
+						sqlite3_bind_int(_sAllocateIp,6,6); // 6 == IPv6
+						if (sqlite3_step(_sAllocateIp) == SQLITE_DONE) {
+							_backupNeeded = true;
+							network->ipv6Assigned.insert(std::pair<uint64_t,uint64_t>(xx[0],xx[1]));
+							member->ipAssignments.push_back(ip6);
+							ip6.setPort(routedNetmaskBits);
+							if (nc.staticIpCount < ZT_MAX_ZT_ASSIGNED_ADDRESSES)
+								nc.staticIps[nc.staticIpCount++] = ip6;
+							assigned = true;
 						}
+						break;
 					}
 				}
+				if (assigned)
+					break;
 			}
 		}
 
 		// Auto-assign IPv4 address if auto-assignment is enabled and it's needed
-		if ( ((network.flags & ZT_DB_NETWORK_FLAG_ZT_MANAGED_V4_AUTO_ASSIGN) != 0) && (!haveManagedIpv4AutoAssignment) && (!amActiveBridge) ) {
-			sqlite3_reset(_sGetIpAssignmentPools);
-			sqlite3_bind_text(_sGetIpAssignmentPools,1,network.id,16,SQLITE_STATIC);
-			sqlite3_bind_int(_sGetIpAssignmentPools,2,4); // 4 == IPv4
-			while (sqlite3_step(_sGetIpAssignmentPools) == SQLITE_ROW) {
-				const unsigned char *ipRangeStartB = reinterpret_cast<const unsigned char *>(sqlite3_column_blob(_sGetIpAssignmentPools,0));
-				const unsigned char *ipRangeEndB = reinterpret_cast<const unsigned char *>(sqlite3_column_blob(_sGetIpAssignmentPools,1));
-				if ((!ipRangeStartB)||(!ipRangeEndB)||(sqlite3_column_bytes(_sGetIpAssignmentPools,0) != 16)||(sqlite3_column_bytes(_sGetIpAssignmentPools,1) != 16))
+		if ( ((network->flags & ZT_DB_NETWORK_FLAG_ZT_MANAGED_V4_AUTO_ASSIGN) != 0) && (!haveManagedIpv4AutoAssignment) && (!amActiveBridge) ) {
+			for(std::vector<_Ipv4Pool>::iterator p(network->ipv4Pools.begin());p!=network->ipv4Pools.end();++p) {
+				// Start with the LSB of the member's address. Unrouted and .255 addresses are never free in the pool.
+				uint32_t ip = 0;
+				if (!p->findFree((uint32_t)(address & 0xffffffff),ip))
 					continue;
 
-				uint32_t ipRangeStart = Utils::ntoh(*(reinterpret_cast<const uint32_t *>(ipRangeStartB + 12)));
-				uint32_t ipRangeEnd = Utils::ntoh(*(reinterpret_cast<const uint32_t *>(ipRangeEndB + 12)));
-				if ((ipRangeEnd <= ipRangeStart)||(ipRangeStart == 0))
-					continue;
-				uint32_t ipRangeLen = ipRangeEnd - ipRangeStart;
-
-				// Start with the LSB of the member's address
-				uint32_t ipTrialCounter = (uint32_t)(identity.address().toInt() & 0xffffffff);
-
-				for(uint32_t k=ipRangeStart,trialCount=0;(k<=ipRangeEnd)&&(trialCount < 1000);++k,++trialCount) {
-					uint32_t ip = (ipRangeLen > 0) ? (ipRangeStart + (ipTrialCounter % ipRangeLen)) : ipRangeStart;
-					++ipTrialCounter;
-					if ((ip & 0x000000ff) == 0x000000ff)
-						continue; // don't allow addresses that end in .255
-
-					// Check if this IP is within a local-to-Ethernet routed network
-					int routedNetmaskBits = 0;
-					for(unsigned int rk=0;rk<nc.routeCount;++rk) {
-						if ((!nc.routes[rk].via.ss_family)&&(nc.routes[rk].target.ss_family == AF_INET)) {
-							uint32_t targetIp = Utils::ntoh((uint32_t)(reinterpret_cast<const struct sockaddr_in *>(&(nc.routes[rk].target))->sin_addr.s_addr));
-							int targetBits = Utils::ntoh((uint16_t)(reinterpret_cast<const struct sockaddr_in *>(&(nc.routes[rk].target))->sin_port));
-							if ((ip & (0xffffffff << (32 - targetBits))) == targetIp) {
-								routedNetmaskBits = targetBits;
-								break;
-							}
+				int routedNetmaskBits = 0;
+				for(unsigned int rk=0;rk<nc.routeCount;++rk) {
+					if ((!nc.routes[rk].via.ss_family)&&(nc.routes[rk].target.ss_family == AF_INET)) {
+						const InetAddress *const target = reinterpret_cast<const InetAddress *>(&(nc.routes[rk].target));
+						if (target->containsAddress(InetAddress(Utils::hton(ip),0))) {
+							routedNetmaskBits = (int)target->netmaskBits();
+							break;
 						}
 					}
-
-					// If it's routed, then try to claim and assign it and if successful end loop
-					if (routedNetmaskBits > 0) {
-						uint32_t ipBlob[4]; // actually a 16-byte blob, we put IPv4s in the last 4 bytes
-						ipBlob[0] = 0; ipBlob[1] = 0; ipBlob[2] = 0; ipBlob[3] = Utils::hton(ip);
-						sqlite3_reset(_sCheckIfIpIsAllocated);
-						sqlite3_bind_text(_sCheckIfIpIsAllocated,1,network.id,16,SQLITE_STATIC);
-						sqlite3_bind_blob(_sCheckIfIpIsAllocated,2,(const void *)ipBlob,16,SQLITE_STATIC);
-						sqlite3_bind_int(_sCheckIfIpIsAllocated,3,4); // 4 == IPv4
-						sqlite3_bind_int(_sCheckIfIpIsAllocated,4,(int)0 /*ZT_IP_ASSIGNMENT_TYPE_ADDRESS*/);
-						if (sqlite3_step(_sCheckIfIpIsAllocated) != SQLITE_ROW) {
-							// No rows returned, so the IP is available
-							sqlite3_reset(_sAllocateIp);
-							sqlite3_bind_text(_sAllocateIp,1,network.id,16,SQLITE_STATIC);
-							sqlite3_bind_text(_sAllocateIp,2,member.nodeId,10,SQLITE_STATIC);
-							sqlite3_bind_int(_sAllocateIp,3,(int)0 /*ZT_IP_ASSIGNMENT_TYPE_ADDRESS*/);
-							sqlite3_bind_blob(_sAllocateIp,4,(const void *)ipBlob,16,SQLITE_STATIC);
-							sqlite3_bind_int(_sAllocateIp,5,routedNetmaskBits); // IP netmask bits from matching route
-							sqlite3_bind_int(_sAllocateIp,6,4); // 4 == IPv4
-							if (sqlite3_step(_sAllocateIp) == SQLITE_DONE) {
-								if (nc.staticIpCount < ZT_MAX_ZT_ASSIGNED_ADDRESSES) {
-									struct sockaddr_in *const v4ip = reinterpret_cast<struct sockaddr_in *>(&(nc.staticIps[nc.staticIpCount++]));
-									v4ip->sin_family = AF_INET;
-									v4ip->sin_port = Utils::hton((uint16_t)routedNetmaskBits);
-									v4ip->sin_addr.s_addr = Utils::hton(ip);
-								}
-								break;
-							}
-						}
+				}
+				if (routedNetmaskBits <= 0)
+					continue; // sanity check, should not happen
+
+				uint32_t ipBlob[4]; // actually a 16-byte blob, we put IPv4s in the last 4 bytes
+				ipBlob[0] = 0; ipBlob[1] = 0; ipBlob[2] = 0; ipBlob[3] = Utils::hton(ip);
+				_DbLock _dl(*this);
+				sqlite3_reset(_sAllocateIp);
+				sqlite3_bind_text(_sAllocateIp,1,nwids,16,SQLITE_STATIC);
+				sqlite3_bind_text(_sAllocateIp,2,addrs,10,SQLITE_STATIC);
+				sqlite3_bind_int(_sAllocateIp,3,(int)0 /*ZT_IP_ASSIGNMENT_TYPE_ADDRESS*/);
+				sqlite3_bind_blob(_sAllocateIp,4,(const void *)ipBlob,16,SQLITE_STATIC);
+				sqlite3_bind_int(_sAllocateIp,5,routedNetmaskBits); // IP netmask bits from matching route
+				sqlite3_bind_int(_sAllocateIp,6,4); // 4 == IPv4
+				p->setTaken(ip); // ours now, or else it was already taken in the database
+				if (sqlite3_step(_sAllocateIp) == SQLITE_DONE) {
+					_backupNeeded = true;
+					member->ipAssignments.push_back(InetAddress((const void *)(ipBlob + 3),4,0));
+					if (nc.staticIpCount < ZT_MAX_ZT_ASSIGNED_ADDRESSES) {
+						struct sockaddr_in *const v4ip = reinterpret_cast<struct sockaddr_in *>(&(nc.staticIps[nc.staticIpCount++]));
+						v4ip->sin_family = AF_INET;
+						v4ip->sin_port = Utils::hton((uint16_t)routedNetmaskBits);
+						v4ip->sin_addr.s_addr = Utils::hton(ip);
 					}
+					break;
 				}
 			}
 		}
+
+		// Use the member's last COM if it's still fresh
+		if ((isPrivate)&&(!member->com.empty())&&((now - member->comTimestamp) < ZT_SQLITENETWORKCONTROLLER_CONFIG_REUSE_PERIOD)) {
+			try {
+				nc.com.deserialize(Buffer<ZT_SQLITENETWORKCONTROLLER_MAX_COM_SIZE>(member->com.data(),(unsigned int)member->com.length()),0);
+				haveCom = true;
+				++shard.configCacheStats.comHits;
+			} catch ( ... ) {} // sanity check, sign a new one
+		}
 	} // end lock
 
 	// Perform signing outside lock to enable concurrency
-	if (network.isPrivate) {
+	if ((isPrivate)&&(!haveCom)) {
 		CertificateOfMembership com(now,ZT_NETWORK_COM_DEFAULT_REVISION_MAX_DELTA,nwid,identity.address());
 		if (com.sign(signingId)) {
 			nc.com = com;
@@ -949,6 +911,34 @@ NetworkController::ResultCode SqliteNetworkController::doNetworkConfigRequest(co
 		}
 	}
 
+	if (config) {
+		if (!nc.toDictionary(*config,sendLegacy))
+			return NETCONF_QUERY_INTERNAL_SERVER_ERROR;
+	}
+
+	// Remember new COM and config for next time (unless the member was changed or deleted meanwhile)
+	if (((isPrivate)&&(!haveCom))||(config)) {
+		Mutex::Lock _l(shard.lock);
+		if ((isPrivate)&&(!haveCom))
+			++shard.configCacheStats.comMisses;
+		_CachedMember *const member = shard.memberCache.get(_MemberKey(nwid,address));
+		if ((member)&&(member->rowid == memberRowId)) {
+			if ((isPrivate)&&(!haveCom)) {
+				Buffer<ZT_SQLITENETWORKCONTROLLER_MAX_COM_SIZE> b;
+				nc.com.serialize(b);
+				member->com.assign((const char *)b.data(),b.size());
+				member->comTimestamp = now;
+			}
+			if (config) {
+				member->config = config->data();
+				member->configRevision = nc.revision;
+				member->configTimestamp = (isPrivate) ? nc.com.revision() : now;
+				member->configLegacy = sendLegacy;
+				member->configRelays = sendRelays;
+			}
+		}
+	}
+
 	return NetworkController::NETCONF_QUERY_OK;
 }
 
@@ -960,8 +950,20 @@ unsigned int SqliteNetworkController::handleControlPlaneHttpGET(
 	std::string &responseBody,
 	std::string &responseContentType)
 {
-	Mutex::Lock _l(_lock);
-	return _doCPGet(path,urlArgs,headers,body,responseBody,responseContentType);
+	if ((path.size() > 0)&&(path[0] == "network")) {
+		if ((path.size() >= 2)&&(path[1].length() == 16)) {
+			// Write new history of this network's members (or just this member) first, but don't
+			// hold up this network's config requests while the response is built
+			const uint64_t nwid = Utils::hexStrToU64(path[1].c_str());
+			_Shard &shard = _shardFor(nwid);
+			_ApiLock _sl(shard);
+			_DbLock _l(*this);
+			_flushMemberHistory(shard,nwid,((path.size() >= 4)&&(path[2] == "member")) ? Utils::hexStrToU64(path[3].c_str()) : 0ULL);
+		}
+		_DbLock _l(*this);
+		return _doCPGet(path,urlArgs,headers,body,responseBody,responseContentType);
+	}
+	return _doCPGet(path,urlArgs,headers,body,responseBody,responseContentType); // GET /controller doesn't use the database
 }
 
 unsigned int SqliteNetworkController::handleControlPlaneHttpPOST(
@@ -974,9 +976,6 @@ unsigned int SqliteNetworkController::handleControlPlaneHttpPOST(
 {
 	if (path.empty())
 		return 404;
-	Mutex::Lock _l(_lock);
-
-	_backupNeeded = true;
 
 	if (path[0] == "network") {
 
@@ -984,6 +983,49 @@ unsigned int SqliteNetworkController::handleControlPlaneHttpPOST(
 			uint64_t nwid = Utils::hexStrToU64(path[1].c_str());
 			char nwids[24];
 			Utils::snprintf(nwids,sizeof(nwids),"%.16llx",(unsigned long long)nwid);
+			std::vector<std::string> path_copy(path);
+
+			if (path[1].substr(10) == "______") {
+				// A special POST /network/##########______ feature lets users create a network
+				// with an arbitrary unused network number at this controller. The number is
+				// picked first so the new network's shard is locked like any other's below.
+				_DbLock _l(*this);
+
+				nwid = 0;
+
+				uint64_t nwidPrefix = (Utils::hexStrToU64(path[1].substr(0,10).c_str()) << 24) & 0xffffffffff000000ULL;
+				uint64_t nwidPostfix = 0;
+				Utils::getSecureRandom(&nwidPostfix,sizeof(nwidPostfix));
+				uint64_t nwidOriginalPostfix = nwidPostfix;
+				do {
+					uint64_t tryNwid = nwidPrefix | (nwidPostfix & 0xffffffULL);
+					if (!nwidPostfix)
+						tryNwid |= 1;
+					Utils::snprintf(nwids,sizeof(nwids),"%.16llx",(unsigned long long)tryNwid);
+
+					sqlite3_reset(_sGetNetworkRevision);
+					sqlite3_bind_text(_sGetNetworkRevision,1,nwids,16,SQLITE_STATIC);
+					if (sqlite3_step(_sGetNetworkRevision) != SQLITE_ROW) {
+						nwid = tryNwid;
+						break;
+					}
+
+					++nwidPostfix;
+				} while (nwidPostfix != nwidOriginalPostfix);
+
+				// 503 means we have no more free IDs for this prefix. You shouldn't host anywhere
+				// near 16 million networks on the same controller, so shouldn't happen.
+				if (!nwid)
+					return 503;
+
+				path_copy[1].assign(nwids);
+			}
+
+			_Shard &shard = _shardFor(nwid);
+			_ApiLock _sl(shard);
+			_DbLock _l(*this);
+
+			_backupNeeded = true;
 
 			int64_t revision = 0;
 			sqlite3_reset(_sGetNetworkRevision);
@@ -1016,6 +1058,9 @@ unsigned int SqliteNetworkController::handleControlPlaneHttpPOST(
 						memberRowId = sqlite3_column_int64(_sGetMember,0);
 					}
 
+					_flushMemberHistory(shard,nwid,address);
+					_MemberChange _mc(*this,shard,nwid,address);
+
 					if (!memberExists) {
 						sqlite3_reset(_sCreateMember);
 						sqlite3_bind_text(_sCreateMember,1,nwids,16,SQLITE_STATIC);
@@ -1183,9 +1228,12 @@ unsigned int SqliteNetworkController::handleControlPlaneHttpPOST(
 
 					test->timestamp = OSUtils::now();
 
-					_CircuitTestEntry &te = _circuitTests[test->testId];
-					te.test = test;
-					te.jsonResults = "";
+					{
+						Mutex::Lock _cl(_circuitTests_m);
+						_CircuitTestEntry &te = _circuitTests[test->testId];
+						te.test = test;
+						te.jsonResults = "";
+					}
 
 					_node->circuitTestBegin(test,&(SqliteNetworkController::_circuitTestCallback));
 
@@ -1198,47 +1246,15 @@ unsigned int SqliteNetworkController::handleControlPlaneHttpPOST(
 				} // else 404
 
 			} else {
-				std::vector<std::string> path_copy(path);
+				shard.networkCache.erase(nwid);
 
 				if (!networkExists) {
-					if (path[1].substr(10) == "______") {
-						// A special POST /network/##########______ feature lets users create a network
-						// with an arbitrary unused network number at this controller.
-						nwid = 0;
-
-						uint64_t nwidPrefix = (Utils::hexStrToU64(path[1].substr(0,10).c_str()) << 24) & 0xffffffffff000000ULL;
-						uint64_t nwidPostfix = 0;
-						Utils::getSecureRandom(&nwidPostfix,sizeof(nwidPostfix));
-						uint64_t nwidOriginalPostfix = nwidPostfix;
-						do {
-							uint64_t tryNwid = nwidPrefix | (nwidPostfix & 0xffffffULL);
-							if (!nwidPostfix)
-								tryNwid |= 1;
-							Utils::snprintf(nwids,sizeof(nwids),"%.16llx",(unsigned long long)tryNwid);
-
-							sqlite3_reset(_sGetNetworkRevision);
-							sqlite3_bind_text(_sGetNetworkRevision,1,nwids,16,SQLITE_STATIC);
-							if (sqlite3_step(_sGetNetworkRevision) != SQLITE_ROW) {
-								nwid = tryNwid;
-								break;
-							}
-
-							++nwidPostfix;
-						} while (nwidPostfix != nwidOriginalPostfix);
-
-						// 503 means we have no more free IDs for this prefix. You shouldn't host anywhere
-						// near 16 million networks on the same controller, so shouldn't happen.
-						if (!nwid)
-							return 503;
-					}
-
 					sqlite3_reset(_sCreateNetwork);
 					sqlite3_bind_text(_sCreateNetwork,1,nwids,16,SQLITE_STATIC);
 					sqlite3_bind_text(_sCreateNetwork,2,"",0,SQLITE_STATIC);
 					sqlite3_bind_int64(_sCreateNetwork,3,(long long)OSUtils::now());
 					if (sqlite3_step(_sCreateNetwork) != SQLITE_DONE)
 						return 500;
-					path_copy[1].assign(nwids);
 				}
 
 				json_value *j = json_parse(body.c_str(),body.length());
@@ -1555,6 +1571,7 @@ unsigned int SqliteNetworkController::handleControlPlaneHttpPOST(
 				sqlite3_bind_text(_sSetNetworkRevision,2,nwids,16,SQLITE_STATIC);
 				sqlite3_step(_sSetNetworkRevision);
 
+				_flushMemberHistory(shard,nwid,0);
 				return _doCPGet(path_copy,urlArgs,headers,body,responseBody,responseContentType);
 			}
 
@@ -1575,9 +1592,6 @@ unsigned int SqliteNetworkController::handleControlPlaneHttpDELETE(
 {
 	if (path.empty())
 		return 404;
-	Mutex::Lock _l(_lock);
-
-	_backupNeeded = true;
 
 	if (path[0] == "network") {
 
@@ -1586,6 +1600,12 @@ unsigned int SqliteNetworkController::handleControlPlaneHttpDELETE(
 			char nwids[24];
 			Utils::snprintf(nwids,sizeof(nwids),"%.16llx",(unsigned long long)nwid);
 
+			_Shard &shard = _shardFor(nwid);
+			_ApiLock _sl(shard);
+			_DbLock _l(*this);
+
+			_backupNeeded = true;
+
 			sqlite3_reset(_sGetNetworkById);
 			sqlite3_bind_text(_sGetNetworkById,1,nwids,16,SQLITE_STATIC);
 			if (sqlite3_step(_sGetNetworkById) != SQLITE_ROW)
@@ -1604,6 +1624,8 @@ unsigned int SqliteNetworkController::handleControlPlaneHttpDELETE(
 					if (sqlite3_step(_sGetMember) != SQLITE_ROW)
 						return 404;
 
+					_MemberChange _mc(*this,shard,nwid,address);
+
 					sqlite3_reset(_sDeleteIpAllocations);
 					sqlite3_bind_text(_sDeleteIpAllocations,1,nwids,16,SQLITE_STATIC);
 					sqlite3_bind_text(_sDeleteIpAllocations,2,addrs,10,SQLITE_STATIC);
@@ -1621,6 +1643,8 @@ unsigned int SqliteNetworkController::handleControlPlaneHttpDELETE(
 
 			} else {
 
+				_uncacheNetwork(shard,nwid);
+
 				sqlite3_reset(_sDeleteNetwork);
 				sqlite3_bind_text(_sDeleteNetwork,1,nwids,16,SQLITE_STATIC);
 				if (sqlite3_step(_sDeleteNetwork) == SQLITE_DONE) {
@@ -1649,7 +1673,7 @@ void SqliteNetworkController::threadMain()
 			const uint64_t now = OSUtils::now();
 			lastCleanupTime = now;
 
-			Mutex::Lock _l(_lock);
+			Mutex::Lock _l(_circuitTests_m);
 
 			// Clean out really old circuit tests to prevent memory build-up
 			for(std::map< uint64_t,_CircuitTestEntry >::iterator ct(_circuitTests.begin());ct!=_circuitTests.end();) {
@@ -1663,6 +1687,22 @@ void SqliteNetworkController::threadMain()
 			}
 		}
 
+		// Write new member request history a batch at a time so config requests aren't held up for long
+		for(unsigned int i=0;i<ZT_SQLITENETWORKCONTROLLER_REQUEST_THREADS;++i) {
+			_Shard &shard = _shards[i];
+			unsigned long toWrite;
+			{
+				Mutex::Lock _l(shard.lock);
+				toWrite = (unsigned long)shard.membersWithNewHistory.size();
+			}
+			while ((toWrite)&&(_backupThreadRun)) {
+				const unsigned long n = std::min(toWrite,(unsigned long)ZT_SQLITENETWORKCONTROLLER_HISTORY_WRITE_BATCH);
+				Mutex::Lock _l(shard.lock);
+				_flushMemberHistory(shard,n);
+				toWrite -= n;
+			}
+		}
+
 		if (((OSUtils::now() - lastBackupTime) >= ZT_NETCONF_BACKUP_PERIOD)&&(_backupNeeded)) {
 			lastBackupTime = OSUtils::now();
 
@@ -1671,15 +1711,32 @@ void SqliteNetworkController::threadMain()
 			Utils::snprintf(backupPath2,sizeof(backupPath),"%s.backup",_dbPath.c_str());
 			OSUtils::rm(backupPath); // delete any unfinished backups
 
+			// In WAL mode the backup reads a snapshot through its own connection in one step
+			// while writes carry on. Otherwise it copies a few pages at a time from _db.
+			sqlite3 *srcdb = _db;
+			if (_wal) {
+				srcdb = (sqlite3 *)0;
+				if (sqlite3_open_v2(_dbPath.c_str(),&srcdb,SQLITE_OPEN_READONLY,(const char *)0) != SQLITE_OK) {
+					sqlite3_close(srcdb);
+					fprintf(stderr,"SqliteNetworkController: CRITICAL: backup failed on sqlite3_open_v2()"ZT_EOL_S);
+					continue;
+				}
+				sqlite3_busy_timeout(srcdb,10000);
+			}
+
 			sqlite3 *bakdb = (sqlite3 *)0;
 			sqlite3_backup *bak = (sqlite3_backup *)0;
 			if (sqlite3_open_v2(backupPath,&bakdb,SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE,(const char *)0) != SQLITE_OK) {
+				if (srcdb != _db)
+					sqlite3_close(srcdb);
 				fprintf(stderr,"SqliteNetworkController: CRITICAL: backup failed on sqlite3_open_v2()"ZT_EOL_S);
 				continue;
 			}
-			bak = sqlite3_backup_init(bakdb,"main",_db,"main");
+			bak = sqlite3_backup_init(bakdb,"main",srcdb,"main");
 			if (!bak) {
 				sqlite3_close(bakdb);
+				if (srcdb != _db)
+					sqlite3_close(srcdb);
 				OSUtils::rm(backupPath); // delete any unfinished backups
 				fprintf(stderr,"SqliteNetworkController: CRITICAL: backup failed on sqlite3_backup_init()"ZT_EOL_S);
 				continue;
@@ -1690,12 +1747,17 @@ void SqliteNetworkController::threadMain()
 				if (!_backupThreadRun) {
 					sqlite3_backup_finish(bak);
 					sqlite3_close(bakdb);
+					if (srcdb != _db)
+						sqlite3_close(srcdb);
 					OSUtils::rm(backupPath);
 					return;
 				}
-				_lock.lock();
-				rc = sqlite3_backup_step(bak,64);
-				_lock.unlock();
+				if (srcdb == _db) {
+					Mutex::Lock _l(_dbLock);
+					rc = sqlite3_backup_step(bak,64);
+				} else {
+					rc = sqlite3_backup_step(bak,-1);
+				}
 				if ((rc == SQLITE_OK)||(rc == SQLITE_LOCKED)||(rc == SQLITE_BUSY))
 					Thread::sleep(50);
 				else break;
@@ -1703,6 +1765,8 @@ void SqliteNetworkController::threadMain()
 
 			sqlite3_backup_finish(bak);
 			sqlite3_close(bakdb);
+			if (srcdb != _db)
+				sqlite3_close(srcdb);
 
 			OSUtils::rm(backupPath2);
 			::rename(backupPath,backupPath2);
@@ -1714,6 +1778,630 @@ void SqliteNetworkController::threadMain()
 	}
 }
 
+void SqliteNetworkController::_requestThreadMain(_RequestThread &rt)
+{
+	_QueuedRequest qr;
+	for(;;) {
+		{
+			Mutex::Lock _l(rt.queue_m);
+			if (!_requestThreadsRun)
+				return;
+			if (rt.queue.empty()) {
+				qr.sender = (NetworkController::Sender *)0;
+			} else {
+				qr = rt.queue.front();
+				rt.queue.pop_front();
+			}
+		}
+
+		if (!qr.sender) {
+			rt.wake.wait();
+			continue;
+		}
+
+		try {
+			const Dictionary<ZT_NETWORKCONFIG_DICT_CAPACITY> metaData(qr.metaData.data(),(unsigned int)qr.metaData.length());
+			NetworkConfig nc;
+			Dictionary<ZT_NETWORKCONFIG_DICT_CAPACITY> config;
+			reply(qr.sender,qr.requestPacketId,qr.identity.address(),qr.nwid,_doNetworkConfigRequest(qr.fromAddr,qr.signingId,qr.identity,qr.nwid,metaData,nc,&config),config);
+		} catch ( ... ) {} // sanity check -- should not throw
+
+		Mutex::Lock _l(rt.queue_m);
+		++rt.completed;
+	}
+}
+
+SqliteNetworkController::_Ipv4Pool::_Ipv4Pool(const uint32_t s,const uint64_t n) :
+	start(s),
+	size(std::min(n,(uint64_t)ZT_SQLITENETWORKCONTROLLER_MAX_IPV4_POOL_SIZE)),
+	_taken((unsigned long)((size + 63) / 64),0xffffffffffffffffULL),
+	_full((unsigned long)((((size + 63) / 64) + 63) / 64),0xffffffffffffffffULL)
+{
+}
+
+void SqliteNetworkController::_Ipv4Pool::setFree(uint32_t first,uint32_t last)
+{
+	if ((last < start)||((uint64_t)first >= ((uint64_t)start + size)))
+		return;
+	uint32_t a = (first > start) ? (first - start) : 0;
+	const uint32_t b = (uint32_t)std::min((uint64_t)(last - start),size - 1);
+	while (a <= b) {
+		if (((a & 63) == 0)&&((b - a) >= 63)) {
+			_taken[a >> 6] = 0;
+			a += 64;
+		} else {
+			_taken[a >> 6] &= ~(1ULL << (a & 63));
+			++a;
+		}
+		_full[(a - 1) >> 12] &= ~(1ULL << (((a - 1) >> 6) & 63));
+	}
+}
+
+void SqliteNetworkController::_Ipv4Pool::setTaken(const uint32_t ip)
+{
+	const uint32_t o = ip - start;
+	if ((ip >= start)&&((uint64_t)o < size)) {
+		uint64_t &w = _taken[o >> 6];
+		w |= (1ULL << (o & 63));
+		if (w == 0xffffffffffffffffULL)
+			_full[o >> 12] |= (1ULL << ((o >> 6) & 63));
+	}
+}
+
+bool SqliteNetworkController::_Ipv4Pool::findFree(const uint32_t from,uint32_t &ip) const
+{
+	if (!size)
+		return false;
+	uint32_t o = 0;
+	if ((_findFree((uint32_t)((uint64_t)from % size),o))||(_findFree(0,o))) {
+		ip = start + o;
+		return true;
+	}
+	return false;
+}
+
+bool SqliteNetworkController::_Ipv4Pool::_findFree(const uint32_t i,uint32_t &o) const
+{
+	const uint32_t words = (uint32_t)_taken.size();
+	uint32_t w = i >> 6;
+	if (w >= words)
+		return false;
+	uint64_t avail = ~_taken[w] & (0xffffffffffffffffULL << (i & 63));
+	if (!avail) {
+		// Skip to the next word that isn't full
+		++w;
+		for(;;) {
+			if (w >= words)
+				return false;
+			const uint64_t notFull = ~_full[w >> 6] & (0xffffffffffffffffULL << (w & 63));
+			if (notFull) {
+				w = (w & 0xffffffc0) + _lowestSetBit(notFull);
+				if (w >= words)
+					return false;
+				avail = ~_taken[w];
+				break;
+			}
+			w = (w | 63) + 1;
+		}
+	}
+	o = (w << 6) + _lowestSetBit(avail);
+	return (o < size);
+}
+
+SqliteNetworkController::_Shard::_Shard() :
+	db((sqlite3 *)0),
+	readLock((Mutex *)0),
+	sGetNetworkById((sqlite3_stmt *)0),
+	sGetEtherTypesFromRuleTable((sqlite3_stmt *)0),
+	sGetActiveBridges((sqlite3_stmt *)0),
+	sGetRelays((sqlite3_stmt *)0),
+	sGetRoutes((sqlite3_stmt *)0),
+	sGetIpAssignmentPools((sqlite3_stmt *)0),
+	sGetIpAssignmentsForNetwork((sqlite3_stmt *)0),
+	sGetMember((sqlite3_stmt *)0),
+	sGetIpAssignmentsForNode((sqlite3_stmt *)0),
+	sGetNodeIdentity((sqlite3_stmt *)0),
+	newHistorySince(0)
+{
+	memset(&configCacheStats,0,sizeof(configCacheStats));
+}
+
+bool SqliteNetworkController::_openShard(_Shard &shard)
+{
+	if (_wal) {
+		if (sqlite3_open_v2(_dbPath.c_str(),&shard.db,SQLITE_OPEN_READONLY,(const char *)0) != SQLITE_OK)
+			return false;
+		sqlite3_busy_timeout(shard.db,10000);
+		shard.readLock = (Mutex *)0;
+	} else {
+		shard.db = _db;
+		shard.readLock = &_dbLock;
+	}
+	return (
+		  (sqlite3_prepare_v2(shard.db,sqlite3_sql(_sGetNetworkById),-1,&shard.sGetNetworkById,(const char **)0) == SQLITE_OK)
+		&&(sqlite3_prepare_v2(shard.db,sqlite3_sql(_sGetEtherTypesFromRuleTable),-1,&shard.sGetEtherTypesFromRuleTable,(const char **)0) == SQLITE_OK)
+		&&(sqlite3_prepare_v2(shard.db,sqlite3_sql(_sGetActiveBridges),-1,&shard.sGetActiveBridges,(const char **)0) == SQLITE_OK)
+		&&(sqlite3_prepare_v2(shard.db,sqlite3_sql(_sGetRelays),-1,&shard.sGetRelays,(const char **)0) == SQLITE_OK)
+		&&(sqlite3_prepare_v2(shard.db,sqlite3_sql(_sGetRoutes),-1,&shard.sGetRoutes,(const char **)0) == SQLITE_OK)
+		&&(sqlite3_prepare_v2(shard.db,sqlite3_sql(_sGetIpAssignmentPools),-1,&shard.sGetIpAssignmentPools,(const char **)0) == SQLITE_OK)
+		&&(sqlite3_prepare_v2(shard.db,sqlite3_sql(_sGetIpAssignmentsForNetwork),-1,&shard.sGetIpAssignmentsForNetwork,(const char **)0) == SQLITE_OK)
+		&&(sqlite3_prepare_v2(shard.db,sqlite3_sql(_sGetMember),-1,&shard.sGetMember,(const char **)0) == SQLITE_OK)
+		&&(sqlite3_prepare_v2(shard.db,sqlite3_sql(_sGetIpAssignmentsForNode),-1,&shard.sGetIpAssignmentsForNode,(const char **)0) == SQLITE_OK)
+		&&(sqlite3_prepare_v2(shard.db,sqlite3_sql(_sGetNodeIdentity),-1,&shard.sGetNodeIdentity,(const char **)0) == SQLITE_OK)
+	);
+}
+
+void SqliteNetworkController::_closeShard(_Shard &shard)
+{
+	sqlite3_finalize(shard.sGetNetworkById);
+	sqlite3_finalize(shard.sGetEtherTypesFromRuleTable);
+	sqlite3_finalize(shard.sGetActiveBridges);
+	sqlite3_finalize(shard.sGetRelays);
+	sqlite3_finalize(shard.sGetRoutes);
+	sqlite3_finalize(shard.sGetIpAssignmentPools);
+	sqlite3_finalize(shard.sGetIpAssignmentsForNetwork);
+	sqlite3_finalize(shard.sGetMember);
+	sqlite3_finalize(shard.sGetIpAssignmentsForNode);
+	sqlite3_finalize(shard.sGetNodeIdentity);
+	if ((shard.db)&&(shard.db != _db))
+		sqlite3_close(shard.db);
+	shard.db = (sqlite3 *)0;
+}
+
+SqliteNetworkController::_CachedNetwork *SqliteNetworkController::_getCachedNetwork(_Shard &shard,uint64_t nwid,const char *nwids)
+{
+	// assumes shard.lock is locked
+	_CachedNetwork *network = shard.networkCache.get(nwid);
+	if (network)
+		return network;
+
+	_CachedNetwork nw;
+
+	// Statements are reset as soon as they're done with so the read connection doesn't keep
+	// an old snapshot open (that would hide later writes and keep the WAL from being reset).
+	_ReadLock _rl(shard);
+
+	sqlite3_reset(shard.sGetNetworkById);
+	sqlite3_bind_text(shard.sGetNetworkById,1,nwids,16,SQLITE_STATIC);
+	if (sqlite3_step(shard.sGetNetworkById) != SQLITE_ROW) {
+		sqlite3_reset(shard.sGetNetworkById);
+		return (_CachedNetwork *)0;
+	}
+	const char *name = (const char *)sqlite3_column_text(shard.sGetNetworkById,0);
+	if (name)
+		nw.name = name;
+	nw.isPrivate = (sqlite3_column_int(shard.sGetNetworkById,1) > 0);
+	nw.enableBroadcast = (sqlite3_column_int(shard.sGetNetworkById,2) > 0);
+	nw.allowPassiveBridging = (sqlite3_column_int(shard.sGetNetworkById,3) > 0);
+	nw.flags = sqlite3_column_int(shard.sGetNetworkById,4);
+	nw.multicastLimit = sqlite3_column_int(shard.sGetNetworkById,5);
+	nw.creationTime = (uint64_t)sqlite3_column_int64(shard.sGetNetworkById,6);
+	nw.revision = (uint64_t)sqlite3_column_int64(shard.sGetNetworkById,7);
+	nw.memberRevisionCounter = (uint64_t)sqlite3_column_int64(shard.sGetNetworkById,8);
+	sqlite3_reset(shard.sGetNetworkById);
+
+	sqlite3_reset(shard.sGetEtherTypesFromRuleTable);
+	sqlite3_bind_text(shard.sGetEtherTypesFromRuleTable,1,nwids,16,SQLITE_STATIC);
+	while (sqlite3_step(shard.sGetEtherTypesFromRuleTable) == SQLITE_ROW) {
+		if (sqlite3_column_type(shard.sGetEtherTypesFromRuleTable,0) == SQLITE_NULL) {
+			nw.etherTypes.clear();
+			nw.etherTypes.push_back(0); // NULL 'allow' matches ANY
+			break;
+		} else {
+			int et = sqlite3_column_int(shard.sGetEtherTypesFromRuleTable,0);
+			if ((et >= 0)&&(et <= 0xffff))
+				nw.etherTypes.push_back(et);
+		}
+	}
+	sqlite3_reset(shard.sGetEtherTypesFromRuleTable);
+	std::sort(nw.etherTypes.begin(),nw.etherTypes.end());
+	nw.etherTypes.erase(std::unique(nw.etherTypes.begin(),nw.etherTypes.end()),nw.etherTypes.end());
+
+	sqlite3_reset(shard.sGetActiveBridges);
+	sqlite3_bind_text(shard.sGetActiveBridges,1,nwids,16,SQLITE_STATIC);
+	while (sqlite3_step(shard.sGetActiveBridges) == SQLITE_ROW) {
+		const char *ab = (const char *)sqlite3_column_text(shard.sGetActiveBridges,0);
+		if ((ab)&&(strlen(ab) == 10))
+			nw.activeBridges.push_back(Address(Utils::hexStrToU64(ab)));
+	}
+	sqlite3_reset(shard.sGetActiveBridges);
+
+	sqlite3_reset(shard.sGetRelays);
+	sqlite3_bind_text(shard.sGetRelays,1,nwids,16,SQLITE_STATIC);
+	while (sqlite3_step(shard.sGetRelays) == SQLITE_ROW) {
+		const char *n = (const char *)sqlite3_column_text(shard.sGetRelays,0);
+		const char *a = (const char *)sqlite3_column_text(shard.sGetRelays,1);
+		if ((n)&&(a)) {
+			Address node(n);
+			if (node)
+				nw.relays.push_back(node);
+		}
+	}
+	sqlite3_reset(shard.sGetRelays);
+
+	sqlite3_reset(shard.sGetRoutes);
+	sqlite3_bind_text(shard.sGetRoutes,1,nwids,16,SQLITE_STATIC);
+	while ((sqlite3_step(shard.sGetRoutes) == SQLITE_ROW)&&(nw.routes.size() < ZT_MAX_NETWORK_ROUTES)) {
+		ZT_VirtualNetworkRoute r;
+		memset(&r,0,sizeof(ZT_VirtualNetworkRoute));
+		switch(sqlite3_column_int(shard.sGetRoutes,3)) { // ipVersion
+			case 4:
+				*(reinterpret_cast<InetAddress *>(&(r.target))) = InetAddress((const void *)((const char *)sqlite3_column_blob(shard.sGetRoutes,0) + 12),4,(unsigned int)sqlite3_column_int(shard.sGetRoutes,2));
+				break;
+			case 6:
+				*(reinterpret_cast<InetAddress *>(&(r.target))) = InetAddress((const void *)sqlite3_column_blob(shard.sGetRoutes,0),16,(unsigned int)sqlite3_column_int(shard.sGetRoutes,2));
+				break;
+			default:
+				continue;
+		}
+		if (sqlite3_column_type(shard.sGetRoutes,1) != SQLITE_NULL) {
+			switch(sqlite3_column_int(shard.sGetRoutes,3)) { // ipVersion
+				case 4:
+					*(reinterpret_cast<InetAddress *>(&(r.via))) = InetAddress((const void *)((const char *)sqlite3_column_blob(shard.sGetRoutes,1) + 12),4,0);
+					break;
+				case 6:
+					*(reinterpret_cast<InetAddress *>(&(r.via))) = InetAddress((const void *)sqlite3_column_blob(shard.sGetRoutes,1),16,0);
+					break;
+				default:
+					continue;
+			}
+		}
+		r.flags = (uint16_t)sqlite3_column_int(shard.sGetRoutes,4);
+		r.metric = (uint16_t)sqlite3_column_int(shard.sGetRoutes,5);
+		nw.routes.push_back(r);
+	}
+	sqlite3_reset(shard.sGetRoutes);
+
+	// Index auto-assign pools and every address already assigned on this network
+	if ((nw.flags & ZT_DB_NETWORK_FLAG_ZT_MANAGED_V4_AUTO_ASSIGN) != 0) {
+		sqlite3_reset(shard.sGetIpAssignmentPools);
+		sqlite3_bind_text(shard.sGetIpAssignmentPools,1,nwids,16,SQLITE_STATIC);
+		sqlite3_bind_int(shard.sGetIpAssignmentPools,2,4); // 4 == IPv4
+		while (sqlite3_step(shard.sGetIpAssignmentPools) == SQLITE_ROW) {
+			const unsigned char *ipRangeStartB = reinterpret_cast<const unsigned char *>(sqlite3_column_blob(shard.sGetIpAssignmentPools,0));
+			const unsigned char *ipRangeEndB = reinterpret_cast<const unsigned char *>(sqlite3_column_blob(shard.sGetIpAssignmentPools,1));
+			if ((!ipRangeStartB)||(!ipRangeEndB)||(sqlite3_column_bytes(shard.sGetIpAssignmentPools,0) != 16)||(sqlite3_column_bytes(shard.sGetIpAssignmentPools,1) != 16))
+				continue;
+			const uint32_t ipRangeStart = Utils::ntoh(*(reinterpret_cast<const uint32_t *>(ipRangeStartB + 12)));
+			const uint32_t ipRangeEnd = Utils::ntoh(*(reinterpret_cast<const uint32_t *>(ipRangeEndB + 12)));
+			if ((ipRangeEnd <= ipRangeStart)||(ipRangeStart == 0))
+				continue;
+
+			// As before, candidates are ipRangeStart up to but not including ipRangeEnd
+			_Ipv4Pool pool(ipRangeStart,(uint64_t)ipRangeEnd - (uint64_t)ipRangeStart);
+			for(std::vector<ZT_VirtualNetworkRoute>::const_iterator r(nw.routes.begin());r!=nw.routes.end();++r) {
+				if ((!r->via.ss_family)&&(r->target.ss_family == AF_INET)) {
+					const unsigned int bits = reinterpret_cast<const InetAddress *>(&(r->target))->netmaskBits();
+					const uint32_t mask = (bits >= 32) ? 0xffffffff : ((bits == 0) ? 0 : (0xffffffff << (32 - bits)));
+					const uint32_t target = Utils::ntoh((uint32_t)(reinterpret_cast<const struct sockaddr_in *>(&(r->target))->sin_addr.s_addr)) & mask;
+					pool.setFree(target,target | ~mask);
+				}
+			}
+			for(uint64_t ip=(uint64_t)(pool.start | 0xff);ip<((uint64_t)pool.start + pool.size);ip+=256)
+				pool.setTaken((uint32_t)ip); // don't allow addresses that end in .255
+
+			nw.ipv4Pools.push_back(pool);
+		}
+		sqlite3_reset(shard.sGetIpAssignmentPools);
+	}
+	if ((nw.flags & ZT_DB_NETWORK_FLAG_ZT_MANAGED_V6_AUTO_ASSIGN) != 0) {
+		sqlite3_reset(shard.sGetIpAssignmentPools);
+		sqlite3_bind_text(shard.sGetIpAssignmentPools,1,nwids,16,SQLITE_STATIC);
+		sqlite3_bind_int(shard.sGetIpAssignmentPools,2,6); // 6 == IPv6
+		while (sqlite3_step(shard.sGetIpAssignmentPools) == SQLITE_ROW) {
+			const uint8_t *const ipRangeStartB = reinterpret_cast<const unsigned char *>(sqlite3_column_blob(shard.sGetIpAssignmentPools,0));
+			const uint8_t *const ipRangeEndB = reinterpret_cast<const unsigned char *>(sqlite3_column_blob(shard.sGetIpAssignmentPools,1));
+			if ((!ipRangeStartB)||(!ipRangeEndB)||(sqlite3_column_bytes(shard.sGetIpAssignmentPools,0) != 16)||(sqlite3_column_bytes(shard.sGetIpAssignmentPools,1) != 16))
+				continue;
+			_Ipv6Pool pool;
+			memcpy(pool.start,ipRangeStartB,16);
+			memcpy(pool.end,ipRangeEndB,16);
+			for(unsigned int i=0;i<2;++i) {
+				pool.start[i] = Utils::ntoh(pool.start[i]);
+				pool.end[i] = Utils::ntoh(pool.end[i]);
+			}
+			nw.ipv6Pools.push_back(pool);
+		}
+		sqlite3_reset(shard.sGetIpAssignmentPools);
+	}
+	if ((!nw.ipv4Pools.empty())||(!nw.ipv6Pools.empty())) {
+		sqlite3_reset(shard.sGetIpAssignmentsForNetwork);
+		sqlite3_bind_text(shard.sGetIpAssignmentsForNetwork,1,nwids,16,SQLITE_STATIC);
+		while (sqlite3_step(shard.sGetIpAssignmentsForNetwork) == SQLITE_ROW) {
+			const unsigned char *const ipbytes = (const unsigned char *)sqlite3_column_blob(shard.sGetIpAssignmentsForNetwork,0);
+			if ((!ipbytes)||(sqlite3_column_bytes(shard.sGetIpAssignmentsForNetwork,0) != 16))
+				continue;
+			switch(sqlite3_column_int(shard.sGetIpAssignmentsForNetwork,1)) { // ipVersion
+				case 4: {
+					const uint32_t ip = Utils::ntoh(*(reinterpret_cast<const uint32_t *>(ipbytes + 12)));
+					for(std::vector<_Ipv4Pool>::iterator p(nw.ipv4Pools.begin());p!=nw.ipv4Pools.end();++p)
+						p->setTaken(ip);
+				}	break;
+				case 6: {
+					uint64_t ip[2];
+					memcpy(ip,ipbytes,16);
+					nw.ipv6Assigned.insert(std::pair<uint64_t,uint64_t>(Utils::ntoh(ip[0]),Utils::ntoh(ip[1])));
+				}	break;
+			}
+		}
+		sqlite3_reset(shard.sGetIpAssignmentsForNetwork);
+	}
+
+	++shard.configCacheStats.networkLoads;
+	return &(shard.networkCache.set(nwid,nw));
+}
+
+SqliteNetworkController::_CachedMember *SqliteNetworkController::_getCachedMember(_Shard &shard,_CachedNetwork &network,uint64_t nwid,const char *nwids,uint64_t address,const char *addrs)
+{
+	// assumes shard.lock is locked
+	const _MemberKey mk(nwid,address);
+	_CachedMember *member = shard.memberCache.get(mk);
+	if (member)
+		return member;
+
+	_CachedMember m;
+
+	bool memberExists = false;
+	{
+		_ReadLock _rl(shard);
+		sqlite3_reset(shard.sGetMember);
+		sqlite3_bind_text(shard.sGetMember,1,nwids,16,SQLITE_STATIC);
+		sqlite3_bind_text(shard.sGetMember,2,addrs,10,SQLITE_STATIC);
+		if (sqlite3_step(shard.sGetMember) == SQLITE_ROW) {
+			memberExists = true;
+			m.rowid = (int64_t)sqlite3_column_int64(shard.sGetMember,0);
+			m.authorized = (sqlite3_column_int(shard.sGetMember,1) > 0);
+			m.activeBridge = (sqlite3_column_int(shard.sGetMember,2) > 0);
+			m.lastRequestTime = (uint64_t)sqlite3_column_int64(shard.sGetMember,5);
+			sqlite3_reset(shard.sGetMember);
+
+			sqlite3_reset(shard.sGetIpAssignmentsForNode);
+			sqlite3_bind_text(shard.sGetIpAssignmentsForNode,1,nwids,16,SQLITE_STATIC);
+			sqlite3_bind_text(shard.sGetIpAssignmentsForNode,2,addrs,10,SQLITE_STATIC);
+			while (sqlite3_step(shard.sGetIpAssignmentsForNode) == SQLITE_ROW) {
+				const unsigned char *const ipbytes = (const unsigned char *)sqlite3_column_blob(shard.sGetIpAssignmentsForNode,0);
+				if ((!ipbytes)||(sqlite3_column_bytes(shard.sGetIpAssignmentsForNode,0) != 16))
+					continue;
+				const int ipVersion = sqlite3_column_int(shard.sGetIpAssignmentsForNode,2);
+				if (ipVersion == 4)
+					m.ipAssignments.push_back(InetAddress(ipbytes + 12,4,0));
+				else if (ipVersion == 6)
+					m.ipAssignments.push_back(InetAddress(ipbytes,16,0));
+			}
+			sqlite3_reset(shard.sGetIpAssignmentsForNode);
+		} else {
+			sqlite3_reset(shard.sGetMember);
+		}
+	}
+
+	if (!memberExists) {
+		m.authorized = (network.isPrivate ? false : true);
+		_DbLock _l(*this);
+		sqlite3_reset(_sCreateMember);
+		sqlite3_bind_text(_sCreateMember,1,nwids,16,SQLITE_STATIC);
+		sqlite3_bind_text(_sCreateMember,2,addrs,10,SQLITE_STATIC);
+		sqlite3_bind_int(_sCreateMember,3,(m.authorized ? 1 : 0));
+		sqlite3_bind_text(_sCreateMember,4,nwids,16,SQLITE_STATIC);
+		if (sqlite3_step(_sCreateMember) != SQLITE_DONE)
+			return (_CachedMember *)0;
+		m.rowid = (int64_t)sqlite3_last_insert_rowid(_db);
+
+		sqlite3_reset(_sIncrementMemberRevisionCounter);
+		sqlite3_bind_text(_sIncrementMemberRevisionCounter,1,nwids,16,SQLITE_STATIC);
+		sqlite3_step(_sIncrementMemberRevisionCounter);
+		++network.memberRevisionCounter;
+
+		_backupNeeded = true;
+	}
+
+	return &(shard.memberCache.set(mk,m));
+}
+
+void SqliteNetworkController::_flushMemberHistory(_Shard &shard,unsigned long max)
+{
+	// assumes shard.lock is locked
+	if (shard.membersWithNewHistory.empty())
+		return;
+
+	_DbLock _l(*this);
+	sqlite3_exec(_db,"BEGIN",0,0,0);
+	while ((max)&&(!shard.membersWithNewHistory.empty())) {
+		--max;
+		const _MemberKey mk(shard.membersWithNewHistory.back());
+		shard.membersWithNewHistory.pop_back();
+
+		_CachedMember *const member = shard.memberCache.get(mk);
+		if ((member)&&(!member->newHistory.empty()))
+			_writeMemberHistory(mk,*member);
+	}
+	sqlite3_exec(_db,"COMMIT",0,0,0);
+
+	_backupNeeded = true;
+}
+
+void SqliteNetworkController::_flushMemberHistory(_Shard &shard,uint64_t nwid,uint64_t address)
+{
+	// assumes shard.lock and _dbLock are locked -- keys stay in membersWithNewHistory and are skipped later
+	if (address) {
+		const _MemberKey mk(nwid,address);
+		_CachedMember *const member = shard.memberCache.get(mk);
+		if ((member)&&(!member->newHistory.empty())) {
+			_writeMemberHistory(mk,*member);
+			_backupNeeded = true;
+		}
+	} else {
+		bool inTransaction = false;
+		for(std::vector<_MemberKey>::const_iterator mk(shard.membersWithNewHistory.begin());mk!=shard.membersWithNewHistory.end();++mk) {
+			if (mk->nwid != nwid)
+				continue;
+			_CachedMember *const member = shard.memberCache.get(*mk);
+			if ((member)&&(!member->newHistory.empty())) {
+				if (!inTransaction) {
+					sqlite3_exec(_db,"BEGIN",0,0,0);
+					inTransaction = true;
+				}
+				_writeMemberHistory(*mk,*member);
+			}
+		}
+		if (inTransaction) {
+			sqlite3_exec(_db,"COMMIT",0,0,0);
+			_backupNeeded = true;
+		}
+	}
+}
+
+void SqliteNetworkController::_writeMemberHistory(const _MemberKey &mk,_CachedMember &member)
+{
+	// assumes _dbLock is locked
+	char nwids[24],addrs[16];
+	Utils::snprintf(nwids,sizeof(nwids),"%.16llx",(unsigned long long)mk.nwid);
+	Utils::snprintf(addrs,sizeof(addrs),"%.10llx",(unsigned long long)mk.address);
+
+	MemberRecentHistory recentHistory;
+	sqlite3_reset(_sGetMember);
+	sqlite3_bind_text(_sGetMember,1,nwids,16,SQLITE_STATIC);
+	sqlite3_bind_text(_sGetMember,2,addrs,10,SQLITE_STATIC);
+	if (sqlite3_step(_sGetMember) == SQLITE_ROW) {
+		const char *rhblob = (const char *)sqlite3_column_blob(_sGetMember,6);
+		if (rhblob)
+			recentHistory.fromBlob(rhblob,(unsigned int)sqlite3_column_bytes(_sGetMember,6));
+	}
+	sqlite3_reset(_sGetMember);
+	for(std::vector<std::string>::const_iterator h(member.newHistory.begin());h!=member.newHistory.end();++h)
+		recentHistory.push_front(*h);
+	while (recentHistory.size() > ZT_NETCONF_DB_MEMBER_HISTORY_LENGTH)
+		recentHistory.pop_back();
+	member.newHistory.clear();
+	const std::string rhblob(recentHistory.toBlob());
+
+	sqlite3_reset(_sUpdateMemberHistory);
+	sqlite3_clear_bindings(_sUpdateMemberHistory);
+	sqlite3_bind_int64(_sUpdateMemberHistory,1,(sqlite3_int64)member.lastRequestTime);
+	sqlite3_bind_blob(_sUpdateMemberHistory,2,(const void *)rhblob.data(),(int)rhblob.length(),SQLITE_STATIC);
+	sqlite3_bind_int64(_sUpdateMemberHistory,3,(sqlite3_int64)member.rowid);
+	sqlite3_step(_sUpdateMemberHistory);
+}
+
+void SqliteNetworkController::_uncacheMember(_Shard &shard,uint64_t nwid,uint64_t address)
+{
+	// assumes shard.lock and _dbLock are locked and member history has been flushed
+	shard.memberCache.erase(_MemberKey(nwid,address));
+	shard.nodeIdentityCache.erase(address);
+
+	_CachedNetwork *const network = shard.networkCache.get(nwid);
+	if (!network)
+		return;
+	network->activeBridges.erase(std::remove(network->activeBridges.begin(),network->activeBridges.end(),Address(address)),network->activeBridges.end());
+	if ((network->ipv4Pools.empty())&&(network->ipv6Pools.empty()))
+		return;
+
+	char nwids[24],addrs[24];
+	Utils::snprintf(nwids,sizeof(nwids),"%.16llx",(unsigned long long)nwid);
+	Utils::snprintf(addrs,sizeof(addrs),"%.10llx",(unsigned long long)address);
+	sqlite3_reset(_sGetIpAssignmentsForNode);
+	sqlite3_bind_text(_sGetIpAssignmentsForNode,1,nwids,16,SQLITE_STATIC);
+	sqlite3_bind_text(_sGetIpAssignmentsForNode,2,addrs,10,SQLITE_STATIC);
+	while (sqlite3_step(_sGetIpAssignmentsForNode) == SQLITE_ROW) {
+		const unsigned char *const ipbytes = (const unsigned char *)sqlite3_column_blob(_sGetIpAssignmentsForNode,0);
+		if ((!ipbytes)||(sqlite3_column_bytes(_sGetIpAssignmentsForNode,0) != 16))
+			continue;
+		switch(sqlite3_column_int(_sGetIpAssignmentsForNode,2)) { // ipVersion
+			case 4: {
+				// Addresses are unique within a network, so this one is free again unless
+				// _getCachedNetwork() would never have offered it (unrouted or a .255)
+				const uint32_t ip = Utils::ntoh(*(reinterpret_cast<const uint32_t *>(ipbytes + 12)));
+				if ((ip & 0xff) == 0xff)
+					break;
+				for(std::vector<ZT_VirtualNetworkRoute>::const_iterator r(network->routes.begin());r!=network->routes.end();++r) {
+					if ((!r->via.ss_family)&&(r->target.ss_family == AF_INET)) {
+						const unsigned int bits = reinterpret_cast<const InetAddress *>(&(r->target))->netmaskBits();
+						const uint32_t mask = (bits >= 32) ? 0xffffffff : ((bits == 0) ? 0 : (0xffffffff << (32 - bits)));
+						if ((ip & mask) == (Utils::ntoh((uint32_t)(reinterpret_cast<const struct sockaddr_in *>(&(r->target))->sin_addr.s_addr)) & mask)) {
+							for(std::vector<_Ipv4Pool>::iterator p(network->ipv4Pools.begin());p!=network->ipv4Pools.end();++p)
+								p->setFree(ip,ip);
+							break;
+						}
+					}
+				}
+			}	break;
+			case 6: {
+				uint64_t ip[2];
+				memcpy(ip,ipbytes,16);
+				network->ipv6Assigned.erase(std::pair<uint64_t,uint64_t>(Utils::ntoh(ip[0]),Utils::ntoh(ip[1])));
+			}	break;
+		}
+	}
+	sqlite3_reset(_sGetIpAssignmentsForNode);
+}
+
+void SqliteNetworkController::_recacheMember(_Shard &shard,uint64_t nwid,uint64_t address)
+{
+	// assumes shard.lock and _dbLock are locked
+	_CachedNetwork *const network = shard.networkCache.get(nwid);
+	if (!network)
+		return;
+
+	char nwids[24],addrs[24];
+	Utils::snprintf(nwids,sizeof(nwids),"%.16llx",(unsigned long long)nwid);
+	Utils::snprintf(addrs,sizeof(addrs),"%.10llx",(unsigned long long)address);
+
+	// Member changes bump the network's revision and member revision counter
+	sqlite3_reset(_sGetNetworkById);
+	sqlite3_bind_text(_sGetNetworkById,1,nwids,16,SQLITE_STATIC);
+	if (sqlite3_step(_sGetNetworkById) != SQLITE_ROW) {
+		sqlite3_reset(_sGetNetworkById);
+		shard.networkCache.erase(nwid);
+		return;
+	}
+	network->revision = (uint64_t)sqlite3_column_int64(_sGetNetworkById,7);
+	network->memberRevisionCounter = (uint64_t)sqlite3_column_int64(_sGetNetworkById,8);
+	sqlite3_reset(_sGetNetworkById);
+
+	sqlite3_reset(_sGetMember);
+	sqlite3_bind_text(_sGetMember,1,nwids,16,SQLITE_STATIC);
+	sqlite3_bind_text(_sGetMember,2,addrs,10,SQLITE_STATIC);
+	if ((sqlite3_step(_sGetMember) == SQLITE_ROW)&&(sqlite3_column_int(_sGetMember,1) > 0)&&(sqlite3_column_int(_sGetMember,2) > 0))
+		network->activeBridges.push_back(Address(address));
+	sqlite3_reset(_sGetMember);
+
+	if ((network->ipv4Pools.empty())&&(network->ipv6Pools.empty()))
+		return;
+	sqlite3_reset(_sGetIpAssignmentsForNode);
+	sqlite3_bind_text(_sGetIpAssignmentsForNode,1,nwids,16,SQLITE_STATIC);
+	sqlite3_bind_text(_sGetIpAssignmentsForNode,2,addrs,10,SQLITE_STATIC);
+	while (sqlite3_step(_sGetIpAssignmentsForNode) == SQLITE_ROW) {
+		const unsigned char *const ipbytes = (const unsigned char *)sqlite3_column_blob(_sGetIpAssignmentsForNode,0);
+		if ((!ipbytes)||(sqlite3_column_bytes(_sGetIpAssignmentsForNode,0) != 16))
+			continue;
+		switch(sqlite3_column_int(_sGetIpAssignmentsForNode,2)) { // ipVersion
+			case 4: {
+				const uint32_t ip = Utils::ntoh(*(reinterpret_cast<const uint32_t *>(ipbytes + 12)));
+				for(std::vector<_Ipv4Pool>::iterator p(network->ipv4Pools.begin());p!=network->ipv4Pools.end();++p)
+					p->setTaken(ip);
+			}	break;
+			case 6: {
+				uint64_t ip[2];
+				memcpy(ip,ipbytes,16);
+				network->ipv6Assigned.insert(std::pair<uint64_t,uint64_t>(Utils::ntoh(ip[0]),Utils::ntoh(ip[1])));
+			}	break;
+		}
+	}
+	sqlite3_reset(_sGetIpAssignmentsForNode);
+}
+
+void SqliteNetworkController::_uncacheNetwork(_Shard &shard,uint64_t nwid)
+{
+	// assumes shard.lock is locked and member history has been flushed
+	shard.networkCache.erase(nwid);
+	Hashtable< _MemberKey,_CachedMember >::Iterator i(shard.memberCache);
+	_MemberKey *k = (_MemberKey *)0;
+	_CachedMember *v = (_CachedMember *)0;
+	while (i.next(k,v)) {
+		if (k->nwid == nwid)
+			shard.memberCache.erase(*k);
+	}
+}
+
 unsigned int SqliteNetworkController::_doCPGet(
 	const std::vector<std::string> &path,
 	const std::map<std::string,std::string> &urlArgs,
@@ -1722,7 +2410,7 @@ unsigned int SqliteNetworkController::_doCPGet(
 	std::string &responseBody,
 	std::string &responseContentType)
 {
-	// Assumes _lock is locked
+	// Assumes _dbLock is locked for /network paths
 	char json[65536];
 
 	if ((path.size() > 0)&&(path[0] == "network")) {
@@ -1863,6 +2551,7 @@ unsigned int SqliteNetworkController::_doCPGet(
 
 				} else if ((path[2] == "test")&&(path.size() >= 4)) {
 
+					Mutex::Lock _cl(_circuitTests_m);
 					std::map< uint64_t,_CircuitTestEntry >::iterator cte(_circuitTests.find(Utils::hexStrToU64(path[3].c_str())));
 					if ((cte != _circuitTests.end())&&(cte->second.test)) {
 
@@ -2118,7 +2807,40 @@ unsigned int SqliteNetworkController::_doCPGet(
 
 	} else {
 		// GET /controller returns status and API version if controller is supported
-		Utils::snprintf(json,sizeof(json),"{\n\t\"controller\": true,\n\t\"apiVersion\": %d,\n\t\"clock\": %llu,\n\t\"instanceId\": \"%s\"\n}\n",ZT_NETCONF_CONTROLLER_API_VERSION,(unsigned long long)OSUtils::now(),_instanceId.c_str());
+		RequestQueueStats rqs;
+		requestQueueStats(rqs);
+		ConfigCacheStats ccs;
+		configCacheStats(ccs);
+		Utils::snprintf(json,sizeof(json),
+			"{\n"
+			"\t\"controller\": true,\n"
+			"\t\"apiVersion\": %d,\n"
+			"\t\"clock\": %llu,\n"
+			"\t\"instanceId\": \"%s\",\n"
+			"\t\"requestsQueued\": %lu,\n"
+			"\t\"requestsMaxQueued\": %lu,\n"
+			"\t\"requestsReceived\": %llu,\n"
+			"\t\"requestsDropped\": %llu,\n"
+			"\t\"requestsCompleted\": %llu,\n"
+			"\t\"configCacheHits\": %llu,\n"
+			"\t\"configCacheMisses\": %llu,\n"
+			"\t\"comCacheHits\": %llu,\n"
+			"\t\"comCacheMisses\": %llu,\n"
+			"\t\"networkCacheLoads\": %llu\n"
+			"}\n",
+			ZT_NETCONF_CONTROLLER_API_VERSION,
+			(unsigned long long)OSUtils::now(),
+			_instanceId.c_str(),
+			rqs.queued,
+			rqs.maxQueued,
+			(unsigned long long)rqs.received,
+			(unsigned long long)rqs.dropped,
+			(unsigned long long)rqs.completed,
+			(unsigned long long)ccs.configHits,
+			(unsigned long long)ccs.configMisses,
+			(unsigned long long)ccs.comHits,
+			(unsigned long long)ccs.comMisses,
+			(unsigned long long)ccs.networkLoads);
 		responseBody = json;
 		responseContentType = "application/json";
 		return 200;
@@ -2137,7 +2859,7 @@ void SqliteNetworkController::_circuitTestCallback(ZT_Node *node,ZT_CircuitTest
 	if (!report)
 		return;
 
-	Mutex::Lock _l(self->_lock);
+	Mutex::Lock _l(self->_circuitTests_m);
 	std::map< uint64_t,_CircuitTestEntry >::iterator cte(self->_circuitTests.find(test->testId));
 
 	if (cte == self->_circuitTests.end()) { // sanity check: a circuit test we didn't launch?
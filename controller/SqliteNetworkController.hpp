@@ -34,11 +34,19 @@
 
 #include <string>
 #include <map>
+#include <set>
 #include <vector>
+#include <deque>
 
 #include "../node/Constants.hpp"
 #include "../node/NetworkController.hpp"
 #include "../node/Mutex.hpp"
+#include "../node/BinarySemaphore.hpp"
+#include "../node/Identity.hpp"
+#include "../node/InetAddress.hpp"
+#include "../node/Address.hpp"
+#include "../node/Hashtable.hpp"
+#include "../node/AtomicCounter.hpp"
 #include "../osdep/Thread.hpp"
 
 // Number of in-memory last log entries to maintain per user
@@ -47,6 +55,31 @@
 // How long do circuit tests last before they're forgotten?
 #define ZT_SQLITENETWORKCONTROLLER_CIRCUIT_TEST_TIMEOUT 60000
 
+// Threads answering network config requests (each network's requests always go to the same one,
+// and networks are sharded the same way so each request thread has its own caches and locks)
+#define ZT_SQLITENETWORKCONTROLLER_REQUEST_THREADS 4
+
+// Maximum queued network config requests per request thread; more are dropped and members retry
+#define ZT_SQLITENETWORKCONTROLLER_MAX_QUEUED_REQUESTS 4096
+
+// Members whose new request history is written to the database per transaction
+#define ZT_SQLITENETWORKCONTROLLER_HISTORY_WRITE_BATCH 256
+
+// Longest new request history may wait for the background thread before a request thread writes
+// it itself (e.g. while a backup is running), which bounds how much of it a crash can lose
+#define ZT_SQLITENETWORKCONTROLLER_HISTORY_MAX_DELAY 1000
+
+// How long a signed COM (and a config that contains it) may be sent again to the same member
+// before signing a new one. Members refresh every ZT_NETWORK_AUTOCONF_DELAY, so COMs in use on a
+// network stay well within the ZT_NETWORK_COM_DEFAULT_REVISION_MAX_DELTA they must agree within.
+#define ZT_SQLITENETWORKCONTROLLER_CONFIG_REUSE_PERIOD (ZT_NETWORK_AUTOCONF_DELAY * 2)
+
+// Buffer size for serializing a COM (fits ZT_NETWORK_COM_MAX_QUALIFIERS qualifiers and a signature)
+#define ZT_SQLITENETWORKCONTROLLER_MAX_COM_SIZE 512
+
+// IPv4 auto-assign pools are indexed in memory up to this many addresses (2MiB of bitmap)
+#define ZT_SQLITENETWORKCONTROLLER_MAX_IPV4_POOL_SIZE 0x1000000
+
 namespace ZeroTier {
 
 class Node;
@@ -57,6 +90,22 @@ public:
 	SqliteNetworkController(Node *node,const char *dbPath,const char *circuitTestPath);
 	virtual ~SqliteNetworkController();
 
+	/**
+	 * Queue a network config request to be answered by a request thread
+	 *
+	 * This returns right away. If the request thread for this network already
+	 * has ZT_SQLITENETWORKCONTROLLER_MAX_QUEUED_REQUESTS waiting, the request
+	 * is dropped and counted and the member will ask again later.
+	 */
+	virtual void request(
+		NetworkController::Sender *sender,
+		uint64_t requestPacketId,
+		const InetAddress &fromAddr,
+		const Identity &signingId,
+		const Identity &identity,
+		uint64_t nwid,
+		const Dictionary<ZT_NETWORKCONFIG_DICT_CAPACITY> &metaData);
+
 	virtual NetworkController::ResultCode doNetworkConfigRequest(
 		const InetAddress &fromAddr,
 		const Identity &signingId,
@@ -91,6 +140,40 @@ public:
 	void threadMain()
 		throw();
 
+	/**
+	 * Network config request queue statistics
+	 */
+	struct RequestQueueStats
+	{
+		unsigned long queued; // waiting now
+		unsigned long maxQueued; // most ever waiting for one request thread
+		uint64_t received; // accepted into queue
+		uint64_t dropped; // not accepted because queue was full
+		uint64_t completed; // answered (or ignored) by request threads
+	};
+
+	/**
+	 * @param s Structure to fill with current totals for all request threads
+	 */
+	void requestQueueStats(RequestQueueStats &s) const;
+
+	/**
+	 * Reuse of serialized configs and signed COMs
+	 */
+	struct ConfigCacheStats
+	{
+		uint64_t configHits; // request thread replies that sent a member's last config again
+		uint64_t configMisses; // request thread replies that had to build a config
+		uint64_t comHits; // configs built with a member's last COM
+		uint64_t comMisses; // new COMs signed
+		uint64_t networkLoads; // networks read from the database into the cache
+	};
+
+	/**
+	 * @param s Structure to fill with totals since startup
+	 */
+	void configCacheStats(ConfigCacheStats &s) const;
+
 private:
 	/* deprecated
 	enum IpAssignmentType {
@@ -111,10 +194,283 @@ private:
 
 	static void _circuitTestCallback(ZT_Node *node,ZT_CircuitTest *test,const ZT_CircuitTestReport *report);
 
+	struct _QueuedRequest
+	{
+		NetworkController::Sender *sender;
+		uint64_t requestPacketId;
+		InetAddress fromAddr;
+		Identity signingId;
+		Identity identity;
+		uint64_t nwid;
+		std::string metaData;
+	};
+
+	// One request thread and its queue
+	struct _RequestThread
+	{
+		_RequestThread() : parent((SqliteNetworkController *)0),maxQueued(0),received(0),dropped(0),completed(0) {}
+		void threadMain() throw() { parent->_requestThreadMain(*this); }
+
+		SqliteNetworkController *parent;
+		std::deque<_QueuedRequest> queue;
+		unsigned long maxQueued;
+		uint64_t received;
+		uint64_t dropped;
+		uint64_t completed;
+		Mutex queue_m;
+		BinarySemaphore wake;
+		Thread thread;
+	};
+
+	void _requestThreadMain(_RequestThread &rt);
+
+	// doNetworkConfigRequest() that also fills in (and caches) the serialized config if config is non-NULL
+	NetworkController::ResultCode _doNetworkConfigRequest(
+		const InetAddress &fromAddr,
+		const Identity &signingId,
+		const Identity &identity,
+		uint64_t nwid,
+		const Dictionary<ZT_NETWORKCONFIG_DICT_CAPACITY> &metaData,
+		NetworkConfig &nc,
+		Dictionary<ZT_NETWORKCONFIG_DICT_CAPACITY> *config);
+
+	// Network and member state needed to answer config requests, kept in memory so that
+	// refreshes are answered without touching the database. Writes go to the database
+	// first and then to the cache (or invalidate it). All of this lives in _Shard.
+
+	// Addresses in an IPv4 auto-assign pool that are taken (or can't be assigned because
+	// they are unrouted or end in .255), one bit each. A second level of bits marks full
+	// words so finding a free address skips over long taken runs in nearly full pools.
+	class _Ipv4Pool
+	{
+	public:
+		// Pool covers [s,s+n) and all addresses start out taken (n is 64-bit so a pool can't wrap to empty)
+		_Ipv4Pool(const uint32_t s,const uint64_t n);
+
+		// Mark an inclusive range of addresses free (only used while building)
+		void setFree(uint32_t first,uint32_t last);
+
+		void setTaken(const uint32_t ip);
+
+		// Find the first free address at or after start + (from % size), wrapping around
+		bool findFree(const uint32_t from,uint32_t &ip) const;
+
+		uint32_t start;
+		uint64_t size;
+
+	private:
+		bool _findFree(const uint32_t i,uint32_t &o) const;
+
+		std::vector<uint64_t> _taken;
+		std::vector<uint64_t> _full;
+	};
+
+	struct _Ipv6Pool
+	{
+		uint64_t start[2]; // host byte order
+		uint64_t end[2];
+	};
+
+	struct _CachedNetwork
+	{
+		_CachedNetwork() : flags(0),isPrivate(true),enableBroadcast(false),allowPassiveBridging(false),multicastLimit(0),creationTime(0),revision(0),memberRevisionCounter(0) {}
+
+		std::string name;
+		int flags;
+		bool isPrivate;
+		bool enableBroadcast;
+		bool allowPassiveBridging;
+		int multicastLimit;
+		uint64_t creationTime;
+		uint64_t revision;
+		uint64_t memberRevisionCounter;
+		std::vector<int> etherTypes; // sorted, 0 means any
+		std::vector<Address> activeBridges; // authorized members with activeBridge set
+		std::vector<Address> relays;
+		std::vector<ZT_VirtualNetworkRoute> routes;
+
+		// Only filled in if the corresponding auto-assign mode is enabled
+		std::vector<_Ipv4Pool> ipv4Pools;
+		std::vector<_Ipv6Pool> ipv6Pools;
+		std::set< std::pair<uint64_t,uint64_t> > ipv6Assigned; // host byte order
+	};
+
+	struct _MemberKey
+	{
+		_MemberKey() : nwid(0),address(0) {}
+		_MemberKey(const uint64_t n,const uint64_t a) : nwid(n),address(a) {}
+		inline unsigned long hashCode() const throw() { return (unsigned long)(nwid ^ (address << 24)); }
+		inline bool operator==(const _MemberKey &k) const throw() { return ((nwid == k.nwid)&&(address == k.address)); }
+		inline bool operator!=(const _MemberKey &k) const throw() { return (!(*this == k)); }
+		uint64_t nwid;
+		uint64_t address;
+	};
+
+	struct _CachedMember
+	{
+		_CachedMember() : rowid(0),authorized(false),activeBridge(false),lastRequestTime(0),comTimestamp(0),configRevision(0),configTimestamp(0),configLegacy(false),configRelays(false) {}
+
+		int64_t rowid;
+		bool authorized;
+		bool activeBridge;
+		uint64_t lastRequestTime;
+		std::vector<InetAddress> ipAssignments; // type 0 (address) assignments, port is zero
+		std::vector<std::string> newHistory; // recentHistory entries not yet in the database, oldest first
+
+		// Last COM signed for this member (serialized) and last config sent to it. These are
+		// dropped along with the rest of the entry when the member is changed or deleted.
+		uint64_t comTimestamp;
+		std::string com;
+		uint64_t configRevision; // network revision config was built from
+		uint64_t configTimestamp; // timestamp of COM in config, or when it was built if none
+		bool configLegacy;
+		bool configRelays;
+		std::string config;
+	};
+
+	// Networks are sharded by network ID just like requests are divided among request threads.
+	// Each shard has its own caches and its own read-only database connection (with its own
+	// prepared statements) for filling them, all guarded by its lock. Writes always go through
+	// _db and are guarded by _dbLock. When both are needed the shard lock must be taken first.
+	struct _Shard
+	{
+		_Shard();
+
+		Mutex lock;
+
+		// API calls queue on apiLock and count themselves in apiWaiting while they wait for
+		// lock, which request threads would otherwise keep grabbing right back (see _ApiLock)
+		Mutex apiLock;
+		AtomicCounter apiWaiting;
+
+		// In WAL mode this is a separate read-only connection. In-memory databases can't be
+		// opened twice, so then it's _db and readLock points to _dbLock.
+		sqlite3 *db;
+		Mutex *readLock;
+
+		sqlite3_stmt *sGetNetworkById;
+		sqlite3_stmt *sGetEtherTypesFromRuleTable;
+		sqlite3_stmt *sGetActiveBridges;
+		sqlite3_stmt *sGetRelays;
+		sqlite3_stmt *sGetRoutes;
+		sqlite3_stmt *sGetIpAssignmentPools;
+		sqlite3_stmt *sGetIpAssignmentsForNetwork;
+		sqlite3_stmt *sGetMember;
+		sqlite3_stmt *sGetIpAssignmentsForNode;
+		sqlite3_stmt *sGetNodeIdentity;
+
+		Hashtable< uint64_t,_CachedNetwork > networkCache;
+		Hashtable< _MemberKey,_CachedMember > memberCache;
+		Hashtable< uint64_t,Identity > nodeIdentityCache;
+		std::vector< _MemberKey > membersWithNewHistory;
+		uint64_t newHistorySince; // when membersWithNewHistory last became nonempty
+
+		// Last request time by address, for rate limitation
+		std::map< std::pair<uint64_t,uint64_t>,uint64_t > lastRequestTime;
+
+		ConfigCacheStats configCacheStats;
+	};
+
+	// Held while reading through a shard's connection; only locks anything if that is _db
+	class _ReadLock
+	{
+	public:
+		_ReadLock(const _Shard &s) : _m(s.readLock) { if (_m) _m->lock(); }
+		~_ReadLock() { if (_m) _m->unlock(); }
+	private:
+		Mutex *const _m;
+	};
+
+	// Taken by API calls in place of a shard's lock. Request threads step aside while one is
+	// waiting, since they take the lock again as soon as it's released and could keep an API
+	// call waiting for as long as requests keep coming in.
+	class _ApiLock
+	{
+	public:
+		_ApiLock(_Shard &s) : _s(s)
+		{
+			_s.apiLock.lock();
+			++_s.apiWaiting;
+			_s.lock.lock();
+			--_s.apiWaiting;
+		}
+		~_ApiLock()
+		{
+			_s.lock.unlock();
+			_s.apiLock.unlock();
+		}
+	private:
+		_Shard &_s;
+	};
+
+	// Held while using _db. Statements on _db are all reset before it's released, since one left
+	// in the middle of its results keeps the connection's transaction (and any writes made in the
+	// meantime) open, where the shards' read connections can't see them.
+	class _DbLock
+	{
+	public:
+		_DbLock(SqliteNetworkController &c) : _c(c) { _c._dbLock.lock(); }
+		~_DbLock()
+		{
+			sqlite3_stmt *s = (sqlite3_stmt *)0;
+			while ((s = sqlite3_next_stmt(_c._db,s)))
+				sqlite3_reset(s);
+			_c._dbLock.unlock();
+		}
+	private:
+		SqliteNetworkController &_c;
+	};
+
+	// Held while an API call changes or deletes a member. Its network stays cached and is brought
+	// up to date for just this member when this goes out of scope, whichever way the call returns,
+	// so it must be declared after the _DbLock.
+	class _MemberChange
+	{
+	public:
+		_MemberChange(SqliteNetworkController &c,_Shard &s,const uint64_t nwid,const uint64_t address) : _c(c),_s(s),_nwid(nwid),_address(address) { _c._uncacheMember(_s,_nwid,_address); }
+		~_MemberChange() { _c._recacheMember(_s,_nwid,_address); }
+	private:
+		SqliteNetworkController &_c;
+		_Shard &_s;
+		const uint64_t _nwid;
+		const uint64_t _address;
+	};
+
+	inline _Shard &_shardFor(const uint64_t nwid) { return _shards[(unsigned int)(nwid % ZT_SQLITENETWORKCONTROLLER_REQUEST_THREADS)]; }
+
+	// Open a shard's read connection and prepare its statements (copies of the ones on _db)
+	bool _openShard(_Shard &shard);
+	void _closeShard(_Shard &shard);
+
+	// These all assume the shard's lock is locked. Returned pointers are only valid until the
+	// next change to the same cache.
+	_CachedNetwork *_getCachedNetwork(_Shard &shard,uint64_t nwid,const char *nwids);
+	_CachedMember *_getCachedMember(_Shard &shard,_CachedNetwork &network,uint64_t nwid,const char *nwids,uint64_t address,const char *addrs);
+
+	// Write up to max members' pending history entries to the database in one transaction
+	void _flushMemberHistory(_Shard &shard,unsigned long max);
+
+	// Write pending history for one network's members, or for one member if address is nonzero,
+	// before it's read or the member is changed (also assumes _dbLock is locked)
+	void _flushMemberHistory(_Shard &shard,uint64_t nwid,uint64_t address);
+	void _writeMemberHistory(const _MemberKey &mk,_CachedMember &member);
+
+	// Forget a member's cached state and take its active bridge role and IP assignments back out
+	// of its cached network, then put back whatever the database has for it after a change (these
+	// assume the shard's lock and _dbLock are locked; see _MemberChange)
+	void _uncacheMember(_Shard &shard,uint64_t nwid,uint64_t address);
+	void _recacheMember(_Shard &shard,uint64_t nwid,uint64_t address);
+
+	// Forget a network and all its members
+	void _uncacheNetwork(_Shard &shard,uint64_t nwid);
+
 	Node *_node;
 	Thread _backupThread;
 	volatile bool _backupThreadRun;
+	volatile bool _requestThreadsRun;
+	_RequestThread _requestThreads[ZT_SQLITENETWORKCONTROLLER_REQUEST_THREADS];
 	volatile bool _backupNeeded;
+	bool _wal;
 	std::string _dbPath;
 	std::string _circuitTestPath;
 	std::string _instanceId;
@@ -126,9 +482,9 @@ private:
 		std::string jsonResults;
 	};
 	std::map< uint64_t,_CircuitTestEntry > _circuitTests;
+	Mutex _circuitTests_m;
 
-	// Last request time by address, for rate limitation
-	std::map< std::pair<uint64_t,uint64_t>,uint64_t > _lastRequestTime;
+	_Shard _shards[ZT_SQLITENETWORKCONTROLLER_REQUEST_THREADS];
 
 	sqlite3 *_db;
 
@@ -141,7 +497,7 @@ private:
 	sqlite3_stmt *_sGetActiveBridges;
 	sqlite3_stmt *_sGetIpAssignmentsForNode;
 	sqlite3_stmt *_sGetIpAssignmentPools;
-	sqlite3_stmt *_sCheckIfIpIsAllocated;
+	sqlite3_stmt *_sGetIpAssignmentsForNetwork;
 	sqlite3_stmt *_sAllocateIp;
 	sqlite3_stmt *_sDeleteIpAllocations;
 	sqlite3_stmt *_sGetRelays;
@@ -173,7 +529,7 @@ private:
 	sqlite3_stmt *_sGetConfig;
 	sqlite3_stmt *_sSetConfig;
 
-	Mutex _lock;
+	Mutex _dbLock;
 };
 
 } // namespace ZeroTier
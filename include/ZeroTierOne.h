@@ -334,6 +334,26 @@ typedef struct
 	 * True if some kind of connectivity appears available
 	 */
 	int online;
+
+	/**
+	 * Packets (e.g. unencrypted HELLOs) waiting for background decoding
+	 */
+	unsigned long deferredPacketQueueDepth;
+
+	/**
+	 * Packets dropped because the background decode queue was full
+	 */
+	uint64_t deferredPacketsDropped;
+
+	/**
+	 * Certificate of membership signature checks answered from cache
+	 */
+	uint64_t verifiedComCacheHits;
+
+	/**
+	 * Certificate of membership signature checks that had to be computed
+	 */
+	uint64_t verifiedComCacheMisses;
 } ZT_NodeStatus;
 
 /**
@@ -525,11 +545,39 @@ enum ZT_VirtualNetworkRuleType
 	ZT_NETWORK_RULE_MATCH_COM_FIELD_LE = 52
 };
 
+/**
+ * Packet characteristics flag: frame arrived from the network (vs. from the tap)
+ */
+#define ZT_RULE_PACKET_CHARACTERISTICS_INBOUND 0x8000000000000000ULL
+
+/**
+ * Packet characteristics flag: destination MAC is multicast
+ */
+#define ZT_RULE_PACKET_CHARACTERISTICS_MULTICAST 0x4000000000000000ULL
+
+/**
+ * Packet characteristics flag: destination MAC is broadcast (ff:ff:ff:ff:ff:ff)
+ */
+#define ZT_RULE_PACKET_CHARACTERISTICS_BROADCAST 0x2000000000000000ULL
+
+/**
+ * Packet characteristics flags: TCP header flags (least significant 9 bits)
+ */
+#define ZT_RULE_PACKET_CHARACTERISTICS_TCP_NS 0x0000000000000100ULL
+#define ZT_RULE_PACKET_CHARACTERISTICS_TCP_CWR 0x0000000000000080ULL
+#define ZT_RULE_PACKET_CHARACTERISTICS_TCP_ECE 0x0000000000000040ULL
+#define ZT_RULE_PACKET_CHARACTERISTICS_TCP_URG 0x0000000000000020ULL
+#define ZT_RULE_PACKET_CHARACTERISTICS_TCP_ACK 0x0000000000000010ULL
+#define ZT_RULE_PACKET_CHARACTERISTICS_TCP_PSH 0x0000000000000008ULL
+#define ZT_RULE_PACKET_CHARACTERISTICS_TCP_RST 0x0000000000000004ULL
+#define ZT_RULE_PACKET_CHARACTERISTICS_TCP_SYN 0x0000000000000002ULL
+#define ZT_RULE_PACKET_CHARACTERISTICS_TCP_FIN 0x0000000000000001ULL
+
 /**
  * Network flow rule
  *
- * NOTE: Currently (1.1.x) only etherType is supported! Other things will
- * have no effect until the rules engine is fully implemented.
+ * NOTE: Matches on COM fields and TCP relative sequence numbers are not yet
+ * implemented and never match. TEE and REDIRECT actions are ignored.
  *
  * Rules are stored in a table in which one or more match entries is followed
  * by an action. If more than one match precedes an action, the rule is
@@ -575,7 +623,7 @@ typedef struct
 		} ipv4;
 
 		/**
-		 * Packet characteristic flags being matched
+		 * Packet characteristic flags being matched (all must be present)
 		 */
 		uint64_t characteristics;
 
@@ -906,6 +954,31 @@ typedef struct
 	 * Is path preferred?
 	 */
 	int preferred;
+
+	/**
+	 * Smoothed round trip time over this path in milliseconds or zero if unknown
+	 */
+	unsigned int latency;
+
+	/**
+	 * Estimated fraction of pings lost on this path (0.0 to 1.0)
+	 */
+	float packetLoss;
+
+	/**
+	 * Packets sent via this path
+	 */
+	uint64_t packetsSent;
+
+	/**
+	 * Bytes sent via this path
+	 */
+	uint64_t bytesSent;
+
+	/**
+	 * Largest UDP payload this path carries without ZeroTier fragmentation, as found by path MTU discovery
+	 */
+	unsigned int mtu;
 } ZT_PeerPhysicalPath;
 
 /**
@@ -1236,6 +1309,32 @@ typedef struct {
 	ZT_ClusterMemberStatus members[ZT_CLUSTER_MAX_MEMBERS];
 } ZT_ClusterStatus;
 
+/**
+ * A packet received from the physical wire, for batched processing
+ */
+typedef struct
+{
+	/**
+	 * Local address, or point to ZT_SOCKADDR_NULL if unspecified
+	 */
+	const struct sockaddr_storage *localAddress;
+
+	/**
+	 * Origin of packet
+	 */
+	const struct sockaddr_storage *remoteAddress;
+
+	/**
+	 * Packet data
+	 */
+	const void *packetData;
+
+	/**
+	 * Packet length
+	 */
+	unsigned int packetLength;
+} ZT_WirePacket;
+
 /**
  * An instance of a ZeroTier One node (opaque)
  */
@@ -1371,7 +1470,7 @@ typedef int (*ZT_DataStorePutFunction)(
  *  (4) Remote address
  *  (5) Packet data
  *  (6) Packet length
- *  (7) Desired IP TTL or 0 to use default
+ *  (7) Desired IP TTL or 0 to use default, possibly OR'd with flags
  *
  * If there is only one local interface it is safe to ignore the local
  * interface address. Otherwise if running with multiple interfaces, the
@@ -1383,10 +1482,23 @@ typedef int (*ZT_DataStorePutFunction)(
  * value if possible. If this is not possible it is acceptable to ignore
  * this value and send anyway with normal or default TTL.
  *
+ * The TTL argument's low 8 bits are the TTL. Higher bits are flags, and
+ * only appear if the host has enabled features that use them:
+ * ZT_WIRE_PACKET_FLAG_DONT_FRAGMENT requires ZT_Node_setPathMtuDiscovery().
+ *
  * The function must return zero on success and may return any error code
  * on failure. Note that success does not (of course) guarantee packet
  * delivery. It only means that the packet appears to have been sent.
  */
+/**
+ * Flag in ZT_WirePacketSendFunction's TTL argument: send with the IP don't-fragment bit set
+ *
+ * Used for path MTU discovery probes. If DF can't be set, or the packet is
+ * too large to leave this host unfragmented, the packet must not be sent
+ * and the function must return nonzero.
+ */
+#define ZT_WIRE_PACKET_FLAG_DONT_FRAGMENT 0x100
+
 typedef int (*ZT_WirePacketSendFunction)(
 	ZT_Node *,                        /* Node */
 	void *,                           /* User ptr */
@@ -1488,6 +1600,28 @@ enum ZT_ResultCode ZT_Node_processWirePacket(
 	unsigned int packetLength,
 	volatile uint64_t *nextBackgroundTaskDeadline);
 
+/**
+ * Process a batch of packets received from the physical wire
+ *
+ * This is equivalent to calling ZT_Node_processWirePacket() for each
+ * packet in order, but the clock and other per-call overhead are only
+ * handled once per batch. This is intended for use with batched receive
+ * facilities such as recvmmsg() on Linux.
+ *
+ * @param node Node instance
+ * @param now Current clock in milliseconds
+ * @param packets Array of received packets
+ * @param packetCount Number of packets in array
+ * @param nextBackgroundTaskDeadline Value/result: set to deadline for next call to processBackgroundTasks()
+ * @return OK (0) or error code if a fatal error condition has occurred
+ */
+enum ZT_ResultCode ZT_Node_processWirePackets(
+	ZT_Node *node,
+	uint64_t now,
+	const ZT_WirePacket *packets,
+	unsigned int packetCount,
+	volatile uint64_t *nextBackgroundTaskDeadline);
+
 /**
  * Process a frame from a virtual network port (tap)
  *
@@ -1870,6 +2004,40 @@ void ZT_Node_clusterStatus(ZT_Node *node,ZT_ClusterStatus *cs);
  */
 void ZT_Node_setTrustedPaths(ZT_Node *node,const struct sockaddr_storage *networks,const uint64_t *ids,unsigned int count);
 
+/**
+ * Enable or disable multipath mode
+ *
+ * By default all traffic to a peer goes over its single best direct path.
+ * In multipath mode network traffic is instead spread across all of a
+ * peer's active direct paths in proportion to their estimated capacity,
+ * which is derived from measured latency and loss. Traffic is assigned to
+ * paths by flow (IP addresses, protocol and ports) so packets within one
+ * TCP connection are not reordered.
+ *
+ * This is useful for sites with more than one uplink. It's off by default
+ * since it makes the other end see traffic from several addresses.
+ *
+ * @param node Node instance
+ * @param enabled If non-zero, enable multipath mode
+ */
+void ZT_Node_setMultipathMode(ZT_Node *node,int enabled);
+
+/**
+ * Enable or disable path MTU discovery
+ *
+ * With discovery on, each direct path is probed with ECHOs of increasing
+ * size sent with ZT_WIRE_PACKET_FLAG_DONT_FRAGMENT, and packets are then
+ * fragmented to the largest size that got through. Only enable this if the
+ * wire packet send function honors that flag. Otherwise probes could pass
+ * via IP fragmentation and overstate the MTU. Paths whose probes can't be
+ * sent keep the default 1444 byte UDP payload, as do all paths with
+ * discovery off (the default).
+ *
+ * @param node Node instance
+ * @param enabled If non-zero, enable path MTU discovery
+ */
+void ZT_Node_setPathMtuDiscovery(ZT_Node *node,int enabled);
+
 /**
  * Do things in the background until Node dies
  *
@@ -1887,6 +2055,10 @@ void ZT_Node_setTrustedPaths(ZT_Node *node,const struct sockaddr_storage *networ
  * handler threads to prevent foreground performance degradation under
  * high load.
  *
+ * If clustering is enabled, the first thread to call this becomes the
+ * sender for cluster state messages instead, so at least two should be
+ * started in that case.
+ *
  * @param node Node instance
  */
 void ZT_Node_backgroundThreadMain(ZT_Node *node);
@@ -16,6 +16,7 @@ LOCAL_SRC_FILES := \
 	$(ZT1)/node/C25519.cpp \
 	$(ZT1)/node/CertificateOfMembership.cpp \
 	$(ZT1)/node/DeferredPackets.cpp \
+	$(ZT1)/node/FlowRules.cpp \
 	$(ZT1)/node/Identity.cpp \
 	$(ZT1)/node/IncomingPacket.cpp \
 	$(ZT1)/node/InetAddress.cpp \
@@ -96,6 +96,11 @@ ifeq ($(ZT_TRACE),1)
 	DEFS+=-DZT_TRACE
 endif
 
+# Use select() instead of epoll in Phy<> (epoll is the default on Linux)
+ifeq ($(ZT_PHY_SELECT),1)
+	DEFS+=-DZT_PHY_NO_EPOLL
+endif
+
 ifeq ($(ZT_DEBUG),1)
 	DEFS+=-DZT_TRACE
 	override CFLAGS+=-Wall -g -O -pthread $(INCLUDES) $(DEFS)
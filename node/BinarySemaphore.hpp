@@ -38,6 +38,7 @@ public:
 	BinarySemaphore() throw() { _sem = CreateSemaphore(NULL,0,1,NULL); }
 	~BinarySemaphore() { CloseHandle(_sem); }
 	inline void wait() { WaitForSingleObject(_sem,INFINITE); }
+	inline bool wait(unsigned long ms) { return (WaitForSingleObject(_sem,(DWORD)ms) == WAIT_OBJECT_0); }
 	inline void post() { ReleaseSemaphore(_sem,1,NULL); }
 private:
 	HANDLE _sem;
@@ -48,6 +49,8 @@ private:
 #else // !__WINDOWS__
 
 #include <pthread.h>
+#include <errno.h>
+#include <sys/time.h>
 
 namespace ZeroTier {
 
@@ -76,6 +79,34 @@ public:
 		pthread_mutex_unlock(const_cast <pthread_mutex_t *>(&_mh));
 	}
 
+	/**
+	 * Wait until posted or until a timeout elapses
+	 *
+	 * @param ms Maximum time to wait in milliseconds
+	 * @return True if posted, false if timed out
+	 */
+	inline bool wait(unsigned long ms)
+	{
+		struct timeval tv;
+		gettimeofday(&tv,(struct timezone *)0);
+		struct timespec ts;
+		ts.tv_sec = tv.tv_sec + (time_t)(ms / 1000);
+		ts.tv_nsec = ((long)tv.tv_usec * 1000L) + ((long)(ms % 1000) * 1000000L);
+		if (ts.tv_nsec >= 1000000000L) {
+			++ts.tv_sec;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_mutex_lock(const_cast <pthread_mutex_t *>(&_mh));
+		while (!_f) {
+			if (pthread_cond_timedwait(const_cast <pthread_cond_t *>(&_cond),const_cast <pthread_mutex_t *>(&_mh),&ts) == ETIMEDOUT)
+				break;
+		}
+		const bool posted = _f;
+		_f = false;
+		pthread_mutex_unlock(const_cast <pthread_mutex_t *>(&_mh));
+		return posted;
+	}
+
 	inline void post()
 	{
 		pthread_mutex_lock(const_cast <pthread_mutex_t *>(&_mh));
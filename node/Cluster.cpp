@@ -186,6 +186,74 @@ private:
 	Mutex _lock;
 };
 
+void ClusterPeerLocations::update(const Address &peerAddress,uint16_t memberId,uint64_t now)
+{
+	_Shard &s = _shard(peerAddress);
+	Mutex::Lock _l(s.lock);
+	_Locations &l = s.peers[peerAddress];
+	unsigned int slot = 0;
+	for(unsigned int i=0;i<ZT_CLUSTER_PEER_LOCATION_SLOTS;++i) {
+		if ((l.lastSeen[i])&&(l.memberId[i] == memberId)) {
+			slot = i;
+			break;
+		}
+		if (l.lastSeen[i] < l.lastSeen[slot])
+			slot = i;
+	}
+	l.lastSeen[slot] = now;
+	l.memberId[slot] = memberId;
+}
+
+bool ClusterPeerLocations::mostRecent(const Address &peerAddress,uint16_t &memberId,uint64_t &lastSeen) const
+{
+	_Shard &s = _shard(peerAddress);
+	Mutex::Lock _l(s.lock);
+	const _Locations *const l = s.peers.get(peerAddress);
+	if (!l)
+		return false;
+	unsigned int best = 0;
+	for(unsigned int i=1;i<ZT_CLUSTER_PEER_LOCATION_SLOTS;++i) {
+		if (l->lastSeen[i] > l->lastSeen[best])
+			best = i;
+	}
+	if (!l->lastSeen[best])
+		return false;
+	memberId = l->memberId[best];
+	lastSeen = l->lastSeen[best];
+	return true;
+}
+
+void ClusterPeerLocations::clean(uint64_t now,uint64_t maxAge)
+{
+	for(unsigned int sn=0;sn<ZT_CLUSTER_PEER_LOCATION_SHARDS;++sn) {
+		_Shard &s = _shards[sn];
+		Mutex::Lock _l(s.lock);
+		Hashtable< Address,_Locations >::Iterator i(s.peers);
+		Address *k = (Address *)0;
+		_Locations *l = (_Locations *)0;
+		while (i.next(k,l)) {
+			bool any = false;
+			for(unsigned int j=0;j<ZT_CLUSTER_PEER_LOCATION_SLOTS;++j) {
+				if ((now - l->lastSeen[j]) >= maxAge)
+					l->lastSeen[j] = 0;
+				else any = true;
+			}
+			if (!any)
+				s.peers.erase(*k);
+		}
+	}
+}
+
+unsigned long ClusterPeerLocations::size() const
+{
+	unsigned long n = 0;
+	for(unsigned int sn=0;sn<ZT_CLUSTER_PEER_LOCATION_SHARDS;++sn) {
+		Mutex::Lock _l(_shards[sn].lock);
+		n += _shards[sn].peers.size();
+	}
+	return n;
+}
+
 Cluster::Cluster(
 	const RuntimeEnvironment *renv,
 	uint16_t id,
@@ -209,6 +277,9 @@ Cluster::Cluster(
 	_id(id),
 	_zeroTierPhysicalEndpoints(zeroTierPhysicalEndpoints),
 	_members(new _Member[ZT_CLUSTER_MAX_MEMBERS]),
+	_wantPeerSent(256),
+	_sendNow(false),
+	_die(false),
 	_lastFlushed(0),
 	_lastCleanedRemotePeers(0),
 	_lastCleanedQueue(0)
@@ -229,6 +300,10 @@ Cluster::Cluster(
 
 Cluster::~Cluster()
 {
+	_die = true;
+	while ((int)_senders > 0)
+		_sendSignal.post();
+
 	Utils::burn(_masterSecret,sizeof(_masterSecret));
 	Utils::burn(_key,sizeof(_key));
 	delete [] _members;
@@ -271,7 +346,16 @@ void Cluster::handleIncomingStateMessage(const void *msg,unsigned int len)
 
 	if (dmsg.size() < 4)
 		return;
-	const uint16_t fromMemberId = dmsg.at<uint16_t>(0);
+	uint16_t fromMemberId = dmsg.at<uint16_t>(0);
+	if ((fromMemberId & ZT_CLUSTER_FLAG_COMPRESSED) != 0) {
+		fromMemberId &= ~ZT_CLUSTER_FLAG_COMPRESSED;
+		char buf[ZT_CLUSTER_MAX_MESSAGE_LENGTH];
+		const int ucl = LZ4_decompress_safe(reinterpret_cast<const char *>(dmsg.data()) + 4,buf,(int)dmsg.size() - 4,(int)sizeof(buf) - 4);
+		if (ucl <= 0)
+			return;
+		dmsg.setSize(4);
+		dmsg.append(buf,(unsigned int)ucl);
+	}
 	unsigned int ptr = 2;
 	if (fromMemberId == _id) // sanity check: we don't talk to ourselves
 		return;
@@ -343,10 +427,7 @@ void Cluster::handleIncomingStateMessage(const void *msg,unsigned int len)
 						if (id) {
 							RR->topology->saveIdentity(id);
 
-							{
-								Mutex::Lock _l(_remotePeers_m);
-								_remotePeers[std::pair<Address,unsigned int>(id.address(),(unsigned int)fromMemberId)] = RR->node->now();
-							}
+							_remotePeers.update(id.address(),fromMemberId,RR->node->now());
 
 							_ClusterSendQueueEntry *q[16384]; // 16384 is "tons"
 							unsigned int qc = _sendQueue->getByDest(id.address(),q,16384);
@@ -364,7 +445,6 @@ void Cluster::handleIncomingStateMessage(const void *msg,unsigned int len)
 						if ( (peer) && (peer->hasClusterOptimalPath(RR->node->now())) ) {
 							Buffer<1024> buf;
 							peer->identity().serialize(buf);
-							Mutex::Lock _l2(_members[fromMemberId].lock);
 							_send(fromMemberId,CLUSTER_MESSAGE_HAVE_PEER,buf.data(),buf.size());
 						}
 					}	break;
@@ -451,10 +531,7 @@ void Cluster::handleIncomingStateMessage(const void *msg,unsigned int len)
 							}
 
 							if (haveMatch) {
-								{
-									Mutex::Lock _l2(_members[fromMemberId].lock);
-									_send(fromMemberId,CLUSTER_MESSAGE_PROXY_SEND,rendezvousForRemote.data(),rendezvousForRemote.size());
-								}
+								_send(fromMemberId,CLUSTER_MESSAGE_PROXY_SEND,rendezvousForRemote.data(),rendezvousForRemote.size());
 								RR->sw->send(rendezvousForLocal,true,0);
 							}
 						}
@@ -488,10 +565,8 @@ void Cluster::broadcastHavePeer(const Identity &id)
 	Buffer<1024> buf;
 	id.serialize(buf);
 	Mutex::Lock _l(_memberIds_m);
-	for(std::vector<uint16_t>::const_iterator mid(_memberIds.begin());mid!=_memberIds.end();++mid) {
-		Mutex::Lock _l2(_members[*mid].lock);
+	for(std::vector<uint16_t>::const_iterator mid(_memberIds.begin());mid!=_memberIds.end();++mid)
 		_send(*mid,CLUSTER_MESSAGE_HAVE_PEER,buf.data(),buf.size());
-	}
 }
 
 void Cluster::sendViaCluster(const Address &fromPeerAddress,const Address &toPeerAddress,const void *data,unsigned int len,bool unite)
@@ -504,17 +579,9 @@ void Cluster::sendViaCluster(const Address &fromPeerAddress,const Address &toPee
 	uint64_t mostRecentTs = 0;
 	unsigned int mostRecentMemberId = 0xffffffff;
 	{
-		Mutex::Lock _l2(_remotePeers_m);
-		std::map< std::pair<Address,unsigned int>,uint64_t >::const_iterator rpe(_remotePeers.lower_bound(std::pair<Address,unsigned int>(toPeerAddress,0)));
-		for(;;) {
-			if ((rpe == _remotePeers.end())||(rpe->first.first != toPeerAddress))
-				break;
-			else if (rpe->second > mostRecentTs) {
-				mostRecentTs = rpe->second;
-				mostRecentMemberId = rpe->first.second;
-			}
-			++rpe;
-		}
+		uint16_t mid = 0;
+		if (_remotePeers.mostRecent(toPeerAddress,mid,mostRecentTs))
+			mostRecentMemberId = mid;
 	}
 
 	const uint64_t age = now - mostRecentTs;
@@ -522,15 +589,22 @@ void Cluster::sendViaCluster(const Address &fromPeerAddress,const Address &toPee
 		const bool enqueueAndWait = ((age >= ZT_PEER_ACTIVITY_TIMEOUT)||(mostRecentMemberId > 0xffff));
 
 		// Poll everyone with WANT_PEER if the age of our most recent entry is
-		// approaching expiration (or has expired, or does not exist).
-		char tmp[ZT_ADDRESS_LENGTH];
-		toPeerAddress.copyTo(tmp,ZT_ADDRESS_LENGTH);
+		// approaching expiration (or has expired, or does not exist), unless
+		// we already have and are still waiting for answers.
+		bool wantPeer;
 		{
+			Mutex::Lock _l(_wantPeerSent_m);
+			uint64_t &lastSent = _wantPeerSent[toPeerAddress];
+			wantPeer = ((now - lastSent) >= ZT_CLUSTER_WANT_PEER_INTERVAL);
+			if (wantPeer)
+				lastSent = now;
+		}
+		if (wantPeer) {
+			char tmp[ZT_ADDRESS_LENGTH];
+			toPeerAddress.copyTo(tmp,ZT_ADDRESS_LENGTH);
 			Mutex::Lock _l(_memberIds_m);
-			for(std::vector<uint16_t>::const_iterator mid(_memberIds.begin());mid!=_memberIds.end();++mid) {
-				Mutex::Lock _l2(_members[*mid].lock);
+			for(std::vector<uint16_t>::const_iterator mid(_memberIds.begin());mid!=_memberIds.end();++mid)
 				_send(*mid,CLUSTER_MESSAGE_WANT_PEER,tmp,ZT_ADDRESS_LENGTH);
-			}
 		}
 
 		// If there isn't a good place to send via, then enqueue this for retrying
@@ -566,11 +640,11 @@ void Cluster::sendViaCluster(const Address &fromPeerAddress,const Address &toPee
 		}
 	}
 
+	if (buf.size() > 0)
+		_send(mostRecentMemberId,CLUSTER_MESSAGE_PROXY_UNITE,buf.data(),buf.size());
+
 	{
 		Mutex::Lock _l2(_members[mostRecentMemberId].lock);
-		if (buf.size() > 0)
-			_send(mostRecentMemberId,CLUSTER_MESSAGE_PROXY_UNITE,buf.data(),buf.size());
-
 		for(std::vector<InetAddress>::const_iterator i1(_zeroTierPhysicalEndpoints.begin());i1!=_zeroTierPhysicalEndpoints.end();++i1) {
 			for(std::vector<InetAddress>::const_iterator i2(_members[mostRecentMemberId].zeroTierPhysicalEndpoints.begin());i2!=_members[mostRecentMemberId].zeroTierPhysicalEndpoints.end();++i2) {
 				if (i1->ss_family == i2->ss_family) {
@@ -592,25 +666,23 @@ void Cluster::sendDistributedQuery(const Packet &pkt)
 	buf.append((uint16_t)pkt.size());
 	buf.append(pkt.data(),pkt.size());
 	Mutex::Lock _l(_memberIds_m);
-	for(std::vector<uint16_t>::const_iterator mid(_memberIds.begin());mid!=_memberIds.end();++mid) {
-		Mutex::Lock _l2(_members[*mid].lock);
+	for(std::vector<uint16_t>::const_iterator mid(_memberIds.begin());mid!=_memberIds.end();++mid)
 		_send(*mid,CLUSTER_MESSAGE_REMOTE_PACKET,buf.data(),buf.size());
-	}
 }
 
-void Cluster::doPeriodicTasks()
+unsigned long Cluster::doPeriodicTasks()
 {
 	const uint64_t now = RR->node->now();
+	unsigned long nextDelay = ZT_CLUSTER_ANNOUNCE_PERIOD;
 
-	if ((now - _lastFlushed) >= ZT_CLUSTER_FLUSH_PERIOD) {
-		_lastFlushed = now;
-
+	{
 		Mutex::Lock _l(_memberIds_m);
 		for(std::vector<uint16_t>::const_iterator mid(_memberIds.begin());mid!=_memberIds.end();++mid) {
-			Mutex::Lock _l2(_members[*mid].lock);
+			_Member &m = _members[*mid];
+			Mutex::Lock _l2(m.lock);
 
-			if ((now - _members[*mid].lastAnnouncedAliveTo) >= ((ZT_CLUSTER_TIMEOUT / 2) - 1000)) {
-				_members[*mid].lastAnnouncedAliveTo = now;
+			if ((now - m.lastAnnouncedAliveTo) >= ZT_CLUSTER_ANNOUNCE_PERIOD) {
+				m.lastAnnouncedAliveTo = now;
 
 				Buffer<2048> alive;
 				alive.append((uint16_t)ZEROTIER_ONE_VERSION_MAJOR);
@@ -634,20 +706,33 @@ void Cluster::doPeriodicTasks()
 				for(std::vector<InetAddress>::const_iterator pe(_zeroTierPhysicalEndpoints.begin());pe!=_zeroTierPhysicalEndpoints.end();++pe)
 					pe->serialize(alive);
 				_send(*mid,CLUSTER_MESSAGE_ALIVE,alive.data(),alive.size());
+			} else {
+				nextDelay = std::min(nextDelay,(unsigned long)(ZT_CLUSTER_ANNOUNCE_PERIOD - (now - m.lastAnnouncedAliveTo)));
 			}
+		}
+	}
 
-			_flush(*mid);
+	// Without a sender thread queues are flushed here, so we must be called often
+	if ((int)_senders <= 0) {
+		nextDelay = ZT_CLUSTER_FLUSH_PERIOD;
+		if ((now - _lastFlushed) >= ZT_CLUSTER_FLUSH_PERIOD) {
+			_lastFlushed = now;
+			_flush();
 		}
 	}
 
 	if ((now - _lastCleanedRemotePeers) >= (ZT_PEER_ACTIVITY_TIMEOUT * 2)) {
 		_lastCleanedRemotePeers = now;
 
-		Mutex::Lock _l(_remotePeers_m);
-		for(std::map< std::pair<Address,unsigned int>,uint64_t >::iterator rp(_remotePeers.begin());rp!=_remotePeers.end();) {
-			if ((now - rp->second) >= ZT_PEER_ACTIVITY_TIMEOUT)
-				_remotePeers.erase(rp++);
-			else ++rp;
+		_remotePeers.clean(now,ZT_PEER_ACTIVITY_TIMEOUT);
+
+		Mutex::Lock _l(_wantPeerSent_m);
+		Hashtable< Address,uint64_t >::Iterator i(_wantPeerSent);
+		Address *k = (Address *)0;
+		uint64_t *v = (uint64_t *)0;
+		while (i.next(k,v)) {
+			if ((now - *v) >= ZT_CLUSTER_WANT_PEER_INTERVAL)
+				_wantPeerSent.erase(*k);
 		}
 	}
 
@@ -655,6 +740,34 @@ void Cluster::doPeriodicTasks()
 		_lastCleanedQueue = now;
 		_sendQueue->expire(now);
 	}
+
+	return nextDelay;
+}
+
+bool Cluster::senderThreadMain()
+{
+	if (++_senders != 1) {
+		--_senders;
+		return false;
+	}
+
+	while (!_die) {
+		_sendSignal.wait(); // something has been queued
+		if (_die)
+			break;
+		// Give other messages a chance to join the batch unless a queue already fills a message
+		if (!_sendNow)
+			_sendSignal.wait(ZT_CLUSTER_FLUSH_PERIOD);
+		if (_die)
+			break;
+		_sendNow = false;
+		try {
+			_flush();
+		} catch ( ... ) {} // sanity check -- should not throw
+	}
+
+	--_senders;
+	return true;
 }
 
 void Cluster::addMember(uint16_t memberId)
@@ -673,6 +786,10 @@ void Cluster::addMember(uint16_t memberId)
 	}
 
 	_members[memberId].clear();
+	{
+		Mutex::Lock _l3(_members[memberId].q_m);
+		_members[memberId].q.clear();
+	}
 
 	// Generate this member's message key from the master and its ID
 	uint16_t stmp[ZT_SHA512_DIGEST_LEN / sizeof(uint16_t)];
@@ -682,15 +799,6 @@ void Cluster::addMember(uint16_t memberId)
 	SHA512::hash(stmp,stmp,sizeof(stmp));
 	memcpy(_members[memberId].key,stmp,sizeof(_members[memberId].key));
 	Utils::burn(stmp,sizeof(stmp));
-
-	// Prepare q
-	_members[memberId].q.clear();
-	char iv[16];
-	Utils::getSecureRandom(iv,16);
-	_members[memberId].q.append(iv,16);
-	_members[memberId].q.addSize(8); // room for MAC
-	_members[memberId].q.append((uint16_t)_id);
-	_members[memberId].q.append((uint16_t)memberId);
 }
 
 void Cluster::removeMember(uint16_t memberId)
@@ -809,54 +917,121 @@ void Cluster::_send(uint16_t memberId,StateMessageType type,const void *msg,unsi
 	if ((len + 3) > (ZT_CLUSTER_MAX_MESSAGE_LENGTH - (24 + 2 + 2))) // sanity check
 		return;
 	_Member &m = _members[memberId];
-	// assumes m.lock is locked!
-	if ((m.q.size() + len + 3) > ZT_CLUSTER_MAX_MESSAGE_LENGTH)
-		_flush(memberId);
-	m.q.append((uint16_t)(len + 1));
-	m.q.append((uint8_t)type);
-	m.q.append(msg,len);
+
+	// Only the queue lock is held here -- compression, encryption, and the
+	// actual send happen later in _flush().
+	bool wake,full;
+	{
+		Mutex::Lock _l(m.q_m);
+		const unsigned long before = (unsigned long)m.q.size();
+		if ((before + len + 3) > ZT_CLUSTER_MAX_QUEUED_BYTES)
+			return;
+		m.q.push_back((char)((len + 1) >> 8));
+		m.q.push_back((char)(len + 1));
+		m.q.push_back((char)type);
+		m.q.append(reinterpret_cast<const char *>(msg),len);
+		full = ((before < (ZT_CLUSTER_MAX_MESSAGE_LENGTH - 28))&&((unsigned long)m.q.size() >= (ZT_CLUSTER_MAX_MESSAGE_LENGTH - 28)));
+		wake = ((before == 0)||(full));
+	}
+
+	if ((wake)&&((int)_senders > 0)) {
+		if (full)
+			_sendNow = true;
+		_sendSignal.post();
+	}
 }
 
-void Cluster::_flush(uint16_t memberId)
+void Cluster::_flush()
 {
-	_Member &m = _members[memberId];
-	// assumes m.lock is locked!
-	if (m.q.size() > (24 + 2 + 2)) { // 16-byte IV + 8-byte MAC + 2 byte from-member-ID + 2 byte to-member-ID
-		// Create key from member's key and IV
-		char keytmp[32];
-		memcpy(keytmp,m.key,32);
-		for(int i=0;i<8;++i)
-			keytmp[i] ^= m.q[i];
-		Salsa20 s20(keytmp,256,m.q.field(8,8));
-		Utils::burn(keytmp,sizeof(keytmp));
+	std::vector<uint16_t> memberIds;
+	{
+		Mutex::Lock _l(_memberIds_m);
+		memberIds = _memberIds;
+	}
 
-		// One-time-use Poly1305 key from first 32 bytes of Salsa20 keystream (as per DJB/NaCl "standard")
-		char polykey[ZT_POLY1305_KEY_LEN];
-		memset(polykey,0,sizeof(polykey));
-		s20.encrypt12(polykey,polykey,sizeof(polykey));
+	Mutex::Lock _l(_flush_m);
+	for(std::vector<uint16_t>::const_iterator mid(memberIds.begin());mid!=memberIds.end();++mid) {
+		_Member &m = _members[*mid];
 
-		// Encrypt m.q in place
-		s20.encrypt12(reinterpret_cast<const char *>(m.q.data()) + 24,const_cast<char *>(reinterpret_cast<const char *>(m.q.data())) + 24,m.q.size() - 24);
+		{
+			Mutex::Lock _l2(m.q_m);
+			if (m.q.empty())
+				continue;
+			m.q.swap(_flushBuf); // _flushBuf is empty, so this leaves its capacity in m.q
+		}
 
-		// Add MAC for authentication (encrypt-then-MAC)
-		char mac[ZT_POLY1305_MAC_LEN];
-		Poly1305::compute(mac,reinterpret_cast<const char *>(m.q.data()) + 24,m.q.size() - 24,polykey);
-		memcpy(m.q.field(16,8),mac,8);
+		unsigned char key[ZT_PEER_SECRET_KEY_LENGTH];
+		{
+			Mutex::Lock _l2(m.lock);
+			memcpy(key,m.key,sizeof(key));
+		}
 
-		// Send!
-		_sendFunction(_sendFunctionArg,memberId,m.q.data(),m.q.size());
+		// Pack as many whole messages into each batch as will fit
+		const char *const msgs = _flushBuf.data();
+		const unsigned int total = (unsigned int)_flushBuf.size();
+		unsigned int start = 0,ptr = 0;
+		while (ptr < total) {
+			const unsigned int mlen = 2 + ((((unsigned int)((const unsigned char *)msgs)[ptr]) << 8) | ((unsigned int)((const unsigned char *)msgs)[ptr + 1]));
+			if (((ptr + mlen) - start) > (ZT_CLUSTER_MAX_MESSAGE_LENGTH - 28)) {
+				_sendBatch(*mid,key,msgs + start,ptr - start);
+				start = ptr;
+			}
+			ptr += mlen;
+		}
+		if (ptr > start)
+			_sendBatch(*mid,key,msgs + start,ptr - start);
 
-		// Prepare for more
-		m.q.clear();
-		char iv[16];
-		Utils::getSecureRandom(iv,16);
-		m.q.append(iv,16);
-		m.q.addSize(8); // room for MAC
-		m.q.append((uint16_t)_id); // from member ID
-		m.q.append((uint16_t)memberId); // to member ID
+		Utils::burn(key,sizeof(key));
+		_flushBuf.clear();
 	}
 }
 
+void Cluster::_sendBatch(uint16_t memberId,const unsigned char *key,const char *msgs,unsigned int len)
+{
+	// FORMAT: <[16] iv><[8] MAC><[2] from-member ID and flags><[2] to-member ID><... messages>
+	Buffer<ZT_CLUSTER_MAX_MESSAGE_LENGTH> b;
+	char iv[16];
+	Utils::getSecureRandom(iv,16);
+	b.append(iv,16);
+	b.addSize(8); // room for MAC
+
+	// Batches of messages like HAVE_PEER are very repetitive, so compress if it helps
+	char cbuf[ZT_CLUSTER_MAX_MESSAGE_LENGTH];
+	const int cl = LZ4_compress_limitedOutput(msgs,cbuf,(int)len,(int)len - 1);
+	if (cl > 0) {
+		b.append((uint16_t)(_id | ZT_CLUSTER_FLAG_COMPRESSED));
+		b.append((uint16_t)memberId);
+		b.append(cbuf,(unsigned int)cl);
+	} else {
+		b.append((uint16_t)_id);
+		b.append((uint16_t)memberId);
+		b.append(msgs,len);
+	}
+
+	// Create key from member's key and IV
+	char keytmp[32];
+	memcpy(keytmp,key,32);
+	for(int i=0;i<8;++i)
+		keytmp[i] ^= iv[i];
+	Salsa20 s20(keytmp,256,iv + 8);
+	Utils::burn(keytmp,sizeof(keytmp));
+
+	// One-time-use Poly1305 key from first 32 bytes of Salsa20 keystream (as per DJB/NaCl "standard")
+	char polykey[ZT_POLY1305_KEY_LEN];
+	memset(polykey,0,sizeof(polykey));
+	s20.encrypt12(polykey,polykey,sizeof(polykey));
+
+	// Encrypt in place
+	s20.encrypt12(reinterpret_cast<const char *>(b.data()) + 24,const_cast<char *>(reinterpret_cast<const char *>(b.data())) + 24,b.size() - 24);
+
+	// Add MAC for authentication (encrypt-then-MAC)
+	char mac[ZT_POLY1305_MAC_LEN];
+	Poly1305::compute(mac,reinterpret_cast<const char *>(b.data()) + 24,b.size() - 24,polykey);
+	memcpy(b.field(16,8),mac,8);
+
+	_sendFunction(_sendFunctionArg,memberId,b.data(),b.size());
+}
+
 void Cluster::_doREMOTE_WHOIS(uint64_t fromMemberId,const Packet &remotep)
 {
 	if (remotep.payloadLength() >= ZT_ADDRESS_LENGTH) {
@@ -872,7 +1047,6 @@ void Cluster::_doREMOTE_WHOIS(uint64_t fromMemberId,const Packet &remotep)
 			routp.setAt<uint16_t>(ZT_ADDRESS_LENGTH + 1,(uint16_t)(routp.size() - ZT_ADDRESS_LENGTH - 3));
 
 			TRACE("responding to remote WHOIS from %s @ %u with identity of %s",remotep.source().toString().c_str(),(unsigned int)fromMemberId,queried.address().toString().c_str());
-			Mutex::Lock _l2(_members[fromMemberId].lock);
 			_send(fromMemberId,CLUSTER_MESSAGE_PROXY_SEND,routp.data(),routp.size());
 		}
 	}
@@ -902,7 +1076,6 @@ void Cluster::_doREMOTE_MULTICAST_GATHER(uint64_t fromMemberId,const Packet &rem
 			routp.setAt<uint16_t>(ZT_ADDRESS_LENGTH + 1,(uint16_t)(routp.size() - ZT_ADDRESS_LENGTH - 3));
 
 			TRACE("responding to remote MULTICAST_GATHER from %s @ %u with %u bytes",remotePeerAddress.toString().c_str(),(unsigned int)fromMemberId,routp.size());
-			Mutex::Lock _l2(_members[fromMemberId].lock);
 			_send(fromMemberId,CLUSTER_MESSAGE_PROXY_SEND,routp.data(),routp.size());
 		}
 	}
@@ -22,6 +22,7 @@
 #ifdef ZT_ENABLE_CLUSTER
 
 #include <map>
+#include <string>
 
 #include "Constants.hpp"
 #include "../include/ZeroTierOne.h"
@@ -35,6 +36,8 @@
 #include "Hashtable.hpp"
 #include "Packet.hpp"
 #include "SharedPtr.hpp"
+#include "AtomicCounter.hpp"
+#include "BinarySemaphore.hpp"
 
 /**
  * Timeout for cluster members being considered "alive"
@@ -46,14 +49,60 @@
 
 /**
  * Desired period between doPeriodicTasks() in milliseconds
+ *
+ * This only applies when no background thread is sending state messages,
+ * since doPeriodicTasks() must then flush outgoing message queues itself.
  */
 #define ZT_CLUSTER_PERIODIC_TASK_PERIOD 20
 
 /**
  * How often to flush outgoing message queues (maximum interval)
+ *
+ * The sender thread waits this long after a message is queued for more to
+ * batch with it, unless a member's queue fills a message first.
  */
 #define ZT_CLUSTER_FLUSH_PERIOD ZT_CLUSTER_PERIODIC_TASK_PERIOD
 
+/**
+ * How often to announce that we're alive to other members
+ */
+#define ZT_CLUSTER_ANNOUNCE_PERIOD ((ZT_CLUSTER_TIMEOUT / 2) - 1000)
+
+/**
+ * Maximum bytes of state messages queued for one member
+ *
+ * Messages are dropped if a member's queue is this full, which only happens
+ * if sending has fallen far behind.
+ */
+#define ZT_CLUSTER_MAX_QUEUED_BYTES 262144
+
+/**
+ * Minimum interval between WANT_PEER broadcasts for the same peer
+ */
+#define ZT_CLUSTER_WANT_PEER_INTERVAL 1000
+
+/**
+ * Flag in from-member ID field indicating that messages are LZ4 compressed
+ *
+ * Members without compression support see this as a member ID above
+ * ZT_CLUSTER_MAX_MEMBERS and drop the whole batch, so all members of a
+ * cluster must be upgraded together.
+ */
+#define ZT_CLUSTER_FLAG_COMPRESSED 0x8000
+
+/**
+ * Number of independently locked shards in the remote peer location table
+ */
+#define ZT_CLUSTER_PEER_LOCATION_SHARDS 64
+
+/**
+ * Number of members that can be remembered as having a given remote peer
+ *
+ * If more members report a peer, the one heard from least recently is
+ * forgotten. Peers are normally connected to one member at a time.
+ */
+#define ZT_CLUSTER_PEER_LOCATION_SLOTS 4
+
 /**
  * Maximum number of queued outgoing packets per sender address
  */
@@ -98,6 +147,69 @@ class Identity;
 // Internal class implemented inside Cluster.cpp
 class _ClusterSendQueue;
 
+/**
+ * Which cluster members have which remote peers, and when they last said so
+ *
+ * This is a hash table from peer address to a small fixed array of member
+ * IDs and timestamps. It is split into ZT_CLUSTER_PEER_LOCATION_SHARDS
+ * independently locked shards by address, so lookups for relayed packets
+ * hold a lock only long enough to scan one peer's slots and don't contend
+ * with updates for other peers.
+ */
+class ClusterPeerLocations
+{
+public:
+	/**
+	 * Record that a member has a peer
+	 *
+	 * @param peerAddress Address of remote peer
+	 * @param memberId Member that has it
+	 * @param now Current time
+	 */
+	void update(const Address &peerAddress,uint16_t memberId,uint64_t now);
+
+	/**
+	 * Find the member most recently known to have a peer
+	 *
+	 * @param peerAddress Address of remote peer
+	 * @param memberId Set to member ID if found
+	 * @param lastSeen Set to time of member's most recent report if found
+	 * @return True if any member is known to have this peer
+	 */
+	bool mostRecent(const Address &peerAddress,uint16_t &memberId,uint64_t &lastSeen) const;
+
+	/**
+	 * Forget reports older than a maximum age
+	 *
+	 * @param now Current time
+	 * @param maxAge Maximum age in milliseconds
+	 */
+	void clean(uint64_t now,uint64_t maxAge);
+
+	/**
+	 * @return Number of remote peers with at least one known location
+	 */
+	unsigned long size() const;
+
+private:
+	struct _Locations
+	{
+		_Locations() { memset(lastSeen,0,sizeof(lastSeen)); memset(memberId,0,sizeof(memberId)); }
+		uint64_t lastSeen[ZT_CLUSTER_PEER_LOCATION_SLOTS]; // 0 if slot is empty
+		uint16_t memberId[ZT_CLUSTER_PEER_LOCATION_SLOTS];
+	};
+	struct _Shard
+	{
+		Hashtable< Address,_Locations > peers;
+		Mutex lock;
+	};
+
+	// Addresses are hashes of identities, so any byte is fine for picking a shard
+	inline _Shard &_shard(const Address &a) const { return const_cast<ClusterPeerLocations *>(this)->_shards[(unsigned long)(a.toInt() >> 32) % ZT_CLUSTER_PEER_LOCATION_SHARDS]; }
+
+	_Shard _shards[ZT_CLUSTER_PEER_LOCATION_SHARDS];
+};
+
 /**
  * Multi-homing cluster state replication and packet relaying
  *
@@ -294,9 +406,22 @@ public:
 	void sendDistributedQuery(const Packet &pkt);
 
 	/**
-	 * Call every ~ZT_CLUSTER_PERIODIC_TASK_PERIOD milliseconds.
+	 * Announce ourselves, clean up, and flush queues if there is no sender thread
+	 *
+	 * @return Number of milliseconds until this should be called again
+	 */
+	unsigned long doPeriodicTasks();
+
+	/**
+	 * Send queued state messages until this cluster is destroyed
+	 *
+	 * This is run by one of the node's background threads. Only one thread
+	 * can be the sender, so this returns false immediately if another
+	 * already is. Without a sender doPeriodicTasks() flushes queues itself.
+	 *
+	 * @return False if another thread is already sending, true on shutdown
 	 */
-	void doPeriodicTasks();
+	bool senderThreadMain();
 
 	/**
 	 * Add a member ID to this cluster
@@ -332,7 +457,8 @@ public:
 
 private:
 	void _send(uint16_t memberId,StateMessageType type,const void *msg,unsigned int len);
-	void _flush(uint16_t memberId);
+	void _flush();
+	void _sendBatch(uint16_t memberId,const unsigned char *key,const char *msgs,unsigned int len);
 
 	void _doREMOTE_WHOIS(uint64_t fromMemberId,const Packet &remotep);
 	void _doREMOTE_MULTICAST_GATHER(uint64_t fromMemberId,const Packet &remotep);
@@ -366,10 +492,12 @@ private:
 
 		std::vector<InetAddress> zeroTierPhysicalEndpoints;
 
-		Buffer<ZT_CLUSTER_MAX_MESSAGE_LENGTH> q;
-
 		Mutex lock;
 
+		// Outgoing messages, each <[2] length><[1] type><[...] payload>
+		std::string q;
+		Mutex q_m;
+
 		inline void clear()
 		{
 			lastReceivedAliveAnnouncement = 0;
@@ -380,7 +508,6 @@ private:
 			y = 0;
 			z = 0;
 			zeroTierPhysicalEndpoints.clear();
-			q.clear();
 		}
 
 		_Member() { this->clear(); }
@@ -391,8 +518,18 @@ private:
 	std::vector<uint16_t> _memberIds;
 	Mutex _memberIds_m;
 
-	std::map< std::pair<Address,unsigned int>,uint64_t > _remotePeers; // we need ordered behavior and lower_bound here
-	Mutex _remotePeers_m;
+	ClusterPeerLocations _remotePeers;
+
+	Hashtable< Address,uint64_t > _wantPeerSent; // when we last broadcast WANT_PEER for each peer
+	Mutex _wantPeerSent_m;
+
+	std::string _flushBuf; // swapped with member queues while they're sent
+	Mutex _flush_m;
+
+	BinarySemaphore _sendSignal;
+	AtomicCounter _senders;
+	volatile bool _sendNow;
+	volatile bool _die;
 
 	uint64_t _lastFlushed;
 	uint64_t _lastCleanedRemotePeers;
@@ -164,8 +164,9 @@
 /**
  * Size of RX queue
  *
- * This is about 2mb, and can be decreased for small devices. A queue smaller
- * than about 4 is probably going to cause a lot of lost packets.
+ * With its fragment buffer pool this is about 1mb, and can be decreased for
+ * small devices. A queue smaller than about 4 is probably going to cause a
+ * lot of lost packets.
  */
 #define ZT_RX_QUEUE_SIZE 64
 
@@ -174,6 +175,42 @@
  */
 #define ZT_RX_QUEUE_EXPIRE 4000
 
+/**
+ * Number of independently locked shards the RX queue is split into
+ *
+ * Entries are assigned to shards by packet ID. ZT_RX_QUEUE_SIZE must be a
+ * multiple of this.
+ */
+#define ZT_RX_QUEUE_SHARDS 4
+
+/**
+ * Number of hash buckets indexing each RX queue shard's entries by packet ID
+ */
+#define ZT_RX_QUEUE_BUCKETS 32
+
+/**
+ * Number of buffers each RX queue shard pools for fragments after the head
+ *
+ * This averages two per entry. Most fragmented packets have only one fragment
+ * after the head, and entries waiting on WHOIS often have none.
+ */
+#define ZT_RX_QUEUE_FRAGMENT_POOL ((ZT_RX_QUEUE_SIZE / ZT_RX_QUEUE_SHARDS) * 2)
+
+/**
+ * Number of independently locked shards the TX queue is split into
+ *
+ * Packets are assigned to shards by destination address.
+ */
+#define ZT_TX_QUEUE_SHARDS 8
+
+/**
+ * Number of independently locked shards in the peer database
+ *
+ * Peers are assigned to shards by address, so threads handling traffic for
+ * different peers rarely contend for the same lock.
+ */
+#define ZT_TOPOLOGY_PEER_SHARDS 16
+
 /**
  * Length of secret key in bytes -- 256-bit -- do not change
  */
@@ -189,6 +226,23 @@
  */
 #define ZT_CORE_TIMER_TASK_GRANULARITY 500
 
+/**
+ * Maximum number of validated identities whose agreed keys are remembered
+ *
+ * Validating a new identity means computing its memory-hard proof of work
+ * hash, so identities that have already passed are cached (see Topology).
+ */
+#define ZT_VERIFIED_IDENTITY_CACHE_SIZE 8192
+
+/**
+ * Maximum number of verified certificate of membership signatures remembered
+ *
+ * Every COM a peer presents is looked up here first, including re-pushes of
+ * the one it already holds, so only new certificates cost a signature check.
+ * See Topology.
+ */
+#define ZT_VERIFIED_COM_CACHE_SIZE 8192
+
 /**
  * How long to remember peer records in RAM if they haven't been used
  */
@@ -243,6 +297,14 @@
  */
 #define ZT_MULTICAST_DEFAULT_LIMIT 32
 
+/**
+ * Always-send-to lists up to this size are scanned linearly when excluding them from a multicast draw
+ *
+ * These are normally a few active bridges. Longer lists are sorted once per
+ * send and binary searched instead.
+ */
+#define ZT_MULTICAST_ALWAYS_SEND_TO_SCAN_MAX 16
+
 /**
  * How frequently to send a zero-byte UDP keepalive packet
  *
@@ -284,6 +346,63 @@
  */
 #define ZT_PEER_DEAD_PATH_DETECTION_MAX_PROBATION 3
 
+/**
+ * Score margin (in ms of latency) a path must beat the current best path by to replace it
+ *
+ * To this is added 1/8 of the current path's latency so slower links need a
+ * proportionally larger improvement before we switch away from them.
+ */
+#define ZT_PEER_PATH_SWITCH_HYSTERESIS 5
+
+/**
+ * Number of UDP payload sizes path MTU discovery steps through
+ *
+ * Probes are sent with DF set and tried from smallest to largest, stopping
+ * at the first that doesn't get through: ZT_UDP_DEFAULT_PAYLOAD_MTU, then a
+ * full ZT_PATH_MTU_ETHERNET frame less IP and UDP headers, then
+ * ZT_PATH_MTU_PROBE_MAX for jumbo frame paths.
+ */
+#define ZT_PATH_MTU_PROBE_STEPS 3
+
+/**
+ * Link MTU of the middle probe step (standard Ethernet)
+ */
+#define ZT_PATH_MTU_ETHERNET 1500
+
+/**
+ * IPv4 and UDP header bytes in a datagram without IP options
+ */
+#define ZT_PATH_MTU_IPV4_UDP_OVERHEAD 28
+
+/**
+ * IPv6 and UDP header bytes in a datagram without extension headers
+ */
+#define ZT_PATH_MTU_IPV6_UDP_OVERHEAD 48
+
+/**
+ * Largest UDP payload path MTU discovery probes for
+ *
+ * This is the largest packet we'll ever build (ZT_PROTO_MAX_PACKET_LENGTH),
+ * so paths that carry it never need ZeroTier fragmentation. It fits in a
+ * 9000 byte jumbo frame.
+ */
+#define ZT_PATH_MTU_PROBE_MAX (ZT_MAX_PACKET_FRAGMENTS * ZT_UDP_DEFAULT_PAYLOAD_MTU)
+
+/**
+ * Unanswered probes at a given size before path MTU discovery gives up on it
+ */
+#define ZT_PATH_MTU_PROBE_ATTEMPTS 3
+
+/**
+ * Minimum delay between path MTU probes while discovery is in progress
+ */
+#define ZT_PATH_MTU_PROBE_INTERVAL 5000
+
+/**
+ * Interval after which a path's MTU is discovered again in case its route changed
+ */
+#define ZT_PATH_MTU_REPROBE_INTERVAL 600000
+
 /**
  * Delay between requests for updated network autoconf information
  *
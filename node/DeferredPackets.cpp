@@ -26,9 +26,14 @@ namespace ZeroTier {
 
 DeferredPackets::DeferredPackets(const RuntimeEnvironment *renv) :
 	RR(renv),
+	_slots(new _Slot[ZT_DEFFEREDPACKETS_MAX]),
+	_enqueuePos(0),
+	_dequeuePos(0),
 	_waiting(0),
 	_die(false)
 {
+	for(unsigned long i=0;i<ZT_DEFFEREDPACKETS_MAX;++i)
+		_store(_slots[i].seq,i);
 }
 
 DeferredPackets::~DeferredPackets()
@@ -41,60 +46,98 @@ DeferredPackets::~DeferredPackets()
 		_q_s.post();
 
 		_q_m.lock();
-		if (_waiting <= 0) {
+		if ((_waiting <= 0)&&((int)_running <= 0)) {
 			_q_m.unlock();
 			break;
 		} else {
 			_q_m.unlock();
 		}
 	}
+
+	delete [] _slots;
 }
 
 bool DeferredPackets::enqueue(IncomingPacket *pkt)
 {
-	{
-		Mutex::Lock _l(_q_m);
-		if (_q.size() >= ZT_DEFFEREDPACKETS_MAX)
+	_Slot *s;
+	unsigned long pos = _load(_enqueuePos);
+	for(;;) {
+		s = &(_slots[pos & (ZT_DEFFEREDPACKETS_MAX - 1)]);
+		const long dif = (long)(_load(s->seq) - pos);
+		if (dif == 0) {
+			if (_cas(_enqueuePos,pos,pos + 1))
+				break;
+			pos = _load(_enqueuePos);
+		} else if (dif < 0) {
+			++_dropped;
 			return false;
-		_q.push_back(*pkt);
+		} else {
+			pos = _load(_enqueuePos);
+		}
 	}
+
+	s->pkt.init(*pkt);
+	_store(s->seq,pos + 1);
+
 	_q_s.post();
 	return true;
 }
 
 int DeferredPackets::process()
 {
-	std::list<IncomingPacket> pkt;
-
-	_q_m.lock();
-
-	if (_die) {
-		_q_m.unlock();
-		return -1;
-	}
+	++_running;
 
-	while (_q.empty()) {
-		++_waiting;
-		_q_m.unlock();
-		_q_s.wait();
-		_q_m.lock();
-		--_waiting;
+	_Slot *s;
+	unsigned long pos = _load(_dequeuePos);
+	for(;;) {
 		if (_die) {
-			_q_m.unlock();
+			--_running;
 			return -1;
 		}
+
+		s = &(_slots[pos & (ZT_DEFFEREDPACKETS_MAX - 1)]);
+		const long dif = (long)(_load(s->seq) - (pos + 1));
+		if (dif == 0) {
+			if (_cas(_dequeuePos,pos,pos + 1))
+				break;
+			pos = _load(_dequeuePos);
+		} else if (dif < 0) {
+			// Empty, so sleep until something is enqueued
+			_q_m.lock();
+			if (_die) {
+				_q_m.unlock();
+				--_running;
+				return -1;
+			}
+			++_waiting;
+			_q_m.unlock();
+			_q_s.wait();
+			_q_m.lock();
+			--_waiting;
+			_q_m.unlock();
+			pos = _load(_dequeuePos);
+		} else {
+			pos = _load(_dequeuePos);
+		}
 	}
 
-	// Move item from _q list to a dummy list here to avoid copying packet
-	pkt.splice(pkt.end(),_q,_q.begin());
+	// Semaphore posts can coalesce, so pass the wakeup on if there's more
+	if (_load(_enqueuePos) != (pos + 1))
+		_q_s.post();
 
-	_q_m.unlock();
+	_decode(s->pkt);
 
-	try {
-		pkt.front().tryDecode(RR,true);
-	} catch ( ... ) {} // drop invalids
+	_store(s->seq,pos + ZT_DEFFEREDPACKETS_MAX);
 
+	--_running;
 	return 1;
 }
 
+void DeferredPackets::_decode(IncomingPacket &pkt)
+{
+	try {
+		pkt.tryDecode(RR,true);
+	} catch ( ... ) {} // drop invalids
+}
+
 } // namespace ZeroTier
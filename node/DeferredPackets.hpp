@@ -19,22 +19,26 @@
 #ifndef ZT_DEFERREDPACKETS_HPP
 #define ZT_DEFERREDPACKETS_HPP
 
-#include <list>
+#include <stdint.h>
 
 #include "Constants.hpp"
-#include "SharedPtr.hpp"
 #include "Mutex.hpp"
-#include "DeferredPackets.hpp"
+#include "NonCopyable.hpp"
+#include "AtomicCounter.hpp"
 #include "BinarySemaphore.hpp"
+#include "IncomingPacket.hpp"
+
+#ifdef __WINDOWS__
+#include <atomic>
+#endif
 
 /**
- * Maximum number of deferred packets
+ * Maximum number of deferred packets (must be a power of two)
  */
 #define ZT_DEFFEREDPACKETS_MAX 256
 
 namespace ZeroTier {
 
-class IncomingPacket;
 class RuntimeEnvironment;
 
 /**
@@ -45,12 +49,19 @@ class RuntimeEnvironment;
  * operations that may be expensive to allow them to potentially be handled
  * in the background or rate limited to maintain quality of service for more
  * routine operations.
+ *
+ * The queue is a bounded lock-free ring of preallocated packet slots, so
+ * enqueueing never allocates or blocks. Any number of threads may enqueue
+ * and any number may call process(). Each slot carries a sequence number
+ * that says whether it is free for position N or holds the packet for it.
+ * A slot stays claimed while its packet is being decoded, so a ring full
+ * of slow decodes drops new packets rather than waiting.
  */
-class DeferredPackets
+class DeferredPackets : NonCopyable
 {
 public:
 	DeferredPackets(const RuntimeEnvironment *renv);
-	~DeferredPackets();
+	virtual ~DeferredPackets();
 
 	/**
 	 * Enqueue a packet
@@ -71,10 +82,52 @@ public:
 	 */
 	int process();
 
+	/**
+	 * @return Approximate number of packets waiting to be decoded
+	 */
+	inline unsigned long depth() const throw() { return (unsigned long)(_load(_enqueuePos) - _load(_dequeuePos)); }
+
+	/**
+	 * @return Total packets dropped because the queue was full
+	 */
+	inline uint64_t dropped() const throw() { return (uint64_t)((int)_dropped); }
+
+protected:
+	/**
+	 * Decode a packet taken off the queue (overridden by selftest to check the queue itself)
+	 *
+	 * @param pkt Packet to decode
+	 */
+	virtual void _decode(IncomingPacket &pkt);
+
 private:
-	std::list<IncomingPacket> _q;
+#ifdef __WINDOWS__
+	typedef std::atomic<unsigned long> _Seq;
+	static inline unsigned long _load(const _Seq &v) throw() { return v.load(); }
+	static inline void _store(_Seq &v,unsigned long x) throw() { v.store(x); }
+	static inline bool _cas(_Seq &v,unsigned long o,unsigned long n) throw() { return v.compare_exchange_strong(o,n); }
+#else
+	typedef volatile unsigned long _Seq;
+	static inline unsigned long _load(const _Seq &v) throw() { return __sync_fetch_and_or(const_cast<_Seq *>(&v),0UL); }
+	static inline void _store(_Seq &v,unsigned long x) throw() { __sync_synchronize(); v = x; }
+	static inline bool _cas(_Seq &v,unsigned long o,unsigned long n) throw() { return __sync_bool_compare_and_swap(&v,o,n); }
+#endif
+
+	struct _Slot
+	{
+		_Seq seq; // == position: free for enqueue, == position+1: holds packet for dequeue
+		IncomingPacket pkt;
+	};
+
 	const RuntimeEnvironment *const RR;
- 	volatile int _waiting;
+	_Slot *const _slots;
+	_Seq _enqueuePos;
+	_Seq _dequeuePos;
+	AtomicCounter _dropped;
+	AtomicCounter _running; // threads inside process()
+
+	// Only used to put idle process() callers to sleep and to shut down
+	volatile int _waiting;
 	volatile bool _die;
 	Mutex _q_m;
 	BinarySemaphore _q_s;
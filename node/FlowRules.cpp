@@ -0,0 +1,406 @@
+/*
+ * ZeroTier One - Network Virtualization Everywhere
+ * Copyright (C) 2011-2016  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "FlowRules.hpp"
+#include "Utils.hpp"
+
+namespace ZeroTier {
+
+FlowRules::Frame::Frame(const Address &zs,const Address &zd,const MAC &ms,const MAC &md,unsigned int et,unsigned int vid,const void *data,unsigned int len,bool inbound) :
+	ztSource(zs.toInt()),
+	ztDest(zd.toInt()),
+	macSource(ms.toInt()),
+	macDest(md.toInt()),
+	characteristics(0),
+	ipv4Source(0),
+	ipv4Dest(0),
+	etherType(et),
+	vlanId(vid),
+	frameSize(len),
+	ipTos(0),
+	ipProtocol(0),
+	portSource(0),
+	portDest(0),
+	isIpv4(false),
+	isIpv6(false),
+	hasPorts(false)
+{
+	const uint8_t *const p = reinterpret_cast<const uint8_t *>(data);
+	unsigned int l4 = 0; // offset of transport header, or 0 if none or not the first fragment
+
+	ipv6Source[0] = ipv6Source[1] = 0;
+	ipv6Dest[0] = ipv6Dest[1] = 0;
+
+	if (inbound)
+		characteristics |= ZT_RULE_PACKET_CHARACTERISTICS_INBOUND;
+	if (md.isMulticast())
+		characteristics |= ZT_RULE_PACKET_CHARACTERISTICS_MULTICAST;
+	if (md.isBroadcast())
+		characteristics |= ZT_RULE_PACKET_CHARACTERISTICS_BROADCAST;
+
+	if ((et == ZT_ETHERTYPE_IPV4)&&(len >= 20)&&((p[0] >> 4) == 4)) {
+		const unsigned int ihl = (p[0] & 0x0f) * 4;
+		if ((ihl >= 20)&&(len >= ihl)) {
+			isIpv4 = true;
+			ipTos = p[1];
+			ipProtocol = p[9];
+			ipv4Source = ((uint32_t)p[12] << 24) | ((uint32_t)p[13] << 16) | ((uint32_t)p[14] << 8) | (uint32_t)p[15];
+			ipv4Dest = ((uint32_t)p[16] << 24) | ((uint32_t)p[17] << 16) | ((uint32_t)p[18] << 8) | (uint32_t)p[19];
+			if ((((unsigned int)(p[6] & 0x1f) << 8) | (unsigned int)p[7]) == 0) // fragment offset
+				l4 = ihl;
+		}
+	} else if ((et == ZT_ETHERTYPE_IPV6)&&(len >= 40)&&((p[0] >> 4) == 6)) {
+		isIpv6 = true;
+		ipTos = ((p[0] & 0x0f) << 4) | (p[1] >> 4);
+		for(unsigned int i=0;i<8;++i) {
+			ipv6Source[0] = (ipv6Source[0] << 8) | (uint64_t)p[8 + i];
+			ipv6Source[1] = (ipv6Source[1] << 8) | (uint64_t)p[16 + i];
+			ipv6Dest[0] = (ipv6Dest[0] << 8) | (uint64_t)p[24 + i];
+			ipv6Dest[1] = (ipv6Dest[1] << 8) | (uint64_t)p[32 + i];
+		}
+
+		// Skip extension headers to find the transport protocol
+		unsigned int nh = p[6];
+		unsigned int ptr = 40;
+		l4 = 40;
+		for(;;) {
+			if ((nh == 0)||(nh == 43)||(nh == 60)) { // hop-by-hop, routing, destination options
+				if ((ptr + 8) > len) { l4 = 0; break; }
+				nh = p[ptr];
+				ptr += ((unsigned int)p[ptr + 1] + 1) * 8;
+			} else if (nh == 44) { // fragment
+				if ((ptr + 8) > len) { l4 = 0; break; }
+				if ((((unsigned int)p[ptr + 2] << 8) | (unsigned int)(p[ptr + 3] & 0xf8)) != 0) { l4 = 0; nh = p[ptr]; break; }
+				nh = p[ptr];
+				ptr += 8;
+			} else if (nh == 51) { // authentication header
+				if ((ptr + 8) > len) { l4 = 0; break; }
+				nh = p[ptr];
+				ptr += ((unsigned int)p[ptr + 1] + 2) * 4;
+			} else {
+				if (l4)
+					l4 = ptr;
+				break;
+			}
+		}
+		ipProtocol = nh;
+	}
+
+	if ((l4)&&((l4 + 4) <= len)) {
+		switch(ipProtocol) {
+			case 0x06: // TCP
+				if ((l4 + 14) <= len)
+					characteristics |= (((uint64_t)(p[l4 + 12] & 0x01)) << 8) | (uint64_t)p[l4 + 13];
+				// fall through
+			case 0x11: // UDP
+			case 0x84: // SCTP
+			case 0x88: // UDP-Lite
+				hasPorts = true;
+				portSource = ((unsigned int)p[l4] << 8) | (unsigned int)p[l4 + 1];
+				portDest = ((unsigned int)p[l4 + 2] << 8) | (unsigned int)p[l4 + 3];
+				break;
+		}
+	}
+}
+
+FlowRules::FlowRules(const ZT_VirtualNetworkRule *rules,unsigned int ruleCount) :
+	_words(1)
+{
+	std::vector<_Match> matches[_FIELD_COUNT];
+	std::vector<unsigned int> pending; // matches before the next action
+
+	for(unsigned int i=0;i<ruleCount;++i) {
+		const unsigned int t = rules[i].t & 0x7f;
+		if (t >= 32) {
+			pending.push_back(i);
+			continue;
+		}
+		if ((t == ZT_NETWORK_RULE_ACTION_ACCEPT)||(t == ZT_NETWORK_RULE_ACTION_DROP)) {
+			const unsigned int entry = (unsigned int)_actions.size();
+			for(std::vector<unsigned int>::const_iterator pi(pending.begin());pi!=pending.end();++pi) {
+				_Field f;
+				_Match m;
+				if (_fieldOf(rules[*pi],f,m.lo,m.hi)) {
+					m.entry = entry;
+					m.no = ((rules[*pi].t & 0x80) != 0);
+					matches[f].push_back(m);
+				} else {
+					_Residual r;
+					r.rule = rules[*pi];
+					r.entry = entry;
+					_residuals.push_back(r);
+				}
+			}
+			_actions.push_back((ZT_VirtualNetworkRuleType)t);
+		}
+		pending.clear();
+	}
+
+	if (_actions.size() > 64)
+		_words = ((unsigned int)_actions.size() + 63) / 64;
+
+	std::vector<uint64_t> all(_words,0);
+	for(unsigned int e=0;e<(unsigned int)_actions.size();++e)
+		all[e / 64] |= 1ULL << (e % 64);
+
+	for(unsigned int f=0;f<(unsigned int)_FIELD_COUNT;++f) {
+		if (matches[f].empty())
+			continue;
+
+		_dimensions.push_back(_Dimension());
+		_Dimension &d = _dimensions.back();
+		d.field = (_Field)f;
+		d.wide = ((f == _FIELD_IPV6_SOURCE)||(f == _FIELD_IPV6_DEST));
+
+		// Every value in [starts[i],starts[i+1]) satisfies the same matches
+		d.starts.push_back(_Value());
+		for(std::vector<_Match>::const_iterator m(matches[f].begin());m!=matches[f].end();++m) {
+			d.starts.push_back(m->lo);
+			_Value next(m->hi.hi,m->hi.lo + 1);
+			if (!next.lo)
+				++next.hi;
+			if ((next.hi)||(next.lo))
+				d.starts.push_back(next);
+		}
+		std::sort(d.starts.begin(),d.starts.end());
+		d.starts.erase(std::unique(d.starts.begin(),d.starts.end()),d.starts.end());
+
+		d.bits.reserve(d.starts.size() * _words);
+		for(std::vector<_Value>::const_iterator s(d.starts.begin());s!=d.starts.end();++s) {
+			const unsigned long b = (unsigned long)d.bits.size();
+			d.bits.insert(d.bits.end(),all.begin(),all.end());
+			for(std::vector<_Match>::const_iterator m(matches[f].begin());m!=matches[f].end();++m) {
+				if (((m->lo <= *s)&&(*s <= m->hi)) == m->no)
+					d.bits[b + (m->entry / 64)] &= ~(1ULL << (m->entry % 64));
+			}
+		}
+
+		d.absent = all;
+		for(std::vector<_Match>::const_iterator m(matches[f].begin());m!=matches[f].end();++m) {
+			if (!m->no)
+				d.absent[m->entry / 64] &= ~(1ULL << (m->entry % 64));
+		}
+	}
+}
+
+ZT_VirtualNetworkRuleType FlowRules::classify(const Frame &f) const
+{
+	uint64_t acc[(ZT_MAX_NETWORK_RULES + 63) / 64];
+	const unsigned int entries = (unsigned int)_actions.size();
+	if (!entries)
+		return ZT_NETWORK_RULE_ACTION_DROP;
+	if ((_dimensions.empty())&&(_residuals.empty()))
+		return _actions[0]; // first entry has no matches, e.g. the default ACCEPT-only table
+	for(unsigned int w=0;w<_words;++w)
+		acc[w] = 0xffffffffffffffffULL;
+	if (entries % 64)
+		acc[_words - 1] = (1ULL << (entries % 64)) - 1;
+
+	for(std::vector<_Dimension>::const_iterator d(_dimensions.begin());d!=_dimensions.end();++d) {
+		_Value v;
+		const uint64_t *b;
+		if (_fieldValue(f,d->field,v)) {
+			// Branch-free search for the last interval start <= v (starts[0] is always 0)
+			const _Value *base = &(d->starts[0]);
+			unsigned long n = (unsigned long)d->starts.size();
+			if (d->wide) {
+				while (n > 1) {
+					const unsigned long half = n / 2;
+					base = (v < base[half]) ? base : (base + half);
+					n -= half;
+				}
+			} else {
+				while (n > 1) {
+					const unsigned long half = n / 2;
+					base = (v.lo < base[half].lo) ? base : (base + half);
+					n -= half;
+				}
+			}
+			b = &(d->bits[(unsigned long)(base - &(d->starts[0])) * _words]);
+		} else b = &(d->absent[0]);
+		uint64_t any = 0;
+		for(unsigned int w=0;w<_words;++w)
+			any |= (acc[w] &= b[w]);
+		if (!any)
+			return ZT_NETWORK_RULE_ACTION_DROP;
+	}
+
+	for(std::vector<_Residual>::const_iterator r(_residuals.begin());r!=_residuals.end();++r) {
+		uint64_t &a = acc[r->entry / 64];
+		const uint64_t bit = 1ULL << (r->entry % 64);
+		if (((a & bit) != 0)&&(_matchResidual(r->rule,f) == ((r->rule.t & 0x80) != 0)))
+			a &= ~bit;
+	}
+
+	for(unsigned int w=0;w<_words;++w) {
+		uint64_t a = acc[w];
+		if (a) {
+			unsigned int e = w * 64;
+			while (!(a & 1)) {
+				a >>= 1;
+				++e;
+			}
+			return _actions[e];
+		}
+	}
+
+	return ZT_NETWORK_RULE_ACTION_DROP;
+}
+
+ZT_VirtualNetworkRuleType FlowRules::classifyLinear(const ZT_VirtualNetworkRule *rules,unsigned int ruleCount,const Frame &f)
+{
+	bool matched = true;
+	for(unsigned int i=0;i<ruleCount;++i) {
+		const unsigned int t = rules[i].t & 0x7f;
+		if (t < 32) {
+			if ((matched)&&((t == ZT_NETWORK_RULE_ACTION_ACCEPT)||(t == ZT_NETWORK_RULE_ACTION_DROP)))
+				return (ZT_VirtualNetworkRuleType)t;
+			matched = true;
+		} else if (matched) {
+			_Field field;
+			_Value lo,hi,v;
+			bool m;
+			if (_fieldOf(rules[i],field,lo,hi))
+				m = ((_fieldValue(f,field,v))&&(lo <= v)&&(v <= hi));
+			else m = _matchResidual(rules[i],f);
+			matched = (m != ((rules[i].t & 0x80) != 0));
+		}
+	}
+	return ZT_NETWORK_RULE_ACTION_DROP;
+}
+
+bool FlowRules::_fieldOf(const ZT_VirtualNetworkRule &r,_Field &field,_Value &lo,_Value &hi)
+{
+	switch((ZT_VirtualNetworkRuleType)(r.t & 0x7f)) {
+		case ZT_NETWORK_RULE_MATCH_SOURCE_ZEROTIER_ADDRESS:
+			field = _FIELD_ZT_SOURCE;
+			lo.lo = hi.lo = r.v.zt;
+			break;
+		case ZT_NETWORK_RULE_MATCH_DEST_ZEROTIER_ADDRESS:
+			field = _FIELD_ZT_DEST;
+			lo.lo = hi.lo = r.v.zt;
+			break;
+		case ZT_NETWORK_RULE_MATCH_VLAN_ID:
+			field = _FIELD_VLAN_ID;
+			lo.lo = hi.lo = r.v.vlanId;
+			break;
+		case ZT_NETWORK_RULE_MATCH_VLAN_PCP:
+			field = _FIELD_VLAN_PCP;
+			lo.lo = hi.lo = r.v.vlanPcp & 0x07;
+			break;
+		case ZT_NETWORK_RULE_MATCH_VLAN_DEI:
+			field = _FIELD_VLAN_DEI;
+			lo.lo = hi.lo = (r.v.vlanDei) ? 1 : 0;
+			break;
+		case ZT_NETWORK_RULE_MATCH_ETHERTYPE:
+			field = _FIELD_ETHERTYPE;
+			lo.lo = hi.lo = r.v.etherType;
+			break;
+		case ZT_NETWORK_RULE_MATCH_MAC_SOURCE:
+		case ZT_NETWORK_RULE_MATCH_MAC_DEST:
+			field = (((r.t & 0x7f) == ZT_NETWORK_RULE_MATCH_MAC_SOURCE) ? _FIELD_MAC_SOURCE : _FIELD_MAC_DEST);
+			for(unsigned int i=0;i<6;++i)
+				lo.lo = (lo.lo << 8) | (uint64_t)r.v.mac[i];
+			hi.lo = lo.lo;
+			break;
+		case ZT_NETWORK_RULE_MATCH_IPV4_SOURCE:
+		case ZT_NETWORK_RULE_MATCH_IPV4_DEST: {
+			field = (((r.t & 0x7f) == ZT_NETWORK_RULE_MATCH_IPV4_SOURCE) ? _FIELD_IPV4_SOURCE : _FIELD_IPV4_DEST);
+			const uint64_t host = (r.v.ipv4.mask >= 32) ? 0ULL : (0xffffffffULL >> r.v.ipv4.mask);
+			lo.lo = (uint64_t)Utils::ntoh((uint32_t)r.v.ipv4.ip) & ~host & 0xffffffffULL;
+			hi.lo = lo.lo | host;
+		}	break;
+		case ZT_NETWORK_RULE_MATCH_IPV6_SOURCE:
+		case ZT_NETWORK_RULE_MATCH_IPV6_DEST: {
+			field = (((r.t & 0x7f) == ZT_NETWORK_RULE_MATCH_IPV6_SOURCE) ? _FIELD_IPV6_SOURCE : _FIELD_IPV6_DEST);
+			for(unsigned int i=0;i<8;++i) {
+				lo.hi = (lo.hi << 8) | (uint64_t)r.v.ipv6.ip[i];
+				lo.lo = (lo.lo << 8) | (uint64_t)r.v.ipv6.ip[8 + i];
+			}
+			const unsigned int bits = (r.v.ipv6.mask > 128) ? 128 : r.v.ipv6.mask;
+			const uint64_t hostHi = (bits >= 64) ? 0ULL : (0xffffffffffffffffULL >> bits);
+			const uint64_t hostLo = (bits <= 64) ? 0xffffffffffffffffULL : ((bits >= 128) ? 0ULL : (0xffffffffffffffffULL >> (bits - 64)));
+			lo.hi &= ~hostHi;
+			lo.lo &= ~hostLo;
+			hi.hi = lo.hi | hostHi;
+			hi.lo = lo.lo | hostLo;
+		}	break;
+		case ZT_NETWORK_RULE_MATCH_IP_TOS:
+			field = _FIELD_IP_TOS;
+			lo.lo = hi.lo = r.v.ipTos;
+			break;
+		case ZT_NETWORK_RULE_MATCH_IP_PROTOCOL:
+			field = _FIELD_IP_PROTOCOL;
+			lo.lo = hi.lo = r.v.ipProtocol;
+			break;
+		case ZT_NETWORK_RULE_MATCH_IP_SOURCE_PORT_RANGE:
+		case ZT_NETWORK_RULE_MATCH_IP_DEST_PORT_RANGE:
+			field = (((r.t & 0x7f) == ZT_NETWORK_RULE_MATCH_IP_SOURCE_PORT_RANGE) ? _FIELD_PORT_SOURCE : _FIELD_PORT_DEST);
+			lo.lo = r.v.port[0];
+			hi.lo = r.v.port[1];
+			break;
+		case ZT_NETWORK_RULE_MATCH_FRAME_SIZE_RANGE:
+			field = _FIELD_FRAME_SIZE;
+			lo.lo = r.v.frameSize[0];
+			hi.lo = r.v.frameSize[1];
+			break;
+		default:
+			return false;
+	}
+	return true;
+}
+
+bool FlowRules::_fieldValue(const Frame &f,_Field field,_Value &v)
+{
+	switch(field) {
+		case _FIELD_ZT_SOURCE:   v.lo = f.ztSource; return true;
+		case _FIELD_ZT_DEST:     v.lo = f.ztDest; return true;
+		case _FIELD_VLAN_ID:     v.lo = f.vlanId; return true;
+		case _FIELD_VLAN_PCP:    return true; // not passed up by taps, so always 0
+		case _FIELD_VLAN_DEI:    return true;
+		case _FIELD_ETHERTYPE:   v.lo = f.etherType; return true;
+		case _FIELD_MAC_SOURCE:  v.lo = f.macSource; return true;
+		case _FIELD_MAC_DEST:    v.lo = f.macDest; return true;
+		case _FIELD_IPV4_SOURCE: v.lo = f.ipv4Source; return f.isIpv4;
+		case _FIELD_IPV4_DEST:   v.lo = f.ipv4Dest; return f.isIpv4;
+		case _FIELD_IPV6_SOURCE: v.hi = f.ipv6Source[0]; v.lo = f.ipv6Source[1]; return f.isIpv6;
+		case _FIELD_IPV6_DEST:   v.hi = f.ipv6Dest[0]; v.lo = f.ipv6Dest[1]; return f.isIpv6;
+		case _FIELD_IP_TOS:      v.lo = f.ipTos; return ((f.isIpv4)||(f.isIpv6));
+		case _FIELD_IP_PROTOCOL: v.lo = f.ipProtocol; return ((f.isIpv4)||(f.isIpv6));
+		case _FIELD_PORT_SOURCE: v.lo = f.portSource; return f.hasPorts;
+		case _FIELD_PORT_DEST:   v.lo = f.portDest; return f.hasPorts;
+		case _FIELD_FRAME_SIZE:  v.lo = f.frameSize; return true;
+		default:                 return false;
+	}
+}
+
+bool FlowRules::_matchResidual(const ZT_VirtualNetworkRule &r,const Frame &f)
+{
+	switch((ZT_VirtualNetworkRuleType)(r.t & 0x7f)) {
+		case ZT_NETWORK_RULE_MATCH_CHARACTERISTICS:
+			return ((f.characteristics & r.v.characteristics) == r.v.characteristics);
+		default: // TCP relative sequence numbers and COM fields aren't tracked per frame
+			return false;
+	}
+}
+
+} // namespace ZeroTier
@@ -0,0 +1,209 @@
+/*
+ * ZeroTier One - Network Virtualization Everywhere
+ * Copyright (C) 2011-2016  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ZT_FLOWRULES_HPP
+#define ZT_FLOWRULES_HPP
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "Constants.hpp"
+#include "../include/ZeroTierOne.h"
+#include "Address.hpp"
+#include "MAC.hpp"
+#include "NonCopyable.hpp"
+#include "AtomicCounter.hpp"
+#include "SharedPtr.hpp"
+
+namespace ZeroTier {
+
+/**
+ * A network's flow rules compiled into a bit vector classifier
+ *
+ * Rules are grouped into (match AND match AND ...) -> action entries and
+ * each ACCEPT or DROP entry gets a bit. For every frame field that any rule
+ * tests, the field's value space is split at compile time into intervals
+ * within which every rule's matches on that field come out the same, and
+ * each interval gets a bit vector of the entries it satisfies. Classifying a
+ * frame is then a binary search per field and an AND of at most four words,
+ * and the lowest set bit is the first matching entry.
+ *
+ * Matches on packet characteristics are checked directly for just the
+ * entries that use them. COM field and TCP relative sequence number matches
+ * need state this node does not track per frame and never match. TEE and
+ * REDIRECT actions are not implemented; they end an entry without deciding
+ * the frame's fate. A frame that matches no entry is dropped.
+ */
+class FlowRules : NonCopyable
+{
+	friend class SharedPtr<FlowRules>;
+
+public:
+	/**
+	 * Fields of a frame that rules can match, parsed once per frame
+	 */
+	struct Frame
+	{
+		/**
+		 * @param ztSource ZeroTier address of sender
+		 * @param ztDest ZeroTier address of recipient or NIL if unknown or multicast
+		 * @param macSource Source MAC
+		 * @param macDest Destination MAC
+		 * @param etherType Ethernet frame type
+		 * @param vlanId VLAN ID or 0 if none
+		 * @param data Ethernet payload
+		 * @param len Length of payload
+		 * @param inbound True if frame came from the network, false if from the tap
+		 */
+		Frame(const Address &ztSource,const Address &ztDest,const MAC &macSource,const MAC &macDest,unsigned int etherType,unsigned int vlanId,const void *data,unsigned int len,bool inbound);
+
+		uint64_t ztSource;
+		uint64_t ztDest;
+		uint64_t macSource;
+		uint64_t macDest;
+		uint64_t characteristics;
+		uint64_t ipv6Source[2]; // most significant half first
+		uint64_t ipv6Dest[2];
+		uint32_t ipv4Source;
+		uint32_t ipv4Dest;
+		unsigned int etherType;
+		unsigned int vlanId;
+		unsigned int frameSize;
+		unsigned int ipTos;
+		unsigned int ipProtocol;
+		unsigned int portSource;
+		unsigned int portDest;
+		bool isIpv4;
+		bool isIpv6;
+		bool hasPorts;
+	};
+
+	/**
+	 * Compile a rule table
+	 *
+	 * @param rules Rules in network config order
+	 * @param ruleCount Number of entries in rules[]
+	 */
+	FlowRules(const ZT_VirtualNetworkRule *rules,unsigned int ruleCount);
+
+	/**
+	 * @param f Parsed frame
+	 * @return True if frame is accepted, false if dropped
+	 */
+	inline bool permits(const Frame &f) const { return (classify(f) == ZT_NETWORK_RULE_ACTION_ACCEPT); }
+
+	/**
+	 * @param f Parsed frame
+	 * @return Action of first matching entry, or ZT_NETWORK_RULE_ACTION_DROP if none
+	 */
+	ZT_VirtualNetworkRuleType classify(const Frame &f) const;
+
+	/**
+	 * Evaluate a rule table by walking it in order
+	 *
+	 * This is the reference for what classify() must return and is used to
+	 * test and benchmark it.
+	 *
+	 * @param rules Rules in network config order
+	 * @param ruleCount Number of entries in rules[]
+	 * @param f Parsed frame
+	 * @return Action of first matching entry, or ZT_NETWORK_RULE_ACTION_DROP if none
+	 */
+	static ZT_VirtualNetworkRuleType classifyLinear(const ZT_VirtualNetworkRule *rules,unsigned int ruleCount,const Frame &f);
+
+	/**
+	 * @return Number of ACCEPT or DROP entries
+	 */
+	inline unsigned int entryCount() const throw() { return (unsigned int)_actions.size(); }
+
+private:
+	// Frame fields compiled into intervals (characteristics and COM fields are not)
+	enum _Field
+	{
+		_FIELD_ZT_SOURCE = 0,
+		_FIELD_ZT_DEST,
+		_FIELD_VLAN_ID,
+		_FIELD_VLAN_PCP,
+		_FIELD_VLAN_DEI,
+		_FIELD_ETHERTYPE,
+		_FIELD_MAC_SOURCE,
+		_FIELD_MAC_DEST,
+		_FIELD_IPV4_SOURCE,
+		_FIELD_IPV4_DEST,
+		_FIELD_IPV6_SOURCE,
+		_FIELD_IPV6_DEST,
+		_FIELD_IP_TOS,
+		_FIELD_IP_PROTOCOL,
+		_FIELD_PORT_SOURCE,
+		_FIELD_PORT_DEST,
+		_FIELD_FRAME_SIZE,
+		_FIELD_COUNT
+	};
+
+	// 128-bit field value, wide enough for an IPv6 address
+	struct _Value
+	{
+		_Value() : hi(0),lo(0) {}
+		_Value(uint64_t h,uint64_t l) : hi(h),lo(l) {}
+		inline bool operator<(const _Value &v) const throw() { return ((hi < v.hi)||((hi == v.hi)&&(lo < v.lo))); }
+		inline bool operator<=(const _Value &v) const throw() { return !(v < *this); }
+		inline bool operator==(const _Value &v) const throw() { return ((hi == v.hi)&&(lo == v.lo)); }
+		uint64_t hi,lo;
+	};
+
+	// One match on a compiled field: value in [lo,hi], inverted if 'no'
+	struct _Match
+	{
+		_Value lo,hi;
+		unsigned int entry;
+		bool no;
+	};
+
+	// A compiled field: starts[i] begins interval i, whose bits are at bits[i * _words]
+	struct _Dimension
+	{
+		_Field field;
+		bool wide; // true if values don't fit in _Value.lo (IPv6)
+		std::vector<_Value> starts;
+		std::vector<uint64_t> bits;
+		std::vector<uint64_t> absent; // bits if frame lacks this field (e.g. not IP)
+	};
+
+	// A match checked per frame rather than compiled
+	struct _Residual
+	{
+		ZT_VirtualNetworkRule rule;
+		unsigned int entry;
+	};
+
+	static bool _fieldOf(const ZT_VirtualNetworkRule &r,_Field &field,_Value &lo,_Value &hi);
+	static bool _fieldValue(const Frame &f,_Field field,_Value &v);
+	static bool _matchResidual(const ZT_VirtualNetworkRule &r,const Frame &f);
+
+	std::vector<_Dimension> _dimensions;
+	std::vector<_Residual> _residuals;
+	std::vector<ZT_VirtualNetworkRuleType> _actions; // by entry
+	unsigned int _words;
+
+	AtomicCounter __refCount;
+};
+
+} // namespace ZeroTier
+
+#endif
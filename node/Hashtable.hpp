@@ -15,19 +15,23 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
-
 #ifndef ZT_HASHTABLE_HPP
 #define ZT_HASHTABLE_HPP
 
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include <new>
 #include <stdexcept>
 #include <vector>
 #include <utility>
 #include <algorithm>
 
+// Slot index returned by Hashtable::_find() if key is not present
+#define ZT_HASHTABLE_NOT_FOUND (~((unsigned long)0))
+
 namespace ZeroTier {
 
 /**
@@ -37,6 +41,11 @@ namespace ZeroTier {
  * limitations. Keys can be uint64_t or an object, and if the latter they
  * must implement a method called hashCode() that returns an unsigned long
  * value that is evenly distributed.
+ *
+ * Entries are stored contiguously and indexed by an open addressing table
+ * using Robin Hood hashing, so there's no allocation per entry and lookups
+ * touch very little memory. Adding or erasing entries may move other entries,
+ * so pointers to values are only valid until the table is next modified.
  */
 template<typename K,typename V>
 class Hashtable
@@ -50,7 +59,12 @@ private:
 		inline _Bucket &operator=(const _Bucket &b) { k = b.k; v = b.v; return *this; }
 		K k;
 		V v;
-		_Bucket *next; // must be set manually for each _Bucket
+	};
+
+	struct _Slot
+	{
+		uint32_t e; // index of entry or 0xffffffff if empty
+		uint32_t h; // full hash of entry's key (top bits are home slot)
 	};
 
 public:
@@ -68,9 +82,8 @@ public:
 		 * @param ht Hash table to iterate over
 		 */
 		Iterator(Hashtable &ht) :
-			_idx(0),
-			_ht(&ht),
-			_b(ht._t[0])
+			_idx(ht._s),
+			_ht(&ht)
 		{
 		}
 
@@ -81,24 +94,19 @@ public:
 		 */
 		inline bool next(K *&kptr,V *&vptr)
 		{
-			for(;;) {
-				if (_b) {
-					kptr = &(_b->k);
-					vptr = &(_b->v);
-					_b = _b->next;
-					return true;
-				}
-				++_idx;
-				if (_idx >= _ht->_bc)
-					return false;
-				_b = _ht->_t[_idx];
+			// Runs backwards since erase() fills the hole with the last entry
+			if (_idx) {
+				_Bucket &b = _ht->_e[--_idx];
+				kptr = &(b.k);
+				vptr = &(b.v);
+				return true;
 			}
+			return false;
 		}
 
 	private:
 		unsigned long _idx;
 		Hashtable *_ht;
-		_Bucket *_b;
 	};
 	friend class Hashtable::Iterator;
 
@@ -106,72 +114,72 @@ public:
 	 * @param bc Initial capacity in buckets (default: 128, must be nonzero)
 	 */
 	Hashtable(unsigned long bc = 128) :
-		_t(reinterpret_cast<_Bucket **>(::malloc(sizeof(_Bucket *) * bc))),
-		_bc(bc),
+		_e((_Bucket *)0),
+		_t((_Slot *)0),
+		_bits(2),
 		_s(0)
 	{
-		if (!_t)
-			throw std::bad_alloc();
-		for(unsigned long i=0;i<bc;++i)
-			_t[i] = (_Bucket *)0;
+		while ((_bits < 31)&&((1UL << _bits) < bc))
+			++_bits;
+		_alloc();
 	}
 
 	Hashtable(const Hashtable<K,V> &ht) :
-		_t(reinterpret_cast<_Bucket **>(::malloc(sizeof(_Bucket *) * ht._bc))),
-		_bc(ht._bc),
-		_s(ht._s)
+		_e((_Bucket *)0),
+		_t((_Slot *)0),
+		_bits(ht._bits),
+		_s(0)
 	{
-		if (!_t)
-			throw std::bad_alloc();
-		for(unsigned long i=0;i<_bc;++i)
-			_t[i] = (_Bucket *)0;
-		for(unsigned long i=0;i<_bc;++i) {
-			const _Bucket *b = ht._t[i];
-			while (b) {
-				_Bucket *nb = new _Bucket(*b);
-				nb->next = _t[i];
-				_t[i] = nb;
-				b = b->next;
-			}
-		}
+		_alloc();
+		_copy(ht);
 	}
 
 	~Hashtable()
 	{
 		this->clear();
+		::free(_e);
 		::free(_t);
 	}
 
 	inline Hashtable &operator=(const Hashtable<K,V> &ht)
 	{
-		this->clear();
-		if (ht._s) {
-			for(unsigned long i=0;i<ht._bc;++i) {
-				const _Bucket *b = ht._t[i];
-				while (b) {
-					this->set(b->k,b->v);
-					b = b->next;
-				}
+		if (this != &ht) {
+			this->clear();
+			if (_bits != ht._bits) {
+				::free(_e);
+				::free(_t);
+				_e = (_Bucket *)0;
+				_t = (_Slot *)0;
+				_bits = ht._bits;
+				_alloc();
 			}
+			_copy(ht);
 		}
 		return *this;
 	}
 
+	/**
+	 * Exchange contents with another table without copying any entries
+	 *
+	 * @param ht Other table
+	 */
+	inline void swap(Hashtable<K,V> &ht)
+	{
+		std::swap(_e,ht._e);
+		std::swap(_t,ht._t);
+		std::swap(_bits,ht._bits);
+		std::swap(_s,ht._s);
+	}
+
 	/**
 	 * Erase all entries
 	 */
 	inline void clear()
 	{
 		if (_s) {
-			for(unsigned long i=0;i<_bc;++i) {
-				_Bucket *b = _t[i];
-				while (b) {
-					_Bucket *const nb = b->next;
-					delete b;
-					b = nb;
-				}
-				_t[i] = (_Bucket *)0;
-			}
+			for(unsigned long i=0;i<_s;++i)
+				_e[i].~_Bucket();
+			memset(_t,0xff,sizeof(_Slot) << _bits);
 			_s = 0;
 		}
 	}
@@ -184,13 +192,8 @@ public:
 		typename std::vector<K> k;
 		if (_s) {
 			k.reserve(_s);
-			for(unsigned long i=0;i<_bc;++i) {
-				_Bucket *b = _t[i];
-				while (b) {
-					k.push_back(b->k);
-					b = b->next;
-				}
-			}
+			for(unsigned long i=0;i<_s;++i)
+				k.push_back(_e[i].k);
 		}
 		return k;
 	}
@@ -204,15 +207,8 @@ public:
 	template<typename C>
 	inline void appendKeys(C &v) const
 	{
-		if (_s) {
-			for(unsigned long i=0;i<_bc;++i) {
-				_Bucket *b = _t[i];
-				while (b) {
-					v.push_back(b->k);
-					b = b->next;
-				}
-			}
-		}
+		for(unsigned long i=0;i<_s;++i)
+			v.push_back(_e[i].k);
 	}
 
 	/**
@@ -223,13 +219,8 @@ public:
 		typename std::vector< std::pair<K,V> > k;
 		if (_s) {
 			k.reserve(_s);
-			for(unsigned long i=0;i<_bc;++i) {
-				_Bucket *b = _t[i];
-				while (b) {
-					k.push_back(std::pair<K,V>(b->k,b->v));
-					b = b->next;
-				}
-			}
+			for(unsigned long i=0;i<_s;++i)
+				k.push_back(std::pair<K,V>(_e[i].k,_e[i].v));
 		}
 		return k;
 	}
@@ -240,13 +231,8 @@ public:
 	 */
 	inline V *get(const K &k)
 	{
-		_Bucket *b = _t[_hc(k) % _bc];
-		while (b) {
-			if (b->k == k)
-				return &(b->v);
-			b = b->next;
-		}
-		return (V *)0;
+		const unsigned long si = _find(k,_hash(k));
+		return ((si != ZT_HASHTABLE_NOT_FOUND) ? &(_e[_t[si].e].v) : (V *)0);
 	}
 	inline const V *get(const K &k) const { return const_cast<Hashtable *>(this)->get(k); }
 
@@ -256,13 +242,7 @@ public:
 	 */
 	inline bool contains(const K &k) const
 	{
-		_Bucket *b = _t[_hc(k) % _bc];
-		while (b) {
-			if (b->k == k)
-				return true;
-			b = b->next;
-		}
-		return false;
+		return (_find(k,_hash(k)) != ZT_HASHTABLE_NOT_FOUND);
 	}
 
 	/**
@@ -271,22 +251,33 @@ public:
 	 */
 	inline bool erase(const K &k)
 	{
-		const unsigned long bidx = _hc(k) % _bc;
-		_Bucket *lastb = (_Bucket *)0;
-		_Bucket *b = _t[bidx];
-		while (b) {
-			if (b->k == k) {
-				if (lastb)
-					lastb->next = b->next;
-				else _t[bidx] = b->next;
-				delete b;
-				--_s;
-				return true;
-			}
-			lastb = b;
-			b = b->next;
+		const unsigned long mask = (1UL << _bits) - 1;
+		unsigned long i = _find(k,_hash(k));
+		if (i == ZT_HASHTABLE_NOT_FOUND)
+			return false;
+		const uint32_t ei = _t[i].e;
+
+		// Shift following displaced slots back by one (k may be dangling after this)
+		unsigned long j = (i + 1) & mask;
+		while ((_t[j].e != 0xffffffff)&&(((j - _home(_t[j].h)) & mask) != 0)) {
+			_t[i] = _t[j];
+			i = j;
+			j = (j + 1) & mask;
+		}
+		_t[i].e = 0xffffffff;
+		_t[i].h = 0xffffffff;
+
+		// Fill the hole in the entry array with the last entry
+		const unsigned long last = _s - 1;
+		if (ei != last) {
+			_t[_find(_e[last].k,_hash(_e[last].k))].e = ei;
+			std::swap(_e[ei].k,_e[last].k);
+			std::swap(_e[ei].v,_e[last].v);
 		}
-		return false;
+		_e[last].~_Bucket();
+		_s = last;
+
+		return true;
 	}
 
 	/**
@@ -296,28 +287,23 @@ public:
 	 */
 	inline V &set(const K &k,const V &v)
 	{
-		const unsigned long h = _hc(k);
-		unsigned long bidx = h % _bc;
-
-		_Bucket *b = _t[bidx];
-		while (b) {
-			if (b->k == k) {
-				b->v = v;
-				return b->v;
-			}
-			b = b->next;
+		const uint32_t h = _hash(k);
+		const unsigned long si = _find(k,h);
+		if (si != ZT_HASHTABLE_NOT_FOUND) {
+			V &ev = _e[_t[si].e].v;
+			ev = v;
+			return ev;
 		}
 
-		if (_s >= _bc) {
+		if (_s >= _capacity()) {
+			// k or v may refer into this table, which _grow() moves
+			const K kc(k);
+			const V vc(v);
 			_grow();
-			bidx = h % _bc;
-		}
-
-		b = new _Bucket(k,v);
-		b->next = _t[bidx];
-		_t[bidx] = b;
-		++_s;
-		return b->v;
+			new (_e + _s) _Bucket(kc,vc);
+		} else new (_e + _s) _Bucket(k,v);
+		_insert((uint32_t)_s,h);
+		return _e[_s++].v;
 	}
 
 	/**
@@ -326,26 +312,18 @@ public:
 	 */
 	inline V &operator[](const K &k)
 	{
-		const unsigned long h = _hc(k);
-		unsigned long bidx = h % _bc;
-
-		_Bucket *b = _t[bidx];
-		while (b) {
-			if (b->k == k)
-				return b->v;
-			b = b->next;
-		}
+		const uint32_t h = _hash(k);
+		const unsigned long si = _find(k,h);
+		if (si != ZT_HASHTABLE_NOT_FOUND)
+			return _e[_t[si].e].v;
 
-		if (_s >= _bc) {
+		if (_s >= _capacity()) {
+			const K kc(k);
 			_grow();
-			bidx = h % _bc;
-		}
-
-		b = new _Bucket(k);
-		b->next = _t[bidx];
-		_t[bidx] = b;
-		++_s;
-		return b->v;
+			new (_e + _s) _Bucket(kc);
+		} else new (_e + _s) _Bucket(k);
+		_insert((uint32_t)_s,h);
+		return _e[_s++].v;
 	}
 
 	/**
@@ -358,6 +336,11 @@ public:
 	 */
 	inline bool empty() const throw() { return (_s == 0); }
 
+	/**
+	 * @return Bytes allocated for entries and index (not counting memory owned by keys or values)
+	 */
+	inline unsigned long memoryUsage() const throw() { return (unsigned long)((sizeof(_Bucket) * _capacity()) + (sizeof(_Slot) << _bits)); }
+
 private:
 	template<typename O>
 	static inline unsigned long _hc(const O &obj)
@@ -368,10 +351,8 @@ private:
 	{
 		/* NOTE: this assumes that 'i' is evenly distributed, which is the case for
 		 * packet IDs and network IDs -- the two use cases in ZT for uint64_t keys.
-		 * These values are also greater than 0xffffffff so they'll map onto a full
-		 * bucket count just fine no matter what happens. Normally you'd want to
-		 * hash an integer key index in a hash table. */
-		return (unsigned long)i;
+		 * _hash() mixes all of its bits into the slot index. */
+		return (unsigned long)(i ^ (i >> 32));
 	}
 	static inline unsigned long _hc(const uint32_t i)
 	{
@@ -382,31 +363,105 @@ private:
 		return ((unsigned long)i * (unsigned long)0x9e3779b1);
 	}
 
-	inline void _grow()
+	// Fibonacci hashing: the top bits of the product depend on all bits of the hash code
+	static inline uint32_t _hash(const K &k) { return (uint32_t)(((uint64_t)_hc(k) * 0x9e3779b97f4a7c15ULL) >> 32); }
+	inline unsigned long _home(const uint32_t h) const throw() { return (unsigned long)(h >> (32 - _bits)); }
+	inline unsigned long _capacity() const throw() { return ((1UL << _bits) >> 1); } // max load 1/2: probe length, not memory, bounds lookups here
+
+	inline unsigned long _find(const K &k,const uint32_t h) const
+	{
+		const unsigned long mask = (1UL << _bits) - 1;
+		unsigned long i = _home(h);
+		for(unsigned long d=0;;++d) {
+			const _Slot &s = _t[i];
+			if (s.e == 0xffffffff)
+				return ZT_HASHTABLE_NOT_FOUND;
+			if (((i - _home(s.h)) & mask) < d) // an entry for k would have displaced this one
+				return ZT_HASHTABLE_NOT_FOUND;
+			if ((s.h == h)&&(_e[s.e].k == k))
+				return i;
+			i = (i + 1) & mask;
+		}
+	}
+
+	inline void _insert(uint32_t e,uint32_t h)
 	{
-		const unsigned long nc = _bc * 2;
-		_Bucket **nt = reinterpret_cast<_Bucket **>(::malloc(sizeof(_Bucket *) * nc));
-		if (nt) {
-			for(unsigned long i=0;i<nc;++i)
-				nt[i] = (_Bucket *)0;
-			for(unsigned long i=0;i<_bc;++i) {
-				_Bucket *b = _t[i];
-				while (b) {
-					_Bucket *const nb = b->next;
-					const unsigned long nidx = _hc(b->k) % nc;
-					b->next = nt[nidx];
-					nt[nidx] = b;
-					b = nb;
-				}
+		const unsigned long mask = (1UL << _bits) - 1;
+		unsigned long i = _home(h);
+		unsigned long d = 0;
+		for(;;) {
+			_Slot &s = _t[i];
+			if (s.e == 0xffffffff) {
+				s.e = e;
+				s.h = h;
+				return;
+			}
+			const unsigned long sd = (i - _home(s.h)) & mask;
+			if (sd < d) { // take from the rich and give to the poor
+				std::swap(s.e,e);
+				std::swap(s.h,h);
+				d = sd;
 			}
+			i = (i + 1) & mask;
+			++d;
+		}
+	}
+
+	inline void _alloc()
+	{
+		_e = reinterpret_cast<_Bucket *>(::malloc(sizeof(_Bucket) * _capacity()));
+		_t = reinterpret_cast<_Slot *>(::malloc(sizeof(_Slot) << _bits));
+		if ((!_e)||(!_t)) {
+			::free(_e);
 			::free(_t);
-			_t = nt;
-			_bc = nc;
+			throw std::bad_alloc();
+		}
+		memset(_t,0xff,sizeof(_Slot) << _bits);
+	}
+
+	inline void _copy(const Hashtable<K,V> &ht)
+	{
+		// assumes this is empty and has the same number of slots as ht
+		for(unsigned long i=0;i<ht._s;++i) {
+			new (_e + i) _Bucket(ht._e[i]);
+			_s = i + 1;
+		}
+		memcpy(_t,ht._t,sizeof(_Slot) << _bits);
+	}
+
+	inline void _grow()
+	{
+		const unsigned int nbits = _bits + 1;
+		_Bucket *const ne = reinterpret_cast<_Bucket *>(::malloc(sizeof(_Bucket) * ((1UL << nbits) >> 1)));
+		_Slot *const nt = reinterpret_cast<_Slot *>(::malloc(sizeof(_Slot) << nbits));
+		if ((!ne)||(!nt)) {
+			::free(ne);
+			::free(nt);
+			throw std::bad_alloc();
+		}
+
+		for(unsigned long i=0;i<_s;++i) {
+			new (ne + i) _Bucket(_e[i]);
+			_e[i].~_Bucket();
+		}
+		::free(_e);
+		_e = ne;
+
+		_Slot *const ot = _t;
+		const unsigned long on = 1UL << _bits;
+		_t = nt;
+		_bits = nbits;
+		memset(_t,0xff,sizeof(_Slot) << _bits);
+		for(unsigned long i=0;i<on;++i) {
+			if (ot[i].e != 0xffffffff)
+				_insert(ot[i].e,ot[i].h);
 		}
+		::free(ot);
 	}
 
-	_Bucket **_t;
-	unsigned long _bc;
+	_Bucket *_e; // entries, packed at the start
+	_Slot *_t; // index, 2^_bits slots
+	unsigned int _bits;
 	unsigned long _s;
 };
 
@@ -275,14 +275,16 @@ bool IncomingPacket::_doHELLO(const RuntimeEnvironment *RR,SharedPtr<Peer> &peer
 			} else {
 				// We don't already have an identity with this address -- validate and learn it
 
-				// Check identity proof of work
-				if (!id.locallyValidate()) {
-					TRACE("dropped HELLO from %s(%s): identity invalid",id.address().toString().c_str(),_remoteAddress.toString().c_str());
+				// Check identity proof of work (cached if we've seen this identity before)
+				unsigned char key[ZT_PEER_SECRET_KEY_LENGTH];
+				if (!RR->topology->verifyIdentity(id,key)) {
+					TRACE("dropped HELLO from %s(%s): identity invalid or being validated by another thread",id.address().toString().c_str(),_remoteAddress.toString().c_str());
 					return true;
 				}
 
 				// Check packet integrity and authentication
-				SharedPtr<Peer> newPeer(new Peer(RR,RR->identity,id));
+				SharedPtr<Peer> newPeer(new Peer(RR,RR->identity,id,key));
+				Utils::burn(key,sizeof(key));
 				if (!dearmor(newPeer->key())) {
 					TRACE("rejected HELLO from %s(%s): packet failed authentication",id.address().toString().c_str(),_remoteAddress.toString().c_str());
 					return true;
@@ -366,6 +368,9 @@ bool IncomingPacket::_doOK(const RuntimeEnvironment *RR,const SharedPtr<Peer> &p
 
 		//TRACE("%s(%s): OK(%s)",source().toString().c_str(),_remoteAddress.toString().c_str(),Packet::verbString(inReVerb));
 
+		int pathLatency = -1; // round trip time over the path this arrived on, if this OK measures one
+		unsigned int mtuProbeSize = 0; // size of path MTU probe this OK acknowledges, if any
+
 		switch(inReVerb) {
 
 			case Packet::VERB_HELLO: {
@@ -400,6 +405,7 @@ bool IncomingPacket::_doOK(const RuntimeEnvironment *RR,const SharedPtr<Peer> &p
 
 				peer->addDirectLatencyMeasurment(latency);
 				peer->setRemoteVersion(vProto,vMajor,vMinor,vRevision);
+				pathLatency = (int)latency;
 
 				if (externalSurfaceAddress)
 					RR->sa->iam(peer->address(),_localAddress,_remoteAddress,externalSurfaceAddress,trusted,RR->node->now());
@@ -431,8 +437,19 @@ bool IncomingPacket::_doOK(const RuntimeEnvironment *RR,const SharedPtr<Peer> &p
 				}
 			}	break;
 
-			//case Packet::VERB_ECHO: {
-			//}	break;
+			case Packet::VERB_ECHO: {
+				// Our ECHOs carry their send time; older ones with no payload are just ignored.
+				// Path MTU probes also carry their size (see Peer::_probeMtu()) and
+				// aren't latency samples since they aren't counted as pings.
+				if ((ZT_PROTO_VERB_OK_IDX_PAYLOAD + 10) <= size()) {
+					mtuProbeSize = at<uint16_t>(ZT_PROTO_VERB_OK_IDX_PAYLOAD + 8);
+				} else if ((ZT_PROTO_VERB_OK_IDX_PAYLOAD + 8) <= size()) {
+					const uint64_t now = RR->node->now();
+					const uint64_t sentAt = at<uint64_t>(ZT_PROTO_VERB_OK_IDX_PAYLOAD);
+					if (sentAt <= now)
+						pathLatency = (int)std::min((unsigned int)(now - sentAt),(unsigned int)0xffff);
+				}
+			}	break;
 
 			case Packet::VERB_MULTICAST_GATHER: {
 				const uint64_t nwid = at<uint64_t>(ZT_PROTO_VERB_MULTICAST_GATHER__OK__IDX_NETWORK_ID);
@@ -471,6 +488,10 @@ bool IncomingPacket::_doOK(const RuntimeEnvironment *RR,const SharedPtr<Peer> &p
 		}
 
 		peer->received(_localAddress,_remoteAddress,hops(),packetId(),Packet::VERB_OK,inRePacketId,inReVerb);
+		if ((pathLatency >= 0)&&(hops() == 0))
+			peer->addPathLatencyMeasurement(_localAddress,_remoteAddress,(unsigned int)pathLatency);
+		if ((mtuProbeSize)&&(hops() == 0))
+			peer->mtuProbeAcknowledged(_localAddress,_remoteAddress,mtuProbeSize);
 	} catch ( ... ) {
 		TRACE("dropped OK from %s(%s): unexpected exception",source().toString().c_str(),_remoteAddress.toString().c_str());
 	}
@@ -550,13 +571,15 @@ bool IncomingPacket::_doFRAME(const RuntimeEnvironment *RR,const SharedPtr<Peer>
 				}
 
 				const unsigned int etherType = at<uint16_t>(ZT_PROTO_VERB_FRAME_IDX_ETHERTYPE);
-				if (!network->config().permitsEtherType(etherType)) {
-					TRACE("dropped FRAME from %s(%s): ethertype %.4x not allowed on %.16llx",peer->address().toString().c_str(),_remoteAddress.toString().c_str(),(unsigned int)etherType,(unsigned long long)network->id());
+				const unsigned int payloadLen = size() - ZT_PROTO_VERB_FRAME_IDX_PAYLOAD;
+				const MAC from(peer->address(),network->id());
+				const void *const payload = field(ZT_PROTO_VERB_FRAME_IDX_PAYLOAD,payloadLen);
+				if (!network->permitsFrame(FlowRules::Frame(peer->address(),RR->identity.address(),from,network->mac(),etherType,0,payload,payloadLen,true))) {
+					TRACE("dropped FRAME from %s(%s): ethertype %.4x frame rejected by rules on %.16llx",peer->address().toString().c_str(),_remoteAddress.toString().c_str(),(unsigned int)etherType,(unsigned long long)network->id());
 					return true;
 				}
 
-				const unsigned int payloadLen = size() - ZT_PROTO_VERB_FRAME_IDX_PAYLOAD;
-				RR->node->putFrame(network->id(),network->userPtr(),MAC(peer->address(),network->id()),network->mac(),etherType,0,field(ZT_PROTO_VERB_FRAME_IDX_PAYLOAD,payloadLen),payloadLen);
+				RR->node->putFrame(network->id(),network->userPtr(),from,network->mac(),etherType,0,payload,payloadLen);
 			}
 
 			peer->received(_localAddress,_remoteAddress,hops(),packetId(),Packet::VERB_FRAME,0,Packet::VERB_NOP);
@@ -594,13 +617,15 @@ bool IncomingPacket::_doEXT_FRAME(const RuntimeEnvironment *RR,const SharedPtr<P
 				// of the certificate, if there was one...
 
 				const unsigned int etherType = at<uint16_t>(comLen + ZT_PROTO_VERB_EXT_FRAME_IDX_ETHERTYPE);
-				if (!network->config().permitsEtherType(etherType)) {
-					TRACE("dropped EXT_FRAME from %s(%s): ethertype %.4x not allowed on network %.16llx",peer->address().toString().c_str(),_remoteAddress.toString().c_str(),(unsigned int)etherType,(unsigned long long)network->id());
-					return true;
-				}
-
 				const MAC to(field(comLen + ZT_PROTO_VERB_EXT_FRAME_IDX_TO,ZT_PROTO_VERB_EXT_FRAME_LEN_TO),ZT_PROTO_VERB_EXT_FRAME_LEN_TO);
 				const MAC from(field(comLen + ZT_PROTO_VERB_EXT_FRAME_IDX_FROM,ZT_PROTO_VERB_EXT_FRAME_LEN_FROM),ZT_PROTO_VERB_EXT_FRAME_LEN_FROM);
+				const unsigned int payloadLen = size() - (comLen + ZT_PROTO_VERB_EXT_FRAME_IDX_PAYLOAD);
+				const void *const payload = field(comLen + ZT_PROTO_VERB_EXT_FRAME_IDX_PAYLOAD,payloadLen);
+
+				if (!network->permitsFrame(FlowRules::Frame(peer->address(),RR->identity.address(),from,to,etherType,0,payload,payloadLen,true))) {
+					TRACE("dropped EXT_FRAME from %s(%s): ethertype %.4x frame rejected by rules on network %.16llx",peer->address().toString().c_str(),_remoteAddress.toString().c_str(),(unsigned int)etherType,(unsigned long long)network->id());
+					return true;
+				}
 
 				if (to.isMulticast()) {
 					TRACE("dropped EXT_FRAME from %s@%s(%s) to %s: destination is multicast, must use MULTICAST_FRAME",from.toString().c_str(),peer->address().toString().c_str(),_remoteAddress.toString().c_str(),to.toString().c_str());
@@ -626,8 +651,7 @@ bool IncomingPacket::_doEXT_FRAME(const RuntimeEnvironment *RR,const SharedPtr<P
 					}
 				}
 
-				const unsigned int payloadLen = size() - (comLen + ZT_PROTO_VERB_EXT_FRAME_IDX_PAYLOAD);
-				RR->node->putFrame(network->id(),network->userPtr(),from,to,etherType,0,field(comLen + ZT_PROTO_VERB_EXT_FRAME_IDX_PAYLOAD,payloadLen),payloadLen);
+				RR->node->putFrame(network->id(),network->userPtr(),from,to,etherType,0,payload,payloadLen);
 			}
 
 			peer->received(_localAddress,_remoteAddress,hops(),packetId(),Packet::VERB_EXT_FRAME,0,Packet::VERB_NOP);
@@ -647,8 +671,14 @@ bool IncomingPacket::_doECHO(const RuntimeEnvironment *RR,const SharedPtr<Peer>
 		Packet outp(peer->address(),RR->identity.address(),Packet::VERB_OK);
 		outp.append((unsigned char)Packet::VERB_ECHO);
 		outp.append((uint64_t)pid);
-		if (size() > ZT_PACKET_IDX_PAYLOAD)
-			outp.append(reinterpret_cast<const unsigned char *>(data()) + ZT_PACKET_IDX_PAYLOAD,size() - ZT_PACKET_IDX_PAYLOAD);
+		if (size() > ZT_PACKET_IDX_PAYLOAD) {
+			// A path MTU probe (timestamp, then its own size, then padding) only
+			// needs its timestamp and size echoed, not the padding.
+			unsigned int echoLength = size() - ZT_PACKET_IDX_PAYLOAD;
+			if ((echoLength >= 10)&&(at<uint16_t>(ZT_PACKET_IDX_PAYLOAD + 8) == size()))
+				echoLength = 10;
+			outp.append(reinterpret_cast<const unsigned char *>(data()) + ZT_PACKET_IDX_PAYLOAD,echoLength);
+		}
 		outp.armor(peer->key(),true);
 		RR->node->putPacket(_localAddress,_remoteAddress,outp.data(),outp.size());
 		peer->received(_localAddress,_remoteAddress,hops(),pid,Packet::VERB_ECHO,0,Packet::VERB_NOP);
@@ -711,56 +741,8 @@ bool IncomingPacket::_doNETWORK_CONFIG_REQUEST(const RuntimeEnvironment *RR,cons
 		peer->received(_localAddress,_remoteAddress,h,pid,Packet::VERB_NETWORK_CONFIG_REQUEST,0,Packet::VERB_NOP);
 
 		if (RR->localNetworkController) {
-			NetworkConfig netconf;
-			switch(RR->localNetworkController->doNetworkConfigRequest((h > 0) ? InetAddress() : _remoteAddress,RR->identity,peer->identity(),nwid,metaData,netconf)) {
-
-				case NetworkController::NETCONF_QUERY_OK: {
-					Dictionary<ZT_NETWORKCONFIG_DICT_CAPACITY> dconf;
-					if (netconf.toDictionary(dconf,metaData.getUI(ZT_NETWORKCONFIG_REQUEST_METADATA_KEY_VERSION,0) < 6)) {
-						Packet outp(peer->address(),RR->identity.address(),Packet::VERB_OK);
-						outp.append((unsigned char)Packet::VERB_NETWORK_CONFIG_REQUEST);
-						outp.append(pid);
-						outp.append(nwid);
-						const unsigned int dlen = dconf.sizeBytes();
-						outp.append((uint16_t)dlen);
-						outp.append((const void *)dconf.data(),dlen);
-						outp.compress();
-						RR->sw->send(outp,true,0);
-					}
-				}	break;
-
-				case NetworkController::NETCONF_QUERY_OBJECT_NOT_FOUND: {
-					Packet outp(peer->address(),RR->identity.address(),Packet::VERB_ERROR);
-					outp.append((unsigned char)Packet::VERB_NETWORK_CONFIG_REQUEST);
-					outp.append(pid);
-					outp.append((unsigned char)Packet::ERROR_OBJ_NOT_FOUND);
-					outp.append(nwid);
-					outp.armor(peer->key(),true);
-					RR->node->putPacket(_localAddress,_remoteAddress,outp.data(),outp.size());
-				}	break;
-
-				case NetworkController::NETCONF_QUERY_ACCESS_DENIED: {
-					Packet outp(peer->address(),RR->identity.address(),Packet::VERB_ERROR);
-					outp.append((unsigned char)Packet::VERB_NETWORK_CONFIG_REQUEST);
-					outp.append(pid);
-					outp.append((unsigned char)Packet::ERROR_NETWORK_ACCESS_DENIED_);
-					outp.append(nwid);
-					outp.armor(peer->key(),true);
-					RR->node->putPacket(_localAddress,_remoteAddress,outp.data(),outp.size());
-				} break;
-
-				case NetworkController::NETCONF_QUERY_INTERNAL_SERVER_ERROR:
-					// TRACE("NETWORK_CONFIG_REQUEST failed: internal error: %s",netconf.get("error","(unknown)").c_str());
-					break;
-
-				case NetworkController::NETCONF_QUERY_IGNORE:
-					break;
-
-				default:
-					TRACE("NETWORK_CONFIG_REQUEST failed: invalid return value from NetworkController::doNetworkConfigRequest()");
-					break;
-
-			}
+			// The controller replies through the node when it's done, possibly later from another thread
+			RR->localNetworkController->request(RR->node,pid,(h > 0) ? InetAddress() : _remoteAddress,RR->identity,peer->identity(),nwid,metaData);
 		} else {
 			Packet outp(peer->address(),RR->identity.address(),Packet::VERB_ERROR);
 			outp.append((unsigned char)Packet::VERB_NETWORK_CONFIG_REQUEST);
@@ -893,7 +875,13 @@ bool IncomingPacket::_doMULTICAST_FRAME(const RuntimeEnvironment *RR,const Share
 					}
 				}
 
-				RR->node->putFrame(network->id(),network->userPtr(),from,to.mac(),etherType,0,field(offset + ZT_PROTO_VERB_MULTICAST_FRAME_IDX_FRAME,payloadLen),payloadLen);
+				const void *const payload = field(offset + ZT_PROTO_VERB_MULTICAST_FRAME_IDX_FRAME,payloadLen);
+				if (!network->permitsFrame(FlowRules::Frame(peer->address(),Address(),from,to.mac(),etherType,0,payload,payloadLen,true))) {
+					TRACE("dropped MULTICAST_FRAME from %s@%s(%s) to %s: ethertype %.4x frame rejected by rules on %.16llx",from.toString().c_str(),peer->address().toString().c_str(),_remoteAddress.toString().c_str(),to.toString().c_str(),(unsigned int)etherType,network->id());
+					return true;
+				}
+
+				RR->node->putFrame(network->id(),network->userPtr(),from,to.mac(),etherType,0,payload,payloadLen);
 			}
 
 			if (gatherLimit) {
@@ -1097,9 +1085,9 @@ bool IncomingPacket::_doCIRCUIT_TEST(const RuntimeEnvironment *RR,const SharedPt
 				remainingHopsPtr += ZT_ADDRESS_LENGTH;
 				SharedPtr<Peer> nhp(RR->topology->getPeer(nextHop[h]));
 				if (nhp) {
-					Path *const rp = nhp->getBestPath(now);
-					if (rp)
-						nextHopBestPathAddress[h] = rp->address();
+					Path rp;
+					if (nhp->getBestPath(now,rp))
+						nextHopBestPathAddress[h] = rp.address();
 				}
 			}
 		}
@@ -111,6 +111,21 @@ public:
 		_remoteAddress = remoteAddress;
 	}
 
+	/**
+	 * Init packet-in-decode in place as a copy of another
+	 *
+	 * Unlike assignment this copies only the packet's used bytes.
+	 *
+	 * @param p Packet to copy
+	 */
+	inline void init(const IncomingPacket &p)
+	{
+		copyFrom(p.data(),p.size());
+		_receiveTime = p._receiveTime;
+		_localAddress = p._localAddress;
+		_remoteAddress = p._remoteAddress;
+	}
+
 	/**
 	 * Attempt to decode this packet
 	 *
@@ -29,9 +29,18 @@
 #include "C25519.hpp"
 #include "CertificateOfMembership.hpp"
 #include "Node.hpp"
+#include "PartialShuffle.hpp"
 
 namespace ZeroTier {
 
+// True if a is in alwaysSendTo, searching the sorted copy if one was made
+static inline bool _alwaysSendsTo(const std::vector<Address> &alwaysSendTo,const std::vector<Address> &alwaysSendToSorted,const Address &a)
+{
+	if (alwaysSendToSorted.empty())
+		return (std::find(alwaysSendTo.begin(),alwaysSendTo.end(),a) != alwaysSendTo.end());
+	return std::binary_search(alwaysSendToSorted.begin(),alwaysSendToSorted.end(),a);
+}
+
 Multicaster::Multicaster(const RuntimeEnvironment *renv) :
 	RR(renv),
 	_groups(1024),
@@ -163,30 +172,74 @@ void Multicaster::send(
 	const void *data,
 	unsigned int len)
 {
-	unsigned long idxbuf[8194];
-	unsigned long *indexes = idxbuf;
+	Address rbuf[256];
+	Address *recipients = rbuf;
+	unsigned int count = 0;
 
 	try {
-		Mutex::Lock _l(_groups_m);
-		MulticastGroupStatus &gs = _groups[Multicaster::Key(nwid,mg)];
-
-		if (!gs.members.empty()) {
-			// Allocate a memory buffer if group is monstrous
-			if (gs.members.size() > (sizeof(idxbuf) / sizeof(unsigned long)))
-				indexes = new unsigned long[gs.members.size()];
-
-			// Generate a random permutation of member indexes
-			for(unsigned long i=0;i<gs.members.size();++i)
-				indexes[i] = i;
-			for(unsigned long i=(unsigned long)gs.members.size()-1;i>0;--i) {
-				unsigned long j = (unsigned long)RR->node->prng() % (i + 1);
-				unsigned long tmp = indexes[j];
-				indexes[j] = indexes[i];
-				indexes[i] = tmp;
+		if (limit > (sizeof(rbuf) / sizeof(Address)))
+			recipients = new Address[limit];
+
+		bool queue = false; // true if we don't know enough members and must gather more
+		bool explicitGather = false;
+		unsigned int gatherLimit = 0;
+		unsigned long memberCount = 0;
+		SharedPtr<Peer> explicitGatherPeers[2];
+
+		/* Recipients are chosen with _groups_m locked, but the frame is built
+		 * and sent to them after it's released. Otherwise every peer lookup,
+		 * copy, and encryption for every recipient would be done under a lock
+		 * that all multicast LIKEs, GATHERs, and sends share. */
+		{
+			Mutex::Lock _l(_groups_m);
+			MulticastGroupStatus &gs = _groups[Multicaster::Key(nwid,mg)];
+
+			for(std::vector<Address>::const_iterator ast(alwaysSendTo.begin());ast!=alwaysSendTo.end();++ast) {
+				if (count >= limit)
+					break;
+				if (*ast != RR->identity.address())
+					recipients[count++] = *ast;
+			}
+
+			std::vector<Address> alwaysSendToSorted;
+			if (alwaysSendTo.size() > ZT_MULTICAST_ALWAYS_SEND_TO_SCAN_MAX) {
+				alwaysSendToSorted = alwaysSendTo;
+				std::sort(alwaysSendToSorted.begin(),alwaysSendToSorted.end());
+			}
+			if (gs.members.size() <= (unsigned long)(limit - count)) {
+				// Everyone fits, so there's nothing to choose
+				for(std::vector<MulticastGroupMember>::const_iterator m(gs.members.begin());m!=gs.members.end();++m) {
+					if (!_alwaysSendsTo(alwaysSendTo,alwaysSendToSorted,m->address))
+						recipients[count++] = m->address;
+				}
+			} else {
+				// Members are drawn in random order as needed rather than shuffling the
+				// whole group, so a send costs O(limit) however large the group is. A
+				// draw can land on an always-send-to address at most once each.
+				PartialShuffle shuffle((unsigned long)gs.members.size(),std::min((unsigned long)gs.members.size(),(unsigned long)limit + (unsigned long)alwaysSendTo.size()));
+				while ((count < limit)&&(shuffle.remaining())) {
+					const Address &ma = gs.members[shuffle.next(RR->node->prng())].address;
+					if (!_alwaysSendsTo(alwaysSendTo,alwaysSendToSorted,ma))
+						recipients[count++] = ma;
+				}
+			}
+
+			memberCount = (unsigned long)gs.members.size();
+			if (memberCount < limit) {
+				queue = true;
+				gatherLimit = (limit - (unsigned int)memberCount) + 1;
+				if ((gs.members.empty())||((now - gs.lastExplicitGather) >= ZT_MULTICAST_EXPLICIT_GATHER_DELAY)) {
+					gs.lastExplicitGather = now;
+					explicitGather = true;
+					explicitGatherPeers[0] = RR->topology->getBestRoot();
+					const Address nwidc(Network::controllerFor(nwid));
+					if (nwidc != RR->identity.address())
+						explicitGatherPeers[1] = RR->topology->getPeer(nwidc);
+				}
 			}
 		}
 
-		if (gs.members.size() >= limit) {
+		if (!queue) {
 			// Skip queue if we already have enough members to complete the send operation
 			OutboundMulticast out;
 
@@ -203,62 +256,39 @@ void Multicaster::send(
 				data,
 				len);
 
-			unsigned int count = 0;
-
-			for(std::vector<Address>::const_iterator ast(alwaysSendTo.begin());ast!=alwaysSendTo.end();++ast) {
-				if (*ast != RR->identity.address()) {
-					out.sendOnly(RR,*ast); // optimization: don't use dedup log if it's a one-pass send
-					if (++count >= limit)
-						break;
+			Packet buf;
+			for(unsigned int i=0;i<count;++i)
+				out.sendOnly(RR,recipients[i],buf); // optimization: don't use dedup log if it's a one-pass send
+		} else {
+			for(unsigned int k=0;k<2;++k) {
+				const SharedPtr<Peer> &p = explicitGatherPeers[k];
+				if (!p)
+					continue;
+				//TRACE(">>MC upstream GATHER up to %u for group %.16llx/%s",gatherLimit,nwid,mg.toString().c_str());
+
+				const CertificateOfMembership *com = (CertificateOfMembership *)0;
+				{
+					SharedPtr<Network> nw(RR->node->network(nwid));
+					if ((nw)&&(nw->hasConfig())&&(nw->config().com)&&(nw->config().isPrivate())&&(p->needsOurNetworkMembershipCertificate(nwid,now,true)))
+						com = &(nw->config().com);
 				}
-			}
 
-			unsigned long idx = 0;
-			while ((count < limit)&&(idx < gs.members.size())) {
-				Address ma(gs.members[indexes[idx++]].address);
-				if (std::find(alwaysSendTo.begin(),alwaysSendTo.end(),ma) == alwaysSendTo.end()) {
-					out.sendOnly(RR,ma); // optimization: don't use dedup log if it's a one-pass send
-					++count;
-				}
+				Packet outp(p->address(),RR->identity.address(),Packet::VERB_MULTICAST_GATHER);
+				outp.append(nwid);
+				outp.append((uint8_t)(com ? 0x01 : 0x00));
+				mg.mac().appendTo(outp);
+				outp.append((uint32_t)mg.adi());
+				outp.append((uint32_t)gatherLimit);
+				if (com)
+					com->serialize(outp);
+				RR->sw->send(outp,true,0);
 			}
-		} else {
-			unsigned int gatherLimit = (limit - (unsigned int)gs.members.size()) + 1;
-
-			if ((gs.members.empty())||((now - gs.lastExplicitGather) >= ZT_MULTICAST_EXPLICIT_GATHER_DELAY)) {
-				gs.lastExplicitGather = now;
-				SharedPtr<Peer> explicitGatherPeers[2];
-				explicitGatherPeers[0] = RR->topology->getBestRoot();
-				const Address nwidc(Network::controllerFor(nwid));
-				if (nwidc != RR->identity.address())
-					explicitGatherPeers[1] = RR->topology->getPeer(nwidc);
-				for(unsigned int k=0;k<2;++k) {
-					const SharedPtr<Peer> &p = explicitGatherPeers[k];
-					if (!p)
-						continue;
-					//TRACE(">>MC upstream GATHER up to %u for group %.16llx/%s",gatherLimit,nwid,mg.toString().c_str());
-
-					const CertificateOfMembership *com = (CertificateOfMembership *)0;
-					{
-						SharedPtr<Network> nw(RR->node->network(nwid));
-						if ((nw)&&(nw->hasConfig())&&(nw->config().com)&&(nw->config().isPrivate())&&(p->needsOurNetworkMembershipCertificate(nwid,now,true)))
-							com = &(nw->config().com);
-					}
-
-					Packet outp(p->address(),RR->identity.address(),Packet::VERB_MULTICAST_GATHER);
-					outp.append(nwid);
-					outp.append((uint8_t)(com ? 0x01 : 0x00));
-					mg.mac().appendTo(outp);
-					outp.append((uint32_t)mg.adi());
-					outp.append((uint32_t)gatherLimit);
-					if (com)
-						com->serialize(outp);
-					RR->sw->send(outp,true,0);
-				}
+			if (explicitGather)
 				gatherLimit = 0;
-			}
 
-			gs.txQueue.push_back(OutboundMulticast());
-			OutboundMulticast &out = gs.txQueue.back();
+			// Built and sent outside the lock, then spliced into the group's queue
+			std::list<OutboundMulticast> txQueue(1);
+			OutboundMulticast &out = txQueue.front();
 
 			out.init(
 				RR,
@@ -273,30 +303,24 @@ void Multicaster::send(
 				data,
 				len);
 
-			unsigned int count = 0;
+			Packet buf;
+			for(unsigned int i=0;i<count;++i)
+				out.sendAndLog(RR,recipients[i],buf);
 
-			for(std::vector<Address>::const_iterator ast(alwaysSendTo.begin());ast!=alwaysSendTo.end();++ast) {
-				if (*ast != RR->identity.address()) {
-					out.sendAndLog(RR,*ast);
-					if (++count >= limit)
-						break;
-				}
-			}
-
-			unsigned long idx = 0;
-			while ((count < limit)&&(idx < gs.members.size())) {
-				Address ma(gs.members[indexes[idx++]].address);
-				if (std::find(alwaysSendTo.begin(),alwaysSendTo.end(),ma) == alwaysSendTo.end()) {
-					out.sendAndLog(RR,ma);
-					++count;
-				}
+			Mutex::Lock _l(_groups_m);
+			MulticastGroupStatus &gs = _groups[Multicaster::Key(nwid,mg)];
+			if (gs.members.size() != memberCount) {
+				// Catch up with members learned while the lock was released
+				for(std::vector<MulticastGroupMember>::const_iterator m(gs.members.begin());((m!=gs.members.end())&&(!out.atLimit()));++m)
+					out.sendIfNew(RR,m->address,buf);
 			}
+			gs.txQueue.splice(gs.txQueue.end(),txQueue);
 		}
-	} catch ( ... ) {} // this is a sanity check to catch any failures and make sure indexes[] still gets deleted
+	} catch ( ... ) {} // this is a sanity check to catch any failures and make sure recipients[] still gets deleted
 
 	// Free allocated memory buffer if any
-	if (indexes != idxbuf)
-		delete [] indexes;
+	if (recipients != rbuf)
+		delete [] recipients;
 }
 
 void Multicaster::clean(uint64_t now)
@@ -356,11 +380,14 @@ void Multicaster::_add(uint64_t now,uint64_t nwid,const MulticastGroup &mg,Multi
 
 	//TRACE("..MC %s joined multicast group %.16llx/%s via %s",member.toString().c_str(),nwid,mg.toString().c_str(),((learnedFrom) ? learnedFrom.toString().c_str() : "(direct)"));
 
+	if (gs.txQueue.empty())
+		return;
+	Packet buf;
 	for(std::list<OutboundMulticast>::iterator tx(gs.txQueue.begin());tx!=gs.txQueue.end();) {
 		if (tx->atLimit())
 			gs.txQueue.erase(tx++);
 		else {
-			tx->sendIfNew(RR,member);
+			tx->sendIfNew(RR,member,buf);
 			if (tx->atLimit())
 				gs.txQueue.erase(tx++);
 			else ++tx;
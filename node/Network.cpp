@@ -159,9 +159,11 @@ bool Network::applyConfiguration(const NetworkConfig &conf)
 		if ((conf.networkId == _id)&&(conf.issuedTo == RR->identity.address())) {
 			ZT_VirtualNetworkConfig ctmp;
 			bool portInitialized;
+			SharedPtr<FlowRules> rules(new FlowRules(conf.rules,conf.ruleCount));
 			{
 				Mutex::Lock _l(_lock);
 				_config = conf;
+				_rules = rules;
 				_lastConfigUpdate = RR->node->now();
 				_netconfFailure = NETCONF_FAILURE_NONE;
 				_externalConfig(&ctmp);
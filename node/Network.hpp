@@ -42,6 +42,7 @@
 #include "Multicaster.hpp"
 #include "NetworkConfig.hpp"
 #include "CertificateOfMembership.hpp"
+#include "FlowRules.hpp"
 
 namespace ZeroTier {
 
@@ -243,6 +244,22 @@ public:
 	 */
 	inline bool hasConfig() const { return (_config); }
 
+	/**
+	 * Check a frame against this network's flow rules
+	 *
+	 * @param f Parsed frame
+	 * @return True if frame is accepted (false if rejected or we have no config)
+	 */
+	inline bool permitsFrame(const FlowRules::Frame &f) const
+	{
+		SharedPtr<FlowRules> r;
+		{
+			Mutex::Lock _l(_lock);
+			r = _rules;
+		}
+		return ((r)&&(r->permits(f)));
+	}
+
 	/**
 	 * @return Ethernet MAC address for this network's local interface
 	 */
@@ -319,6 +336,7 @@ private:
 	Hashtable< MAC,Address > _remoteBridgeRoutes; // remote addresses where given MACs are reachable (for tracking devices behind remote bridges)
 
 	NetworkConfig _config;
+	SharedPtr<FlowRules> _rules; // compiled from _config.rules
 	volatile uint64_t _lastConfigUpdate;
 
 	volatile bool _destroyed;
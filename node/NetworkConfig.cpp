@@ -470,7 +470,7 @@ bool NetworkConfig::fromDictionary(const Dictionary<ZT_NETWORKCONFIG_DICT_CAPACI
 							break;
 						case ZT_NETWORK_RULE_MATCH_FRAME_SIZE_RANGE:
 							rules[ruleCount].v.frameSize[0] = tmp.at<uint16_t>(p);
-							rules[ruleCount].v.frameSize[0] = tmp.at<uint16_t>(p + 2);
+							rules[ruleCount].v.frameSize[1] = tmp.at<uint16_t>(p + 2);
 							break;
 						case ZT_NETWORK_RULE_MATCH_TCP_RELATIVE_SEQUENCE_NUMBER_RANGE:
 							rules[ruleCount].v.tcpseq[0] = tmp.at<uint32_t>(p);
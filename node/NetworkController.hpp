@@ -24,13 +24,13 @@
 #include "Constants.hpp"
 #include "Dictionary.hpp"
 #include "NetworkConfig.hpp"
+#include "Identity.hpp"
+#include "Address.hpp"
+#include "InetAddress.hpp"
 
 namespace ZeroTier {
 
 class RuntimeEnvironment;
-class Identity;
-class Address;
-struct InetAddress;
 
 /**
  * Interface for network controller implementations
@@ -50,9 +50,74 @@ public:
 		NETCONF_QUERY_IGNORE = 4
 	};
 
+	/**
+	 * Interface for sending replies to network config requests
+	 *
+	 * Methods may be called from any thread, including threads belonging to
+	 * the controller, and must be thread safe.
+	 */
+	class Sender
+	{
+	public:
+		Sender() {}
+		virtual ~Sender() {}
+
+		/**
+		 * Send a network configuration to a member
+		 *
+		 * @param nwid Network ID
+		 * @param requestPacketId Packet ID of request being answered
+		 * @param destination Member to send to
+		 * @param config Network configuration already serialized for this member
+		 */
+		virtual void ncSendConfig(uint64_t nwid,uint64_t requestPacketId,const Address &destination,const Dictionary<ZT_NETWORKCONFIG_DICT_CAPACITY> &config) = 0;
+
+		/**
+		 * Send an error reply to a member
+		 *
+		 * @param nwid Network ID
+		 * @param requestPacketId Packet ID of request being answered
+		 * @param destination Member to send to
+		 * @param rc NETCONF_QUERY_OBJECT_NOT_FOUND or NETCONF_QUERY_ACCESS_DENIED
+		 */
+		virtual void ncSendError(uint64_t nwid,uint64_t requestPacketId,const Address &destination,NetworkController::ResultCode rc) = 0;
+	};
+
 	NetworkController() {}
 	virtual ~NetworkController() {}
 
+	/**
+	 * Handle a network config request from a member and reply when done
+	 *
+	 * This is called from the packet processing path, so implementations that
+	 * may take a while should queue the request and reply later. The default
+	 * implementation calls doNetworkConfigRequest() and replies right away.
+	 *
+	 * @param sender Sender to use for reply
+	 * @param requestPacketId Packet ID of request
+	 * @param fromAddr Originating wire address or null address if packet is not direct
+	 * @param signingId Identity that should be used to sign results -- must include private key
+	 * @param identity Originating peer ZeroTier identity
+	 * @param nwid 64-bit network ID
+	 * @param metaData Meta-data bundled with request (if any)
+	 */
+	virtual void request(
+		Sender *sender,
+		uint64_t requestPacketId,
+		const InetAddress &fromAddr,
+		const Identity &signingId,
+		const Identity &identity,
+		uint64_t nwid,
+		const Dictionary<ZT_NETWORKCONFIG_DICT_CAPACITY> &metaData)
+	{
+		NetworkConfig nc;
+		Dictionary<ZT_NETWORKCONFIG_DICT_CAPACITY> config;
+		NetworkController::ResultCode rc = doNetworkConfigRequest(fromAddr,signingId,identity,nwid,metaData,nc);
+		if ((rc == NETCONF_QUERY_OK)&&(!nc.toDictionary(config,sendLegacyFormatConfig(metaData))))
+			rc = NETCONF_QUERY_INTERNAL_SERVER_ERROR;
+		reply(sender,requestPacketId,identity.address(),nwid,rc,config);
+	}
+
 	/**
 	 * Handle a network config request, sending replies if necessary
 	 *
@@ -77,6 +142,36 @@ public:
 		uint64_t nwid,
 		const Dictionary<ZT_NETWORKCONFIG_DICT_CAPACITY> &metaData,
 		NetworkConfig &nc) = 0;
+
+protected:
+	/**
+	 * @param metaData Meta-data bundled with request
+	 * @return True if config should also be sent in the old format for older members
+	 */
+	static inline bool sendLegacyFormatConfig(const Dictionary<ZT_NETWORKCONFIG_DICT_CAPACITY> &metaData)
+	{
+		return (metaData.getUI(ZT_NETWORKCONFIG_REQUEST_METADATA_KEY_VERSION,0) < 6);
+	}
+
+	/**
+	 * Send the result of a config request via a sender
+	 *
+	 * @param config Serialized config, only used if rc is NETCONF_QUERY_OK
+	 */
+	static inline void reply(Sender *sender,uint64_t requestPacketId,const Address &destination,uint64_t nwid,NetworkController::ResultCode rc,const Dictionary<ZT_NETWORKCONFIG_DICT_CAPACITY> &config)
+	{
+		switch(rc) {
+			case NETCONF_QUERY_OK:
+				sender->ncSendConfig(nwid,requestPacketId,destination,config);
+				break;
+			case NETCONF_QUERY_OBJECT_NOT_FOUND:
+			case NETCONF_QUERY_ACCESS_DENIED:
+				sender->ncSendError(nwid,requestPacketId,destination,rc);
+				break;
+			default: // internal errors and ignored (e.g. rate limited) requests get no reply
+				break;
+		}
+	}
 };
 
 } // namespace ZeroTier
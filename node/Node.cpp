@@ -75,6 +75,8 @@ Node::Node(
 	_lastHousekeepingRun(0)
 {
 	_online = false;
+	_multipath = false;
+	_pathMtuDiscovery = false;
 
 	// Use Salsa20 alone as a high-quality non-crypto PRNG
 	{
@@ -146,11 +148,28 @@ ZT_ResultCode Node::processWirePacket(
 	unsigned int packetLength,
 	volatile uint64_t *nextBackgroundTaskDeadline)
 {
-	_now = now;
+	_setNow(now,true);
 	RR->sw->onRemotePacket(*(reinterpret_cast<const InetAddress *>(localAddress)),*(reinterpret_cast<const InetAddress *>(remoteAddress)),packetData,packetLength);
 	return ZT_RESULT_OK;
 }
 
+ZT_ResultCode Node::processWirePackets(
+	uint64_t now,
+	const ZT_WirePacket *packets,
+	unsigned int packetCount,
+	volatile uint64_t *nextBackgroundTaskDeadline)
+{
+	_setNow(now,true);
+	for(unsigned int i=0;i<packetCount;++i) {
+		try {
+			RR->sw->onRemotePacket(*(reinterpret_cast<const InetAddress *>(packets[i].localAddress)),*(reinterpret_cast<const InetAddress *>(packets[i].remoteAddress)),packets[i].packetData,packets[i].packetLength);
+		} catch (std::bad_alloc &exc) {
+			throw;
+		} catch ( ... ) {} // invalid packets are simply dropped, as in processWirePacket()
+	}
+	return ZT_RESULT_OK;
+}
+
 ZT_ResultCode Node::processVirtualNetworkFrame(
 	uint64_t now,
 	uint64_t nwid,
@@ -162,7 +181,7 @@ ZT_ResultCode Node::processVirtualNetworkFrame(
 	unsigned int frameLength,
 	volatile uint64_t *nextBackgroundTaskDeadline)
 {
-	_now = now;
+	_setNow(now,true);
 	SharedPtr<Network> nw(this->network(nwid));
 	if (nw) {
 		RR->sw->onLocalEthernet(nw,MAC(sourceMac),MAC(destMac),etherType,vlanId,frameData,frameLength);
@@ -273,7 +292,7 @@ private:
 
 ZT_ResultCode Node::processBackgroundTasks(uint64_t now,volatile uint64_t *nextBackgroundTaskDeadline)
 {
-	_now = now;
+	_setNow(now,false);
 	Mutex::Lock bl(_backgroundTasksLock);
 
 	unsigned long timeUntilNextPingCheck = ZT_PING_CHECK_INVERVAL;
@@ -330,18 +349,13 @@ ZT_ResultCode Node::processBackgroundTasks(uint64_t now,volatile uint64_t *nextB
 	}
 
 	try {
+		unsigned long nextDelay = std::max(std::min(timeUntilNextPingCheck,RR->sw->doTimerTasks(now)),(unsigned long)ZT_CORE_TIMER_TASK_GRANULARITY);
 #ifdef ZT_ENABLE_CLUSTER
-		// If clustering is enabled we have to call cluster->doPeriodicTasks() very often, so we override normal timer deadline behavior
-		if (RR->cluster) {
-			RR->sw->doTimerTasks(now);
-			RR->cluster->doPeriodicTasks();
-			*nextBackgroundTaskDeadline = now + ZT_CLUSTER_PERIODIC_TASK_PERIOD; // this is really short so just tick at this rate
-		} else {
-#endif
-			*nextBackgroundTaskDeadline = now + (uint64_t)std::max(std::min(timeUntilNextPingCheck,RR->sw->doTimerTasks(now)),(unsigned long)ZT_CORE_TIMER_TASK_GRANULARITY);
-#ifdef ZT_ENABLE_CLUSTER
-		}
+		// Cluster may need a shorter tick than the granularity if it has no sender thread and must flush its own queues
+		if (RR->cluster)
+			nextDelay = std::min(nextDelay,RR->cluster->doPeriodicTasks());
 #endif
+		*nextBackgroundTaskDeadline = now + (uint64_t)nextDelay;
 	} catch ( ... ) {
 		return ZT_RESULT_FATAL_ERROR_INTERNAL;
 	}
@@ -407,6 +421,9 @@ void Node::status(ZT_NodeStatus *status) const
 	status->publicIdentity = RR->publicIdentityStr.c_str();
 	status->secretIdentity = RR->secretIdentityStr.c_str();
 	status->online = _online ? 1 : 0;
+	status->deferredPacketQueueDepth = RR->dp->depth();
+	status->deferredPacketsDropped = RR->dp->dropped();
+	RR->topology->verifiedComCacheCounters(status->verifiedComCacheHits,status->verifiedComCacheMisses);
 }
 
 ZT_PeerList *Node::peers() const
@@ -439,15 +456,21 @@ ZT_PeerList *Node::peers() const
 		p->role = RR->topology->isRoot(pi->second->identity()) ? ZT_PEER_ROLE_ROOT : ZT_PEER_ROLE_LEAF;
 
 		std::vector<Path> paths(pi->second->paths());
-		Path *bestPath = pi->second->getBestPath(_now);
+		Path bestPath;
+		const bool haveBestPath = pi->second->getBestPath(_now,bestPath);
 		p->pathCount = 0;
 		for(std::vector<Path>::iterator path(paths.begin());path!=paths.end();++path) {
 			memcpy(&(p->paths[p->pathCount].address),&(path->address()),sizeof(struct sockaddr_storage));
 			p->paths[p->pathCount].lastSend = path->lastSend();
 			p->paths[p->pathCount].lastReceive = path->lastReceived();
 			p->paths[p->pathCount].active = path->active(_now) ? 1 : 0;
-			p->paths[p->pathCount].preferred = ((bestPath)&&(*path == *bestPath)) ? 1 : 0;
+			p->paths[p->pathCount].preferred = ((haveBestPath)&&(*path == bestPath)) ? 1 : 0;
 			p->paths[p->pathCount].trustedPathId = RR->topology->getOutboundPathTrust(path->address());
+			p->paths[p->pathCount].latency = (path->latency() == ZT_PATH_LATENCY_UNKNOWN) ? 0 : path->latency();
+			p->paths[p->pathCount].packetLoss = (float)path->packetLoss() / (float)ZT_PATH_PACKET_LOSS_MAX;
+			p->paths[p->pathCount].packetsSent = path->packetsSent();
+			p->paths[p->pathCount].bytesSent = path->bytesSent();
+			p->paths[p->pathCount].mtu = path->mtu();
 			++p->pathCount;
 		}
 	}
@@ -641,6 +664,11 @@ void Node::clusterStatus(ZT_ClusterStatus *cs)
 
 void Node::backgroundThreadMain()
 {
+#ifdef ZT_ENABLE_CLUSTER
+	// The first background thread to get here becomes the cluster's sender
+	if ((RR->cluster)&&(RR->cluster->senderThreadMain()))
+		return;
+#endif
 	++RR->dpEnabled;
 	for(;;) {
 		try {
@@ -751,6 +779,48 @@ void Node::setTrustedPaths(const struct sockaddr_storage *networks,const uint64_
 	RR->topology->setTrustedPaths(reinterpret_cast<const InetAddress *>(networks),ids,count);
 }
 
+void Node::setMultipathMode(bool enabled)
+{
+	_multipath = enabled;
+}
+
+void Node::setPathMtuDiscovery(bool enabled)
+{
+	_pathMtuDiscovery = enabled;
+}
+
+void Node::ncSendConfig(uint64_t nwid,uint64_t requestPacketId,const Address &destination,const Dictionary<ZT_NETWORKCONFIG_DICT_CAPACITY> &config)
+{
+	Packet outp(destination,RR->identity.address(),Packet::VERB_OK);
+	outp.append((unsigned char)Packet::VERB_NETWORK_CONFIG_REQUEST);
+	outp.append(requestPacketId);
+	outp.append(nwid);
+	const unsigned int dlen = config.sizeBytes();
+	outp.append((uint16_t)dlen);
+	outp.append((const void *)config.data(),dlen);
+	outp.compress();
+	RR->sw->send(outp,true,0);
+}
+
+void Node::ncSendError(uint64_t nwid,uint64_t requestPacketId,const Address &destination,NetworkController::ResultCode rc)
+{
+	Packet outp(destination,RR->identity.address(),Packet::VERB_ERROR);
+	outp.append((unsigned char)Packet::VERB_NETWORK_CONFIG_REQUEST);
+	outp.append(requestPacketId);
+	switch(rc) {
+		case NetworkController::NETCONF_QUERY_OBJECT_NOT_FOUND:
+			outp.append((unsigned char)Packet::ERROR_OBJ_NOT_FOUND);
+			break;
+		case NetworkController::NETCONF_QUERY_ACCESS_DENIED:
+			outp.append((unsigned char)Packet::ERROR_NETWORK_ACCESS_DENIED_);
+			break;
+		default:
+			return;
+	}
+	outp.append(nwid);
+	RR->sw->send(outp,true,0);
+}
+
 } // namespace ZeroTier
 
 /****************************************************************************/
@@ -809,6 +879,22 @@ enum ZT_ResultCode ZT_Node_processWirePacket(
 	}
 }
 
+enum ZT_ResultCode ZT_Node_processWirePackets(
+	ZT_Node *node,
+	uint64_t now,
+	const ZT_WirePacket *packets,
+	unsigned int packetCount,
+	volatile uint64_t *nextBackgroundTaskDeadline)
+{
+	try {
+		return reinterpret_cast<ZeroTier::Node *>(node)->processWirePackets(now,packets,packetCount,nextBackgroundTaskDeadline);
+	} catch (std::bad_alloc &exc) {
+		return ZT_RESULT_FATAL_ERROR_OUT_OF_MEMORY;
+	} catch ( ... ) {
+		return ZT_RESULT_OK; // "OK" since invalid packets are simply dropped, but the system is still up
+	}
+}
+
 enum ZT_ResultCode ZT_Node_processVirtualNetworkFrame(
 	ZT_Node *node,
 	uint64_t now,
@@ -1027,6 +1113,20 @@ void ZT_Node_setTrustedPaths(ZT_Node *node,const struct sockaddr_storage *networ
 	} catch ( ... ) {}
 }
 
+void ZT_Node_setMultipathMode(ZT_Node *node,int enabled)
+{
+	try {
+		reinterpret_cast<ZeroTier::Node *>(node)->setMultipathMode(enabled != 0);
+	} catch ( ... ) {}
+}
+
+void ZT_Node_setPathMtuDiscovery(ZT_Node *node,int enabled)
+{
+	try {
+		reinterpret_cast<ZeroTier::Node *>(node)->setPathMtuDiscovery(enabled != 0);
+	} catch ( ... ) {}
+}
+
 void ZT_Node_backgroundThreadMain(ZT_Node *node)
 {
 	try {
@@ -34,6 +34,7 @@
 #include "Mutex.hpp"
 #include "MAC.hpp"
 #include "Network.hpp"
+#include "NetworkController.hpp"
 #include "Path.hpp"
 #include "Salsa20.hpp"
 
@@ -51,7 +52,7 @@ namespace ZeroTier {
  *
  * The pointer returned by ZT_Node_new() is an instance of this class.
  */
-class Node
+class Node : public NetworkController::Sender
 {
 public:
 	Node(
@@ -76,6 +77,11 @@ public:
 		const void *packetData,
 		unsigned int packetLength,
 		volatile uint64_t *nextBackgroundTaskDeadline);
+	ZT_ResultCode processWirePackets(
+		uint64_t now,
+		const ZT_WirePacket *packets,
+		unsigned int packetCount,
+		volatile uint64_t *nextBackgroundTaskDeadline);
 	ZT_ResultCode processVirtualNetworkFrame(
 		uint64_t now,
 		uint64_t nwid,
@@ -132,7 +138,14 @@ public:
 	/**
 	 * @return Time as of last call to run()
 	 */
-	inline uint64_t now() const throw() { return _now; }
+	inline uint64_t now() const throw()
+	{
+#if defined(__GNUC__) && !defined(__LP64__)
+		return __sync_add_and_fetch(const_cast<volatile uint64_t *>(&_now),0); // 64-bit loads aren't atomic here
+#else
+		return _now;
+#endif
+	}
 
 	/**
 	 * Enqueue a ZeroTier message to be sent
@@ -257,6 +270,22 @@ public:
 	uint64_t prng();
 	void postCircuitTestReport(const ZT_CircuitTestReport *report);
 	void setTrustedPaths(const struct sockaddr_storage *networks,const uint64_t *ids,unsigned int count);
+	void setMultipathMode(bool enabled);
+
+	/**
+	 * @return True if traffic to a peer may be spread over all its active direct paths
+	 */
+	inline bool multipathEnabled() const throw() { return _multipath; }
+
+	void setPathMtuDiscovery(bool enabled);
+
+	/**
+	 * @return True if the host honors ZT_WIRE_PACKET_FLAG_DONT_FRAGMENT and paths should be probed for their MTU
+	 */
+	inline bool pathMtuDiscoveryEnabled() const throw() { return _pathMtuDiscovery; }
+
+	virtual void ncSendConfig(uint64_t nwid,uint64_t requestPacketId,const Address &destination,const Dictionary<ZT_NETWORKCONFIG_DICT_CAPACITY> &config);
+	virtual void ncSendError(uint64_t nwid,uint64_t requestPacketId,const Address &destination,NetworkController::ResultCode rc);
 
 private:
 	inline SharedPtr<Network> _network(uint64_t nwid) const
@@ -297,10 +326,27 @@ private:
 	Salsa20 _prng;
 	uint64_t _prngStream[16]; // repeatedly encrypted with _prng to yield a high-quality non-crypto PRNG stream
 
-	uint64_t _now;
+	/* Packets may be handed to us by several I/O threads at once, each with
+	 * its own idea of the time, so they only ever move the clock forward. The
+	 * background task caller sets it outright so a clock change still takes. */
+	inline void _setNow(const uint64_t now,const bool forwardOnly)
+	{
+#ifdef __GNUC__
+		uint64_t n = _now;
+		while (((!forwardOnly)||(now > n))&&(!__sync_bool_compare_and_swap(&_now,n,now)))
+			n = _now;
+#else
+		if ((!forwardOnly)||(now > _now))
+			_now = now;
+#endif
+	}
+
+	volatile uint64_t _now;
 	uint64_t _lastPingCheck;
 	uint64_t _lastHousekeepingRun;
 	bool _online;
+	bool _multipath;
+	bool _pathMtuDiscovery;
 };
 
 } // namespace ZeroTier
@@ -91,23 +91,22 @@ void OutboundMulticast::init(
 	} else _haveCom = false;
 }
 
-void OutboundMulticast::sendOnly(const RuntimeEnvironment *RR,const Address &toAddr)
+void OutboundMulticast::sendOnly(const RuntimeEnvironment *RR,const Address &toAddr,Packet &buf)
 {
+	const Packet *tmpl = &_packetNoCom;
 	if (_haveCom) {
 		SharedPtr<Peer> peer(RR->topology->getPeer(toAddr));
 		if ( (!peer) || (peer->needsOurNetworkMembershipCertificate(_nwid,RR->node->now(),true)) ) {
 			//TRACE(">>MC %.16llx -> %s (with COM)",(unsigned long long)this,toAddr.toString().c_str());
-			_packetWithCom.newInitializationVector();
-			_packetWithCom.setDestination(toAddr);
-			RR->sw->send(_packetWithCom,true,_nwid);
-			return;
+			tmpl = &_packetWithCom;
 		}
 	}
 
-	//TRACE(">>MC %.16llx -> %s (without COM)",(unsigned long long)this,toAddr.toString().c_str());
-	_packetNoCom.newInitializationVector();
-	_packetNoCom.setDestination(toAddr);
-	RR->sw->send(_packetNoCom,true,_nwid);
+	//TRACE(">>MC %.16llx -> %s",(unsigned long long)this,toAddr.toString().c_str());
+	buf.copyFrom(tmpl->data(),tmpl->size());
+	buf.newInitializationVector();
+	buf.setDestination(toAddr);
+	RR->sw->sendInPlace(buf,true,_nwid);
 }
 
 } // namespace ZeroTier
@@ -98,21 +98,26 @@ public:
 	/**
 	 * Just send without checking log
 	 *
+	 * The recipient's copy is built from the compressed template in buf and
+	 * armored there, so one buffer can be reused for a whole fan-out.
+	 *
 	 * @param RR Runtime environment
 	 * @param toAddr Destination address
+	 * @param buf Scratch packet buffer (contents are overwritten)
 	 */
-	void sendOnly(const RuntimeEnvironment *RR,const Address &toAddr);
+	void sendOnly(const RuntimeEnvironment *RR,const Address &toAddr,Packet &buf);
 
 	/**
 	 * Just send and log but do not check sent log
 	 *
 	 * @param RR Runtime environment
 	 * @param toAddr Destination address
+	 * @param buf Scratch packet buffer (contents are overwritten)
 	 */
-	inline void sendAndLog(const RuntimeEnvironment *RR,const Address &toAddr)
+	inline void sendAndLog(const RuntimeEnvironment *RR,const Address &toAddr,Packet &buf)
 	{
 		_alreadySentTo.push_back(toAddr);
-		sendOnly(RR,toAddr);
+		sendOnly(RR,toAddr,buf);
 	}
 
 	/**
@@ -120,12 +125,13 @@ public:
 	 *
 	 * @param RR Runtime environment
 	 * @param toAddr Destination address
+	 * @param buf Scratch packet buffer (contents are overwritten)
 	 * @return True if address is new and packet was sent to switch, false if duplicate
 	 */
-	inline bool sendIfNew(const RuntimeEnvironment *RR,const Address &toAddr)
+	inline bool sendIfNew(const RuntimeEnvironment *RR,const Address &toAddr,Packet &buf)
 	{
 		if (std::find(_alreadySentTo.begin(),_alreadySentTo.end(),toAddr) == _alreadySentTo.end()) {
-			sendAndLog(RR,toAddr);
+			sendAndLog(RR,toAddr,buf);
 			return true;
 		} else return false;
 	}
@@ -122,10 +122,11 @@ bool Packet::dearmor(const void *key)
 
 bool Packet::compress()
 {
-	unsigned char buf[ZT_PROTO_MAX_PACKET_LENGTH * 2];
+	unsigned char buf[ZT_PROTO_MAX_PACKET_LENGTH];
 	if ((!compressed())&&(size() > (ZT_PACKET_IDX_PAYLOAD + 32))) {
 		int pl = (int)(size() - ZT_PACKET_IDX_PAYLOAD);
-		int cl = LZ4_compress((const char *)field(ZT_PACKET_IDX_PAYLOAD,(unsigned int)pl),(char *)buf,pl);
+		// Output is only useful if it's smaller, so let LZ4 give up at that point
+		int cl = LZ4_compress_limitedOutput((const char *)field(ZT_PACKET_IDX_PAYLOAD,(unsigned int)pl),(char *)buf,pl,pl - 1);
 		if ((cl > 0)&&(cl < pl)) {
 			(*this)[ZT_PACKET_IDX_VERB] |= (char)ZT_PROTO_VERB_FLAG_COMPRESSED;
 			setSize((unsigned int)cl + ZT_PACKET_IDX_PAYLOAD);
@@ -1339,6 +1339,38 @@ public:
 	 */
 	bool uncompress();
 
+	/**
+	 * Turn a chunk of this packet into a fragment by writing its header in place
+	 *
+	 * The fragment header overwrites the ZT_PROTO_MIN_FRAGMENT_LENGTH bytes just
+	 * before fragStart, so this may only be used on an armored packet once
+	 * everything before fragStart has been sent. It saves copying each chunk
+	 * into a Fragment.
+	 *
+	 * @param fragStart Start of fragment payload (raw index in packet data)
+	 * @param fragLen Length of fragment payload in bytes
+	 * @param fragNo Which fragment (>= 1, since 0 is Packet with end chopped off)
+	 * @param fragTotal Total number of fragments (including 0)
+	 * @return Pointer to fragment, which is fragLen + ZT_PROTO_MIN_FRAGMENT_LENGTH bytes long
+	 * @throws std::out_of_range Fragment is past end of packet or would overwrite its header
+	 */
+	inline const void *fragmentInPlace(unsigned int fragStart,unsigned int fragLen,unsigned int fragNo,unsigned int fragTotal)
+		throw(std::out_of_range)
+	{
+		if ((fragStart < (ZT_PROTO_MIN_FRAGMENT_LENGTH + ZT_PACKET_IDX_FLAGS))||((fragStart + fragLen) > size()))
+			throw std::out_of_range("Packet: tried to create in-place fragment outside packet payload");
+		unsigned char *const f = (unsigned char *)field(fragStart - ZT_PROTO_MIN_FRAGMENT_LENGTH,ZT_PROTO_MIN_FRAGMENT_LENGTH);
+
+		// NOTE: this copies both the IV/packet ID and the destination address.
+		memcpy(f + ZT_PACKET_FRAGMENT_IDX_PACKET_ID,field(ZT_PACKET_IDX_IV,13),13);
+
+		f[ZT_PACKET_FRAGMENT_IDX_FRAGMENT_INDICATOR] = ZT_PACKET_FRAGMENT_INDICATOR;
+		f[ZT_PACKET_FRAGMENT_IDX_FRAGMENT_NO] = (unsigned char)(((fragTotal & 0xf) << 4) | (fragNo & 0xf));
+		f[ZT_PACKET_FRAGMENT_IDX_HOPS] = 0;
+
+		return f;
+	}
+
 private:
 	static const unsigned char ZERO_KEY[32];
 
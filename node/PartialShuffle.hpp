@@ -0,0 +1,130 @@
+/*
+ * ZeroTier One - Network Virtualization Everywhere
+ * Copyright (C) 2011-2016  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ZT_PARTIALSHUFFLE_HPP
+#define ZT_PARTIALSHUFFLE_HPP
+
+#include <stdint.h>
+
+#include "Constants.hpp"
+#include "NonCopyable.hpp"
+
+/**
+ * Draws that fit in PartialShuffle's internal table without allocating
+ */
+#define ZT_PARTIALSHUFFLE_STATIC_DRAWS 64
+
+namespace ZeroTier {
+
+/**
+ * Draws distinct random indexes from [0,n) without shuffling all of them
+ *
+ * This is a Fisher-Yates shuffle that's run one step at a time as indexes are
+ * needed. Instead of an n-entry index array it only remembers the positions
+ * it has swapped, in a small open addressing table, so drawing k indexes costs
+ * O(k) time and memory no matter how large n is. Each draw consumes one
+ * caller-supplied random number.
+ */
+class PartialShuffle : NonCopyable
+{
+public:
+	/**
+	 * @param n Number of indexes to draw from
+	 * @param maxDraws Maximum number of times next() will be called (must be <= n)
+	 */
+	PartialShuffle(unsigned long n,unsigned long maxDraws) :
+		_t(_st),
+		_n(n),
+		_i(0),
+		_mask(0)
+	{
+		unsigned long ts = 16;
+		while (ts < (maxDraws * 2))
+			ts <<= 1;
+		if (ts > (ZT_PARTIALSHUFFLE_STATIC_DRAWS * 2))
+			_t = new _Swap[ts];
+		_mask = ts - 1;
+		for(unsigned long i=0;i<ts;++i)
+			_t[i].pos = ~((unsigned long)0);
+	}
+
+	~PartialShuffle()
+	{
+		if (_t != _st)
+			delete [] _t;
+	}
+
+	/**
+	 * @return Number of indexes not yet drawn
+	 */
+	inline unsigned long remaining() const throw() { return (_n - _i); }
+
+	/**
+	 * Draw the next index (remaining() must be nonzero)
+	 *
+	 * @param r Random number
+	 * @return Index in [0,n) not previously returned
+	 */
+	inline unsigned long next(uint64_t r)
+	{
+		const unsigned long j = _i + (unsigned long)(r % (uint64_t)(_n - _i));
+		const unsigned long pick = _get(j);
+		if (j != _i)
+			_set(j,_get(_i)); // position _i is never looked at again so it needn't be set
+		++_i;
+		return pick;
+	}
+
+private:
+	struct _Swap
+	{
+		unsigned long pos; // ~0 if empty
+		unsigned long val;
+	};
+
+	inline unsigned long _slot(unsigned long pos) const throw()
+	{
+		unsigned long s = (unsigned long)((pos * 0x9e3779b1UL) & _mask);
+		while ((_t[s].pos != pos)&&(_t[s].pos != ~((unsigned long)0)))
+			s = (s + 1) & _mask;
+		return s;
+	}
+
+	inline unsigned long _get(unsigned long pos) const throw()
+	{
+		const _Swap &sw = _t[_slot(pos)];
+		return ((sw.pos == pos) ? sw.val : pos);
+	}
+
+	inline void _set(unsigned long pos,unsigned long val) throw()
+	{
+		_Swap &sw = _t[_slot(pos)];
+		sw.pos = pos;
+		sw.val = val;
+	}
+
+	_Swap _st[ZT_PARTIALSHUFFLE_STATIC_DRAWS * 2];
+	_Swap *_t;
+	unsigned long _n;
+	unsigned long _i;
+	unsigned long _mask;
+};
+
+} // namespace ZeroTier
+
+#endif
@@ -26,6 +26,7 @@ bool Path::send(const RuntimeEnvironment *RR,const void *data,unsigned int len,u
 {
 	if (RR->node->putPacket(_localAddress,address(),data,len)) {
 		sent(now);
+		countSent(len);
 		return true;
 	}
 	return false;
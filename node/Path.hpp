@@ -54,6 +54,41 @@
  */
 #define ZT_PATH_MAX_PREFERENCE_RANK ((ZT_INETADDRESS_MAX_SCOPE << 1) | 1)
 
+/**
+ * Latency reported for paths that have not been measured yet
+ */
+#define ZT_PATH_LATENCY_UNKNOWN 0xffff
+
+/**
+ * Latency above which paths are scored as if unmeasured
+ */
+#define ZT_PATH_MAX_SCORED_LATENCY 2000
+
+/**
+ * Maximum value of packetLoss() (100% loss)
+ */
+#define ZT_PATH_PACKET_LOSS_MAX 0xffff
+
+/**
+ * Score penalty for unanswered probes in ms of latency at 100% loss
+ */
+#define ZT_PATH_PACKET_LOSS_PENALTY 1000
+
+/**
+ * Score bonus per unit of preferenceRank() in ms of latency
+ */
+#define ZT_PATH_PREFERENCE_RANK_BONUS 2
+
+/**
+ * Latency below which paths are all given the same capacityWeight()
+ */
+#define ZT_PATH_CAPACITY_MIN_LATENCY 16
+
+/**
+ * Maximum value of capacityWeight(), reached at ZT_PATH_CAPACITY_MIN_LATENCY with no loss
+ */
+#define ZT_PATH_CAPACITY_MAX_WEIGHT 64
+
 namespace ZeroTier {
 
 class RuntimeEnvironment;
@@ -74,6 +109,17 @@ public:
 		_addr(),
 		_localAddress(),
 		_flags(0),
+		_probation(0),
+		_latency8(ZT_PATH_LATENCY_UNKNOWN * 8),
+		_packetLoss(0),
+		_pingOutstanding(false),
+		_packetsSent(0),
+		_bytesSent(0),
+		_lastMtuProbe(0),
+		_mtu(ZT_UDP_DEFAULT_PAYLOAD_MTU),
+		_mtuProbeSize(0),
+		_mtuProbeStep(0),
+		_mtuProbeFailures(0),
 		_ipScope(InetAddress::IP_SCOPE_NONE)
 	{
 	}
@@ -86,6 +132,17 @@ public:
 		_addr(addr),
 		_localAddress(localAddress),
 		_flags(0),
+		_probation(0),
+		_latency8(ZT_PATH_LATENCY_UNKNOWN * 8),
+		_packetLoss(0),
+		_pingOutstanding(false),
+		_packetsSent(0),
+		_bytesSent(0),
+		_lastMtuProbe(0),
+		_mtu(ZT_UDP_DEFAULT_PAYLOAD_MTU),
+		_mtuProbeSize(0),
+		_mtuProbeStep(0),
+		_mtuProbeFailures(0),
 		_ipScope(addr.ipScope())
 	{
 	}
@@ -106,12 +163,54 @@ public:
 	 */
 	inline void sent(uint64_t t) { _lastSend = t; }
 
+	/**
+	 * Count a packet sent via this path
+	 *
+	 * This is called automatically by Path::send().
+	 *
+	 * @param len Length of packet in bytes
+	 */
+	inline void countSent(unsigned int len)
+	{
+		++_packetsSent;
+		_bytesSent += len;
+	}
+
 	/**
 	 * Called when we've sent a ping or echo
 	 *
+	 * If the previous one was never answered it counts as lost.
+	 *
 	 * @param t Time of send
 	 */
-	inline void pinged(uint64_t t) { _lastPing = t; }
+	inline void pinged(uint64_t t)
+	{
+		if (_pingOutstanding)
+			_packetLoss += (ZT_PATH_PACKET_LOSS_MAX - _packetLoss) / 8;
+		_pingOutstanding = true;
+		_lastPing = t;
+	}
+
+	/**
+	 * Called when a reply to a ping or echo gives us a round trip time
+	 *
+	 * Latency is an exponentially weighted moving average with the same 1/8
+	 * gain as TCP's smoothed RTT.
+	 *
+	 * @param l Measured round trip time in ms
+	 */
+	inline void updateLatency(unsigned int l)
+	{
+		if (l > ZT_PATH_LATENCY_UNKNOWN - 1)
+			l = ZT_PATH_LATENCY_UNKNOWN - 1;
+		if (_latency8 == (ZT_PATH_LATENCY_UNKNOWN * 8))
+			_latency8 = l * 8;
+		else _latency8 = _latency8 - (_latency8 / 8) + l;
+		if (_pingOutstanding) {
+			_packetLoss -= _packetLoss / 8;
+			_pingOutstanding = false;
+		}
+	}
 
 	/**
 	 * Called when we send a NAT keepalive
@@ -176,6 +275,129 @@ public:
 	 */
 	inline uint64_t lastReceived() const throw() { return _lastReceived; }
 
+	/**
+	 * @return Smoothed round trip time in ms or ZT_PATH_LATENCY_UNKNOWN if not measured
+	 */
+	inline unsigned int latency() const throw() { return (_latency8 / 8); }
+
+	/**
+	 * @return Latency in ms as used by score(), ZT_PATH_MAX_SCORED_LATENCY if unmeasured or higher
+	 */
+	inline unsigned int scoredLatency() const throw() { return std::min(latency(),(unsigned int)ZT_PATH_MAX_SCORED_LATENCY); }
+
+	/**
+	 * @return Estimated fraction of pings lost, from 0 to ZT_PATH_PACKET_LOSS_MAX
+	 */
+	inline unsigned int packetLoss() const throw() { return _packetLoss; }
+
+	/**
+	 * Relative share of traffic this path should carry when a peer's flows are spread over several paths
+	 *
+	 * We have no bandwidth measurement, so capacity is estimated the way TCP
+	 * throughput scales: inversely with round trip time and with loss. The
+	 * result is rounded down to a power of two so RTT jitter doesn't keep
+	 * moving flows between paths.
+	 *
+	 * @return Weight from 1 to ZT_PATH_CAPACITY_MAX_WEIGHT
+	 */
+	inline unsigned int capacityWeight() const throw()
+	{
+		const unsigned int l = std::max(scoredLatency(),(unsigned int)ZT_PATH_CAPACITY_MIN_LATENCY);
+		const unsigned int w = (((ZT_PATH_CAPACITY_MAX_WEIGHT * ZT_PATH_CAPACITY_MIN_LATENCY) / l) * (ZT_PATH_PACKET_LOSS_MAX - _packetLoss)) / ZT_PATH_PACKET_LOSS_MAX;
+		unsigned int pw = 1;
+		while ((pw << 1) <= w)
+			pw <<= 1;
+		return pw;
+	}
+
+	/**
+	 * @return Largest UDP payload this path is known to carry, at least ZT_UDP_DEFAULT_PAYLOAD_MTU
+	 */
+	inline unsigned int mtu() const throw() { return _mtu; }
+
+	/**
+	 * Advance path MTU discovery and get the size of probe to send, if any
+	 *
+	 * Discovery steps up through ZT_PATH_MTU_PROBE_STEPS sizes, giving up on
+	 * each after ZT_PATH_MTU_PROBE_ATTEMPTS unanswered probes, and is repeated
+	 * every ZT_PATH_MTU_REPROBE_INTERVAL. The MTU is the largest size that got
+	 * through, so if a size at or below it stops being answered it drops back.
+	 *
+	 * @param now Current time
+	 * @return Size of UDP payload to probe with or 0 if no probe is due
+	 */
+	inline unsigned int mtuProbe(const uint64_t now)
+	{
+		if (_mtuProbeStep >= ZT_PATH_MTU_PROBE_STEPS) {
+			if ((now - _lastMtuProbe) < ZT_PATH_MTU_REPROBE_INTERVAL)
+				return 0;
+			_mtuProbeStep = 0;
+			_mtuProbeFailures = 0;
+		} else if ((now - _lastMtuProbe) < ZT_PATH_MTU_PROBE_INTERVAL) {
+			return 0;
+		} else if ((_mtuProbeSize)&&(++_mtuProbeFailures >= ZT_PATH_MTU_PROBE_ATTEMPTS)) {
+			mtuProbeFailed();
+			return 0;
+		}
+		_mtuProbeSize = _mtuProbeStepSize(_mtuProbeStep);
+		_lastMtuProbe = now;
+		return _mtuProbeSize;
+	}
+
+	/**
+	 * Called when the peer acknowledges an MTU probe
+	 *
+	 * @param size Size of probe acknowledged
+	 */
+	inline void mtuProbeAcknowledged(unsigned int size)
+	{
+		if ((size)&&(size == _mtuProbeSize)) {
+			if (size > _mtu)
+				_mtu = size;
+			_mtuProbeSize = 0;
+			_mtuProbeFailures = 0;
+			++_mtuProbeStep;
+		}
+	}
+
+	/**
+	 * End this round of discovery at the last size that got through
+	 *
+	 * Called when a probe goes unanswered too many times, or can't be sent
+	 * at all because DF can't be set or the size exceeds the local link.
+	 */
+	inline void mtuProbeFailed()
+	{
+		if (_mtuProbeSize)
+			_mtu = (_mtuProbeStep) ? _mtuProbeStepSize(_mtuProbeStep - 1) : (unsigned int)ZT_UDP_DEFAULT_PAYLOAD_MTU;
+		_mtuProbeSize = 0;
+		_mtuProbeFailures = 0;
+		_mtuProbeStep = ZT_PATH_MTU_PROBE_STEPS;
+	}
+
+	/**
+	 * Drop back to the default MTU, e.g. if traffic over this path stops being answered
+	 *
+	 * @param now Current time (discovery resumes after ZT_PATH_MTU_REPROBE_INTERVAL)
+	 */
+	inline void resetMtu(const uint64_t now)
+	{
+		_lastMtuProbe = now;
+		_mtu = ZT_UDP_DEFAULT_PAYLOAD_MTU;
+		_mtuProbeSize = 0;
+		_mtuProbeStep = ZT_PATH_MTU_PROBE_STEPS;
+	}
+
+	/**
+	 * @return Number of packets sent via this path
+	 */
+	inline uint64_t packetsSent() const throw() { return _packetsSent; }
+
+	/**
+	 * @return Number of bytes sent via this path
+	 */
+	inline uint64_t bytesSent() const throw() { return _bytesSent; }
+
 	/**
 	 * @return Physical address
 	 */
@@ -229,11 +451,15 @@ public:
 	{
 		// This is a little bit convoluted because we try to be branch-free, using multiplication instead of branches for boolean flags
 
-		// Start with the last time this path was active, and add a fudge factor to prevent integer underflow if _lastReceived is 0
-		uint64_t score = _lastReceived + (ZT_PEER_DIRECT_PING_DELAY * (ZT_PEER_DEAD_PATH_DETECTION_MAX_PROBATION + 1));
+		// Start with a constant large enough that the penalties below can't underflow
+		uint64_t score = (ZT_PEER_DIRECT_PING_DELAY * (ZT_PEER_DEAD_PATH_DETECTION_MAX_PROBATION + 1)) + ZT_PATH_MAX_SCORED_LATENCY + ZT_PATH_PACKET_LOSS_PENALTY;
+
+		// Decrease score by latency and by probe loss scaled to a latency equivalent
+		score -= (uint64_t)scoredLatency();
+		score -= ((uint64_t)_packetLoss * ZT_PATH_PACKET_LOSS_PENALTY) / ZT_PATH_PACKET_LOSS_MAX;
 
 		// Increase score based on path preference rank, which is based on IP scope and address family
-		score += preferenceRank() * (ZT_PEER_DIRECT_PING_DELAY / ZT_PATH_MAX_PREFERENCE_RANK);
+		score += preferenceRank() * ZT_PATH_PREFERENCE_RANK_BONUS;
 
 		// Increase score if this is known to be an optimal path to a cluster
 		score += (uint64_t)(_flags & ZT_PATH_FLAG_CLUSTER_OPTIMAL) * (ZT_PEER_DIRECT_PING_DELAY / 2); // /2 because CLUSTER_OPTIMAL is flag 0x0002
@@ -341,6 +567,16 @@ public:
 		p += _localAddress.deserialize(b,p);
 		_flags = b.template at<uint16_t>(p); p += 2;
 		_probation = b.template at<uint16_t>(p); p += 2;
+		_latency8 = ZT_PATH_LATENCY_UNKNOWN * 8; // measurements are not persisted
+		_packetLoss = 0;
+		_pingOutstanding = false;
+		_packetsSent = 0;
+		_bytesSent = 0;
+		_lastMtuProbe = 0;
+		_mtu = ZT_UDP_DEFAULT_PAYLOAD_MTU;
+		_mtuProbeSize = 0;
+		_mtuProbeStep = 0;
+		_mtuProbeFailures = 0;
 		_ipScope = _addr.ipScope();
 		return (p - startAt);
 	}
@@ -349,6 +585,15 @@ public:
 	inline bool operator!=(const Path &p) const { return ((p._addr != _addr)||(p._localAddress != _localAddress)); }
 
 private:
+	inline unsigned int _mtuProbeStepSize(const unsigned int step) const throw()
+	{
+		switch(step) {
+			case 0: return ZT_UDP_DEFAULT_PAYLOAD_MTU;
+			case 1: return ZT_PATH_MTU_ETHERNET - ((_addr.ss_family == AF_INET6) ? ZT_PATH_MTU_IPV6_UDP_OVERHEAD : ZT_PATH_MTU_IPV4_UDP_OVERHEAD);
+			default: return ZT_PATH_MTU_PROBE_MAX;
+		}
+	}
+
 	uint64_t _lastSend;
 	uint64_t _lastPing;
 	uint64_t _lastKeepalive;
@@ -357,6 +602,16 @@ private:
 	InetAddress _localAddress;
 	unsigned int _flags;
 	unsigned int _probation;
+	unsigned int _latency8; // smoothed RTT in 1/8 ms
+	unsigned int _packetLoss;
+	bool _pingOutstanding;
+	uint64_t _packetsSent;
+	uint64_t _bytesSent;
+	uint64_t _lastMtuProbe;
+	unsigned int _mtu;
+	unsigned int _mtuProbeSize; // size of unanswered probe or 0 if none
+	unsigned int _mtuProbeStep; // index of size being probed, ZT_PATH_MTU_PROBE_STEPS when done
+	unsigned int _mtuProbeFailures;
 	InetAddress::IpScope _ipScope; // memoize this since it's a computed value checked often
 };
 
@@ -36,7 +36,7 @@ namespace ZeroTier {
 // Used to send varying values for NAT keepalive
 static uint32_t _natKeepaliveBuf = 0;
 
-Peer::Peer(const RuntimeEnvironment *renv,const Identity &myIdentity,const Identity &peerIdentity) :
+Peer::Peer(const RuntimeEnvironment *renv,const Identity &myIdentity,const Identity &peerIdentity,const unsigned char *agreedKey) :
 	RR(renv),
 	_lastUsed(0),
 	_lastReceive(0),
@@ -52,12 +52,15 @@ Peer::Peer(const RuntimeEnvironment *renv,const Identity &myIdentity,const Ident
 	_vRevision(0),
 	_id(peerIdentity),
 	_numPaths(0),
+	_bestPath(ZT_MAX_PEER_NETWORK_PATHS),
 	_latency(0),
 	_directPathPushCutoffCount(0),
 	_networkComs(4),
 	_lastPushedComs(4)
 {
-	if (!myIdentity.agree(peerIdentity,_key,ZT_PEER_SECRET_KEY_LENGTH))
+	if (agreedKey)
+		memcpy(_key,agreedKey,ZT_PEER_SECRET_KEY_LENGTH);
+	else if (!myIdentity.agree(peerIdentity,_key,ZT_PEER_SECRET_KEY_LENGTH))
 		throw std::runtime_error("new peer identity key agreement failed");
 }
 
@@ -70,8 +73,8 @@ void Peer::received(
 	uint64_t inRePacketId,
 	Packet::Verb inReVerb)
 {
-#ifdef ZT_ENABLE_CLUSTER
 	bool suboptimalPath = false;
+#ifdef ZT_ENABLE_CLUSTER
 	if ((RR->cluster)&&(hops == 0)) {
 		// Note: findBetterEndpoint() is first since we still want to check
 		// for a better endpoint even if we don't actually send a redirect.
@@ -124,47 +127,49 @@ void Peer::received(
 		_lastMulticastFrame = now;
 
 	if (hops == 0) {
-		bool pathIsConfirmed = false;
-		unsigned int np = _numPaths;
-		for(unsigned int p=0;p<np;++p) {
-			if ((_paths[p].address() == remoteAddr)&&(_paths[p].localAddress() == localAddr)) {
-				_paths[p].received(now);
-#ifdef ZT_ENABLE_CLUSTER
-				_paths[p].setClusterSuboptimal(suboptimalPath);
-#endif
-				pathIsConfirmed = true;
-				break;
-			}
+		bool pathIsConfirmed;
+		{
+			Mutex::Lock _l(_paths_m);
+			pathIsConfirmed = _pathReceived(localAddr,remoteAddr,now,suboptimalPath);
 		}
 
 		if ((!pathIsConfirmed)&&(RR->node->shouldUsePathForZeroTierTraffic(localAddr,remoteAddr))) {
 			if (verb == Packet::VERB_OK) {
 
-				Path *slot = (Path *)0;
-				if (np < ZT_MAX_PEER_NETWORK_PATHS) {
-					slot = &(_paths[np++]);
-				} else {
-					uint64_t slotWorstScore = 0xffffffffffffffffULL;
-					for(unsigned int p=0;p<ZT_MAX_PEER_NETWORK_PATHS;++p) {
-						if (!_paths[p].active(now)) {
-							slot = &(_paths[p]);
-							break;
+				{
+					Mutex::Lock _l(_paths_m);
+					// Another I/O thread may have learned this path since we checked
+					if (!_pathReceived(localAddr,remoteAddr,now,suboptimalPath)) {
+						unsigned int np = _numPaths;
+						Path *slot = (Path *)0;
+						if (np < ZT_MAX_PEER_NETWORK_PATHS) {
+							slot = &(_paths[np++]);
 						} else {
-							const uint64_t score = _paths[p].score();
-							if (score <= slotWorstScore) {
-								slotWorstScore = score;
-								slot = &(_paths[p]);
+							uint64_t slotWorstScore = 0xffffffffffffffffULL;
+							for(unsigned int p=0;p<ZT_MAX_PEER_NETWORK_PATHS;++p) {
+								if (!_paths[p].active(now)) {
+									slot = &(_paths[p]);
+									break;
+								} else {
+									const uint64_t score = _paths[p].score();
+									if (score <= slotWorstScore) {
+										slotWorstScore = score;
+										slot = &(_paths[p]);
+									}
+								}
 							}
 						}
-					}
-				}
-				if (slot) {
-					*slot = Path(localAddr,remoteAddr);
-					slot->received(now);
+						if (slot) {
+							if ((unsigned int)(slot - _paths) == _bestPath)
+								_bestPath = ZT_MAX_PEER_NETWORK_PATHS;
+							*slot = Path(localAddr,remoteAddr);
+							slot->received(now);
 #ifdef ZT_ENABLE_CLUSTER
-					slot->setClusterSuboptimal(suboptimalPath);
+							slot->setClusterSuboptimal(suboptimalPath);
 #endif
-					_numPaths = np;
+							_numPaths = np;
+						}
+					}
 				}
 
 #ifdef ZT_ENABLE_CLUSTER
@@ -178,6 +183,7 @@ void Peer::received(
 
 				if ( (_vProto >= 5) && ( !((_vMajor == 1)&&(_vMinor == 1)&&(_vRevision == 0)) ) ) {
 					Packet outp(_id.address(),RR->identity.address(),Packet::VERB_ECHO);
+					outp.append(now); // echoed back in OK(ECHO) to measure the new path's latency
 					outp.armor(_key,true);
 					RR->node->putPacket(localAddr,remoteAddr,outp.data(),outp.size());
 				} else {
@@ -196,6 +202,20 @@ void Peer::received(
 	}
 }
 
+bool Peer::_pathReceived(const InetAddress &localAddr,const InetAddress &remoteAddr,const uint64_t now,const bool clusterSuboptimal)
+{
+	for(unsigned int p=0,np=_numPaths;p<np;++p) {
+		if ((_paths[p].address() == remoteAddr)&&(_paths[p].localAddress() == localAddr)) {
+			_paths[p].received(now);
+#ifdef ZT_ENABLE_CLUSTER
+			_paths[p].setClusterSuboptimal(clusterSuboptimal);
+#endif
+			return true;
+		}
+	}
+	return false;
+}
+
 void Peer::sendHELLO(const InetAddress &localAddr,const InetAddress &atAddress,uint64_t now,unsigned int ttl)
 {
 	Packet outp(_id.address(),RR->identity.address(),Packet::VERB_HELLO);
@@ -215,6 +235,7 @@ void Peer::sendHELLO(const InetAddress &localAddr,const InetAddress &atAddress,u
 
 bool Peer::doPingAndKeepalive(uint64_t now,int inetAddressFamily)
 {
+	Mutex::Lock _l(_paths_m);
 	Path *p = (Path *)0;
 
 	if (inetAddressFamily != 0) {
@@ -237,6 +258,20 @@ bool Peer::doPingAndKeepalive(uint64_t now,int inetAddressFamily)
 		} else {
 			//TRACE("no PING or NAT keepalive: addr==%s reliable==%d %llums/%llums send/receive inactivity",p->address().toString().c_str(),(int)p->reliable(),now - p->lastSend(),now - p->lastReceived());
 		}
+
+		// Keep latency and loss estimates fresh for every live path, not just
+		// the one we're using, so _getBestPath() can tell when another is better.
+		// Path MTU discovery probes ride along on the same schedule.
+		if (!RR->topology->amRoot()) {
+			for(unsigned int i=0;i<_numPaths;++i) {
+				if ( ((inetAddressFamily == 0)||((int)_paths[i].address().ss_family == inetAddressFamily)) && (_paths[i].active(now)) ) {
+					if ((now - _paths[i].lastPing()) >= ZT_PEER_DIRECT_PING_DELAY)
+						_probePath(_paths[i],now);
+					_probeMtu(_paths[i],now);
+				}
+			}
+		}
+
 		return true;
 	}
 
@@ -331,6 +366,7 @@ bool Peer::pushDirectPaths(const InetAddress &localAddr,const InetAddress &toAdd
 
 bool Peer::resetWithinScope(InetAddress::IpScope scope,uint64_t now)
 {
+	Mutex::Lock _l(_paths_m);
 	unsigned int np = _numPaths;
 	unsigned int x = 0;
 	unsigned int y = 0;
@@ -344,6 +380,8 @@ bool Peer::resetWithinScope(InetAddress::IpScope scope,uint64_t now)
 		}
 		++x;
 	}
+	if (y < np)
+		_bestPath = ZT_MAX_PEER_NETWORK_PATHS;
 	_numPaths = y;
 	return (y < np);
 }
@@ -351,6 +389,7 @@ bool Peer::resetWithinScope(InetAddress::IpScope scope,uint64_t now)
 void Peer::getBestActiveAddresses(uint64_t now,InetAddress &v4,InetAddress &v6) const
 {
 	uint64_t bestV4 = 0,bestV6 = 0;
+	Mutex::Lock _l(_paths_m);
 	for(unsigned int p=0,np=_numPaths;p<np;++p) {
 		if (_paths[p].active(now)) {
 			uint64_t lr = _paths[p].lastReceived();
@@ -386,50 +425,32 @@ bool Peer::validateAndSetNetworkMembershipCertificate(uint64_t nwid,const Certif
 	if ((!com)||(com.issuedTo() != _id.address()))
 		return false;
 
-	// Return true if we already have this *exact* COM
-	{
-		Mutex::Lock _l(_networkComs_m);
-		_NetworkCom *ourCom = _networkComs.get(nwid);
-		if ((ourCom)&&(ourCom->com == com))
-			return true;
-	}
-
 	// Check signature, log and return if cert is invalid
 	if (com.signedBy() != Network::controllerFor(nwid)) {
 		TRACE("rejected network membership certificate for %.16llx signed by %s: signer not a controller of this network",(unsigned long long)nwid,com.signedBy().toString().c_str());
 		return false; // invalid signer
 	}
 
-	if (com.signedBy() == RR->identity.address()) {
-
-		// We are the controller: RR->identity.address() == controller() == cert.signedBy()
-		// So, verify that we signed th cert ourself
-		if (!com.verify(RR->identity)) {
-			TRACE("rejected network membership certificate for %.16llx self signed by %s: signature check failed",(unsigned long long)nwid,com.signedBy().toString().c_str());
+	// A COM we already hold, or any COM seen recently, is answered from cache
+	switch(RR->topology->verifyCertificateOfMembership(com)) {
+		case 0:
+			TRACE("rejected network membership certificate for %.16llx signed by %s: signature check failed",(unsigned long long)nwid,com.signedBy().toString().c_str());
 			return false; // invalid signature
-		}
-
-	} else {
-
-		SharedPtr<Peer> signer(RR->topology->getPeer(com.signedBy()));
-
-		if (!signer) {
+		case -1:
 			// This would be rather odd, since this is our controller... could happen
 			// if we get packets before we've gotten config.
 			RR->sw->requestWhois(com.signedBy());
 			return false; // signer unknown
-		}
-
-		if (!com.verify(signer->identity())) {
-			TRACE("rejected network membership certificate for %.16llx signed by %s: signature check failed",(unsigned long long)nwid,com.signedBy().toString().c_str());
-			return false; // invalid signature
-		}
+		default:
+			break;
 	}
 
 	// If we made it past all those checks, add or update cert in our cert info store
 	{
 		Mutex::Lock _l(_networkComs_m);
-		_networkComs.set(nwid,_NetworkCom(RR->node->now(),com));
+		_NetworkCom *ourCom = _networkComs.get(nwid);
+		if ((!ourCom)||(ourCom->com != com))
+			_networkComs.set(nwid,_NetworkCom(RR->node->now(),com));
 	}
 
 	return true;
@@ -448,6 +469,7 @@ bool Peer::needsOurNetworkMembershipCertificate(uint64_t nwid,uint64_t now,bool
 void Peer::clean(uint64_t now)
 {
 	{
+		Mutex::Lock _l(_paths_m);
 		unsigned int np = _numPaths;
 		unsigned int x = 0;
 		unsigned int y = 0;
@@ -456,6 +478,8 @@ void Peer::clean(uint64_t now)
 				_paths[y++] = _paths[x];
 			++x;
 		}
+		if (y < np)
+			_bestPath = ZT_MAX_PEER_NETWORK_PATHS;
 		_numPaths = y;
 	}
 
@@ -482,6 +506,78 @@ void Peer::clean(uint64_t now)
 	}
 }
 
+Path *Peer::getPathForFlow(uint64_t now,uint32_t flowId)
+{
+	Path *const bestPath = _getBestPath(now);
+	if ((!bestPath)||(!flowId)||(!RR->node->multipathEnabled()))
+		return bestPath;
+
+	// Paths not yet measured carry no flows. Paths on probation keep theirs
+	// unless they die, since one lost probe shouldn't make flows hop around.
+	unsigned int weights[ZT_MAX_PEER_NETWORK_PATHS];
+	unsigned int totalWeight = 0;
+	for(unsigned int i=0;i<_numPaths;++i) {
+		if ((_paths[i].active(now))&&(_paths[i].latency() != ZT_PATH_LATENCY_UNKNOWN))
+			weights[i] = _paths[i].capacityWeight();
+		else weights[i] = 0;
+		totalWeight += weights[i];
+	}
+	if (!totalWeight)
+		return bestPath;
+
+	// Scale a mixed flow hash into [0,totalWeight) and find the path whose share that lands in
+	unsigned int w = (unsigned int)((((uint64_t)(flowId * 0x9e3779b1)) * (uint64_t)totalWeight) >> 32);
+	for(unsigned int i=0;i<_numPaths;++i) {
+		if (w < weights[i]) {
+			if (&(_paths[i]) != bestPath)
+				_doDeadPathDetection(_paths[i],now);
+			return &(_paths[i]);
+		}
+		w -= weights[i];
+	}
+	return bestPath;
+}
+
+void Peer::_probePath(Path &p,const uint64_t now)
+{
+	// ECHO carries our send time so OK(ECHO) gives a round trip time for this path
+	if ( (_vProto >= 5) && ( !((_vMajor == 1)&&(_vMinor == 1)&&(_vRevision == 0)) ) ) {
+		Packet outp(_id.address(),RR->identity.address(),Packet::VERB_ECHO);
+		outp.append(now);
+		outp.armor(_key,true);
+		p.send(RR,outp.data(),outp.size(),now);
+	} else {
+		sendHELLO(p.localAddress(),p.address(),now);
+		p.sent(now);
+	}
+	p.pinged(now);
+}
+
+void Peer::_probeMtu(Path &p,const uint64_t now)
+{
+	// Hosts that can't send with DF, and peers too old for ECHO, keep the default MTU
+	if (!RR->node->pathMtuDiscoveryEnabled())
+		return;
+	if ( (_vProto < 5) || ((_vMajor == 1)&&(_vMinor == 1)&&(_vRevision == 0)) )
+		return;
+	const unsigned int size = p.mtuProbe(now);
+	if (size) {
+		// ECHO padded to the probe size; its OK echoes back our timestamp and the size
+		Packet outp(_id.address(),RR->identity.address(),Packet::VERB_ECHO);
+		outp.append(now);
+		outp.append((uint16_t)size);
+		outp.append((unsigned char)0,size - outp.size());
+		outp.armor(_key,true);
+		if (RR->node->putPacket(p.localAddress(),p.address(),outp.data(),outp.size(),ZT_WIRE_PACKET_FLAG_DONT_FRAGMENT)) {
+			p.sent(now);
+			p.countSent(outp.size());
+		} else {
+			// DF couldn't be set on this path, or the size won't leave this host unfragmented
+			p.mtuProbeFailed();
+		}
+	}
+}
+
 void Peer::_doDeadPathDetection(Path &p,const uint64_t now)
 {
 	/* Dead path detection: if we have sent something to this peer and have not
@@ -507,18 +603,11 @@ void Peer::_doDeadPathDetection(Path &p,const uint64_t now)
 			 (!RR->topology->amRoot())
 		 ) {
 		TRACE("%s(%s) does not seem to be answering in a timely manner, checking if dead (probation == %u)",_id.address().toString().c_str(),p.address().toString().c_str(),p.probation());
-
-		if ( (_vProto >= 5) && ( !((_vMajor == 1)&&(_vMinor == 1)&&(_vRevision == 0)) ) ) {
-			Packet outp(_id.address(),RR->identity.address(),Packet::VERB_ECHO);
-			outp.armor(_key,true);
-			p.send(RR,outp.data(),outp.size(),now);
-			p.pinged(now);
-		} else {
-			sendHELLO(p.localAddress(),p.address(),now);
-			p.sent(now);
-			p.pinged(now);
-		}
-
+		// A second unanswered check may mean large packets have started being
+		// dropped, so stop sending them until MTU discovery is repeated.
+		if (p.probation() > 0)
+			p.resetMtu(now);
+		_probePath(p,now);
 		p.increaseProbation();
 	}
 }
@@ -534,8 +623,11 @@ Path *Peer::_getBestPath(const uint64_t now)
 			bestPath = &(_paths[i]);
 		}
 	}
-	if (bestPath)
+	if (bestPath) {
+		bestPath = _applyPathHysteresis(bestPath,bestPathScore,now,0);
+		_bestPath = (unsigned int)(bestPath - _paths);
 		_doDeadPathDetection(*bestPath,now);
+	}
 	return bestPath;
 }
 
@@ -550,8 +642,25 @@ Path *Peer::_getBestPath(const uint64_t now,int inetAddressFamily)
 			bestPath = &(_paths[i]);
 		}
 	}
-	if (bestPath)
+	if (bestPath) {
+		bestPath = _applyPathHysteresis(bestPath,bestPathScore,now,inetAddressFamily);
 		_doDeadPathDetection(*bestPath,now);
+	}
+	return bestPath;
+}
+
+Path *Peer::_applyPathHysteresis(Path *bestPath,const uint64_t bestPathScore,const uint64_t now,int inetAddressFamily)
+{
+	/* Stay on the path we're using unless the new best beats it by a margin,
+	 * so two paths with similar latency don't make us flap back and forth
+	 * between them (and reorder traffic) as their estimates wander. */
+	if (_bestPath < _numPaths) {
+		Path *const cur = &(_paths[_bestPath]);
+		if ( (cur != bestPath) && ((inetAddressFamily == 0)||((int)cur->address().ss_family == inetAddressFamily)) && (cur->active(now)) ) {
+			if ((cur->score() + ZT_PEER_PATH_SWITCH_HYSTERESIS + (cur->scoredLatency() / 8)) >= bestPathScore)
+				return cur;
+		}
+	}
 	return bestPath;
 }
 
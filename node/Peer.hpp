@@ -69,9 +69,10 @@ public:
 	 * @param renv Runtime environment
 	 * @param myIdentity Identity of THIS node (for key agreement)
 	 * @param peerIdentity Identity of peer
+	 * @param agreedKey Key already agreed with this identity, or NULL to perform key agreement
 	 * @throws std::runtime_error Key agreement with peer's identity failed
 	 */
-	Peer(const RuntimeEnvironment *renv,const Identity &myIdentity,const Identity &peerIdentity);
+	Peer(const RuntimeEnvironment *renv,const Identity &myIdentity,const Identity &peerIdentity,const unsigned char *agreedKey = (const unsigned char *)0);
 
 	/**
 	 * @return Time peer record was last used in any way
@@ -120,13 +121,55 @@ public:
 		Packet::Verb inReVerb = Packet::VERB_NOP);
 
 	/**
-	 * Get the current best direct path to this peer
+	 * Lock that must be held while using a path returned by getBestPath(now) or getPathForFlow()
+	 *
+	 * Paths are kept in an array that received() overwrites and clean() compacts,
+	 * and packets for the same peer may be handled by several I/O threads, so a
+	 * path pointer is only good for as long as this is held.
+	 *
+	 * @return This peer's path lock
+	 */
+	inline Mutex &pathLock() { return _paths_m; }
+
+	/**
+	 * Get the current best direct path to this peer (pathLock() must be held)
 	 *
 	 * @param now Current time
 	 * @return Best path or NULL if there are no active direct paths
 	 */
 	inline Path *getBestPath(uint64_t now) { return _getBestPath(now); }
 
+	/**
+	 * Get a copy of the current best direct path to this peer
+	 *
+	 * @param now Current time
+	 * @param bestPath Set to best path if there is one
+	 * @return True if there is an active direct path
+	 */
+	inline bool getBestPath(uint64_t now,Path &bestPath)
+	{
+		Mutex::Lock _l(_paths_m);
+		Path *const p = _getBestPath(now);
+		if (p) {
+			bestPath = *p;
+			return true;
+		}
+		return false;
+	}
+
+	/**
+	 * Get the direct path to use for a flow of network traffic
+	 *
+	 * This is getBestPath() unless multipath mode is enabled, in which case
+	 * flows are hashed across all active measured paths in proportion to
+	 * their Path::capacityWeight(). The caller must hold pathLock().
+	 *
+	 * @param now Current time
+	 * @param flowId Flow hash or 0 for traffic that isn't part of a flow
+	 * @return Path or NULL if there are no active direct paths
+	 */
+	Path *getPathForFlow(uint64_t now,uint32_t flowId);
+
 	/**
 	 * @param now Current time
 	 * @param addr Remote address
@@ -134,6 +177,7 @@ public:
 	 */
 	inline bool hasActivePathTo(uint64_t now,const InetAddress &addr) const
 	{
+		Mutex::Lock _l(_paths_m);
 		for(unsigned int p=0;p<_numPaths;++p) {
 			if ((_paths[p].active(now))&&(_paths[p].address() == addr))
 				return true;
@@ -150,6 +194,7 @@ public:
 	 */
 	inline void setClusterOptimalPathForAddressFamily(const InetAddress &addr)
 	{
+		Mutex::Lock _l(_paths_m);
 		for(unsigned int p=0;p<_numPaths;++p) {
 			if (_paths[p].address().ss_family == addr.ss_family) {
 				_paths[p].setClusterSuboptimal(_paths[p].address() != addr);
@@ -163,16 +208,15 @@ public:
 	 * @param data Packet data
 	 * @param len Packet length
 	 * @param now Current time
-	 * @return Path used on success or NULL on failure
+	 * @return True if packet was sent via a direct path
 	 */
-	inline Path *send(const void *data,unsigned int len,uint64_t now)
+	inline bool send(const void *data,unsigned int len,uint64_t now)
 	{
-		Path *const bestPath = getBestPath(now);
-		if (bestPath) {
-			if (bestPath->send(RR,data,len,now))
-				return bestPath;
-		}
-		return (Path *)0;
+		Mutex::Lock _l(_paths_m);
+		Path *const bestPath = _getBestPath(now);
+		if (bestPath)
+			return bestPath->send(RR,data,len,now);
+		return false;
 	}
 
 	/**
@@ -215,6 +259,7 @@ public:
 	inline std::vector<Path> paths() const
 	{
 		std::vector<Path> pp;
+		Mutex::Lock _l(_paths_m);
 		for(unsigned int p=0,np=_numPaths;p<np;++p)
 			pp.push_back(_paths[p]);
 		return pp;
@@ -285,12 +330,49 @@ public:
 		else _latency = std::min(l,(unsigned int)65535);
 	}
 
+	/**
+	 * Update a direct path's latency with a round trip time measured over it
+	 *
+	 * @param localAddr Local address of path
+	 * @param remoteAddr Remote address of path
+	 * @param l Round trip time in ms
+	 */
+	inline void addPathLatencyMeasurement(const InetAddress &localAddr,const InetAddress &remoteAddr,unsigned int l)
+	{
+		Mutex::Lock _l(_paths_m);
+		for(unsigned int p=0,np=_numPaths;p<np;++p) {
+			if ((_paths[p].address() == remoteAddr)&&(_paths[p].localAddress() == localAddr)) {
+				_paths[p].updateLatency(l);
+				break;
+			}
+		}
+	}
+
+	/**
+	 * Record that a direct path carried an MTU probe of a given size
+	 *
+	 * @param localAddr Local address of path
+	 * @param remoteAddr Remote address of path
+	 * @param size Size of probe acknowledged
+	 */
+	inline void mtuProbeAcknowledged(const InetAddress &localAddr,const InetAddress &remoteAddr,unsigned int size)
+	{
+		Mutex::Lock _l(_paths_m);
+		for(unsigned int p=0,np=_numPaths;p<np;++p) {
+			if ((_paths[p].address() == remoteAddr)&&(_paths[p].localAddress() == localAddr)) {
+				_paths[p].mtuProbeAcknowledged(size);
+				break;
+			}
+		}
+	}
+
 	/**
 	 * @param now Current time
 	 * @return True if this peer has at least one active direct path
 	 */
 	inline bool hasActiveDirectPath(uint64_t now) const
 	{
+		Mutex::Lock _l(_paths_m);
 		for(unsigned int p=0;p<_numPaths;++p) {
 			if (_paths[p].active(now))
 				return true;
@@ -305,6 +387,7 @@ public:
 	 */
 	inline bool hasClusterOptimalPath(uint64_t now) const
 	{
+		Mutex::Lock _l(_paths_m);
 		for(unsigned int p=0,np=_numPaths;p<np;++p) {
 			if ((_paths[p].active(now))&&(!_paths[p].isClusterSuboptimal()))
 				return true;
@@ -461,9 +544,12 @@ public:
 		b.append((uint32_t)_latency);
 		b.append((uint16_t)_directPathPushCutoffCount);
 
-		b.append((uint16_t)_numPaths);
-		for(unsigned int i=0;i<_numPaths;++i)
-			_paths[i].serialize(b);
+		{
+			Mutex::Lock _l2(_paths_m);
+			b.append((uint16_t)_numPaths);
+			for(unsigned int i=0;i<_numPaths;++i)
+				_paths[i].serialize(b);
+		}
 
 		b.append((uint32_t)_networkComs.size());
 		{
@@ -561,9 +647,13 @@ public:
 	}
 
 private:
+	bool _pathReceived(const InetAddress &localAddr,const InetAddress &remoteAddr,const uint64_t now,const bool clusterSuboptimal);
+	void _probePath(Path &p,const uint64_t now);
+	void _probeMtu(Path &p,const uint64_t now);
 	void _doDeadPathDetection(Path &p,const uint64_t now);
 	Path *_getBestPath(const uint64_t now);
 	Path *_getBestPath(const uint64_t now,int inetAddressFamily);
+	Path *_applyPathHysteresis(Path *bestPath,const uint64_t bestPathScore,const uint64_t now,int inetAddressFamily);
 
 	unsigned char _key[ZT_PEER_SECRET_KEY_LENGTH]; // computed with key agreement, not serialized
 
@@ -583,6 +673,8 @@ private:
 	Identity _id;
 	Path _paths[ZT_MAX_PEER_NETWORK_PATHS];
 	unsigned int _numPaths;
+	unsigned int _bestPath; // index of path last returned by _getBestPath(now), for hysteresis
+	Mutex _paths_m; // guards _paths, _numPaths and _bestPath
 	unsigned int _latency;
 	unsigned int _directPathPushCutoffCount;
 
@@ -64,8 +64,110 @@ public:
 static const _s20sseconsts _S20SSECONSTANTS;
 #endif
 
+// On x86 with GCC or clang, also build an 8-block AVX2 kernel and pick it at runtime via CPUID
+#if defined(ZT_SALSA20_SSE) && (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__)) && (!defined(ZT_SALSA20_NO_AVX2))
+#define ZT_SALSA20_AVX2 1
+#include <immintrin.h>
+
+static bool _s20DetectAVX2()
+{
+	__builtin_cpu_init();
+	return (__builtin_cpu_supports("avx2") != 0);
+}
+static const bool _S20HAVEAVX2 = _s20DetectAVX2();
+
+#define ZT_S20AVX2_ROTATE(v,c) _mm256_or_si256(_mm256_slli_epi32((v),(c)),_mm256_srli_epi32((v),32 - (c)))
+#define ZT_S20AVX2_QR(a,b,c,d) \
+	b = _mm256_xor_si256(b,ZT_S20AVX2_ROTATE(_mm256_add_epi32(a,d),7)); \
+	c = _mm256_xor_si256(c,ZT_S20AVX2_ROTATE(_mm256_add_epi32(b,a),9)); \
+	d = _mm256_xor_si256(d,ZT_S20AVX2_ROTATE(_mm256_add_epi32(c,b),13)); \
+	a = _mm256_xor_si256(a,ZT_S20AVX2_ROTATE(_mm256_add_epi32(d,c),18))
+
+// Transpose 8 words from each of 8 blocks (w[n] lane b is word n of block b), XOR, and store 32 bytes per block
+static inline __attribute__((target("avx2"))) void _s20avx2Store(const __m256i *w,const uint8_t *m,uint8_t *c)
+{
+	const __m256i t0 = _mm256_unpacklo_epi32(w[0],w[1]);
+	const __m256i t1 = _mm256_unpackhi_epi32(w[0],w[1]);
+	const __m256i t2 = _mm256_unpacklo_epi32(w[2],w[3]);
+	const __m256i t3 = _mm256_unpackhi_epi32(w[2],w[3]);
+	const __m256i t4 = _mm256_unpacklo_epi32(w[4],w[5]);
+	const __m256i t5 = _mm256_unpackhi_epi32(w[4],w[5]);
+	const __m256i t6 = _mm256_unpacklo_epi32(w[6],w[7]);
+	const __m256i t7 = _mm256_unpackhi_epi32(w[6],w[7]);
+	const __m256i u0 = _mm256_unpacklo_epi64(t0,t2); // blocks 0 and 4
+	const __m256i u1 = _mm256_unpackhi_epi64(t0,t2); // blocks 1 and 5
+	const __m256i u2 = _mm256_unpacklo_epi64(t1,t3); // blocks 2 and 6
+	const __m256i u3 = _mm256_unpackhi_epi64(t1,t3); // blocks 3 and 7
+	const __m256i u4 = _mm256_unpacklo_epi64(t4,t6);
+	const __m256i u5 = _mm256_unpackhi_epi64(t4,t6);
+	const __m256i u6 = _mm256_unpacklo_epi64(t5,t7);
+	const __m256i u7 = _mm256_unpackhi_epi64(t5,t7);
+	_mm256_storeu_si256((__m256i *)(c),_mm256_xor_si256(_mm256_permute2x128_si256(u0,u4,0x20),_mm256_loadu_si256((const __m256i *)(m))));
+	_mm256_storeu_si256((__m256i *)(c + 64),_mm256_xor_si256(_mm256_permute2x128_si256(u1,u5,0x20),_mm256_loadu_si256((const __m256i *)(m + 64))));
+	_mm256_storeu_si256((__m256i *)(c + 128),_mm256_xor_si256(_mm256_permute2x128_si256(u2,u6,0x20),_mm256_loadu_si256((const __m256i *)(m + 128))));
+	_mm256_storeu_si256((__m256i *)(c + 192),_mm256_xor_si256(_mm256_permute2x128_si256(u3,u7,0x20),_mm256_loadu_si256((const __m256i *)(m + 192))));
+	_mm256_storeu_si256((__m256i *)(c + 256),_mm256_xor_si256(_mm256_permute2x128_si256(u0,u4,0x31),_mm256_loadu_si256((const __m256i *)(m + 256))));
+	_mm256_storeu_si256((__m256i *)(c + 320),_mm256_xor_si256(_mm256_permute2x128_si256(u1,u5,0x31),_mm256_loadu_si256((const __m256i *)(m + 320))));
+	_mm256_storeu_si256((__m256i *)(c + 384),_mm256_xor_si256(_mm256_permute2x128_si256(u2,u6,0x31),_mm256_loadu_si256((const __m256i *)(m + 384))));
+	_mm256_storeu_si256((__m256i *)(c + 448),_mm256_xor_si256(_mm256_permute2x128_si256(u3,u7,0x31),_mm256_loadu_si256((const __m256i *)(m + 448))));
+}
+
+// Process as many whole 512-byte (8 block) chunks as possible, returning bytes done; state is in SSE order (see init())
+static __attribute__((target("avx2"))) unsigned int _s20avx2(uint32_t *const state,const uint8_t *m,uint8_t *c,unsigned int bytes,const unsigned int doubleRounds)
+{
+	// Standard Salsa20 word n lives at state[SSE_ORDER[n]]
+	static const unsigned int SSE_ORDER[16] = { 0,13,10,7,4,1,14,11,8,5,2,15,12,9,6,3 };
+	__m256i j[16],x[16];
+	for(unsigned int n=0;n<16;++n)
+		j[n] = _mm256_set1_epi32((int)state[SSE_ORDER[n]]);
+	uint64_t ctr = ((uint64_t)state[8]) | (((uint64_t)state[5]) << 32);
+
+	unsigned int done = 0;
+	while ((bytes - done) >= 512) {
+		j[8] = _mm256_setr_epi32((int)ctr,(int)(ctr + 1),(int)(ctr + 2),(int)(ctr + 3),(int)(ctr + 4),(int)(ctr + 5),(int)(ctr + 6),(int)(ctr + 7));
+		j[9] = _mm256_setr_epi32((int)(ctr >> 32),(int)((ctr + 1) >> 32),(int)((ctr + 2) >> 32),(int)((ctr + 3) >> 32),(int)((ctr + 4) >> 32),(int)((ctr + 5) >> 32),(int)((ctr + 6) >> 32),(int)((ctr + 7) >> 32));
+		for(unsigned int n=0;n<16;++n)
+			x[n] = j[n];
+
+		for(unsigned int r=0;r<doubleRounds;++r) {
+			ZT_S20AVX2_QR(x[0],x[4],x[8],x[12]);
+			ZT_S20AVX2_QR(x[5],x[9],x[13],x[1]);
+			ZT_S20AVX2_QR(x[10],x[14],x[2],x[6]);
+			ZT_S20AVX2_QR(x[15],x[3],x[7],x[11]);
+			ZT_S20AVX2_QR(x[0],x[1],x[2],x[3]);
+			ZT_S20AVX2_QR(x[5],x[6],x[7],x[4]);
+			ZT_S20AVX2_QR(x[10],x[11],x[8],x[9]);
+			ZT_S20AVX2_QR(x[15],x[12],x[13],x[14]);
+		}
+
+		for(unsigned int n=0;n<16;++n)
+			x[n] = _mm256_add_epi32(x[n],j[n]);
+		_s20avx2Store(x,m + done,c + done);
+		_s20avx2Store(x + 8,m + done + 32,c + done + 32);
+
+		ctr += 8;
+		done += 512;
+	}
+
+	state[8] = (uint32_t)ctr;
+	state[5] = (uint32_t)(ctr >> 32);
+	return done;
+}
+
+#endif // ZT_SALSA20_AVX2
+
 namespace ZeroTier {
 
+bool Salsa20::usingAVX2()
+	throw()
+{
+#ifdef ZT_SALSA20_AVX2
+	return _S20HAVEAVX2;
+#else
+	return false;
+#endif
+}
+
 void Salsa20::init(const void *key,unsigned int kbits,const void *iv)
 	throw()
 {
@@ -140,6 +242,17 @@ void Salsa20::encrypt12(const void *in,void *out,unsigned int bytes)
 	if (!bytes)
 		return;
 
+#ifdef ZT_SALSA20_AVX2
+	if ((bytes >= 512)&&(_S20HAVEAVX2)) {
+		const unsigned int done = _s20avx2(_state.i,m,c,bytes,6);
+		if (done == bytes)
+			return;
+		bytes -= done;
+		m += done;
+		c += done;
+	}
+#endif
+
 #ifndef ZT_SALSA20_SSE
 	j0 = _state.i[0];
 	j1 = _state.i[1];
@@ -640,6 +753,17 @@ void Salsa20::encrypt20(const void *in,void *out,unsigned int bytes)
 	if (!bytes)
 		return;
 
+#ifdef ZT_SALSA20_AVX2
+	if ((bytes >= 512)&&(_S20HAVEAVX2)) {
+		const unsigned int done = _s20avx2(_state.i,m,c,bytes,10);
+		if (done == bytes)
+			return;
+		bytes -= done;
+		m += done;
+		c += done;
+	}
+#endif
+
 #ifndef ZT_SALSA20_SSE
 	j0 = _state.i[0];
 	j1 = _state.i[1];
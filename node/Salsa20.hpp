@@ -45,6 +45,12 @@ public:
 		init(key,kbits,iv);
 	}
 
+	/**
+	 * @return True if this CPU supports and we are using the 8-block AVX2 kernel for long inputs
+	 */
+	static bool usingAVX2()
+		throw();
+
 	/**
 	 * Initialize cipher
 	 *
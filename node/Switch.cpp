@@ -56,6 +56,33 @@ static const char *etherTypeName(const unsigned int etherType)
 }
 #endif // ZT_TRACE
 
+// Hash of an IP frame's addresses, protocol and ports for multipath, or 0 if it's not IP
+static uint32_t flowIdForFrame(const unsigned int etherType,const void *data,const unsigned int len)
+{
+	const uint8_t *const b = reinterpret_cast<const uint8_t *>(data);
+	unsigned int addrStart,addrLen,proto,portsAt;
+	if ((etherType == ZT_ETHERTYPE_IPV4)&&(len >= 20)) {
+		addrStart = 12;
+		addrLen = 8;
+		proto = b[9];
+		portsAt = ((b[6] & 0x3f) | b[7]) ? len : ((unsigned int)(b[0] & 0xf) * 4); // fragments hash by address only so all pieces take one path
+	} else if ((etherType == ZT_ETHERTYPE_IPV6)&&(len >= 40)) {
+		addrStart = 8;
+		addrLen = 32;
+		proto = b[6];
+		portsAt = 40; // extension headers aren't walked, so flows using them hash by address only
+	} else return 0;
+
+	uint32_t h = 0x811c9dc5 ^ proto; // FNV-1a
+	for(unsigned int i=addrStart;i<(addrStart+addrLen);++i)
+		h = (h ^ b[i]) * 0x01000193;
+	if (((proto == 6)||(proto == 17)||(proto == 132))&&((portsAt + 4) <= len)) {
+		for(unsigned int i=portsAt;i<(portsAt+4);++i)
+			h = (h ^ b[i]) * 0x01000193;
+	}
+	return (h) ? h : 1;
+}
+
 Switch::Switch(const RuntimeEnvironment *renv) :
 	RR(renv),
 	_lastBeaconResponse(0),
@@ -137,37 +164,41 @@ void Switch::onRemotePacket(const InetAddress &localAddr,const InetAddress &from
 						// Total fragments must be more than 1, otherwise why are we
 						// seeing a Packet::Fragment?
 
-						Mutex::Lock _l(_rxQueue_m);
-						RXQueueEntry *const rq = _findRXQueueEntry(now,fragmentPacketId);
+						RXQueueShard &rqs = _rxQueueShard(fragmentPacketId);
+						Mutex::Lock _l(rqs.lock);
+						rqs.expire(now);
+						RXQueueEntry *rq = rqs.get(fragmentPacketId);
 
-						if ((!rq->timestamp)||(rq->packetId != fragmentPacketId)) {
+						if (!rq) {
 							// No packet found, so we received a fragment without its head.
 							//TRACE("fragment (%u/%u) of %.16llx from %s",fragmentNumber + 1,totalFragments,fragmentPacketId,fromAddr.toString().c_str());
 
-							rq->timestamp = now;
-							rq->packetId = fragmentPacketId;
-							rq->frags[fragmentNumber - 1] = fragment;
-							rq->totalFragments = totalFragments; // total fragment count is known
-							rq->haveFragments = 1 << fragmentNumber; // we have only this fragment
-							rq->complete = false;
-						} else if (!(rq->haveFragments & (1 << fragmentNumber))) {
+							rq = rqs.create(now,fragmentPacketId);
+							if (rqs.addFragment(rq,fragmentNumber,fragment)) {
+								rq->totalFragments = totalFragments; // total fragment count is known
+								rq->haveFragments = 1 << fragmentNumber; // we have only this fragment
+							} else {
+								rqs.release(rq);
+							}
+						} else if ((!rq->complete)&&(!(rq->haveFragments & (1 << fragmentNumber)))) {
 							// We have other fragments and maybe the head, so add this one and check
 							//TRACE("fragment (%u/%u) of %.16llx from %s",fragmentNumber + 1,totalFragments,fragmentPacketId,fromAddr.toString().c_str());
 
-							rq->frags[fragmentNumber - 1] = fragment;
-							rq->totalFragments = totalFragments;
+							if (rqs.addFragment(rq,fragmentNumber,fragment)) {
+								rq->totalFragments = totalFragments;
 
-							if (Utils::countBits(rq->haveFragments |= (1 << fragmentNumber)) == totalFragments) {
-								// We have all fragments -- assemble and process full Packet
-								//TRACE("packet %.16llx is complete, assembling and processing...",fragmentPacketId);
+								if (Utils::countBits(rq->haveFragments |= (1 << fragmentNumber)) == totalFragments) {
+									// We have all fragments -- assemble and process full Packet
+									//TRACE("packet %.16llx is complete, assembling and processing...",fragmentPacketId);
 
-								for(unsigned int f=1;f<totalFragments;++f)
-									rq->frag0.append(rq->frags[f - 1].payload(),rq->frags[f - 1].payloadLength());
+									for(unsigned int f=1;f<totalFragments;++f)
+										rq->frag0.append(rq->frags[f - 1]->payload(),rq->frags[f - 1]->payloadLength());
 
-								if (rq->frag0.tryDecode(RR,false)) {
-									rq->timestamp = 0; // packet decoded, free entry
-								} else {
-									rq->complete = true; // set complete flag but leave entry since it probably needs WHOIS or something
+									if (rq->frag0.tryDecode(RR,false)) {
+										rqs.release(rq); // packet decoded, free entry
+									} else {
+										rqs.setComplete(rq); // leave entry since it probably needs WHOIS or something
+									}
 								}
 							}
 						} // else this is a duplicate fragment, ignore
@@ -239,19 +270,18 @@ void Switch::onRemotePacket(const InetAddress &localAddr,const InetAddress &from
 				} else if ((reinterpret_cast<const uint8_t *>(data)[ZT_PACKET_IDX_FLAGS] & ZT_PROTO_FLAG_FRAGMENTED) != 0) {
 					// Packet is the head of a fragmented packet series
 
-					Mutex::Lock _l(_rxQueue_m);
-					RXQueueEntry *const rq = _findRXQueueEntry(now,packetId);
+					RXQueueShard &rqs = _rxQueueShard(packetId);
+					Mutex::Lock _l(rqs.lock);
+					rqs.expire(now);
+					RXQueueEntry *rq = rqs.get(packetId);
 
-					if ((!rq->timestamp)||(rq->packetId != packetId)) {
+					if (!rq) {
 						// If we have no other fragments yet, create an entry and save the head
 						//TRACE("fragment (0/?) of %.16llx from %s",pid,fromAddr.toString().c_str());
 
-						rq->timestamp = now;
-						rq->packetId = packetId;
+						rq = rqs.create(now,packetId);
 						rq->frag0.init(data,len,localAddr,fromAddr,now);
-						rq->totalFragments = 0;
 						rq->haveFragments = 1;
-						rq->complete = false;
 					} else if (!(rq->haveFragments & 1)) {
 						// If we have other fragments but no head, see if we are complete with the head
 
@@ -261,12 +291,12 @@ void Switch::onRemotePacket(const InetAddress &localAddr,const InetAddress &from
 
 							rq->frag0.init(data,len,localAddr,fromAddr,now);
 							for(unsigned int f=1;f<rq->totalFragments;++f)
-								rq->frag0.append(rq->frags[f - 1].payload(),rq->frags[f - 1].payloadLength());
+								rq->frag0.append(rq->frags[f - 1]->payload(),rq->frags[f - 1]->payloadLength());
 
 							if (rq->frag0.tryDecode(RR,false)) {
-								rq->timestamp = 0; // packet decoded, free entry
+								rqs.release(rq); // packet decoded, free entry
 							} else {
-								rq->complete = true; // set complete flag but leave entry since it probably needs WHOIS or something
+								rqs.setComplete(rq); // leave entry since it probably needs WHOIS or something
 							}
 						} else {
 							// Still waiting on more fragments, but keep the head
@@ -277,20 +307,16 @@ void Switch::onRemotePacket(const InetAddress &localAddr,const InetAddress &from
 					// Packet is unfragmented, so just process it
 					IncomingPacket packet(data,len,localAddr,fromAddr,now);
 					if (!packet.tryDecode(RR,false)) {
-						Mutex::Lock _l(_rxQueue_m);
-						RXQueueEntry *rq = &(_rxQueue[ZT_RX_QUEUE_SIZE - 1]);
-						unsigned long i = ZT_RX_QUEUE_SIZE - 1;
-						while ((i)&&(rq->timestamp)) {
-							RXQueueEntry *tmp = &(_rxQueue[--i]);
-							if (tmp->timestamp < rq->timestamp)
-								rq = tmp;
+						RXQueueShard &rqs = _rxQueueShard(packetId);
+						Mutex::Lock _l(rqs.lock);
+						rqs.expire(now);
+						if (!rqs.get(packetId)) { // else this is a duplicate already waiting
+							RXQueueEntry *const rq = rqs.create(now,packetId);
+							rq->frag0 = packet;
+							rq->totalFragments = 1;
+							rq->haveFragments = 1;
+							rqs.setComplete(rq);
 						}
-						rq->timestamp = now;
-						rq->packetId = packetId;
-						rq->frag0 = packet;
-						rq->totalFragments = 1;
-						rq->haveFragments = 1;
-						rq->complete = true;
 					}
 				}
 
@@ -313,9 +339,9 @@ void Switch::onLocalEthernet(const SharedPtr<Network> &network,const MAC &from,c
 	if (to == network->mac())
 		return;
 
-	// Check to make sure this protocol is allowed on this network
-	if (!network->config().permitsEtherType(etherType)) {
-		TRACE("%.16llx: ignored tap: %s -> %s: ethertype %s not allowed on network %.16llx",network->id(),from.toString().c_str(),to.toString().c_str(),etherTypeName(etherType),(unsigned long long)network->id());
+	// Check this frame against the network's flow rules
+	if (!network->permitsFrame(FlowRules::Frame(RR->identity.address(),((!to.isMulticast())&&(to[0] == MAC::firstOctetForNetwork(network->id()))) ? to.toAddress(network->id()) : Address(),from,to,etherType,vlanId,data,len,false))) {
+		TRACE("%.16llx: ignored tap: %s -> %s: %s frame rejected by rules on network %.16llx",network->id(),from.toString().c_str(),to.toString().c_str(),etherTypeName(etherType),(unsigned long long)network->id());
 		return;
 	}
 
@@ -478,14 +504,14 @@ void Switch::onLocalEthernet(const SharedPtr<Network> &network,const MAC &from,c
 			outp.append((uint16_t)etherType);
 			outp.append(data,len);
 			outp.compress();
-			send(outp,true,network->id());
+			sendInPlace(outp,true,network->id(),flowIdForFrame(etherType,data,len));
 		} else {
 			Packet outp(toZT,RR->identity.address(),Packet::VERB_FRAME);
 			outp.append(network->id());
 			outp.append((uint16_t)etherType);
 			outp.append(data,len);
 			outp.compress();
-			send(outp,true,network->id());
+			sendInPlace(outp,true,network->id(),flowIdForFrame(etherType,data,len));
 		}
 
 		//TRACE("%.16llx: UNICAST: %s -> %s etherType==%s(%.4x) vlanId==%u len==%u fromBridged==%d includeCom==%d",network->id(),from.toString().c_str(),to.toString().c_str(),etherTypeName(etherType),etherType,vlanId,len,(int)fromBridged,(int)includeCom);
@@ -543,12 +569,18 @@ void Switch::onLocalEthernet(const SharedPtr<Network> &network,const MAC &from,c
 			outp.append((uint16_t)etherType);
 			outp.append(data,len);
 			outp.compress();
-			send(outp,true,network->id());
+			sendInPlace(outp,true,network->id(),flowIdForFrame(etherType,data,len));
 		}
 	}
 }
 
 void Switch::send(const Packet &packet,bool encrypt,uint64_t nwid)
+{
+	Packet tmp(packet);
+	sendInPlace(tmp,encrypt,nwid);
+}
+
+void Switch::sendInPlace(Packet &packet,bool encrypt,uint64_t nwid,uint32_t flowId)
 {
 	if (packet.destination() == RR->identity.address()) {
 		TRACE("BUG: caught attempt to send() to self, ignored");
@@ -557,9 +589,10 @@ void Switch::send(const Packet &packet,bool encrypt,uint64_t nwid)
 
 	//TRACE(">> %s to %s (%u bytes, encrypt==%d, nwid==%.16llx)",Packet::verbString(packet.verb()),packet.destination().toString().c_str(),packet.size(),(int)encrypt,nwid);
 
-	if (!_trySend(packet,encrypt,nwid)) {
-		Mutex::Lock _l(_txQueue_m);
-		_txQueue.push_back(TXQueueEntry(packet.destination(),RR->node->now(),packet,encrypt,nwid));
+	if (!_trySend(packet,encrypt,nwid,flowId)) {
+		TXQueueShard &txs = _txQueueShard(packet.destination());
+		Mutex::Lock _l(txs.lock);
+		txs.entries.push_back(TXQueueEntry(packet.destination(),RR->node->now(),packet,encrypt,nwid,flowId));
 	}
 }
 
@@ -667,24 +700,27 @@ void Switch::doAnythingWaitingForPeer(const SharedPtr<Peer> &peer)
 		_outstandingWhoisRequests.erase(peer->address());
 	}
 
-	{	// finish processing any packets waiting on peer's public key / identity
-		Mutex::Lock _l(_rxQueue_m);
-		unsigned long i = ZT_RX_QUEUE_SIZE;
-		while (i) {
-			RXQueueEntry *rq = &(_rxQueue[--i]);
-			if ((rq->timestamp)&&(rq->complete)) {
-				if (rq->frag0.tryDecode(RR,false))
-					rq->timestamp = 0;
-			}
+	// finish processing any packets waiting on peer's public key / identity
+	for(unsigned int s=0;s<ZT_RX_QUEUE_SHARDS;++s) {
+		RXQueueShard &rqs = _rxQueue[s];
+		Mutex::Lock _l(rqs.lock);
+		if (!rqs.waiting())
+			continue;
+		for(RXQueueEntry *rq=rqs.oldest();rq;) {
+			RXQueueEntry *const next = rq->newer;
+			if ((rq->complete)&&(rq->frag0.tryDecode(RR,false)))
+				rqs.release(rq);
+			rq = next;
 		}
 	}
 
 	{	// finish sending any packets waiting on peer's public key / identity
-		Mutex::Lock _l(_txQueue_m);
-		for(std::list< TXQueueEntry >::iterator txi(_txQueue.begin());txi!=_txQueue.end();) {
+		TXQueueShard &txs = _txQueueShard(peer->address());
+		Mutex::Lock _l(txs.lock);
+		for(std::list< TXQueueEntry >::iterator txi(txs.entries.begin());txi!=txs.entries.end();) {
 			if (txi->dest == peer->address()) {
-				if (_trySend(txi->packet,txi->encrypt,txi->nwid))
-					_txQueue.erase(txi++);
+				if (_trySend(txi->packet,txi->encrypt,txi->nwid,txi->flowId))
+					txs.entries.erase(txi++);
 				else ++txi;
 			} else ++txi;
 		}
@@ -755,14 +791,15 @@ unsigned long Switch::doTimerTasks(uint64_t now)
 		}
 	}
 
-	{	// Time out TX queue packets that never got WHOIS lookups or other info.
-		Mutex::Lock _l(_txQueue_m);
-		for(std::list< TXQueueEntry >::iterator txi(_txQueue.begin());txi!=_txQueue.end();) {
-			if (_trySend(txi->packet,txi->encrypt,txi->nwid))
-				_txQueue.erase(txi++);
+	// Time out TX queue packets that never got WHOIS lookups or other info.
+	for(unsigned int s=0;s<ZT_TX_QUEUE_SHARDS;++s) {
+		Mutex::Lock _l(_txQueue[s].lock);
+		for(std::list< TXQueueEntry >::iterator txi(_txQueue[s].entries.begin());txi!=_txQueue[s].entries.end();) {
+			if (_trySend(txi->packet,txi->encrypt,txi->nwid,txi->flowId))
+				_txQueue[s].entries.erase(txi++);
 			else if ((now - txi->creationTime) > ZT_TRANSMIT_QUEUE_TIMEOUT) {
 				TRACE("TX %s -> %s timed out",txi->packet.source().toString().c_str(),txi->packet.destination().toString().c_str());
-				_txQueue.erase(txi++);
+				_txQueue[s].entries.erase(txi++);
 			} else ++txi;
 		}
 	}
@@ -794,7 +831,7 @@ Address Switch::_sendWhoisRequest(const Address &addr,const Address *peersAlread
 	return Address();
 }
 
-bool Switch::_trySend(const Packet &packet,bool encrypt,uint64_t nwid)
+bool Switch::_trySend(Packet &packet,bool encrypt,uint64_t nwid,uint32_t flowId)
 {
 	SharedPtr<Peer> peer(RR->topology->getPeer(packet.destination()));
 
@@ -808,10 +845,9 @@ bool Switch::_trySend(const Packet &packet,bool encrypt,uint64_t nwid)
 				return false; // we probably just left this network, let its packets die
 		}
 
-		Path *viaPath = peer->getBestPath(now);
 		SharedPtr<Peer> relay;
 
-		if (!viaPath) {
+		if (!peer->hasActiveDirectPath(now)) {
 			if (network) {
 				unsigned int bestq = ~((unsigned int)0); // max unsigned int since quality is lower==better
 				unsigned int ptr = 0;
@@ -832,55 +868,181 @@ bool Switch::_trySend(const Packet &packet,bool encrypt,uint64_t nwid)
 
 			if (!relay)
 				relay = RR->topology->getBestRoot();
-
-			if ( (!relay) || (!(viaPath = relay->getBestPath(now))) )
+			if (!relay)
 				return false;
 		}
-		// viaPath will not be null if we make it here
 
-		// Push possible direct paths to us if we are relaying
-		if (relay) {
-			peer->pushDirectPaths(viaPath->localAddress(),viaPath->address(),now,false,( (network)&&(network->isAllowed(peer)) ));
-			viaPath->sent(now);
-		}
+		InetAddress relayLocalAddr,relayAddr;
+		{
+			// Other I/O threads may replace or drop paths, so hold the lock of the
+			// peer whose path we send through until we're done with it.
+			Mutex::Lock _pl(((relay) ? relay : peer)->pathLock());
+			Path *const viaPath = (relay) ? relay->getBestPath(now) : peer->getPathForFlow(now,flowId);
+			if (!viaPath)
+				return false;
 
-		Packet tmp(packet);
+			if (relay) {
+				relayLocalAddr = viaPath->localAddress();
+				relayAddr = viaPath->address();
+				viaPath->sent(now);
+			}
 
-		unsigned int chunkSize = std::min(tmp.size(),(unsigned int)ZT_UDP_DEFAULT_PAYLOAD_MTU);
-		tmp.setFragmented(chunkSize < tmp.size());
+			// Relays forward datagrams as-is over paths whose MTU we don't know
+			const unsigned int mtu = (relay) ? (unsigned int)ZT_UDP_DEFAULT_PAYLOAD_MTU : viaPath->mtu();
+			unsigned int chunkSize = std::min(packet.size(),mtu);
+			packet.setFragmented(chunkSize < packet.size());
 
-		const uint64_t trustedPathId = RR->topology->getOutboundPathTrust(viaPath->address());
-		if (trustedPathId) {
-			tmp.setTrusted(trustedPathId);
-		} else {
-			tmp.armor(peer->key(),encrypt);
-		}
+			const uint64_t trustedPathId = RR->topology->getOutboundPathTrust(viaPath->address());
+			if (trustedPathId) {
+				packet.setTrusted(trustedPathId);
+			} else {
+				packet.armor(peer->key(),encrypt);
+			}
 
-		if (viaPath->send(RR,tmp.data(),chunkSize,now)) {
-			if (chunkSize < tmp.size()) {
-				// Too big for one packet, fragment the rest
-				unsigned int fragStart = chunkSize;
-				unsigned int remaining = tmp.size() - chunkSize;
-				unsigned int fragsRemaining = (remaining / (ZT_UDP_DEFAULT_PAYLOAD_MTU - ZT_PROTO_MIN_FRAGMENT_LENGTH));
-				if ((fragsRemaining * (ZT_UDP_DEFAULT_PAYLOAD_MTU - ZT_PROTO_MIN_FRAGMENT_LENGTH)) < remaining)
-					++fragsRemaining;
-				unsigned int totalFragments = fragsRemaining + 1;
-
-				for(unsigned int fno=1;fno<totalFragments;++fno) {
-					chunkSize = std::min(remaining,(unsigned int)(ZT_UDP_DEFAULT_PAYLOAD_MTU - ZT_PROTO_MIN_FRAGMENT_LENGTH));
-					Packet::Fragment frag(tmp,fragStart,chunkSize,fno,totalFragments);
-					viaPath->send(RR,frag.data(),frag.size(),now);
-					fragStart += chunkSize;
-					remaining -= chunkSize;
+			// Once armored the packet can't be queued for retry, so from here on a
+			// failed send is just packet loss.
+			if (viaPath->send(RR,packet.data(),chunkSize,now)) {
+				if (chunkSize < packet.size()) {
+					// Too big for one packet, fragment the rest
+					unsigned int fragStart = chunkSize;
+					unsigned int remaining = packet.size() - chunkSize;
+					unsigned int fragsRemaining = (remaining / (mtu - ZT_PROTO_MIN_FRAGMENT_LENGTH));
+					if ((fragsRemaining * (mtu - ZT_PROTO_MIN_FRAGMENT_LENGTH)) < remaining)
+						++fragsRemaining;
+					unsigned int totalFragments = fragsRemaining + 1;
+
+					for(unsigned int fno=1;fno<totalFragments;++fno) {
+						chunkSize = std::min(remaining,(unsigned int)(mtu - ZT_PROTO_MIN_FRAGMENT_LENGTH));
+						viaPath->send(RR,packet.fragmentInPlace(fragStart,chunkSize,fno,totalFragments),chunkSize + ZT_PROTO_MIN_FRAGMENT_LENGTH,now);
+						fragStart += chunkSize;
+						remaining -= chunkSize;
+					}
 				}
 			}
-
-			return true;
 		}
+
+		// Push possible direct paths to us if we are relaying
+		if (relay)
+			peer->pushDirectPaths(relayLocalAddr,relayAddr,now,false,( (network)&&(network->isAllowed(peer)) ));
+
+		return true;
 	} else {
 		requestWhois(packet.destination());
 	}
 	return false;
 }
 
+Switch::RXQueueShard::RXQueueShard() :
+	_oldest((RXQueueEntry *)0),
+	_newest((RXQueueEntry *)0),
+	_freeEntries((RXQueueEntry *)0),
+	_freeFragmentCount(0),
+	_waiting(0)
+{
+	for(unsigned long i=0;i<ZT_RX_QUEUE_BUCKETS;++i)
+		_buckets[i] = (RXQueueEntry *)0;
+	for(unsigned long i=0;i<(ZT_RX_QUEUE_SIZE / ZT_RX_QUEUE_SHARDS);++i) {
+		for(unsigned int f=0;f<(ZT_MAX_PACKET_FRAGMENTS - 1);++f)
+			_entries[i].frags[f] = (Packet::Fragment *)0;
+		_entries[i].nextInBucket = _freeEntries;
+		_freeEntries = &(_entries[i]);
+	}
+	for(unsigned long i=0;i<ZT_RX_QUEUE_FRAGMENT_POOL;++i)
+		_freeFragments[_freeFragmentCount++] = &(_fragments[i]);
+}
+
+Switch::RXQueueEntry *Switch::RXQueueShard::get(uint64_t packetId) const
+{
+	RXQueueEntry *rq = _buckets[_bucket(packetId)];
+	while ((rq)&&(rq->packetId != packetId))
+		rq = rq->nextInBucket;
+	return rq;
+}
+
+Switch::RXQueueEntry *Switch::RXQueueShard::create(uint64_t now,uint64_t packetId)
+{
+	if (!_freeEntries)
+		release(_oldest);
+	RXQueueEntry *const rq = _freeEntries;
+	_freeEntries = rq->nextInBucket;
+
+	RXQueueEntry *&b = _buckets[_bucket(packetId)];
+	rq->nextInBucket = b;
+	b = rq;
+
+	rq->older = _newest;
+	rq->newer = (RXQueueEntry *)0;
+	if (_newest)
+		_newest->newer = rq;
+	else _oldest = rq;
+	_newest = rq;
+
+	rq->timestamp = now;
+	rq->packetId = packetId;
+	rq->totalFragments = 0;
+	rq->haveFragments = 0;
+	rq->complete = false;
+	return rq;
+}
+
+bool Switch::RXQueueShard::addFragment(RXQueueEntry *rq,unsigned int fragmentNumber,const Packet::Fragment &fragment)
+{
+	if (!_freeFragmentCount) {
+		// Pool is dry, so give up on the oldest packet that has any fragments
+		RXQueueEntry *victim = _oldest;
+		while ((victim)&&((victim == rq)||(!(victim->haveFragments & 0xfffffffe))))
+			victim = victim->newer;
+		if (!victim)
+			return false;
+		release(victim);
+	}
+	Packet::Fragment *const f = _freeFragments[--_freeFragmentCount];
+	*f = fragment;
+	rq->frags[fragmentNumber - 1] = f;
+	return true;
+}
+
+void Switch::RXQueueShard::setComplete(RXQueueEntry *rq)
+{
+	if (!rq->complete) {
+		rq->complete = true;
+		++_waiting;
+	}
+}
+
+void Switch::RXQueueShard::release(RXQueueEntry *rq)
+{
+	for(unsigned int f=0;f<(ZT_MAX_PACKET_FRAGMENTS - 1);++f) {
+		if (rq->frags[f]) {
+			_freeFragments[_freeFragmentCount++] = rq->frags[f];
+			rq->frags[f] = (Packet::Fragment *)0;
+		}
+	}
+
+	RXQueueEntry **b = &(_buckets[_bucket(rq->packetId)]);
+	while (*b != rq)
+		b = &((*b)->nextInBucket);
+	*b = rq->nextInBucket;
+
+	if (rq->older)
+		rq->older->newer = rq->newer;
+	else _oldest = rq->newer;
+	if (rq->newer)
+		rq->newer->older = rq->older;
+	else _newest = rq->older;
+
+	if (rq->complete)
+		--_waiting;
+	rq->timestamp = 0;
+	rq->nextInBucket = _freeEntries;
+	_freeEntries = rq;
+}
+
+void Switch::RXQueueShard::expire(uint64_t now)
+{
+	// Entries are never re-timestamped, so the list is in timestamp order
+	while ((_oldest)&&((now - _oldest->timestamp) >= ZT_RX_QUEUE_EXPIRE))
+		release(_oldest);
+}
+
 } // namespace ZeroTier
@@ -102,6 +102,20 @@ public:
 	 */
 	void send(const Packet &packet,bool encrypt,uint64_t nwid);
 
+	/**
+	 * Send a packet the caller is done with
+	 *
+	 * This is the same as send() except that the packet is armored and
+	 * fragmented in place instead of being copied first. Its contents are
+	 * undefined after this returns.
+	 *
+	 * @param packet Packet to send (modified)
+	 * @param encrypt Encrypt packet payload? (always true except for HELLO)
+	 * @param nwid Related network ID or 0 if message is not in-network traffic
+	 * @param flowId Hash of the frame's flow for multipath or 0 if none (default: 0)
+	 */
+	void sendInPlace(Packet &packet,bool encrypt,uint64_t nwid,uint32_t flowId = 0);
+
 	/**
 	 * Send RENDEZVOUS to two peers to permit them to directly connect
 	 *
@@ -151,7 +165,7 @@ public:
 
 private:
 	Address _sendWhoisRequest(const Address &addr,const Address *peersAlreadyConsulted,unsigned int numPeersAlreadyConsulted);
-	bool _trySend(const Packet &packet,bool encrypt,uint64_t nwid);
+	bool _trySend(Packet &packet,bool encrypt,uint64_t nwid,uint32_t flowId); // packet is modified if and only if this returns true
 
 	const RuntimeEnvironment *const RR;
 	uint64_t _lastBeaconResponse;
@@ -170,56 +184,136 @@ private:
 	// Packets waiting for WHOIS replies or other decode info or missing fragments
 	struct RXQueueEntry
 	{
-		RXQueueEntry() : timestamp(0) {}
+		RXQueueEntry() : nextInBucket((RXQueueEntry *)0),older((RXQueueEntry *)0),newer((RXQueueEntry *)0),timestamp(0) {}
+		RXQueueEntry *nextInBucket; // next entry in the same packet ID hash bucket or in the free list
+		RXQueueEntry *older,*newer; // neighbors in order of creation
 		uint64_t timestamp; // 0 if entry is not in use
 		uint64_t packetId;
 		IncomingPacket frag0; // head of packet
-		Packet::Fragment frags[ZT_MAX_PACKET_FRAGMENTS - 1]; // later fragments (if any)
+		Packet::Fragment *frags[ZT_MAX_PACKET_FRAGMENTS - 1]; // later fragments (if any), borrowed from the shard's pool
 		unsigned int totalFragments; // 0 if only frag0 received, waiting for frags
 		uint32_t haveFragments; // bit mask, LSB to MSB
 		bool complete; // if true, packet is complete
 	};
-	RXQueueEntry _rxQueue[ZT_RX_QUEUE_SIZE];
-	Mutex _rxQueue_m;
 
-	/* Returns the matching or oldest entry. Caller must check timestamp and
-	 * packet ID to determine which. */
-	inline RXQueueEntry *_findRXQueueEntry(uint64_t now,uint64_t packetId)
+	/* RX queue is sharded by packet ID so unrelated packets don't contend for
+	 * one lock. Within a shard entries are found through a hash index on packet
+	 * ID and are kept on a list in order of creation, so expiring or evicting
+	 * entries only ever looks at the oldest. Later fragments are held in buffers
+	 * borrowed from a pool so entries that are only waiting on WHOIS don't need
+	 * their own. All methods require the caller to hold the shard's lock. */
+	class RXQueueShard
 	{
-		RXQueueEntry *rq;
-		RXQueueEntry *oldest = &(_rxQueue[ZT_RX_QUEUE_SIZE - 1]);
-		unsigned long i = ZT_RX_QUEUE_SIZE;
-		while (i) {
-			rq = &(_rxQueue[--i]);
-			if ((rq->packetId == packetId)&&(rq->timestamp))
-				return rq;
-			if ((now - rq->timestamp) >= ZT_RX_QUEUE_EXPIRE)
-				rq->timestamp = 0;
-			if (rq->timestamp < oldest->timestamp)
-				oldest = rq;
-		}
-		return oldest;
-	}
+	public:
+		RXQueueShard();
+
+		/**
+		 * @param packetId Packet ID
+		 * @return Entry for this packet or NULL if none
+		 */
+		RXQueueEntry *get(uint64_t packetId) const;
+
+		/**
+		 * Create an entry for a packet, evicting the oldest entry if all are in use
+		 *
+		 * The caller must fill in the entry's fragment fields.
+		 *
+		 * @param now Current time
+		 * @param packetId Packet ID (must not already have an entry)
+		 * @return New entry
+		 */
+		RXQueueEntry *create(uint64_t now,uint64_t packetId);
+
+		/**
+		 * Store a later fragment of an entry's packet in a pooled buffer
+		 *
+		 * If the pool is empty the oldest other entry holding fragments is
+		 * dropped to free one.
+		 *
+		 * @param rq Entry
+		 * @param fragmentNumber Fragment number (1 or more)
+		 * @param fragment Fragment
+		 * @return False if no buffer could be found
+		 */
+		bool addFragment(RXQueueEntry *rq,unsigned int fragmentNumber,const Packet::Fragment &fragment);
+
+		/**
+		 * Flag an entry's packet as complete but waiting on something else to decode
+		 *
+		 * @param rq Entry
+		 */
+		void setComplete(RXQueueEntry *rq);
+
+		/**
+		 * Release an entry and any fragment buffers it holds
+		 *
+		 * @param rq Entry
+		 */
+		void release(RXQueueEntry *rq);
+
+		/**
+		 * Release entries older than ZT_RX_QUEUE_EXPIRE
+		 *
+		 * @param now Current time
+		 */
+		void expire(uint64_t now);
+
+		/**
+		 * @return Oldest entry or NULL if none (follow newer to iterate)
+		 */
+		inline RXQueueEntry *oldest() const throw() { return _oldest; }
+
+		/**
+		 * @return Number of entries holding complete packets that are waiting to be decoded
+		 */
+		inline unsigned int waiting() const throw() { return _waiting; }
+
+		Mutex lock;
+
+	private:
+		inline unsigned long _bucket(uint64_t packetId) const throw() { return (unsigned long)((packetId / ZT_RX_QUEUE_SHARDS) ^ (packetId >> 32)) % ZT_RX_QUEUE_BUCKETS; }
+
+		RXQueueEntry _entries[ZT_RX_QUEUE_SIZE / ZT_RX_QUEUE_SHARDS];
+		RXQueueEntry *_buckets[ZT_RX_QUEUE_BUCKETS];
+		RXQueueEntry *_oldest,*_newest;
+		RXQueueEntry *_freeEntries;
+		Packet::Fragment _fragments[ZT_RX_QUEUE_FRAGMENT_POOL];
+		Packet::Fragment *_freeFragments[ZT_RX_QUEUE_FRAGMENT_POOL];
+		unsigned int _freeFragmentCount;
+		unsigned int _waiting;
+	};
+	RXQueueShard _rxQueue[ZT_RX_QUEUE_SHARDS];
+
+	inline RXQueueShard &_rxQueueShard(uint64_t packetId) { return _rxQueue[(unsigned long)(packetId % ZT_RX_QUEUE_SHARDS)]; }
 
 	// ZeroTier-layer TX queue entry
 	struct TXQueueEntry
 	{
 		TXQueueEntry() {}
-		TXQueueEntry(Address d,uint64_t ct,const Packet &p,bool enc,uint64_t nw) :
+		TXQueueEntry(Address d,uint64_t ct,const Packet &p,bool enc,uint64_t nw,uint32_t fl) :
 			dest(d),
 			creationTime(ct),
 			nwid(nw),
 			packet(p),
+			flowId(fl),
 			encrypt(enc) {}
 
 		Address dest;
 		uint64_t creationTime;
 		uint64_t nwid;
 		Packet packet; // unencrypted/unMAC'd packet -- this is done at send time
+		uint32_t flowId;
 		bool encrypt;
 	};
-	std::list< TXQueueEntry > _txQueue;
-	Mutex _txQueue_m;
+	// TX queue is sharded by destination so a peer's queued packets are in one place
+	struct TXQueueShard
+	{
+		std::list< TXQueueEntry > entries;
+		Mutex lock;
+	};
+	TXQueueShard _txQueue[ZT_TX_QUEUE_SHARDS];
+
+	inline TXQueueShard &_txQueueShard(const Address &dest) { return _txQueue[(unsigned long)(dest.toInt() % ZT_TX_QUEUE_SHARDS)]; }
 
 	// Tracks sending of VERB_RENDEZVOUS to relaying peers
 	struct _LastUniteKey
@@ -23,6 +23,7 @@
 #include "Network.hpp"
 #include "NetworkConfig.hpp"
 #include "Buffer.hpp"
+#include "SHA512.hpp"
 
 namespace ZeroTier {
 
@@ -45,7 +46,9 @@ static const unsigned char ZT_DEFAULT_WORLD[ZT_DEFAULT_WORLD_LENGTH] = {0x01,0x0
 Topology::Topology(const RuntimeEnvironment *renv) :
 	RR(renv),
 	_trustedPathCount(0),
-	_amRoot(false)
+	_amRoot(false),
+	_verifiedComHits(0),
+	_verifiedComMisses(0)
 {
 	std::string alls(RR->node->dataStoreGet("peers.save"));
 	const uint8_t *all = reinterpret_cast<const uint8_t *>(alls.data());
@@ -68,7 +71,7 @@ Topology::Topology(const RuntimeEnvironment *renv) :
 			if (!p)
 				break; // stop if invalid records
 			if (p->address() != RR->identity.address())
-				_peers.set(p->address(),p);
+				_peerShard(p->address()).peers.set(p->address(),p);
 		} catch ( ... ) {
 			break; // stop if invalid records
 		}
@@ -106,20 +109,22 @@ Topology::~Topology()
 		pbuf = new Buffer<ZT_PEER_SUGGESTED_SERIALIZATION_BUFFER_SIZE>();
 		std::string all;
 
-		Address *a = (Address *)0;
-		SharedPtr<Peer> *p = (SharedPtr<Peer> *)0;
-		Hashtable< Address,SharedPtr<Peer> >::Iterator i(_peers);
-		while (i.next(a,p)) {
-			if (std::find(_rootAddresses.begin(),_rootAddresses.end(),*a) == _rootAddresses.end()) {
-				pbuf->clear();
-				try {
-					(*p)->serialize(*pbuf);
+		for(unsigned int s=0;s<ZT_TOPOLOGY_PEER_SHARDS;++s) {
+			Address *a = (Address *)0;
+			SharedPtr<Peer> *p = (SharedPtr<Peer> *)0;
+			Hashtable< Address,SharedPtr<Peer> >::Iterator i(_peerShards[s].peers);
+			while (i.next(a,p)) {
+				if (std::find(_rootAddresses.begin(),_rootAddresses.end(),*a) == _rootAddresses.end()) {
+					pbuf->clear();
 					try {
-						all.append((const char *)pbuf->data(),pbuf->size());
-					} catch ( ... ) {
-						return; // out of memory? just skip
-					}
-				} catch ( ... ) {} // peer too big? shouldn't happen, but it so skip
+						(*p)->serialize(*pbuf);
+						try {
+							all.append((const char *)pbuf->data(),pbuf->size());
+						} catch ( ... ) {
+							return; // out of memory? just skip
+						}
+					} catch ( ... ) {} // peer too big? shouldn't happen, but it so skip
+				}
 			}
 		}
 
@@ -144,8 +149,9 @@ SharedPtr<Peer> Topology::addPeer(const SharedPtr<Peer> &peer)
 
 	SharedPtr<Peer> np;
 	{
-		Mutex::Lock _l(_lock);
-		SharedPtr<Peer> &hp = _peers[peer->address()];
+		_PeerShard &ps = _peerShard(peer->address());
+		Mutex::Lock _l(ps.lock);
+		SharedPtr<Peer> &hp = ps.peers[peer->address()];
 		if (!hp)
 			hp = peer;
 		np = hp;
@@ -164,9 +170,10 @@ SharedPtr<Peer> Topology::getPeer(const Address &zta)
 		return SharedPtr<Peer>();
 	}
 
+	_PeerShard &ps = _peerShard(zta);
 	{
-		Mutex::Lock _l(_lock);
-		const SharedPtr<Peer> *const ap = _peers.get(zta);
+		Mutex::Lock _l(ps.lock);
+		const SharedPtr<Peer> *const ap = ps.peers.get(zta);
 		if (ap) {
 			(*ap)->use(RR->node->now());
 			return *ap;
@@ -178,8 +185,8 @@ SharedPtr<Peer> Topology::getPeer(const Address &zta)
 		if (id) {
 			SharedPtr<Peer> np(new Peer(RR,RR->identity,id));
 			{
-				Mutex::Lock _l(_lock);
-				SharedPtr<Peer> &ap = _peers[zta];
+				Mutex::Lock _l(ps.lock);
+				SharedPtr<Peer> &ap = ps.peers[zta];
 				if (!ap)
 					ap.swap(np);
 				ap->use(RR->node->now());
@@ -197,8 +204,9 @@ SharedPtr<Peer> Topology::getPeer(const Address &zta)
 Identity Topology::getIdentity(const Address &zta)
 {
 	{
-		Mutex::Lock _l(_lock);
-		const SharedPtr<Peer> *const ap = _peers.get(zta);
+		_PeerShard &ps = _peerShard(zta);
+		Mutex::Lock _l(ps.lock);
+		const SharedPtr<Peer> *const ap = ps.peers.get(zta);
 		if (ap)
 			return (*ap)->identity();
 	}
@@ -228,10 +236,16 @@ SharedPtr<Peer> Topology::getBestRoot(const Address *avoid,unsigned int avoidCou
 		for(unsigned long p=0;p<_rootAddresses.size();++p) {
 			if (_rootAddresses[p] == RR->identity.address()) {
 				for(unsigned long q=1;q<_rootAddresses.size();++q) {
-					const SharedPtr<Peer> *const nextsn = _peers.get(_rootAddresses[(p + q) % _rootAddresses.size()]);
-					if ((nextsn)&&((*nextsn)->hasActiveDirectPath(now))) {
-						(*nextsn)->use(now);
-						return *nextsn;
+					// _rootPeers holds every root but us, so no need to consult the peer shards
+					const Address &nextsna = _rootAddresses[(p + q) % _rootAddresses.size()];
+					for(std::vector< SharedPtr<Peer> >::const_iterator nextsn(_rootPeers.begin());nextsn!=_rootPeers.end();++nextsn) {
+						if ((*nextsn)->address() == nextsna) {
+							if ((*nextsn)->hasActiveDirectPath(now)) {
+								(*nextsn)->use(now);
+								return *nextsn;
+							}
+							break;
+						}
 					}
 				}
 				break;
@@ -311,17 +325,153 @@ bool Topology::worldUpdateIfValid(const World &newWorld)
 
 void Topology::clean(uint64_t now)
 {
-	Mutex::Lock _l(_lock);
-	Hashtable< Address,SharedPtr<Peer> >::Iterator i(_peers);
-	Address *a = (Address *)0;
-	SharedPtr<Peer> *p = (SharedPtr<Peer> *)0;
-	while (i.next(a,p)) {
-		if (((now - (*p)->lastUsed()) >= ZT_PEER_IN_MEMORY_EXPIRATION)&&(std::find(_rootAddresses.begin(),_rootAddresses.end(),*a) == _rootAddresses.end())) {
-			_peers.erase(*a);
-		} else {
-			(*p)->clean(now);
+	const std::vector<Address> rootAddresses(this->rootAddresses());
+	for(unsigned int s=0;s<ZT_TOPOLOGY_PEER_SHARDS;++s) {
+		Mutex::Lock _l(_peerShards[s].lock);
+		Hashtable< Address,SharedPtr<Peer> >::Iterator i(_peerShards[s].peers);
+		Address *a = (Address *)0;
+		SharedPtr<Peer> *p = (SharedPtr<Peer> *)0;
+		while (i.next(a,p)) {
+			if (((now - (*p)->lastUsed()) >= ZT_PEER_IN_MEMORY_EXPIRATION)&&(std::find(rootAddresses.begin(),rootAddresses.end(),*a) == rootAddresses.end())) {
+				_peerShards[s].peers.erase(*a);
+			} else {
+				(*p)->clean(now);
+			}
+		}
+	}
+	{
+		Mutex::Lock _l(_verifiedComs_m);
+		for(int g=0;g<2;++g) {
+			Hashtable< _VerifiedComKey,_VerifiedCom > &vcs = (g) ? _verifiedComsOld : _verifiedComs;
+			Hashtable< _VerifiedComKey,_VerifiedCom >::Iterator i(vcs);
+			_VerifiedComKey *k = (_VerifiedComKey *)0;
+			_VerifiedCom *v = (_VerifiedCom *)0;
+			while (i.next(k,v)) {
+				if (v->expires <= now)
+					vcs.erase(*k);
+			}
+		}
+	}
+}
+
+bool Topology::verifyIdentity(const Identity &id,unsigned char *key)
+{
+	{
+		Mutex::Lock _l(_verifiedIdentities_m);
+		_VerifiedIdentity *const vi = _verifiedIdentities.get(id.address());
+		if ((vi)&&(vi->id == id)) {
+			memcpy(key,vi->key,ZT_PEER_SECRET_KEY_LENGTH);
+			return true;
+		}
+		_VerifiedIdentity *const ovi = _verifiedIdentitiesOld.get(id.address());
+		if ((ovi)&&(ovi->id == id)) {
+			memcpy(key,ovi->key,ZT_PEER_SECRET_KEY_LENGTH);
+			_verifiedIdentitiesOld.erase(id.address());
+			_cacheVerifiedIdentity(id,key);
+			return true;
 		}
+		if (std::find(_verifyingIdentities.begin(),_verifyingIdentities.end(),id) != _verifyingIdentities.end())
+			return false;
+		_verifyingIdentities.push_back(id);
+	}
+
+	// Expensive part is done without holding the lock so that different
+	// identities can be validated at the same time.
+	const bool valid = ((id.locallyValidate())&&(RR->identity.agree(id,key,ZT_PEER_SECRET_KEY_LENGTH)));
+
+	Mutex::Lock _l(_verifiedIdentities_m);
+	std::vector< Identity >::iterator v(std::find(_verifyingIdentities.begin(),_verifyingIdentities.end(),id));
+	if (v != _verifyingIdentities.end())
+		_verifyingIdentities.erase(v);
+	if (valid)
+		_cacheVerifiedIdentity(id,key);
+	return valid;
+}
+
+int Topology::verifyCertificateOfMembership(const CertificateOfMembership &com)
+{
+	if (!com.isSigned())
+		return 0;
+
+	_VerifiedComKey k;
+	{
+		// Hash everything, not just the signature, since the signature is
+		// only meaningful together with what was signed.
+		Buffer<ZT_PROTO_MAX_PACKET_LENGTH> tmp;
+		com.serialize(tmp);
+		unsigned char digest[64];
+		SHA512::hash(digest,tmp.data(),tmp.size());
+		k.nwid = com.networkId();
+		k.issuedTo = com.issuedTo().toInt();
+		memcpy(k.digest,digest,sizeof(k.digest));
+	}
+
+	const uint64_t now = RR->node->now();
+	{
+		Mutex::Lock _l(_verifiedComs_m);
+		_VerifiedCom *const vc = _verifiedComs.get(k);
+		if ((vc)&&(vc->expires > now)) {
+			++_verifiedComHits;
+			return 1;
+		}
+		_VerifiedCom *const ovc = _verifiedComsOld.get(k);
+		if ((ovc)&&(ovc->expires > now)) {
+			const uint64_t expires = ovc->expires;
+			_verifiedComsOld.erase(k);
+			_cacheVerifiedCom(k,expires);
+			++_verifiedComHits;
+			return 1;
+		}
+	}
+
+	// Only a miss needs the signer's identity
+	if (com.signedBy() == RR->identity.address()) {
+		if (!com.verify(RR->identity))
+			return 0;
+	} else {
+		SharedPtr<Peer> signer(getPeer(com.signedBy()));
+		if (!signer)
+			return -1;
+		if (!com.verify(signer->identity()))
+			return 0;
+	}
+
+	// Keep the result while the certificate could still agree with others: up
+	// to revision + maxDelta, but never longer than maxDelta from our clock in
+	// case the controller's clock is ahead, and at least one autoconf period in
+	// case it's behind.
+	uint64_t expires = com.revision() + com.revisionMaxDelta();
+	if (expires > (now + com.revisionMaxDelta()))
+		expires = now + com.revisionMaxDelta();
+	if (expires < (now + ZT_NETWORK_AUTOCONF_DELAY))
+		expires = now + ZT_NETWORK_AUTOCONF_DELAY;
+
+	Mutex::Lock _l(_verifiedComs_m);
+	++_verifiedComMisses;
+	_cacheVerifiedCom(k,expires);
+	return 1;
+}
+
+void Topology::_cacheVerifiedIdentity(const Identity &id,const unsigned char *key)
+{
+	// Caller must hold _verifiedIdentities_m
+	if ((_verifiedIdentities.size() >= (ZT_VERIFIED_IDENTITY_CACHE_SIZE / 2))&&(!_verifiedIdentities.contains(id.address()))) {
+		_verifiedIdentitiesOld.swap(_verifiedIdentities);
+		_verifiedIdentities.clear();
+	}
+	_VerifiedIdentity &vi = _verifiedIdentities[id.address()];
+	vi.id = id;
+	memcpy(vi.key,key,ZT_PEER_SECRET_KEY_LENGTH);
+}
+
+void Topology::_cacheVerifiedCom(const _VerifiedComKey &k,uint64_t expires)
+{
+	// Caller must hold _verifiedComs_m
+	if ((_verifiedComs.size() >= (ZT_VERIFIED_COM_CACHE_SIZE / 2))&&(!_verifiedComs.contains(k))) {
+		_verifiedComsOld.swap(_verifiedComs);
+		_verifiedComs.clear();
 	}
+	_verifiedComs[k].expires = expires;
 }
 
 Identity Topology::_getIdentity(const Address &zta)
@@ -339,7 +489,7 @@ Identity Topology::_getIdentity(const Address &zta)
 
 void Topology::_setWorld(const World &newWorld)
 {
-	// assumed _lock is locked (or in constructor)
+	// assumed _lock is locked (or in constructor), peer shards are locked here as needed
 	_world = newWorld;
 	_amRoot = false;
 	_rootAddresses.clear();
@@ -349,12 +499,14 @@ void Topology::_setWorld(const World &newWorld)
 		if (r->identity.address() == RR->identity.address()) {
 			_amRoot = true;
 		} else {
-			SharedPtr<Peer> *rp = _peers.get(r->identity.address());
+			_PeerShard &ps = _peerShard(r->identity.address());
+			Mutex::Lock _l(ps.lock);
+			SharedPtr<Peer> *rp = ps.peers.get(r->identity.address());
 			if (rp) {
 				_rootPeers.push_back(*rp);
 			} else {
 				SharedPtr<Peer> newrp(new Peer(RR,RR->identity,r->identity));
-				_peers.set(r->identity.address(),newrp);
+				ps.peers.set(r->identity.address(),newrp);
 				_rootPeers.push_back(newrp);
 			}
 		}
@@ -32,6 +32,7 @@
 
 #include "Address.hpp"
 #include "Identity.hpp"
+#include "CertificateOfMembership.hpp"
 #include "Peer.hpp"
 #include "Mutex.hpp"
 #include "InetAddress.hpp"
@@ -44,6 +45,12 @@ class RuntimeEnvironment;
 
 /**
  * Database of network topology
+ *
+ * Peers are kept in ZT_TOPOLOGY_PEER_SHARDS independently locked shards
+ * keyed by address, so lookups for different peers from different threads
+ * do not serialize on one lock. The world definition, root list, and trusted
+ * paths are guarded by a separate lock. That lock may be held while taking a
+ * shard lock, but never the reverse.
  */
 class Topology
 {
@@ -82,8 +89,9 @@ public:
 	 */
 	inline SharedPtr<Peer> getPeerNoCache(const Address &zta)
 	{
-		Mutex::Lock _l(_lock);
-		const SharedPtr<Peer> *const ap = _peers.get(zta);
+		_PeerShard &ps = _peerShard(zta);
+		Mutex::Lock _l(ps.lock);
+		const SharedPtr<Peer> *const ap = ps.peers.get(zta);
 		if (ap)
 			return *ap;
 		return SharedPtr<Peer>();
@@ -107,6 +115,49 @@ public:
 	 */
 	void saveIdentity(const Identity &id);
 
+	/**
+	 * Validate an identity learned from the network and agree on a key with it
+	 *
+	 * Validation runs the identity's memory-hard proof of work check, so the
+	 * result is cached by address and public key. Repeated calls for the same
+	 * identity are cheap, and calls for different identities on different
+	 * threads run in parallel. If another thread is already validating this
+	 * same identity, this returns false immediately instead of repeating the
+	 * work. A different identity claiming the same address is validated on
+	 * its own, so it can't get the real one dropped.
+	 *
+	 * @param id Identity to validate
+	 * @param key Buffer to fill with agreed key (ZT_PEER_SECRET_KEY_LENGTH bytes)
+	 * @return True if identity is valid and key was filled
+	 */
+	bool verifyIdentity(const Identity &id,unsigned char *key);
+
+	/**
+	 * Check a certificate of membership's signature against its signer
+	 *
+	 * Results are cached node-wide by network ID, recipient, and a hash of
+	 * the whole certificate until the certificate's revision window has passed.
+	 * The cache is checked before anything else, so a certificate seen before
+	 * is accepted without its signer's identity or its Peer's stored COM, e.g.
+	 * when a peer alternates between two revisions or is forgotten and
+	 * re-learned.
+	 *
+	 * @param com Certificate of membership
+	 * @return 1 if signature is valid, 0 if not, -1 if the signer's identity isn't known yet
+	 */
+	int verifyCertificateOfMembership(const CertificateOfMembership &com);
+
+	/**
+	 * @param hits Filled with number of COM signature checks answered from cache
+	 * @param misses Filled with number of COM signature checks actually computed
+	 */
+	inline void verifiedComCacheCounters(uint64_t &hits,uint64_t &misses) const
+	{
+		Mutex::Lock _l(_verifiedComs_m);
+		hits = _verifiedComHits;
+		misses = _verifiedComMisses;
+	}
+
 	/**
 	 * Get the current favorite root server
 	 *
@@ -198,12 +249,15 @@ public:
 	inline unsigned long countActive(uint64_t now) const
 	{
 		unsigned long cnt = 0;
-		Mutex::Lock _l(_lock);
-		Hashtable< Address,SharedPtr<Peer> >::Iterator i(const_cast<Topology *>(this)->_peers);
-		Address *a = (Address *)0;
-		SharedPtr<Peer> *p = (SharedPtr<Peer> *)0;
-		while (i.next(a,p)) {
-			cnt += (unsigned long)((*p)->hasActiveDirectPath(now));
+		for(unsigned int s=0;s<ZT_TOPOLOGY_PEER_SHARDS;++s) {
+			_PeerShard &ps = const_cast<Topology *>(this)->_peerShards[s];
+			Mutex::Lock _l(ps.lock);
+			Hashtable< Address,SharedPtr<Peer> >::Iterator i(ps.peers);
+			Address *a = (Address *)0;
+			SharedPtr<Peer> *p = (SharedPtr<Peer> *)0;
+			while (i.next(a,p)) {
+				cnt += (unsigned long)((*p)->hasActiveDirectPath(now));
+			}
 		}
 		return cnt;
 	}
@@ -214,9 +268,9 @@ public:
 	 * Note: explicitly template this by reference if you want the object
 	 * passed by reference instead of copied.
 	 *
-	 * Warning: be careful not to use features in these that call any other
-	 * methods of Topology that may lock _lock, otherwise a recursive lock
-	 * and deadlock or lock corruption may occur.
+	 * Each shard's peers are copied out and its lock released before the
+	 * function is applied, so the function may call other Topology methods
+	 * or send packets. Peers added while this runs may or may not be seen.
 	 *
 	 * @param f Function to apply
 	 * @tparam F Function or function object type
@@ -224,18 +278,26 @@ public:
 	template<typename F>
 	inline void eachPeer(F f)
 	{
-		Mutex::Lock _l(_lock);
-		Hashtable< Address,SharedPtr<Peer> >::Iterator i(_peers);
-		Address *a = (Address *)0;
-		SharedPtr<Peer> *p = (SharedPtr<Peer> *)0;
-		while (i.next(a,p)) {
+		std::vector< SharedPtr<Peer> > sp;
+		for(unsigned int s=0;s<ZT_TOPOLOGY_PEER_SHARDS;++s) {
+			sp.clear();
+			{
+				Mutex::Lock _l(_peerShards[s].lock);
+				Hashtable< Address,SharedPtr<Peer> >::Iterator i(_peerShards[s].peers);
+				Address *a = (Address *)0;
+				SharedPtr<Peer> *p = (SharedPtr<Peer> *)0;
+				while (i.next(a,p)) {
 #ifdef ZT_TRACE
-			if (!(*p)) {
-				fprintf(stderr,"FATAL BUG: eachPeer() caught NULL peer for %s -- peer pointers in Topology should NEVER be NULL" ZT_EOL_S,a->toString().c_str());
-				abort();
-			}
+					if (!(*p)) {
+						fprintf(stderr,"FATAL BUG: eachPeer() caught NULL peer for %s -- peer pointers in Topology should NEVER be NULL" ZT_EOL_S,a->toString().c_str());
+						abort();
+					}
 #endif
-			f(*this,*((const SharedPtr<Peer> *)p));
+					sp.push_back(*p);
+				}
+			}
+			for(std::vector< SharedPtr<Peer> >::const_iterator p(sp.begin());p!=sp.end();++p)
+				f(*this,*p);
 		}
 	}
 
@@ -244,8 +306,13 @@ public:
 	 */
 	inline std::vector< std::pair< Address,SharedPtr<Peer> > > allPeers() const
 	{
-		Mutex::Lock _l(_lock);
-		return _peers.entries();
+		std::vector< std::pair< Address,SharedPtr<Peer> > > all;
+		for(unsigned int s=0;s<ZT_TOPOLOGY_PEER_SHARDS;++s) {
+			Mutex::Lock _l(_peerShards[s].lock);
+			std::vector< std::pair< Address,SharedPtr<Peer> > > e(_peerShards[s].peers.entries());
+			all.insert(all.end(),e.begin(),e.end());
+		}
+		return all;
 	}
 
 	/**
@@ -303,6 +370,41 @@ public:
 	}
 
 private:
+	struct _PeerShard
+	{
+		Hashtable< Address,SharedPtr<Peer> > peers;
+		Mutex lock;
+	};
+
+	// Addresses are hashes of identities, so any byte is fine for picking a shard
+	inline _PeerShard &_peerShard(const Address &a) { return _peerShards[(unsigned long)(a.toInt() >> 32) % ZT_TOPOLOGY_PEER_SHARDS]; }
+
+	struct _VerifiedIdentity
+	{
+		~_VerifiedIdentity() { Utils::burn(key,sizeof(key)); }
+		Identity id;
+		unsigned char key[ZT_PEER_SECRET_KEY_LENGTH];
+	};
+
+	struct _VerifiedComKey
+	{
+		_VerifiedComKey() : nwid(0),issuedTo(0) { memset(digest,0,sizeof(digest)); }
+		inline unsigned long hashCode() const { return (unsigned long)(digest[0] ^ nwid ^ issuedTo); }
+		inline bool operator==(const _VerifiedComKey &k) const { return ((nwid == k.nwid)&&(issuedTo == k.issuedTo)&&(memcmp(digest,k.digest,sizeof(digest)) == 0)); }
+		inline bool operator!=(const _VerifiedComKey &k) const { return (!(*this == k)); }
+		uint64_t nwid;
+		uint64_t issuedTo;
+		uint64_t digest[4]; // first 256 bits of SHA-512 over serialized COM including signature
+	};
+
+	struct _VerifiedCom
+	{
+		_VerifiedCom() : expires(0) {}
+		uint64_t expires;
+	};
+
+	void _cacheVerifiedIdentity(const Identity &id,const unsigned char *key);
+	void _cacheVerifiedCom(const _VerifiedComKey &k,uint64_t expires);
 	Identity _getIdentity(const Address &zta);
 	void _setWorld(const World &newWorld);
 
@@ -312,12 +414,26 @@ private:
 	InetAddress _trustedPathNetworks[ZT_MAX_TRUSTED_PATHS];
 	unsigned int _trustedPathCount;
 	World _world;
-	Hashtable< Address,SharedPtr<Peer> > _peers;
+	_PeerShard _peerShards[ZT_TOPOLOGY_PEER_SHARDS];
 	std::vector< Address > _rootAddresses;
 	std::vector< SharedPtr<Peer> > _rootPeers;
 	bool _amRoot;
 
-	Mutex _lock;
+	Mutex _lock; // world, roots, and trusted paths (not peers)
+
+	// Two generations: when the new one is half the cache size the old one is
+	// dropped, and hits in the old one move back to the new one.
+	Hashtable< Address,_VerifiedIdentity > _verifiedIdentities;
+	Hashtable< Address,_VerifiedIdentity > _verifiedIdentitiesOld;
+	std::vector< Identity > _verifyingIdentities; // validation in progress on some thread
+	Mutex _verifiedIdentities_m;
+
+	// Two generations like _verifiedIdentities
+	Hashtable< _VerifiedComKey,_VerifiedCom > _verifiedComs;
+	Hashtable< _VerifiedComKey,_VerifiedCom > _verifiedComsOld;
+	uint64_t _verifiedComHits;
+	uint64_t _verifiedComMisses;
+	Mutex _verifiedComs_m;
 };
 
 } // namespace ZeroTier
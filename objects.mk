@@ -3,6 +3,7 @@ OBJS=\
 	node/CertificateOfMembership.o \
 	node/Cluster.o \
 	node/DeferredPackets.o \
+	node/FlowRules.o \
 	node/Identity.o \
 	node/IncomingPacket.o \
 	node/InetAddress.o \
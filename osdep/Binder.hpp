@@ -63,6 +63,22 @@
  */
 #define ZT_BINDER_REFRESH_PERIOD 30000
 
+/**
+ * Maximum number of UDP packets one thread stages for batched sending
+ */
+#define ZT_BINDER_SEND_BATCH_SIZE 64
+
+/**
+ * Maximum size of a staged UDP packet (larger packets are sent immediately)
+ */
+#define ZT_BINDER_SEND_BATCH_MAX_PACKET 2048
+
+#if defined(_WIN32) || defined(_WIN64)
+#define ZT_BINDER_THREAD_LOCAL __declspec(thread)
+#else
+#define ZT_BINDER_THREAD_LOCAL __thread
+#endif
+
 namespace ZeroTier {
 
 /**
@@ -84,15 +100,61 @@ private:
 		_Binding() :
 			udpSock((PhySocket *)0),
 			tcpListenSock((PhySocket *)0),
-			address() {}
+			address(),
+			sendFailed(false) {}
 
 		PhySocket *udpSock;
 		PhySocket *tcpListenSock;
 		InetAddress address;
+		bool sendFailed; // staged packets were lost, so send at once until a send succeeds
+	};
+
+	struct _StagedPacket
+	{
+		Binder *binder;
+		PhySocket *udpSock;
+		InetAddress remote;
+		unsigned int len;
+		char data[ZT_BINDER_SEND_BATCH_MAX_PACKET];
 	};
 
 public:
-	Binder() {}
+	/**
+	 * Outgoing UDP packets staged by one thread
+	 *
+	 * Each thread that batches its sends owns one of these and hands it to
+	 * beginSendBatch() and flushSendBatch(). In between, that thread's calls
+	 * to udpSend() on any Binder stage into it, so threads never flush or end
+	 * each other's batches.
+	 */
+	class SendBatch : NonCopyable
+	{
+		friend class Binder;
+	public:
+		SendBatch() : _queue((_StagedPacket *)0),_size(0) {}
+		~SendBatch() { delete [] _queue; }
+	private:
+		_StagedPacket *_queue; // allocated on first beginSendBatch()
+		unsigned int _size;
+	};
+
+	Binder() :
+		_reusePort(false) {}
+
+	/**
+	 * Bind future UDP sockets with SO_REUSEPORT
+	 *
+	 * Every Binder sharing a port must set this before its first refresh().
+	 * The kernel then hashes incoming flows across their sockets, which lets
+	 * several threads each receive on their own socket.
+	 *
+	 * @param rp If true, set SO_REUSEPORT on UDP sockets bound by refresh()
+	 */
+	inline void setReusePort(bool rp)
+	{
+		Mutex::Lock _l(_lock);
+		_reusePort = rp;
+	}
 
 	/**
 	 * Close all bound ports
@@ -217,7 +279,7 @@ public:
 			}
 
 			if (bi == _bindings.end()) {
-				udps = phy.udpBind(reinterpret_cast<const struct sockaddr *>(&(ii->first)),(void *)0,ZT_UDP_DESIRED_BUF_SIZE);
+				udps = phy.udpBind(reinterpret_cast<const struct sockaddr *>(&(ii->first)),(void *)0,ZT_UDP_DESIRED_BUF_SIZE,_reusePort);
 				if (udps) {
 					//tcps = phy.tcpListen(reinterpret_cast<const struct sockaddr *>(&ii),(void *)0);
 					//if (tcps) {
@@ -268,43 +330,90 @@ public:
 	 * In any case on most hosts there's only one or two interfaces that we
 	 * will use, so none of this is particularly costly.
 	 *
+	 * Between beginSendBatch() and flushSendBatch() the calling thread's packets
+	 * are staged rather than sent, except for packets with a TTL override or
+	 * DF, packets too big to stage, and packets from a socket whose staged
+	 * packets were lost. Those are sent at once but only after this Binder's
+	 * staged packets, so nothing overtakes a packet staged earlier.
+	 *
 	 * @param local Local interface address or null address for 'all'
 	 * @param remote Remote address
 	 * @param data Data to send
 	 * @param len Length of data
 	 * @param v4ttl If non-zero, send this packet with the specified IP TTL (IPv4 only)
+	 * @param dontFragment If true, send with DF set, or not at all if DF can't be set
+	 * @return True if sent or staged
 	 */
 	template<typename PHY_HANDLER_TYPE>
-	inline bool udpSend(Phy<PHY_HANDLER_TYPE> &phy,const InetAddress &local,const InetAddress &remote,const void *data,unsigned int len,unsigned int v4ttl = 0) const
+	inline bool udpSend(Phy<PHY_HANDLER_TYPE> &phy,const InetAddress &local,const InetAddress &remote,const void *data,unsigned int len,unsigned int v4ttl = 0,bool dontFragment = false)
 	{
+		SendBatch *const batch = _threadBatch();
 		Mutex::Lock _l(_lock);
 		if (local) {
-			for(typename std::vector<_Binding>::const_iterator i(_bindings.begin());i!=_bindings.end();++i) {
-				if (i->address == local) {
-					if ((v4ttl)&&(local.ss_family == AF_INET))
-						phy.setIp4UdpTtl(i->udpSock,v4ttl);
-					const bool result = phy.udpSend(i->udpSock,reinterpret_cast<const struct sockaddr *>(&remote),data,len);
-					if ((v4ttl)&&(local.ss_family == AF_INET))
-						phy.setIp4UdpTtl(i->udpSock,255);
-					return result;
-				}
+			for(typename std::vector<_Binding>::iterator i(_bindings.begin());i!=_bindings.end();++i) {
+				if (i->address == local)
+					return _udpSend(phy,batch,*i,remote,data,len,v4ttl,dontFragment);
 			}
 			return false;
 		} else {
 			bool result = false;
-			for(typename std::vector<_Binding>::const_iterator i(_bindings.begin());i!=_bindings.end();++i) {
-				if (i->address.ss_family == remote.ss_family) {
-					if ((v4ttl)&&(remote.ss_family == AF_INET))
-						phy.setIp4UdpTtl(i->udpSock,v4ttl);
-					result |= phy.udpSend(i->udpSock,reinterpret_cast<const struct sockaddr *>(&remote),data,len);
-					if ((v4ttl)&&(remote.ss_family == AF_INET))
-						phy.setIp4UdpTtl(i->udpSock,255);
-				}
+			for(typename std::vector<_Binding>::iterator i(_bindings.begin());i!=_bindings.end();++i) {
+				if (i->address.ss_family == remote.ss_family)
+					result |= _udpSend(phy,batch,*i,remote,data,len,v4ttl,dontFragment);
 			}
 			return result;
 		}
 	}
 
+	/**
+	 * Begin staging the calling thread's packets sent with udpSend()
+	 *
+	 * @param batch Batch owned by the calling thread
+	 */
+	static inline void beginSendBatch(SendBatch &batch)
+	{
+		if (!batch._queue) {
+			try {
+				batch._queue = new _StagedPacket[ZT_BINDER_SEND_BATCH_SIZE];
+			} catch ( ... ) {
+				return; // leave batching disabled
+			}
+		}
+		_threadBatch() = &batch;
+	}
+
+	/**
+	 * Send all of the calling thread's staged packets and stop staging
+	 *
+	 * Consecutive packets from the same socket go out with as few system
+	 * calls as the platform allows. Packets staged on a socket that has since
+	 * been closed are dropped. A socket that loses packets here sends at once
+	 * from then on until a send succeeds, so persistent errors reach callers
+	 * of udpSend().
+	 *
+	 * @param phy Physical interface of every Binder the batch was staged on
+	 * @param batch Batch passed to beginSendBatch()
+	 * @return Number of staged packets that were not sent
+	 */
+	template<typename PHY_HANDLER_TYPE>
+	static inline unsigned int flushSendBatch(Phy<PHY_HANDLER_TYPE> &phy,SendBatch &batch)
+	{
+		_threadBatch() = (SendBatch *)0;
+		unsigned int failed = 0;
+		unsigned int i = 0;
+		while (i < batch._size) {
+			Binder *const binder = batch._queue[i].binder;
+			unsigned int n = 1;
+			while (((i + n) < batch._size)&&(batch._queue[i + n].binder == binder))
+				++n;
+			Mutex::Lock _l(binder->_lock);
+			failed += binder->_sendStaged(phy,batch._queue + i,n);
+			i += n;
+		}
+		batch._size = 0;
+		return failed;
+	}
+
 	/**
 	 * @return All currently bound local interface addresses
 	 */
@@ -318,7 +427,118 @@ public:
 	}
 
 private:
+	// Batch the calling thread is staging into, if any
+	static inline SendBatch *&_threadBatch()
+	{
+		static ZT_BINDER_THREAD_LOCAL SendBatch *b = (SendBatch *)0;
+		return b;
+	}
+
+	// Must be called with _lock held
+	template<typename PHY_HANDLER_TYPE>
+	inline bool _udpSend(Phy<PHY_HANDLER_TYPE> &phy,SendBatch *batch,_Binding &b,const InetAddress &remote,const void *data,unsigned int len,unsigned int v4ttl,bool dontFragment)
+	{
+		if (remote.ss_family != AF_INET)
+			v4ttl = 0;
+
+		if ((batch)&&(batch->_queue)) {
+			if ((!v4ttl)&&(!dontFragment)&&(!b.sendFailed)&&(len <= ZT_BINDER_SEND_BATCH_MAX_PACKET)) {
+				if (batch->_size >= ZT_BINDER_SEND_BATCH_SIZE)
+					_sendOwnStaged(phy,*batch);
+				if (batch->_size < ZT_BINDER_SEND_BATCH_SIZE) {
+					_StagedPacket &sp = batch->_queue[batch->_size++];
+					sp.binder = this;
+					sp.udpSock = b.udpSock;
+					sp.remote = remote;
+					sp.len = len;
+					memcpy(sp.data,data,len);
+					return true;
+				}
+			} else {
+				_sendOwnStaged(phy,*batch);
+			}
+		}
+
+		if (dontFragment) {
+			// DF is cleared again before anything else can be sent from this socket
+			int previous = 0;
+			if (!phy.setUdpDontFragment(b.udpSock,previous))
+				return false;
+			const bool result = phy.udpSend(b.udpSock,reinterpret_cast<const struct sockaddr *>(&remote),data,len);
+			phy.restoreUdpFragmentation(b.udpSock,previous);
+			return result;
+		}
+
+		bool result;
+		if (v4ttl) {
+			phy.setIp4UdpTtl(b.udpSock,v4ttl);
+			result = phy.udpSend(b.udpSock,reinterpret_cast<const struct sockaddr *>(&remote),data,len);
+			phy.setIp4UdpTtl(b.udpSock,255);
+		} else {
+			result = phy.udpSend(b.udpSock,reinterpret_cast<const struct sockaddr *>(&remote),data,len);
+		}
+		if (result)
+			b.sendFailed = false;
+		return result;
+	}
+
+	// Must be called with _lock held; sends this Binder's packets from a batch now and keeps the rest
+	template<typename PHY_HANDLER_TYPE>
+	inline void _sendOwnStaged(Phy<PHY_HANDLER_TYPE> &phy,SendBatch &batch)
+	{
+		unsigned int i = 0,k = 0;
+		while (i < batch._size) {
+			if (batch._queue[i].binder == this) {
+				unsigned int n = 1;
+				while (((i + n) < batch._size)&&(batch._queue[i + n].binder == this))
+					++n;
+				_sendStaged(phy,batch._queue + i,n);
+				i += n;
+			} else {
+				if (k != i)
+					batch._queue[k] = batch._queue[i];
+				++k;
+				++i;
+			}
+		}
+		batch._size = k;
+	}
+
+	// Must be called with _lock held; consecutive packets from the same socket go out together
+	template<typename PHY_HANDLER_TYPE>
+	inline unsigned int _sendStaged(Phy<PHY_HANDLER_TYPE> &phy,const _StagedPacket *staged,unsigned int count)
+	{
+		PhyDatagram dg[ZT_BINDER_SEND_BATCH_SIZE];
+		unsigned int failed = 0;
+		unsigned int i = 0;
+		while (i < count) {
+			PhySocket *const udpSock = staged[i].udpSock;
+			unsigned int n = 0;
+			while ((i < count)&&(staged[i].udpSock == udpSock)) {
+				dg[n].addr = reinterpret_cast<const struct sockaddr *>(&(staged[i].remote));
+				dg[n].data = const_cast<char *>(staged[i].data);
+				dg[n].len = staged[i].len;
+				++n;
+				++i;
+			}
+			typename std::vector<_Binding>::iterator b(_bindings.begin());
+			while ((b != _bindings.end())&&(b->udpSock != udpSock))
+				++b;
+			if (b == _bindings.end()) {
+				failed += n; // closed by refresh() or closeAll() since being staged
+			} else {
+				const unsigned int sent = phy.udpSendBatch(udpSock,dg,n);
+				if (sent < n) {
+					b->sendFailed = true;
+					failed += n - sent;
+				}
+			}
+		}
+		return failed;
+	}
+
 	std::vector<_Binding> _bindings;
+	bool _reusePort;
 	Mutex _lock;
 };
 
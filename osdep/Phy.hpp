@@ -59,18 +59,52 @@
 #ifndef IPV6_DONTFRAG
 #define IPV6_DONTFRAG 62
 #endif
+#if defined(MSG_WAITFORONE) && !defined(ZT_PHY_NO_RECVMMSG)
+#define ZT_PHY_HAVE_RECVMMSG 1
+#endif
+#if defined(MSG_WAITFORONE) && !defined(ZT_PHY_NO_SENDMMSG)
+#define ZT_PHY_HAVE_SENDMMSG 1
+#endif
+#ifndef ZT_PHY_NO_EPOLL
+#define ZT_PHY_USE_EPOLL 1
+#include <sys/epoll.h>
+#endif
 #endif
 
 #define ZT_PHY_SOCKFD_TYPE int
 #define ZT_PHY_SOCKFD_NULL (-1)
 #define ZT_PHY_SOCKFD_VALID(s) ((s) > -1)
 #define ZT_PHY_CLOSE_SOCKET(s) ::close(s)
+#ifdef ZT_PHY_USE_EPOLL
+#define ZT_PHY_MAX_SOCKETS 0x7fffffff
+#else
 #define ZT_PHY_MAX_SOCKETS (FD_SETSIZE)
+#endif
 #define ZT_PHY_MAX_INTERCEPTS ZT_PHY_MAX_SOCKETS
 #define ZT_PHY_SOCKADDR_STORAGE_TYPE struct sockaddr_storage
 
 #endif // Windows or not
 
+/**
+ * Maximum number of UDP datagrams to receive per recvmmsg() call
+ */
+#define ZT_PHY_UDP_RECV_BATCH_SIZE 32
+
+/**
+ * Size of each preallocated batch receive buffer (larger datagrams are dropped)
+ */
+#define ZT_PHY_UDP_RECV_BATCH_BUF_SIZE 16384
+
+/**
+ * Maximum number of UDP datagrams to send per sendmmsg() call
+ */
+#define ZT_PHY_UDP_SEND_BATCH_SIZE 64
+
+/**
+ * Maximum number of events to fetch per epoll_wait() call
+ */
+#define ZT_PHY_EPOLL_MAX_EVENTS 256
+
 namespace ZeroTier {
 
 /**
@@ -78,6 +112,16 @@ namespace ZeroTier {
  */
 typedef void PhySocket;
 
+/**
+ * A UDP datagram for batched receive (phyOnDatagramBatch()) or send (udpSendBatch())
+ */
+struct PhyDatagram
+{
+	const struct sockaddr *addr; // source on receive, destination on send
+	void *data;
+	unsigned long len;
+};
+
 /**
  * Simple templated non-blocking sockets implementation
  *
@@ -104,6 +148,14 @@ typedef void PhySocket;
  * phyOnUnixData(PhySocket *sock,void **uptr,void *data,unsigned long len)
  * phyOnUnixWritable(PhySocket *sock,void **uptr)
  *
+ * On Linux only, where UDP sockets are drained with recvmmsg():
+ *
+ * phyOnDatagramBatch(PhySocket *sock,void **uptr,const struct sockaddr *localAddr,const PhyDatagram *datagrams,unsigned int count)
+ *
+ * The batch handler receives up to ZT_PHY_UDP_RECV_BATCH_SIZE datagrams
+ * at once and is called instead of phyOnDatagram() for UDP sockets. The
+ * data and addresses it points to are only valid until it returns.
+ *
  * These templates typically refer to function objects. Templates are used to
  * avoid the call overhead of indirection, which is surprisingly high for high
  * bandwidth applications pushing a lot of packets.
@@ -122,6 +174,12 @@ typedef void PhySocket;
  * handler, and in that case close() can be told not to call handlers to
  * prevent recursion.
  *
+ * On Linux this uses epoll, which has no limit on the number of sockets
+ * and dispatches only sockets that are ready. Sockets created by Phy<> are
+ * edge-triggered and drained on each event, while Unix domain and wrapped
+ * sockets remain level-triggered. Define ZT_PHY_NO_EPOLL to use select()
+ * as on all other platforms.
+ *
  * This isn't thread-safe with the exception of whack(), which is safe to
  * call from another thread to abort poll().
  */
@@ -150,15 +208,23 @@ private:
 		ZT_PHY_SOCKFD_TYPE sock;
 		void *uptr; // user-settable pointer
 		ZT_PHY_SOCKADDR_STORAGE_TYPE saddr; // remote for TCP_OUT and TCP_IN, local for TCP_LISTEN, RAW, and UDP
+#ifdef ZT_PHY_USE_EPOLL
+		uint32_t events; // current epoll interest set
+#endif
 	};
 
 	std::list<PhySocketImpl> _socks;
+#ifdef ZT_PHY_USE_EPOLL
+	int _epfd;
+	bool _haveClosedSocks;
+#else
 	fd_set _readfds;
 	fd_set _writefds;
 #if defined(_WIN32) || defined(_WIN64)
 	fd_set _exceptfds;
 #endif
 	long _nfds;
+#endif
 
 	ZT_PHY_SOCKFD_TYPE _whackReceiveSocket;
 	ZT_PHY_SOCKFD_TYPE _whackSendSocket;
@@ -166,6 +232,15 @@ private:
 	bool _noDelay;
 	bool _noCheck;
 
+#ifdef ZT_PHY_HAVE_RECVMMSG
+	// Preallocated receive ring for recvmmsg(), allocated on first udpBind()
+	char *_udpRecvBuf;
+	struct mmsghdr _udpRecvMsgs[ZT_PHY_UDP_RECV_BATCH_SIZE];
+	struct iovec _udpRecvIov[ZT_PHY_UDP_RECV_BATCH_SIZE];
+	struct sockaddr_storage _udpRecvFrom[ZT_PHY_UDP_RECV_BATCH_SIZE];
+	PhyDatagram _udpRecvDatagrams[ZT_PHY_UDP_RECV_BATCH_SIZE];
+#endif
+
 public:
 	/**
 	 * @param handler Pointer of type HANDLER_PTR_TYPE to handler
@@ -175,8 +250,10 @@ public:
 	Phy(HANDLER_PTR_TYPE handler,bool noDelay,bool noCheck) :
 		_handler(handler)
 	{
+#ifndef ZT_PHY_USE_EPOLL
 		FD_ZERO(&_readfds);
 		FD_ZERO(&_writefds);
+#endif
 
 #if defined(_WIN32) || defined(_WIN64)
 		FD_ZERO(&_exceptfds);
@@ -212,11 +289,29 @@ public:
 			throw std::runtime_error("unable to create pipes for select() abort");
 #endif // Windows or not
 
+#ifdef ZT_PHY_USE_EPOLL
+		_epfd = ::epoll_create(1024);
+		if (_epfd < 0)
+			throw std::runtime_error("unable to create epoll instance");
+		{
+			struct epoll_event ev;
+			memset(&ev,0,sizeof(ev));
+			ev.events = EPOLLIN;
+			ev.data.ptr = (void *)0; // null means the whack pipe
+			::epoll_ctl(_epfd,EPOLL_CTL_ADD,pipes[0],&ev);
+		}
+		_haveClosedSocks = false;
+#else
 		_nfds = (pipes[0] > pipes[1]) ? (long)pipes[0] : (long)pipes[1];
+#endif
 		_whackReceiveSocket = pipes[0];
 		_whackSendSocket = pipes[1];
 		_noDelay = noDelay;
 		_noCheck = noCheck;
+
+#ifdef ZT_PHY_HAVE_RECVMMSG
+		_udpRecvBuf = (char *)0;
+#endif
 	}
 
 	~Phy()
@@ -227,6 +322,12 @@ public:
 		}
 		ZT_PHY_CLOSE_SOCKET(_whackReceiveSocket);
 		ZT_PHY_CLOSE_SOCKET(_whackSendSocket);
+#ifdef ZT_PHY_USE_EPOLL
+		::close(_epfd);
+#endif
+#ifdef ZT_PHY_HAVE_RECVMMSG
+		delete [] _udpRecvBuf;
+#endif
 	}
 
 	/**
@@ -297,14 +398,12 @@ public:
 			return (PhySocket *)0;
 		}
 		PhySocketImpl &sws = _socks.back();
-		if ((long)fd > _nfds)
-			_nfds = (long)fd;
-		FD_SET(fd,&_readfds);
 		sws.type = ZT_PHY_SOCKET_UNIX_IN; /* TODO: Type was changed to allow for CBs with new RPC model */
 		sws.sock = fd;
 		sws.uptr = uptr;
 		memset(&(sws.saddr),0,sizeof(struct sockaddr_storage));
 		// no sockaddr for this socket type, leave saddr null
+		_pollSet(sws,true,false,true);
 		return (PhySocket *)&sws;
 	}
 
@@ -314,13 +413,32 @@ public:
 	 * @param localAddress Local endpoint address and port
 	 * @param uptr Initial value of user pointer associated with this socket (default: NULL)
 	 * @param bufferSize Desired socket receive/send buffer size -- will set as close to this as possible (default: 0, leave alone)
+	 * @param reusePort If true, set SO_REUSEPORT so several sockets may share this address and port where supported (default: false)
 	 * @return Socket or NULL on failure to bind
 	 */
-	inline PhySocket *udpBind(const struct sockaddr *localAddress,void *uptr = (void *)0,int bufferSize = 0)
+	inline PhySocket *udpBind(const struct sockaddr *localAddress,void *uptr = (void *)0,int bufferSize = 0,bool reusePort = false)
 	{
 		if (_socks.size() >= ZT_PHY_MAX_SOCKETS)
 			return (PhySocket *)0;
 
+#ifdef ZT_PHY_HAVE_RECVMMSG
+		if (!_udpRecvBuf) {
+			try {
+				_udpRecvBuf = new char[ZT_PHY_UDP_RECV_BATCH_SIZE * ZT_PHY_UDP_RECV_BATCH_BUF_SIZE];
+			} catch ( ... ) {
+				return (PhySocket *)0;
+			}
+			memset(_udpRecvMsgs,0,sizeof(_udpRecvMsgs));
+			for(unsigned int i=0;i<ZT_PHY_UDP_RECV_BATCH_SIZE;++i) {
+				_udpRecvIov[i].iov_base = (void *)(_udpRecvBuf + (i * ZT_PHY_UDP_RECV_BATCH_BUF_SIZE));
+				_udpRecvIov[i].iov_len = ZT_PHY_UDP_RECV_BATCH_BUF_SIZE;
+				_udpRecvMsgs[i].msg_hdr.msg_name = (void *)&(_udpRecvFrom[i]);
+				_udpRecvMsgs[i].msg_hdr.msg_iov = &(_udpRecvIov[i]);
+				_udpRecvMsgs[i].msg_hdr.msg_iovlen = 1;
+			}
+		}
+#endif
+
 		ZT_PHY_SOCKFD_TYPE s = ::socket(localAddress->sa_family,SOCK_DGRAM,0);
 		if (!ZT_PHY_SOCKFD_VALID(s))
 			return (PhySocket *)0;
@@ -366,6 +484,11 @@ public:
 			}
 			f = 0; setsockopt(s,SOL_SOCKET,SO_REUSEADDR,(void *)&f,sizeof(f));
 			f = 1; setsockopt(s,SOL_SOCKET,SO_BROADCAST,(void *)&f,sizeof(f));
+#ifdef SO_REUSEPORT
+			if (reusePort) {
+				f = 1; setsockopt(s,SOL_SOCKET,SO_REUSEPORT,(void *)&f,sizeof(f));
+			}
+#endif
 #ifdef IP_DONTFRAG
 			f = 0; setsockopt(s,IPPROTO_IP,IP_DONTFRAG,&f,sizeof(f));
 #endif
@@ -402,14 +525,12 @@ public:
 		}
 		PhySocketImpl &sws = _socks.back();
 
-		if ((long)s > _nfds)
-			_nfds = (long)s;
-		FD_SET(s,&_readfds);
 		sws.type = ZT_PHY_SOCKET_UDP;
 		sws.sock = s;
 		sws.uptr = uptr;
 		memset(&(sws.saddr),0,sizeof(struct sockaddr_storage));
 		memcpy(&(sws.saddr),localAddress,(localAddress->sa_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+		_pollSet(sws,true,false,true);
 
 		return (PhySocket *)&sws;
 	}
@@ -432,6 +553,65 @@ public:
 #endif
 	}
 
+	/**
+	 * Set the don't-fragment bit for packets sent from a UDP socket
+	 *
+	 * On Linux this uses IP_PMTUDISC_PROBE, which sets DF without consulting
+	 * or updating the kernel's path MTU cache. A probe that gets lost therefore
+	 * can't shrink what other traffic is allowed to send. Elsewhere it uses
+	 * IP_DONTFRAG or IP_DONTFRAGMENT and IPV6_DONTFRAG where available.
+	 *
+	 * The socket's previous setting is saved so restoreUdpFragmentation() can
+	 * put it back, e.g. so IPv6 sockets keep honoring Packet Too Big.
+	 *
+	 * @param sock UDP socket
+	 * @param previous Filled with the socket's previous setting
+	 * @return True if DF was set, false if unsupported or it failed
+	 */
+	inline bool setUdpDontFragment(PhySocket *sock,int &previous)
+	{
+		PhySocketImpl &sws = *(reinterpret_cast<PhySocketImpl *>(sock));
+		int level = 0,name = 0,value = 0;
+		if (!_udpDontFragmentOption(sws,level,name,value))
+			return false;
+#if defined(_WIN32) || defined(_WIN64)
+		DWORD p = 0;
+		int plen = sizeof(p);
+		if (::getsockopt(sws.sock,level,name,(char *)&p,&plen) != 0)
+			return false;
+		previous = (int)p;
+		DWORD f = (DWORD)value;
+		return (::setsockopt(sws.sock,level,name,(const char *)&f,sizeof(f)) == 0);
+#else
+		int p = 0;
+		socklen_t plen = sizeof(p);
+		if (::getsockopt(sws.sock,level,name,(void *)&p,&plen) != 0)
+			return false;
+		previous = p;
+		return (::setsockopt(sws.sock,level,name,(void *)&value,sizeof(value)) == 0);
+#endif
+	}
+
+	/**
+	 * Put back a UDP socket's fragmentation setting from before setUdpDontFragment()
+	 *
+	 * @param sock UDP socket
+	 * @param previous Setting saved by setUdpDontFragment()
+	 */
+	inline void restoreUdpFragmentation(PhySocket *sock,int previous)
+	{
+		PhySocketImpl &sws = *(reinterpret_cast<PhySocketImpl *>(sock));
+		int level = 0,name = 0,value = 0;
+		if (!_udpDontFragmentOption(sws,level,name,value))
+			return;
+#if defined(_WIN32) || defined(_WIN64)
+		DWORD f = (DWORD)previous;
+		::setsockopt(sws.sock,level,name,(const char *)&f,sizeof(f));
+#else
+		::setsockopt(sws.sock,level,name,(void *)&previous,sizeof(previous));
+#endif
+	}
+
 	/**
 	 * Send a UDP packet
 	 *
@@ -451,6 +631,60 @@ public:
 #endif
 	}
 
+	/**
+	 * Send several UDP packets from the same socket
+	 *
+	 * On Linux this uses sendmmsg() to send up to ZT_PHY_UDP_SEND_BATCH_SIZE
+	 * datagrams per system call. Elsewhere it is equivalent to calling
+	 * udpSend() for each datagram. A datagram that fails to send is skipped
+	 * and does not prevent the rest from being sent.
+	 *
+	 * @param sock UDP socket
+	 * @param datagrams Datagrams with destination addresses
+	 * @param count Number of datagrams
+	 * @return Number of datagrams successfully sent
+	 */
+	inline unsigned int udpSendBatch(PhySocket *sock,const PhyDatagram *datagrams,unsigned int count)
+	{
+#ifdef ZT_PHY_HAVE_SENDMMSG
+		PhySocketImpl &sws = *(reinterpret_cast<PhySocketImpl *>(sock));
+		struct mmsghdr msgs[ZT_PHY_UDP_SEND_BATCH_SIZE];
+		struct iovec iov[ZT_PHY_UDP_SEND_BATCH_SIZE];
+		unsigned int sent = 0;
+		unsigned int i = 0;
+		while (i < count) {
+			const unsigned int n = ((count - i) > ZT_PHY_UDP_SEND_BATCH_SIZE) ? ZT_PHY_UDP_SEND_BATCH_SIZE : (count - i);
+			memset(msgs,0,sizeof(struct mmsghdr) * n);
+			for(unsigned int k=0;k<n;++k) {
+				const PhyDatagram &d = datagrams[i + k];
+				iov[k].iov_base = d.data;
+				iov[k].iov_len = d.len;
+				msgs[k].msg_hdr.msg_name = const_cast<struct sockaddr *>(d.addr);
+				msgs[k].msg_hdr.msg_namelen = (d.addr->sa_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+				msgs[k].msg_hdr.msg_iov = &(iov[k]);
+				msgs[k].msg_hdr.msg_iovlen = 1;
+			}
+			unsigned int k = 0;
+			while (k < n) {
+				const int r = ::sendmmsg(sws.sock,msgs + k,n - k,0);
+				if (r > 0) {
+					sent += (unsigned int)r;
+					k += (unsigned int)r;
+				} else ++k; // skip the datagram that failed, as a failed sendto() would
+			}
+			i += n;
+		}
+		return sent;
+#else
+		unsigned int sent = 0;
+		for(unsigned int i=0;i<count;++i) {
+			if (udpSend(sock,datagrams[i].addr,datagrams[i].data,datagrams[i].len))
+				++sent;
+		}
+		return sent;
+#endif
+	}
+
 #ifdef __UNIX_LIKE__
 	/**
 	 * Listen for connections on a Unix domain socket
@@ -496,14 +730,12 @@ public:
 		}
 		PhySocketImpl &sws = _socks.back();
 
-		if ((long)s > _nfds)
-			_nfds = (long)s;
-		FD_SET(s,&_readfds);
 		sws.type = ZT_PHY_SOCKET_UNIX_LISTEN;
 		sws.sock = s;
 		sws.uptr = uptr;
 		memset(&(sws.saddr),0,sizeof(struct sockaddr_storage));
 		memcpy(&(sws.saddr),&sun,sizeof(struct sockaddr_un));
+		_pollSet(sws,true,false,true);
 
 		return (PhySocket *)&sws;
 	}
@@ -562,14 +794,12 @@ public:
 		}
 		PhySocketImpl &sws = _socks.back();
 
-		if ((long)s > _nfds)
-			_nfds = (long)s;
-		FD_SET(s,&_readfds);
 		sws.type = ZT_PHY_SOCKET_TCP_LISTEN;
 		sws.sock = s;
 		sws.uptr = uptr;
 		memset(&(sws.saddr),0,sizeof(struct sockaddr_storage));
 		memcpy(&(sws.saddr),localAddress,(localAddress->sa_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+		_pollSet(sws,true,false,true);
 
 		return (PhySocket *)&sws;
 	}
@@ -647,22 +877,16 @@ public:
 		}
 		PhySocketImpl &sws = _socks.back();
 
-		if ((long)s > _nfds)
-			_nfds = (long)s;
-		if (connected) {
-			FD_SET(s,&_readfds);
-			sws.type = ZT_PHY_SOCKET_TCP_OUT_CONNECTED;
-		} else {
-			FD_SET(s,&_writefds);
-#if defined(_WIN32) || defined(_WIN64)
-			FD_SET(s,&_exceptfds);
-#endif
-			sws.type = ZT_PHY_SOCKET_TCP_OUT_PENDING;
-		}
+		sws.type = (connected) ? ZT_PHY_SOCKET_TCP_OUT_CONNECTED : ZT_PHY_SOCKET_TCP_OUT_PENDING;
 		sws.sock = s;
 		sws.uptr = uptr;
 		memset(&(sws.saddr),0,sizeof(struct sockaddr_storage));
 		memcpy(&(sws.saddr),remoteAddress,(remoteAddress->sa_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+		_pollSet(sws,connected,!connected,true);
+#if defined(_WIN32) || defined(_WIN64)
+		if (!connected)
+			FD_SET(s,&_exceptfds);
+#endif
 
 		if ((callConnectHandler)&&(connected)) {
 			try {
@@ -810,11 +1034,16 @@ public:
 	inline const void setNotifyWritable(PhySocket *sock,bool notifyWritable)
 	{
 		PhySocketImpl &sws = *(reinterpret_cast<PhySocketImpl *>(sock));
+#ifdef ZT_PHY_USE_EPOLL
+		if ((notifyWritable)||((sws.events & EPOLLOUT) != 0))
+			_pollSet(sws,((sws.events & EPOLLIN) != 0),notifyWritable,false);
+#else
 		if (notifyWritable) {
 			FD_SET(sws.sock,&_writefds);
 		} else {
 			FD_CLR(sws.sock,&_writefds);
 		}
+#endif
 	}
 
 	/**
@@ -830,11 +1059,16 @@ public:
 	inline const void setNotifyReadable(PhySocket *sock,bool notifyReadable)
 	{
 		PhySocketImpl &sws = *(reinterpret_cast<PhySocketImpl *>(sock));
+#ifdef ZT_PHY_USE_EPOLL
+		if ((notifyReadable)||((sws.events & EPOLLIN) != 0))
+			_pollSet(sws,notifyReadable,((sws.events & EPOLLOUT) != 0),false);
+#else
 		if (notifyReadable) {
 			FD_SET(sws.sock,&_readfds);
 		} else {
 			FD_CLR(sws.sock,&_readfds);
 		}
+#endif
 	}
 
 	/**
@@ -848,8 +1082,32 @@ public:
 	 */
 	inline void poll(unsigned long timeout)
 	{
-		char buf[131072];
-		struct sockaddr_storage ss;
+#ifdef ZT_PHY_USE_EPOLL
+		struct epoll_event events[ZT_PHY_EPOLL_MAX_EVENTS];
+		const int n = ::epoll_wait(_epfd,events,ZT_PHY_EPOLL_MAX_EVENTS,(timeout > 0) ? ((timeout < 0x7fffffffUL) ? (int)timeout : 0x7fffffff) : -1);
+
+		for(int i=0;i<n;++i) {
+			PhySocketImpl *const s = reinterpret_cast<PhySocketImpl *>(events[i].data.ptr);
+			if (!s) {
+				char tmp[16];
+				::read(_whackReceiveSocket,tmp,16);
+			} else if (s->type != ZT_PHY_SOCKET_CLOSED) {
+				// Errors and hangups are passed on as readable/writable so the I/O call that follows sees them
+				const uint32_t ev = events[i].events;
+				_handleEvents(*s,((ev & (EPOLLIN|EPOLLERR|EPOLLHUP)) != 0),((ev & (EPOLLOUT|EPOLLERR|EPOLLHUP)) != 0),false);
+			}
+		}
+
+		// Closed sockets are only removed here since events for them may be pending in the batch above
+		if (_haveClosedSocks) {
+			_haveClosedSocks = false;
+			for(typename std::list<PhySocketImpl>::iterator s(_socks.begin());s!=_socks.end();) {
+				if (s->type == ZT_PHY_SOCKET_CLOSED)
+					_socks.erase(s++);
+				else ++s;
+			}
+		}
+#else
 		struct timeval tv;
 		fd_set rfds,wfds,efds;
 
@@ -876,171 +1134,14 @@ public:
 		}
 
 		for(typename std::list<PhySocketImpl>::iterator s(_socks.begin());s!=_socks.end();) {
-			switch (s->type) {
-
-				case ZT_PHY_SOCKET_TCP_OUT_PENDING:
-#if defined(_WIN32) || defined(_WIN64)
-					if (FD_ISSET(s->sock,&efds)) {
-						this->close((PhySocket *)&(*s),true);
-					} else // ... if
-#endif
-					if (FD_ISSET(s->sock,&wfds)) {
-						socklen_t slen = sizeof(ss);
-						if (::getpeername(s->sock,(struct sockaddr *)&ss,&slen) != 0) {
-							this->close((PhySocket *)&(*s),true);
-						} else {
-							s->type = ZT_PHY_SOCKET_TCP_OUT_CONNECTED;
-							FD_SET(s->sock,&_readfds);
-							FD_CLR(s->sock,&_writefds);
-#if defined(_WIN32) || defined(_WIN64)
-							FD_CLR(s->sock,&_exceptfds);
-#endif
-							try {
-								_handler->phyOnTcpConnect((PhySocket *)&(*s),&(s->uptr),true);
-							} catch ( ... ) {}
-						}
-					}
-					break;
-
-				case ZT_PHY_SOCKET_TCP_OUT_CONNECTED:
-				case ZT_PHY_SOCKET_TCP_IN: {
-					ZT_PHY_SOCKFD_TYPE sock = s->sock; // if closed, s->sock becomes invalid as s is no longer dereferencable
-					if (FD_ISSET(sock,&rfds)) {
-						long n = (long)::recv(sock,buf,sizeof(buf),0);
-						if (n <= 0) {
-							this->close((PhySocket *)&(*s),true);
-						} else {
-							try {
-								_handler->phyOnTcpData((PhySocket *)&(*s),&(s->uptr),(void *)buf,(unsigned long)n);
-							} catch ( ... ) {}
-						}
-					}
-					if ((FD_ISSET(sock,&wfds))&&(FD_ISSET(sock,&_writefds))) {
-						try {
-							_handler->phyOnTcpWritable((PhySocket *)&(*s),&(s->uptr));
-						} catch ( ... ) {}
-					}
-				}	break;
-
-				case ZT_PHY_SOCKET_TCP_LISTEN:
-					if (FD_ISSET(s->sock,&rfds)) {
-						memset(&ss,0,sizeof(ss));
-						socklen_t slen = sizeof(ss);
-						ZT_PHY_SOCKFD_TYPE newSock = ::accept(s->sock,(struct sockaddr *)&ss,&slen);
-						if (ZT_PHY_SOCKFD_VALID(newSock)) {
-							if (_socks.size() >= ZT_PHY_MAX_SOCKETS) {
-								ZT_PHY_CLOSE_SOCKET(newSock);
-							} else {
-#if defined(_WIN32) || defined(_WIN64)
-								{ BOOL f = (_noDelay ? TRUE : FALSE); setsockopt(newSock,IPPROTO_TCP,TCP_NODELAY,(char *)&f,sizeof(f)); }
-								{ u_long iMode=1; ioctlsocket(newSock,FIONBIO,&iMode); }
-#else
-								{ int f = (_noDelay ? 1 : 0); setsockopt(newSock,IPPROTO_TCP,TCP_NODELAY,(char *)&f,sizeof(f)); }
-								fcntl(newSock,F_SETFL,O_NONBLOCK);
-#endif
-								_socks.push_back(PhySocketImpl());
-								PhySocketImpl &sws = _socks.back();
-								FD_SET(newSock,&_readfds);
-								if ((long)newSock > _nfds)
-									_nfds = (long)newSock;
-								sws.type = ZT_PHY_SOCKET_TCP_IN;
-								sws.sock = newSock;
-								sws.uptr = (void *)0;
-								memcpy(&(sws.saddr),&ss,sizeof(struct sockaddr_storage));
-								try {
-									_handler->phyOnTcpAccept((PhySocket *)&(*s),(PhySocket *)&(_socks.back()),&(s->uptr),&(sws.uptr),(const struct sockaddr *)&(sws.saddr));
-								} catch ( ... ) {}
-							}
-						}
-					}
-					break;
-
-				case ZT_PHY_SOCKET_UDP:
-					if (FD_ISSET(s->sock,&rfds)) {
-						for(;;) {
-							memset(&ss,0,sizeof(ss));
-							socklen_t slen = sizeof(ss);
-							long n = (long)::recvfrom(s->sock,buf,sizeof(buf),0,(struct sockaddr *)&ss,&slen);
-							if (n > 0) {
-								try {
-									_handler->phyOnDatagram((PhySocket *)&(*s),&(s->uptr),(const struct sockaddr *)&(s->saddr),(const struct sockaddr *)&ss,(void *)buf,(unsigned long)n);
-								} catch ( ... ) {}
-							} else if (n < 0)
-								break;
-						}
-					}
-					break;
-
-				case ZT_PHY_SOCKET_UNIX_IN: {
-#ifdef __UNIX_LIKE__
-					ZT_PHY_SOCKFD_TYPE sock = s->sock; // if closed, s->sock becomes invalid as s is no longer dereferencable
-					if ((FD_ISSET(sock,&wfds))&&(FD_ISSET(sock,&_writefds))) {
-						try {
-							_handler->phyOnUnixWritable((PhySocket *)&(*s),&(s->uptr),false);
-						} catch ( ... ) {}
-					}
-					if (FD_ISSET(sock,&rfds)) {
-						long n = (long)::read(sock,buf,sizeof(buf));
-						if (n <= 0) {
-							this->close((PhySocket *)&(*s),true);
-						} else {
-							try {
-								_handler->phyOnUnixData((PhySocket *)&(*s),&(s->uptr),(void *)buf,(unsigned long)n);
-							} catch ( ... ) {}
-						}
-					}
-#endif // __UNIX_LIKE__
-				}	break;
-
-				case ZT_PHY_SOCKET_UNIX_LISTEN:
-#ifdef __UNIX_LIKE__
-					if (FD_ISSET(s->sock,&rfds)) {
-						memset(&ss,0,sizeof(ss));
-						socklen_t slen = sizeof(ss);
-						ZT_PHY_SOCKFD_TYPE newSock = ::accept(s->sock,(struct sockaddr *)&ss,&slen);
-						if (ZT_PHY_SOCKFD_VALID(newSock)) {
-							if (_socks.size() >= ZT_PHY_MAX_SOCKETS) {
-								ZT_PHY_CLOSE_SOCKET(newSock);
-							} else {
-								fcntl(newSock,F_SETFL,O_NONBLOCK);
-								_socks.push_back(PhySocketImpl());
-								PhySocketImpl &sws = _socks.back();
-								FD_SET(newSock,&_readfds);
-								if ((long)newSock > _nfds)
-									_nfds = (long)newSock;
-								sws.type = ZT_PHY_SOCKET_UNIX_IN;
-								sws.sock = newSock;
-								sws.uptr = (void *)0;
-								memcpy(&(sws.saddr),&ss,sizeof(struct sockaddr_storage));
-								try {
-									//_handler->phyOnUnixAccept((PhySocket *)&(*s),(PhySocket *)&(_socks.back()),&(s->uptr),&(sws.uptr));
-								} catch ( ... ) {}
-							}
-						}
-					}
-#endif // __UNIX_LIKE__
-					break;
-
-				case ZT_PHY_SOCKET_FD: {
-					ZT_PHY_SOCKFD_TYPE sock = s->sock;
-					const bool readable = ((FD_ISSET(sock,&rfds))&&(FD_ISSET(sock,&_readfds)));
-					const bool writable = ((FD_ISSET(sock,&wfds))&&(FD_ISSET(sock,&_writefds)));
-					if ((readable)||(writable)) {
-						try {
-							//_handler->phyOnFileDescriptorActivity((PhySocket *)&(*s),&(s->uptr),readable,writable);
-						} catch ( ... ) {}
-					}
-				}	break;
-
-				default:
-					break;
-
-			}
+			if (s->type != ZT_PHY_SOCKET_CLOSED)
+				_handleEvents(*s,(FD_ISSET(s->sock,&rfds) != 0),(FD_ISSET(s->sock,&wfds) != 0),(FD_ISSET(s->sock,&efds) != 0));
 
 			if (s->type == ZT_PHY_SOCKET_CLOSED)
 				_socks.erase(s++);
 			else ++s;
 		}
+#endif
 	}
 
 	/**
@@ -1055,10 +1156,18 @@ public:
 		if (sws.type == ZT_PHY_SOCKET_CLOSED)
 			return;
 
+#ifdef ZT_PHY_USE_EPOLL
+		{
+			struct epoll_event ev; // non-null for kernels before 2.6.9
+			memset(&ev,0,sizeof(ev));
+			::epoll_ctl(_epfd,EPOLL_CTL_DEL,sws.sock,&ev);
+		}
+#else
 		FD_CLR(sws.sock,&_readfds);
 		FD_CLR(sws.sock,&_writefds);
 #if defined(_WIN32) || defined(_WIN64)
 		FD_CLR(sws.sock,&_exceptfds);
+#endif
 #endif
 
 		if (sws.type != ZT_PHY_SOCKET_FD)
@@ -1097,6 +1206,9 @@ public:
 		// Causes entry to be deleted from list in poll(), ignored elsewhere
 		sws.type = ZT_PHY_SOCKET_CLOSED;
 
+#ifdef ZT_PHY_USE_EPOLL
+		_haveClosedSocks = true;
+#else
 		if ((long)sws.sock >= (long)_nfds) {
 			long nfds = (long)_whackSendSocket;
 			if ((long)_whackReceiveSocket > nfds)
@@ -1107,6 +1219,294 @@ public:
 			}
 			_nfds = nfds;
 		}
+#endif
+	}
+
+private:
+	// Socket option that sets DF for this socket's address family, and the value that sets it
+	static inline bool _udpDontFragmentOption(const PhySocketImpl &sws,int &level,int &name,int &value)
+	{
+#if defined(_WIN32) || defined(_WIN64)
+		if (sws.saddr.ss_family == AF_INET6) {
+			level = IPPROTO_IPV6; name = IPV6_DONTFRAG; value = 1;
+		} else {
+			level = IPPROTO_IP; name = IP_DONTFRAGMENT; value = 1;
+		}
+		return true;
+#else
+		if (sws.saddr.ss_family == AF_INET6) {
+#if defined(IPV6_MTU_DISCOVER) && defined(IPV6_PMTUDISC_PROBE)
+			level = IPPROTO_IPV6; name = IPV6_MTU_DISCOVER; value = IPV6_PMTUDISC_PROBE;
+			return true;
+#elif defined(IPV6_DONTFRAG)
+			level = IPPROTO_IPV6; name = IPV6_DONTFRAG; value = 1;
+			return true;
+#else
+			return false;
+#endif
+		}
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE)
+		level = IPPROTO_IP; name = IP_MTU_DISCOVER; value = IP_PMTUDISC_PROBE;
+		return true;
+#elif defined(IP_DONTFRAG)
+		level = IPPROTO_IP; name = IP_DONTFRAG; value = 1;
+		return true;
+#else
+		return false;
+#endif
+#endif
+	}
+
+	// Set readability/writability interest for a socket, adding it to the poll set if 'add' is true
+	inline void _pollSet(PhySocketImpl &sws,bool readable,bool writable,bool add)
+	{
+#ifdef ZT_PHY_USE_EPOLL
+		struct epoll_event ev;
+		memset(&ev,0,sizeof(ev));
+		ev.events = (readable ? (uint32_t)EPOLLIN : (uint32_t)0) | (writable ? (uint32_t)EPOLLOUT : (uint32_t)0);
+		// Sockets we create are non-blocking and drained on every event, so they can be
+		// edge-triggered. Unix and wrapped sockets may be blocking and stay level-triggered.
+		if (sws.type != ZT_PHY_SOCKET_UNIX_IN)
+			ev.events |= (uint32_t)EPOLLET;
+		ev.data.ptr = (void *)&sws;
+		sws.events = ev.events;
+		::epoll_ctl(_epfd,(add) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,sws.sock,&ev);
+#else
+		if (readable) {
+			FD_SET(sws.sock,&_readfds);
+		} else {
+			FD_CLR(sws.sock,&_readfds);
+		}
+		if (writable) {
+			FD_SET(sws.sock,&_writefds);
+		} else {
+			FD_CLR(sws.sock,&_writefds);
+		}
+		if ((add)&&((long)sws.sock > _nfds))
+			_nfds = (long)sws.sock;
+#endif
+	}
+
+	// True if we still want writability notifications (handlers may have changed this)
+	inline bool _wantWritable(const PhySocketImpl &sws) const
+	{
+		if (sws.type == ZT_PHY_SOCKET_CLOSED)
+			return false;
+#ifdef ZT_PHY_USE_EPOLL
+		return ((sws.events & EPOLLOUT) != 0);
+#else
+		return (FD_ISSET(sws.sock,&_writefds) != 0);
+#endif
+	}
+
+	// Handle readiness of one socket; 'exceptional' is only used for TCP connect on Windows
+	inline void _handleEvents(PhySocketImpl &s,const bool readable,const bool writable,const bool exceptional)
+	{
+		char buf[131072];
+		struct sockaddr_storage ss;
+
+		switch (s.type) {
+
+			case ZT_PHY_SOCKET_TCP_OUT_PENDING:
+#if defined(_WIN32) || defined(_WIN64)
+				if (exceptional) {
+					this->close((PhySocket *)&s,true);
+				} else // ... if
+#endif
+				if (writable) {
+					socklen_t slen = sizeof(ss);
+					if (::getpeername(s.sock,(struct sockaddr *)&ss,&slen) != 0) {
+						this->close((PhySocket *)&s,true);
+					} else {
+						s.type = ZT_PHY_SOCKET_TCP_OUT_CONNECTED;
+						_pollSet(s,true,false,false);
+#if defined(_WIN32) || defined(_WIN64)
+						FD_CLR(s.sock,&_exceptfds);
+#endif
+						try {
+							_handler->phyOnTcpConnect((PhySocket *)&s,&(s.uptr),true);
+						} catch ( ... ) {}
+					}
+				}
+				break;
+
+			case ZT_PHY_SOCKET_TCP_OUT_CONNECTED:
+			case ZT_PHY_SOCKET_TCP_IN:
+				if (readable) {
+#ifdef ZT_PHY_USE_EPOLL
+					for(;;) { // edge-triggered, so read until the socket would block
+						const long n = (long)::recv(s.sock,buf,sizeof(buf),0);
+						if (n <= 0) {
+							if ((n < 0)&&(errno == EINTR))
+								continue;
+							if ((n == 0)||((errno != EAGAIN)&&(errno != EWOULDBLOCK)))
+								this->close((PhySocket *)&s,true);
+							break;
+						}
+						try {
+							_handler->phyOnTcpData((PhySocket *)&s,&(s.uptr),(void *)buf,(unsigned long)n);
+						} catch ( ... ) {}
+						if ((s.type == ZT_PHY_SOCKET_CLOSED)||((s.events & EPOLLIN) == 0))
+							break;
+					}
+#else
+					long n = (long)::recv(s.sock,buf,sizeof(buf),0);
+					if (n <= 0) {
+						this->close((PhySocket *)&s,true);
+					} else {
+						try {
+							_handler->phyOnTcpData((PhySocket *)&s,&(s.uptr),(void *)buf,(unsigned long)n);
+						} catch ( ... ) {}
+					}
+#endif
+				}
+				if ((writable)&&(_wantWritable(s))) {
+					try {
+						_handler->phyOnTcpWritable((PhySocket *)&s,&(s.uptr));
+					} catch ( ... ) {}
+				}
+				break;
+
+			case ZT_PHY_SOCKET_TCP_LISTEN:
+				if (readable) {
+					for(;;) {
+						memset(&ss,0,sizeof(ss));
+						socklen_t slen = sizeof(ss);
+						ZT_PHY_SOCKFD_TYPE newSock = ::accept(s.sock,(struct sockaddr *)&ss,&slen);
+						if (!ZT_PHY_SOCKFD_VALID(newSock))
+							break;
+						if (_socks.size() >= ZT_PHY_MAX_SOCKETS) {
+							ZT_PHY_CLOSE_SOCKET(newSock);
+						} else {
+#if defined(_WIN32) || defined(_WIN64)
+							{ BOOL f = (_noDelay ? TRUE : FALSE); setsockopt(newSock,IPPROTO_TCP,TCP_NODELAY,(char *)&f,sizeof(f)); }
+							{ u_long iMode=1; ioctlsocket(newSock,FIONBIO,&iMode); }
+#else
+							{ int f = (_noDelay ? 1 : 0); setsockopt(newSock,IPPROTO_TCP,TCP_NODELAY,(char *)&f,sizeof(f)); }
+							fcntl(newSock,F_SETFL,O_NONBLOCK);
+#endif
+							_socks.push_back(PhySocketImpl());
+							PhySocketImpl &sws = _socks.back();
+							sws.type = ZT_PHY_SOCKET_TCP_IN;
+							sws.sock = newSock;
+							sws.uptr = (void *)0;
+							memcpy(&(sws.saddr),&ss,sizeof(struct sockaddr_storage));
+							_pollSet(sws,true,false,true);
+							try {
+								_handler->phyOnTcpAccept((PhySocket *)&s,(PhySocket *)&sws,&(s.uptr),&(sws.uptr),(const struct sockaddr *)&(sws.saddr));
+							} catch ( ... ) {}
+						}
+						if (s.type == ZT_PHY_SOCKET_CLOSED)
+							break;
+					}
+				}
+				break;
+
+			case ZT_PHY_SOCKET_UDP:
+				if (readable) {
+#ifdef ZT_PHY_HAVE_RECVMMSG
+					for(;;) {
+						for(unsigned int i=0;i<ZT_PHY_UDP_RECV_BATCH_SIZE;++i)
+							_udpRecvMsgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+						const int n = ::recvmmsg(s.sock,_udpRecvMsgs,ZT_PHY_UDP_RECV_BATCH_SIZE,MSG_DONTWAIT,(struct timespec *)0);
+						if (n <= 0)
+							break;
+						unsigned int cnt = 0;
+						for(int i=0;i<n;++i) {
+							if ((_udpRecvMsgs[i].msg_len > 0)&&((_udpRecvMsgs[i].msg_hdr.msg_flags & MSG_TRUNC) == 0)) {
+								_udpRecvDatagrams[cnt].addr = (const struct sockaddr *)&(_udpRecvFrom[i]);
+								_udpRecvDatagrams[cnt].data = _udpRecvIov[i].iov_base;
+								_udpRecvDatagrams[cnt].len = (unsigned long)_udpRecvMsgs[i].msg_len;
+								++cnt;
+							}
+						}
+						if (cnt) {
+							try {
+								_handler->phyOnDatagramBatch((PhySocket *)&s,&(s.uptr),(const struct sockaddr *)&(s.saddr),_udpRecvDatagrams,cnt);
+							} catch ( ... ) {}
+						}
+						if (s.type == ZT_PHY_SOCKET_CLOSED)
+							break;
+					}
+#else
+					for(;;) {
+						memset(&ss,0,sizeof(ss));
+						socklen_t slen = sizeof(ss);
+						long n = (long)::recvfrom(s.sock,buf,sizeof(buf),0,(struct sockaddr *)&ss,&slen);
+						if (n > 0) {
+							try {
+								_handler->phyOnDatagram((PhySocket *)&s,&(s.uptr),(const struct sockaddr *)&(s.saddr),(const struct sockaddr *)&ss,(void *)buf,(unsigned long)n);
+							} catch ( ... ) {}
+						} else if (n < 0)
+							break;
+						if (s.type == ZT_PHY_SOCKET_CLOSED)
+							break;
+					}
+#endif
+				}
+				break;
+
+			case ZT_PHY_SOCKET_UNIX_IN:
+#ifdef __UNIX_LIKE__
+				if ((writable)&&(_wantWritable(s))) {
+					try {
+						_handler->phyOnUnixWritable((PhySocket *)&s,&(s.uptr),false);
+					} catch ( ... ) {}
+				}
+				if ((readable)&&(s.type != ZT_PHY_SOCKET_CLOSED)) {
+					long n = (long)::read(s.sock,buf,sizeof(buf));
+					if (n <= 0) {
+						this->close((PhySocket *)&s,true);
+					} else {
+						try {
+							_handler->phyOnUnixData((PhySocket *)&s,&(s.uptr),(void *)buf,(unsigned long)n);
+						} catch ( ... ) {}
+					}
+				}
+#endif // __UNIX_LIKE__
+				break;
+
+			case ZT_PHY_SOCKET_UNIX_LISTEN:
+#ifdef __UNIX_LIKE__
+				if (readable) {
+					for(;;) {
+						memset(&ss,0,sizeof(ss));
+						socklen_t slen = sizeof(ss);
+						ZT_PHY_SOCKFD_TYPE newSock = ::accept(s.sock,(struct sockaddr *)&ss,&slen);
+						if (!ZT_PHY_SOCKFD_VALID(newSock))
+							break;
+						if (_socks.size() >= ZT_PHY_MAX_SOCKETS) {
+							ZT_PHY_CLOSE_SOCKET(newSock);
+						} else {
+							fcntl(newSock,F_SETFL,O_NONBLOCK);
+							_socks.push_back(PhySocketImpl());
+							PhySocketImpl &sws = _socks.back();
+							sws.type = ZT_PHY_SOCKET_UNIX_IN;
+							sws.sock = newSock;
+							sws.uptr = (void *)0;
+							memcpy(&(sws.saddr),&ss,sizeof(struct sockaddr_storage));
+							_pollSet(sws,true,false,true);
+							try {
+								//_handler->phyOnUnixAccept((PhySocket *)&s,(PhySocket *)&sws,&(s.uptr),&(sws.uptr));
+							} catch ( ... ) {}
+						}
+					}
+				}
+#endif // __UNIX_LIKE__
+				break;
+
+			case ZT_PHY_SOCKET_FD:
+				if ((readable)||((writable)&&(_wantWritable(s)))) {
+					try {
+						//_handler->phyOnFileDescriptorActivity((PhySocket *)&s,&(s.uptr),readable,writable);
+					} catch ( ... ) {}
+				}
+				break;
+
+			default:
+				break;
+
+		}
 	}
 };
 
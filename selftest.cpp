@@ -25,6 +25,8 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <map>
+#include <set>
 
 #include "node/Constants.hpp"
 #include "node/Hashtable.hpp"
@@ -38,6 +40,7 @@
 #include "node/MAC.hpp"
 #include "node/NetworkConfig.hpp"
 #include "node/Peer.hpp"
+#include "node/Path.hpp"
 #include "node/Dictionary.hpp"
 #include "node/SHA512.hpp"
 #include "node/C25519.hpp"
@@ -45,6 +48,14 @@
 #include "node/CertificateOfMembership.hpp"
 #include "node/Node.hpp"
 #include "node/IncomingPacket.hpp"
+#include "node/DeferredPackets.hpp"
+#include "node/AtomicCounter.hpp"
+#include "node/PartialShuffle.hpp"
+#include "node/FlowRules.hpp"
+#include "node/World.hpp"
+#include "node/NetworkController.hpp"
+#include "node/Cluster.hpp"
+#include "node/Topology.hpp"
 
 #include "osdep/OSUtils.hpp"
 #include "osdep/Phy.hpp"
@@ -139,6 +150,9 @@ static const C25519TestVector C25519_TEST_VECTORS[ZT_NUM_C25519_TEST_VECTORS] =
 
 static unsigned char fuzzbuf[1048576];
 
+// Set by -b on the command line to also run the slower benchmarks
+static bool benchmarks = false;
+
 static int testCrypto()
 {
 	unsigned char buf1[16384];
@@ -188,6 +202,38 @@ static int testCrypto()
 #else
 	std::cout << "[crypto] Salsa20 SSE: DISABLED" << std::endl;
 #endif
+	std::cout << "[crypto] Salsa20 AVX2: " << (Salsa20::usingAVX2() ? "ENABLED" : "DISABLED") << std::endl;
+
+	std::cout << "[crypto] Testing Salsa20 multi-block output against one block at a time... "; std::cout.flush();
+	{
+		// Long inputs take the multi-block path (if any); 64-byte calls never do
+		const unsigned int len = 4325;
+		unsigned char *in = (unsigned char *)::malloc(len);
+		unsigned char *out1 = (unsigned char *)::malloc(len);
+		unsigned char *out2 = (unsigned char *)::malloc(len);
+		for(unsigned int i=0;i<len;++i)
+			in[i] = (unsigned char)rand();
+		for(unsigned int r=0;r<2;++r) {
+			Salsa20 a(s20TV0Key,256,s20TV0Iv);
+			Salsa20 b(s20TV0Key,256,s20TV0Iv);
+			if (r == 0)
+				a.encrypt12(in,out1,len);
+			else a.encrypt20(in,out1,len);
+			for(unsigned int k=0;k<len;k+=64) {
+				if (r == 0)
+					b.encrypt12(in + k,out2 + k,std::min(len - k,64U));
+				else b.encrypt20(in + k,out2 + k,std::min(len - k,64U));
+			}
+			if (memcmp(out1,out2,len)) {
+				std::cout << "FAIL (Salsa20/" << ((r == 0) ? 12 : 20) << ")" << std::endl;
+				return -1;
+			}
+		}
+		::free((void *)in);
+		::free((void *)out1);
+		::free((void *)out2);
+	}
+	std::cout << "PASS" << std::endl;
 
 	std::cout << "[crypto] Benchmarking Salsa20/12... "; std::cout.flush();
 	{
@@ -579,10 +625,186 @@ static int testPacket()
 		return -1;
 	}
 
+	{
+		Packet p(Address(),Address(),Packet::VERB_FRAME);
+		while (p.size() < 3000)
+			p.append((unsigned char)rand());
+		p.setFragmented(true);
+		p.armor(salsaKey,true);
+		const Packet orig(p);
+		const unsigned int fragPayload = ZT_UDP_DEFAULT_PAYLOAD_MTU - ZT_PROTO_MIN_FRAGMENT_LENGTH;
+		unsigned int fragStart = ZT_UDP_DEFAULT_PAYLOAD_MTU;
+		const unsigned int totalFragments = 1 + ((p.size() - fragStart) + fragPayload - 1) / fragPayload;
+		for(unsigned int fno=1;fno<totalFragments;++fno) {
+			const unsigned int chunkSize = std::min(p.size() - fragStart,fragPayload);
+			Packet::Fragment frag(orig,fragStart,chunkSize,fno,totalFragments);
+			if (memcmp(p.fragmentInPlace(fragStart,chunkSize,fno,totalFragments),frag.data(),frag.size())) {
+				std::cout << "FAIL (in-place fragment " << fno << ")" << std::endl;
+				return -1;
+			}
+			fragStart += chunkSize;
+		}
+	}
+
 	std::cout << "PASS" << std::endl;
+
+	static const unsigned int benchSizes[3] = { 64,512,1400 };
+	for(unsigned int si=0;(benchmarks)&&(si<3);++si) {
+		std::cout << "[packet] Benchmarking armor+dearmor of " << benchSizes[si] << " byte packets... "; std::cout.flush();
+		Packet p(Address(),Address(),Packet::VERB_FRAME);
+		while (p.size() < benchSizes[si])
+			p.append((unsigned char)rand());
+		const unsigned int iterations = 200000;
+		uint64_t start = OSUtils::now();
+		for(unsigned int i=0;i<iterations;++i) {
+			a = p;
+			a.armor(salsaKey,true);
+			a.dearmor(salsaKey);
+		}
+		uint64_t end = OSUtils::now();
+		std::cout << (((double)(end - start) * 1000000.0) / (double)iterations) << " ns/packet" << std::endl;
+	}
+
 	return 0;
 }
 
+// Rules and frames for FlowRules tests, drawn from small value pools so they often match
+static void randomFlowRule(ZT_VirtualNetworkRule &r)
+{
+	static const unsigned int types[14] = {
+		ZT_NETWORK_RULE_MATCH_SOURCE_ZEROTIER_ADDRESS,ZT_NETWORK_RULE_MATCH_DEST_ZEROTIER_ADDRESS,ZT_NETWORK_RULE_MATCH_ETHERTYPE,
+		ZT_NETWORK_RULE_MATCH_MAC_SOURCE,ZT_NETWORK_RULE_MATCH_IPV4_SOURCE,ZT_NETWORK_RULE_MATCH_IPV4_DEST,ZT_NETWORK_RULE_MATCH_IPV6_SOURCE,
+		ZT_NETWORK_RULE_MATCH_IPV6_DEST,ZT_NETWORK_RULE_MATCH_IP_TOS,ZT_NETWORK_RULE_MATCH_IP_PROTOCOL,ZT_NETWORK_RULE_MATCH_IP_SOURCE_PORT_RANGE,
+		ZT_NETWORK_RULE_MATCH_IP_DEST_PORT_RANGE,ZT_NETWORK_RULE_MATCH_CHARACTERISTICS,ZT_NETWORK_RULE_MATCH_FRAME_SIZE_RANGE
+	};
+	static const uint16_t etherTypes[3] = { ZT_ETHERTYPE_IPV4,ZT_ETHERTYPE_IPV6,ZT_ETHERTYPE_ARP };
+	memset(&r,0,sizeof(r));
+	if ((rand() % 4) == 0) {
+		r.t = ((rand() % 8) == 0) ? (uint8_t)ZT_NETWORK_RULE_ACTION_TEE : (uint8_t)(rand() % 2);
+		return;
+	}
+	r.t = (uint8_t)(types[rand() % 14] | (((rand() % 4) == 0) ? 0x80 : 0x00));
+	switch(r.t & 0x7f) {
+		case ZT_NETWORK_RULE_MATCH_SOURCE_ZEROTIER_ADDRESS:
+		case ZT_NETWORK_RULE_MATCH_DEST_ZEROTIER_ADDRESS: r.v.zt = 0x1000000000ULL + (uint64_t)(rand() % 4); break;
+		case ZT_NETWORK_RULE_MATCH_ETHERTYPE: r.v.etherType = etherTypes[rand() % 3]; break;
+		case ZT_NETWORK_RULE_MATCH_MAC_SOURCE: r.v.mac[0] = 0x32; r.v.mac[5] = (uint8_t)(rand() % 4); break;
+		case ZT_NETWORK_RULE_MATCH_IPV4_SOURCE:
+		case ZT_NETWORK_RULE_MATCH_IPV4_DEST: r.v.ipv4.ip = Utils::hton((uint32_t)(0x0a000000 | (rand() % 1024))); r.v.ipv4.mask = (uint8_t)(rand() % 33); break;
+		case ZT_NETWORK_RULE_MATCH_IPV6_SOURCE:
+		case ZT_NETWORK_RULE_MATCH_IPV6_DEST: r.v.ipv6.ip[0] = 0xfd; r.v.ipv6.ip[7] = (uint8_t)(rand() % 4); r.v.ipv6.ip[15] = (uint8_t)(rand() % 4); r.v.ipv6.mask = (uint8_t)(rand() % 129); break;
+		case ZT_NETWORK_RULE_MATCH_IP_TOS: r.v.ipTos = (uint8_t)(rand() % 4); break;
+		case ZT_NETWORK_RULE_MATCH_IP_PROTOCOL: r.v.ipProtocol = ((rand() % 2) == 0) ? 6 : 17; break;
+		case ZT_NETWORK_RULE_MATCH_IP_SOURCE_PORT_RANGE:
+		case ZT_NETWORK_RULE_MATCH_IP_DEST_PORT_RANGE: r.v.port[0] = (uint16_t)(rand() % 100); r.v.port[1] = (uint16_t)(r.v.port[0] + (rand() % 50)); break;
+		case ZT_NETWORK_RULE_MATCH_CHARACTERISTICS: r.v.characteristics = (rand() % 2) ? ZT_RULE_PACKET_CHARACTERISTICS_TCP_SYN : ZT_RULE_PACKET_CHARACTERISTICS_INBOUND; break;
+		case ZT_NETWORK_RULE_MATCH_FRAME_SIZE_RANGE: r.v.frameSize[0] = (uint16_t)(rand() % 100); r.v.frameSize[1] = (uint16_t)(r.v.frameSize[0] + (rand() % 100)); break;
+	}
+}
+
+static unsigned int randomFlowRuleFrame(uint8_t *buf,unsigned int &etherType)
+{
+	const unsigned int len = 40 + 20 + (rand() % 100);
+	memset(buf,0,len);
+	const unsigned int proto = ((rand() % 2) == 0) ? 6 : 17;
+	unsigned int l4;
+	switch(rand() % 3) {
+		case 0:
+			etherType = ZT_ETHERTYPE_IPV4;
+			buf[0] = 0x45; buf[1] = (uint8_t)(rand() % 4); buf[9] = (uint8_t)proto;
+			buf[12] = 10; buf[14] = (uint8_t)(rand() % 4); buf[15] = (uint8_t)rand();
+			buf[16] = 10; buf[18] = (uint8_t)(rand() % 4); buf[19] = (uint8_t)rand();
+			l4 = 20;
+			break;
+		case 1:
+			etherType = ZT_ETHERTYPE_IPV6;
+			buf[0] = 0x60 | (uint8_t)(rand() % 2); buf[6] = (uint8_t)proto;
+			buf[8] = 0xfd; buf[15] = (uint8_t)(rand() % 4); buf[23] = (uint8_t)(rand() % 4);
+			buf[24] = 0xfd; buf[31] = (uint8_t)(rand() % 4); buf[39] = (uint8_t)(rand() % 4);
+			l4 = 40;
+			break;
+		default:
+			etherType = ZT_ETHERTYPE_ARP;
+			return len;
+	}
+	buf[l4 + 1] = (uint8_t)(rand() % 160);
+	buf[l4 + 3] = (uint8_t)(rand() % 160);
+	buf[l4 + 13] = (uint8_t)(rand() % 4);
+	return len;
+}
+
+// Run path MTU discovery on p for a while over a link that carries UDP payloads up to linkMtu with DF set
+static unsigned int simPathMtuDiscovery(Path &p,uint64_t &now,unsigned int linkMtu,bool dfSupported)
+{
+	for(const uint64_t end=now+120000;now<end;now+=1000) {
+		const unsigned int size = p.mtuProbe(now);
+		if (!size)
+			continue;
+		if (!dfSupported)
+			p.mtuProbeFailed();
+		else if (size <= linkMtu)
+			p.mtuProbeAcknowledged(size);
+	}
+	return p.mtu();
+}
+
+#define ZT_TEST_DEFERRED_PRODUCERS 4
+#define ZT_TEST_DEFERRED_CONSUMERS 4
+#define ZT_TEST_DEFERRED_PACKETS_PER_PRODUCER 50000
+
+// Counts what comes off the deferred packet ring by packet ID instead of decoding it
+class TestDeferredPackets : public DeferredPackets
+{
+public:
+	TestDeferredPackets(unsigned long n) : DeferredPackets((const RuntimeEnvironment *)0),seen(new AtomicCounter[n]),_n(n) {}
+	virtual ~TestDeferredPackets() { delete [] seen; }
+	AtomicCounter *const seen;
+	AtomicCounter decoded;
+protected:
+	virtual void _decode(IncomingPacket &pkt)
+	{
+		const uint64_t id = pkt.packetId();
+		if (id < _n)
+			++seen[id];
+		++decoded;
+	}
+private:
+	const unsigned long _n;
+};
+class TestDeferredConsumer
+{
+public:
+	TestDeferredConsumer() : dp((TestDeferredPackets *)0) {}
+	void threadMain() throw() { while (dp->process() >= 0) {} }
+	TestDeferredPackets *dp;
+	Thread thread;
+};
+class TestDeferredProducer
+{
+public:
+	TestDeferredProducer() : dp((TestDeferredPackets *)0),first(0),count(0),failed(0) {}
+	void threadMain()
+		throw()
+	{
+		uint8_t data[ZT_PROTO_MIN_PACKET_LENGTH];
+		memset(data,0,sizeof(data));
+		for(uint64_t id=first;id<(first + count);++id) {
+			for(unsigned int i=0;i<8;++i)
+				data[i] = (uint8_t)(id >> (56 - (i * 8))); // packet ID
+			IncomingPacket pkt(data,sizeof(data),InetAddress(),InetAddress(),0);
+			while (!dp->enqueue(&pkt)) {
+				++failed;
+				Thread::sleep(1);
+			}
+		}
+	}
+	TestDeferredPackets *dp;
+	uint64_t first;
+	unsigned long count;
+	unsigned long failed;
+	Thread thread;
+};
+
 static int testOther()
 {
 	std::cout << "[other] Testing Hashtable... "; std::cout.flush();
@@ -603,6 +825,18 @@ static int testOther()
 				vref = v;
 				ht.erase(0xffffffffffffffffULL);
 			}
+			{
+				// Values passed by reference into the table itself must survive a grow
+				Hashtable<uint64_t,std::string> aht(2);
+				aht.set(1,std::string(100,'x'));
+				for(uint64_t k=2;k<1000;++k) {
+					aht.set(k,*aht.get(k - 1));
+					if (*aht.get(k) != std::string(100,'x')) {
+						std::cout << "FAILED! (self-aliased value lost on grow)" << std::endl;
+						return -1;
+					}
+				}
+			}
 			if (ht.size() != ref.size()) {
 				std::cout << "FAILED! (size mismatch, original)" << std::endl;
 				return -1;
@@ -745,6 +979,403 @@ static int testOther()
 				std::cout << "FAILED! (clear by iterate, " << ht.size() << ")" << std::endl;
 				return -1;
 			}
+			for(int i=0;i<10000;++i) {
+				uint64_t k = rand();
+				while ((k == 0)||(ref.count(k) > 0))
+					++k;
+				ht.set(k,std::string("x"));
+				ref[k] = "x";
+			}
+			{
+				Hashtable<uint64_t,std::string>::Iterator i(ht);
+				uint64_t *k;
+				std::string *v;
+				unsigned long ic = 0;
+				while (i.next(k,v)) {
+					++ic;
+					if ((*k & 1) != 0) {
+						ref.erase(*k);
+						ht.erase(*k);
+					}
+				}
+				if (ic != 10000) {
+					std::cout << "FAILED! (erase while iterating, coverage)" << std::endl;
+					return -1;
+				}
+			}
+			if (ht.size() != ref.size()) {
+				std::cout << "FAILED! (erase while iterating, size)" << std::endl;
+				return -1;
+			}
+			for(std::map<uint64_t,std::string>::iterator i(ref.begin());i!=ref.end();++i) {
+				if (!ht.contains(i->first)) {
+					std::cout << "FAILED! (erase while iterating, key lost)" << std::endl;
+					return -1;
+				}
+			}
+			ht.clear();
+			ref.clear();
+		}
+	}
+	std::cout << "PASS" << std::endl;
+
+	for(unsigned long n=10000;(benchmarks)&&(n<=1000000);n*=100) {
+		std::cout << "[other] Benchmarking Hashtable<Address,uint64_t> with " << n << " entries... "; std::cout.flush();
+		std::vector<Address> addrs;
+		addrs.reserve(n * 2);
+		for(unsigned long i=0;i<(n * 2);++i)
+			addrs.push_back(Address(((((uint64_t)rand()) << 32) ^ (uint64_t)rand() ^ (uint64_t)i) & 0xffffffffffULL));
+		const unsigned long rounds = 1000000 / n;
+		uint64_t tset = 0,tget = 0,tmiss = 0,terase = 0;
+		unsigned long mem = 0,found = 0;
+		for(unsigned long r=0;r<rounds;++r) {
+			Hashtable<Address,uint64_t> ht;
+			uint64_t t = OSUtils::now();
+			for(unsigned long i=0;i<n;++i)
+				ht.set(addrs[i],(uint64_t)i);
+			uint64_t t2 = OSUtils::now();
+			tset += t2 - t;
+			for(unsigned long i=0;i<n;++i)
+				found += (ht.get(addrs[i])) ? 1 : 0;
+			t = OSUtils::now();
+			tget += t - t2;
+			for(unsigned long i=n;i<(n * 2);++i)
+				found += (ht.get(addrs[i])) ? 1 : 0;
+			t2 = OSUtils::now();
+			tmiss += t2 - t;
+			mem = ht.memoryUsage();
+			for(unsigned long i=0;i<n;++i)
+				ht.erase(addrs[i]);
+			terase += OSUtils::now() - t2;
+		}
+		const double ops = (double)(n * rounds) / 1000.0; // ms -> ops/sec in millions
+		std::cout << "set " << (ops / (double)std::max(tset,(uint64_t)1)) << " M/s, get " << (ops / (double)std::max(tget,(uint64_t)1)) << " M/s, miss " << (ops / (double)std::max(tmiss,(uint64_t)1)) << " M/s, erase " << (ops / (double)std::max(terase,(uint64_t)1)) << " M/s, " << ((double)mem / (double)n) << " bytes/entry (" << found << " found)" << std::endl;
+	}
+
+	std::cout << "[other] Testing PartialShuffle... "; std::cout.flush();
+	for(unsigned long n=1;n<=5000;n*=3) {
+		std::vector<bool> seen(n,false);
+		PartialShuffle ps(n,n);
+		while (ps.remaining()) {
+			const unsigned long i = ps.next((((uint64_t)rand()) << 32) ^ (uint64_t)rand());
+			if ((i >= n)||(seen[i])) {
+				std::cout << "FAILED! (index " << i << " of " << n << " out of range or repeated)" << std::endl;
+				return -1;
+			}
+			seen[i] = true;
+		}
+		if (std::find(seen.begin(),seen.end(),false) != seen.end()) {
+			std::cout << "FAILED! (not all " << n << " indexes drawn)" << std::endl;
+			return -1;
+		}
+	}
+	std::cout << "PASS" << std::endl;
+
+	for(unsigned long n=10;(benchmarks)&&(n<=100000);n*=10) {
+		std::cout << "[other] Benchmarking selection of 32 multicast recipients from " << n << ": "; std::cout.flush();
+		const unsigned long limit = std::min(n,(unsigned long)32);
+		const unsigned long rounds = 10000000 / (n + 1000);
+		std::vector<unsigned long> indexes(n);
+		unsigned long sum = 0;
+		uint64_t t = OSUtils::now();
+		for(unsigned long r=0;r<rounds;++r) {
+			for(unsigned long i=0;i<n;++i)
+				indexes[i] = i;
+			for(unsigned long i=n-1;i>0;--i) {
+				unsigned long j = (unsigned long)rand() % (i + 1);
+				unsigned long tmp = indexes[j];
+				indexes[j] = indexes[i];
+				indexes[i] = tmp;
+			}
+			for(unsigned long i=0;i<limit;++i)
+				sum += indexes[i];
+		}
+		const uint64_t tfull = OSUtils::now() - t;
+		t = OSUtils::now();
+		for(unsigned long r=0;r<1000000;++r) {
+			if (n <= 32) { // Multicaster takes a group that fits whole without drawing
+				for(unsigned long i=0;i<n;++i)
+					sum += i;
+			} else {
+				PartialShuffle ps(n,limit);
+				for(unsigned long i=0;i<limit;++i)
+					sum += ps.next((uint64_t)rand());
+			}
+		}
+		const uint64_t tpartial = OSUtils::now() - t;
+		std::cout << "full shuffle " << (((double)tfull * 1000000.0) / (double)rounds) << " ns, Multicaster " << ((double)tpartial) << " ns (" << (sum & 1) << ")" << std::endl;
+	}
+
+	std::cout << "[other] Testing path MTU discovery steps... "; std::cout.flush();
+	{
+		const unsigned int eth4 = ZT_PATH_MTU_ETHERNET - ZT_PATH_MTU_IPV4_UDP_OVERHEAD;
+		const unsigned int eth6 = ZT_PATH_MTU_ETHERNET - ZT_PATH_MTU_IPV6_UDP_OVERHEAD;
+		const InetAddress v4l("10.0.0.1/9993"),v4r("10.0.0.2/9993"),v6l("fd00::1/9993"),v6r("fd00::2/9993");
+		uint64_t now = 1000000;
+		Path jumbo(v4l,v4r),ethernet(v4l,v4r),ethernet6(v6l,v6r),pppoe(v4l,v4r),noDf(v4l,v4r);
+		const unsigned int mJumbo = simPathMtuDiscovery(jumbo,now,8972,true);
+		const unsigned int mEthernet = simPathMtuDiscovery(ethernet,now,eth4,true);
+		const unsigned int mEthernet6 = simPathMtuDiscovery(ethernet6,now,eth6,true);
+		const unsigned int mPppoe = simPathMtuDiscovery(pppoe,now,1464,true);
+		const unsigned int mNoDf = simPathMtuDiscovery(noDf,now,8972,false);
+		std::cout << "jumbo " << mJumbo << ", Ethernet " << mEthernet << "/" << mEthernet6 << ", PPPoE " << mPppoe << ", no DF " << mNoDf << ", ";
+		if ((mJumbo != ZT_PATH_MTU_PROBE_MAX)||(mEthernet != eth4)||(mEthernet6 != eth6)||(mPppoe != ZT_UDP_DEFAULT_PAYLOAD_MTU)||(mNoDf != ZT_UDP_DEFAULT_PAYLOAD_MTU)) {
+			std::cout << "FAILED!" << std::endl;
+			return -1;
+		}
+
+		// Rediscovery after the route changes settles on the largest size that still gets through
+		now += ZT_PATH_MTU_REPROBE_INTERVAL;
+		const unsigned int mRerouted = simPathMtuDiscovery(jumbo,now,eth4,true);
+		std::cout << "jumbo rerouted over Ethernet " << mRerouted << " ";
+		if (mRerouted != eth4) {
+			std::cout << "FAILED!" << std::endl;
+			return -1;
+		}
+	}
+	std::cout << "PASS" << std::endl;
+
+	std::cout << "[other] Testing FlowRules frame parsing... "; std::cout.flush();
+	{
+		const Address zs(0x1000000001ULL);
+		const MAC ms(0x320000000001ULL);
+		uint8_t pkt[128];
+
+		// IPv4 with 4 bytes of options, TCP 12345 -> 80 with NS, SYN and ACK set
+		memset(pkt,0,sizeof(pkt));
+		pkt[0] = 0x46; pkt[1] = 0x10; pkt[9] = 6;
+		pkt[12] = 10; pkt[13] = 1; pkt[14] = 2; pkt[15] = 3;
+		pkt[16] = 10; pkt[17] = 4; pkt[18] = 5; pkt[19] = 6;
+		pkt[24] = 0x30; pkt[25] = 0x39; pkt[26] = 0x00; pkt[27] = 0x50;
+		pkt[36] = 0x51; pkt[37] = 0x12;
+		{
+			const FlowRules::Frame f(zs,Address(),ms,MAC(0x320000000002ULL),ZT_ETHERTYPE_IPV4,0,pkt,44,true);
+			if ((!f.isIpv4)||(f.ipTos != 0x10)||(f.ipProtocol != 6)||(f.ipv4Source != 0x0a010203)||(f.ipv4Dest != 0x0a040506)||(!f.hasPorts)||(f.portSource != 12345)||(f.portDest != 80)||
+			    (f.characteristics != (ZT_RULE_PACKET_CHARACTERISTICS_INBOUND|ZT_RULE_PACKET_CHARACTERISTICS_TCP_NS|ZT_RULE_PACKET_CHARACTERISTICS_TCP_ACK|ZT_RULE_PACKET_CHARACTERISTICS_TCP_SYN))) {
+				std::cout << "FAILED! (IPv4 TCP)" << std::endl;
+				return -1;
+			}
+		}
+
+		// Same packet as a non-first fragment (offset 0x10 * 8): no transport header
+		pkt[6] = 0x20; pkt[7] = 0x10;
+		{
+			const FlowRules::Frame f(zs,Address(),ms,MAC(0xffffffffffffULL),ZT_ETHERTYPE_IPV4,0,pkt,44,false);
+			if ((!f.isIpv4)||(f.ipProtocol != 6)||(f.hasPorts)||(f.portSource)||(f.portDest)||
+			    (f.characteristics != (ZT_RULE_PACKET_CHARACTERISTICS_MULTICAST|ZT_RULE_PACKET_CHARACTERISTICS_BROADCAST))) {
+				std::cout << "FAILED! (IPv4 fragment)" << std::endl;
+				return -1;
+			}
+		}
+
+		// IPv6: hop-by-hop (8 bytes), destination options (16 bytes), then UDP 53 -> 5353
+		memset(pkt,0,sizeof(pkt));
+		pkt[0] = 0x6a; pkt[1] = 0xb0; pkt[6] = 0;
+		pkt[8] = 0xfd; pkt[23] = 0x01;
+		pkt[24] = 0xfd; pkt[39] = 0x02;
+		pkt[40] = 60; pkt[41] = 0;
+		pkt[48] = 17; pkt[49] = 1;
+		pkt[64] = 0x00; pkt[65] = 0x35; pkt[66] = 0x14; pkt[67] = 0xe9;
+		{
+			const FlowRules::Frame f(zs,Address(),ms,MAC(0x333300000001ULL),ZT_ETHERTYPE_IPV6,0,pkt,72,true);
+			if ((!f.isIpv6)||(f.ipTos != 0xab)||(f.ipProtocol != 17)||(f.ipv6Source[0] != 0xfd00000000000000ULL)||(f.ipv6Source[1] != 1)||(f.ipv6Dest[0] != 0xfd00000000000000ULL)||(f.ipv6Dest[1] != 2)||
+			    (!f.hasPorts)||(f.portSource != 53)||(f.portDest != 5353)||(f.characteristics != (ZT_RULE_PACKET_CHARACTERISTICS_INBOUND|ZT_RULE_PACKET_CHARACTERISTICS_MULTICAST))) {
+				std::cout << "FAILED! (IPv6 extension headers)" << std::endl;
+				return -1;
+			}
+		}
+
+		// Extension header chain running past the end of the frame
+		{
+			const FlowRules::Frame f(zs,Address(),ms,MAC(0x320000000002ULL),ZT_ETHERTYPE_IPV6,0,pkt,52,true);
+			if ((!f.isIpv6)||(f.hasPorts)) {
+				std::cout << "FAILED! (IPv6 truncated extension headers)" << std::endl;
+				return -1;
+			}
+		}
+
+		// IPv6 fragment header with a nonzero offset: protocol is known, ports are not
+		memset(pkt,0,sizeof(pkt));
+		pkt[0] = 0x60; pkt[6] = 44;
+		pkt[40] = 6; pkt[42] = 0x00; pkt[43] = 0xb8;
+		{
+			const FlowRules::Frame f(zs,Address(),ms,MAC(0x320000000002ULL),ZT_ETHERTYPE_IPV6,0,pkt,80,true);
+			if ((!f.isIpv6)||(f.ipProtocol != 6)||(f.hasPorts)||(f.characteristics != ZT_RULE_PACKET_CHARACTERISTICS_INBOUND)) {
+				std::cout << "FAILED! (IPv6 fragment)" << std::endl;
+				return -1;
+			}
+		}
+
+		// First IPv6 fragment: TCP follows the fragment header, FIN|RST flags
+		pkt[43] = 0x01; // M flag only, offset 0
+		pkt[48] = 0x01; pkt[49] = 0xbb; pkt[50] = 0xc0; pkt[51] = 0x00; pkt[61] = 0x05;
+		{
+			const FlowRules::Frame f(zs,Address(),ms,MAC(0x320000000002ULL),ZT_ETHERTYPE_IPV6,0,pkt,80,true);
+			if ((!f.isIpv6)||(f.ipProtocol != 6)||(!f.hasPorts)||(f.portSource != 443)||(f.portDest != 49152)||
+			    (f.characteristics != (ZT_RULE_PACKET_CHARACTERISTICS_INBOUND|ZT_RULE_PACKET_CHARACTERISTICS_TCP_RST|ZT_RULE_PACKET_CHARACTERISTICS_TCP_FIN))) {
+				std::cout << "FAILED! (IPv6 first fragment)" << std::endl;
+				return -1;
+			}
+		}
+	}
+	std::cout << "PASS" << std::endl;
+
+	std::cout << "[other] Testing FlowRules against linear rule evaluation... "; std::cout.flush();
+	for(unsigned int k=0;k<2000;++k) {
+		ZT_VirtualNetworkRule rules[ZT_MAX_NETWORK_RULES];
+		const unsigned int ruleCount = (unsigned int)(rand() % (ZT_MAX_NETWORK_RULES + 1));
+		for(unsigned int i=0;i<ruleCount;++i)
+			randomFlowRule(rules[i]);
+		FlowRules fr(rules,ruleCount);
+		for(unsigned int i=0;i<64;++i) {
+			unsigned int etherType;
+			const unsigned int len = randomFlowRuleFrame(fuzzbuf,etherType);
+			const FlowRules::Frame f(Address(0x1000000000ULL + (uint64_t)(rand() % 4)),Address(0x1000000000ULL + (uint64_t)(rand() % 4)),MAC(0x320000000000ULL + (uint64_t)(rand() % 4)),MAC(0x320000000001ULL),etherType,0,fuzzbuf,len,((rand() % 2) == 0));
+			if (fr.classify(f) != FlowRules::classifyLinear(rules,ruleCount,f)) {
+				std::cout << "FAILED! (" << ruleCount << " rules)" << std::endl;
+				return -1;
+			}
+		}
+	}
+	std::cout << "PASS" << std::endl;
+
+	for(unsigned int ruleCount=1;ruleCount<=256;ruleCount*=(ruleCount == 1) ? 64 : 4) {
+		std::cout << "[other] Benchmarking FlowRules with " << ruleCount << " rules: "; std::cout.flush();
+		// Firewall-like table: DROP entries of one or two narrow matches, then ACCEPT everything else
+		ZT_VirtualNetworkRule rules[ZT_MAX_NETWORK_RULES];
+		unsigned int i = 0;
+		while ((i + 3) < ruleCount) {
+			for(unsigned int m=(rand() % 2);;--m) {
+				do { randomFlowRule(rules[i]); } while (((rules[i].t & 0x7f) < 32)||((rules[i].t & 0x7f) == ZT_NETWORK_RULE_MATCH_ETHERTYPE)||((rules[i].t & 0x7f) == ZT_NETWORK_RULE_MATCH_IP_PROTOCOL)||((rules[i].t & 0x7f) == ZT_NETWORK_RULE_MATCH_CHARACTERISTICS));
+				rules[i].t &= 0x7f;
+				rules[i].v.ipv4.mask |= 24; // also narrows IPv6 masks
+				if (!m)
+					break;
+				++i;
+			}
+			memset(&(rules[++i]),0,sizeof(ZT_VirtualNetworkRule));
+			rules[i++].t = ZT_NETWORK_RULE_ACTION_DROP;
+		}
+		while (i < ruleCount) {
+			memset(&(rules[i]),0,sizeof(ZT_VirtualNetworkRule));
+			rules[i++].t = ZT_NETWORK_RULE_ACTION_ACCEPT;
+		}
+		FlowRules fr(rules,ruleCount);
+		std::vector<FlowRules::Frame> frames;
+		for(unsigned int i=0;i<1024;++i) {
+			unsigned int etherType;
+			const unsigned int len = randomFlowRuleFrame(fuzzbuf,etherType);
+			frames.push_back(FlowRules::Frame(Address(0x1000000000ULL + (uint64_t)(rand() % 4)),Address(0x1000000000ULL),MAC(0x320000000000ULL + (uint64_t)(rand() % 4)),MAC(0x320000000001ULL),etherType,0,fuzzbuf,len,false));
+		}
+		unsigned long accepted = 0;
+		uint64_t t = OSUtils::now();
+		for(unsigned int r=0;r<1000;++r) {
+			for(unsigned int i=0;i<1024;++i)
+				accepted += (FlowRules::classifyLinear(rules,ruleCount,frames[i]) == ZT_NETWORK_RULE_ACTION_ACCEPT) ? 1 : 0;
+		}
+		const uint64_t tlinear = OSUtils::now() - t;
+		t = OSUtils::now();
+		for(unsigned int r=0;r<1000;++r) {
+			for(unsigned int i=0;i<1024;++i)
+				accepted += (fr.permits(frames[i])) ? 1 : 0;
+		}
+		const uint64_t tcompiled = OSUtils::now() - t;
+		std::cout << fr.entryCount() << " entries, linear " << (((double)tlinear * 1000000.0) / 1024000.0) << " ns/frame, compiled " << (((double)tcompiled * 1000000.0) / 1024000.0) << " ns/frame (" << accepted << " accepted)" << std::endl;
+	}
+
+	std::cout << "[other] Testing Path latency and loss estimation... "; std::cout.flush();
+	{
+		Path fast(InetAddress("10.0.0.2/9993"),InetAddress("10.0.0.1/9993"));
+		Path slow(InetAddress("10.0.0.3/9993"),InetAddress("10.0.0.1/9993"));
+		Path lossy(InetAddress("10.0.0.4/9993"),InetAddress("10.0.0.1/9993"));
+		if ((fast.latency() != ZT_PATH_LATENCY_UNKNOWN)||(fast.packetLoss() != 0)) {
+			std::cout << "FAILED! (initial state)" << std::endl;
+			return -1;
+		}
+		for(unsigned int i=0;i<64;++i) {
+			fast.pinged(i); fast.updateLatency(10 + (i % 3));
+			slow.pinged(i); slow.updateLatency(100);
+			lossy.pinged(i);
+			if ((i % 2) == 0) lossy.updateLatency(10);
+		}
+		if ((fast.latency() < 10)||(fast.latency() > 12)||(slow.latency() != 100)||(fast.packetLoss() != 0)||(lossy.packetLoss() < (ZT_PATH_PACKET_LOSS_MAX / 8))) {
+			std::cout << "FAILED! (fast " << fast.latency() << "ms, slow " << slow.latency() << "ms, lossy " << lossy.packetLoss() << ")" << std::endl;
+			return -1;
+		}
+		if ((fast.score() <= slow.score())||(fast.score() <= lossy.score())||(lossy.score() <= Path(InetAddress("10.0.0.5/9993"),InetAddress("10.0.0.1/9993")).score())) {
+			std::cout << "FAILED! (score ordering)" << std::endl;
+			return -1;
+		}
+	}
+	std::cout << "PASS" << std::endl;
+
+	std::cout << "[other] Testing DeferredPackets with " << ZT_TEST_DEFERRED_PRODUCERS << " producers and " << ZT_TEST_DEFERRED_CONSUMERS << " consumers... "; std::cout.flush();
+	{
+		const unsigned long overfill = 10;
+		const unsigned long total = ZT_DEFFEREDPACKETS_MAX + overfill + (ZT_TEST_DEFERRED_PRODUCERS * ZT_TEST_DEFERRED_PACKETS_PER_PRODUCER);
+		TestDeferredPackets *const dp = new TestDeferredPackets(total);
+
+		// Nobody is dequeueing yet, so the ring fills and the rest are dropped and counted
+		uint8_t data[ZT_PROTO_MIN_PACKET_LENGTH];
+		memset(data,0,sizeof(data));
+		unsigned long accepted = 0;
+		for(unsigned long id=0;id<(ZT_DEFFEREDPACKETS_MAX + overfill);++id) {
+			data[7] = (uint8_t)id;
+			data[6] = (uint8_t)(id >> 8);
+			IncomingPacket pkt(data,sizeof(data),InetAddress(),InetAddress(),0);
+			if (dp->enqueue(&pkt))
+				++accepted;
+		}
+		if ((accepted != ZT_DEFFEREDPACKETS_MAX)||(dp->dropped() != overfill)||(dp->depth() != ZT_DEFFEREDPACKETS_MAX)) {
+			std::cout << "FAILED! (full ring: " << accepted << " accepted, " << dp->dropped() << " dropped, depth " << dp->depth() << ")" << std::endl;
+			return -1;
+		}
+
+		TestDeferredConsumer consumers[ZT_TEST_DEFERRED_CONSUMERS];
+		for(unsigned int c=0;c<ZT_TEST_DEFERRED_CONSUMERS;++c) {
+			consumers[c].dp = dp;
+			consumers[c].thread = Thread::start(&(consumers[c]));
+		}
+		TestDeferredProducer producers[ZT_TEST_DEFERRED_PRODUCERS];
+		const uint64_t start = OSUtils::now();
+		for(unsigned int p=0;p<ZT_TEST_DEFERRED_PRODUCERS;++p) {
+			producers[p].dp = dp;
+			producers[p].first = ZT_DEFFEREDPACKETS_MAX + overfill + (p * ZT_TEST_DEFERRED_PACKETS_PER_PRODUCER);
+			producers[p].count = ZT_TEST_DEFERRED_PACKETS_PER_PRODUCER;
+			producers[p].thread = Thread::start(&(producers[p]));
+		}
+		unsigned long failed = 0;
+		for(unsigned int p=0;p<ZT_TEST_DEFERRED_PRODUCERS;++p) {
+			Thread::join(producers[p].thread);
+			failed += producers[p].failed;
+		}
+		const unsigned long expected = total - overfill;
+		for(unsigned int t=0;((t<10000)&&((unsigned long)((int)dp->decoded) < expected));++t)
+			Thread::sleep(1);
+		const uint64_t end = OSUtils::now();
+
+		unsigned long lost = 0,duplicated = 0;
+		for(unsigned long id=0;id<total;++id) {
+			const int n = (int)dp->seen[id];
+			if ((id >= ZT_DEFFEREDPACKETS_MAX)&&(id < (ZT_DEFFEREDPACKETS_MAX + overfill))) {
+				if (n)
+					++duplicated; // was dropped, so should never come out
+			} else if (n == 0) {
+				++lost;
+			} else if (n > 1) {
+				++duplicated;
+			}
+		}
+		const uint64_t dropped = dp->dropped();
+		const unsigned long depth = dp->depth();
+		delete dp; // wakes consumers, whose process() then returns -1
+		for(unsigned int c=0;c<ZT_TEST_DEFERRED_CONSUMERS;++c)
+			Thread::join(consumers[c].thread);
+
+		std::cout << expected << " packets, " << failed << " full ring retries, " << (unsigned long)((double)expected / ((double)std::max(end - start,(uint64_t)1) / 1000.0)) << " packets/second ";
+		if ((lost)||(duplicated)||(dropped != (overfill + failed))||(depth)) {
+			std::cout << "FAILED! (" << lost << " lost, " << duplicated << " duplicated, " << dropped << " dropped, depth " << depth << ")" << std::endl;
+			return -1;
 		}
 	}
 	std::cout << "PASS" << std::endl;
@@ -827,55 +1458,1280 @@ static int testOther()
 	return 0;
 }
 
-#define ZT_TEST_PHY_NUM_UDP_PACKETS 10000
-#define ZT_TEST_PHY_UDP_PACKET_SIZE 1000
-#define ZT_TEST_PHY_NUM_VALID_TCP_CONNECTS 10
-#define ZT_TEST_PHY_NUM_INVALID_TCP_CONNECTS 2
-#define ZT_TEST_PHY_TCP_MESSAGE_SIZE 1000000
-#define ZT_TEST_PHY_TIMEOUT_MS 20000
-static unsigned long phyTestUdpPacketCount = 0;
-static unsigned long phyTestTcpByteCount = 0;
-static unsigned long phyTestTcpConnectSuccessCount = 0;
-static unsigned long phyTestTcpConnectFailCount = 0;
-static unsigned long phyTestTcpAcceptCount = 0;
-struct TestPhyHandlers;
-static Phy<TestPhyHandlers *> *testPhyInstance = (Phy<TestPhyHandlers *> *)0;
-struct TestPhyHandlers
+// Default world ID (see node/Topology.cpp); a cached "world" with a later timestamp replaces it
+#define ZT_TEST_SIM_WORLD_ID 149604618ULL
+#define ZT_TEST_SIM_FLOWS 64
+#define ZT_TEST_SIM_FRAMES 4096
+#define ZT_TEST_SIM_FRAME_SIZE 1000
+
+/* Two in-process nodes joined by an IPv4 link and an IPv6 link, each with
+ * its own latency and loss. Node 0 is the network controller and each node
+ * is the other's only root, so they find each other over both links without
+ * touching a real network. Time is virtual and packets are delivered in order
+ * of arrival time. */
+struct SimLink
 {
-	inline void phyOnDatagram(PhySocket *sock,void **uptr,const struct sockaddr *localAddr,const struct sockaddr *from,void *data,unsigned long len)
+	InetAddress addr[2]; // node 0's and node 1's address on this link
+	unsigned int latency; // one way in ms
+	unsigned int lossPerMille;
+	unsigned int jitter; // random extra latency in ms, reorders datagrams
+	unsigned int duplicatePerMille;
+	unsigned int maxPacketSize; // larger datagrams are dropped
+	unsigned long sent[2]; // packets sent by node 0 and node 1
+};
+struct SimPacket
+{
+	unsigned int to;
+	InetAddress localAddr;
+	InetAddress remoteAddr;
+	std::string data;
+};
+struct SimNet;
+struct SimNodeRef
+{
+	SimNet *net;
+	unsigned int n;
+};
+struct SimNet
+{
+	ZT_Node *nodes[2];
+	SimNodeRef refs[2];
+	std::map<std::string,std::string> store[2];
+	SimLink links[2];
+	std::multimap<uint64_t,SimPacket> inFlight;
+	uint64_t now;
+	volatile uint64_t deadline[2];
+	uint32_t lossPrng;
+	uint32_t lastSeq[ZT_TEST_SIM_FLOWS]; // last frame sequence number node 1 got in each flow
+	unsigned long framesReceived;
+	unsigned long framesReordered;
+	std::set<uint64_t> framesSeen; // flow and sequence number of each distinct frame node 1 got
+};
+class SimController : public NetworkController
+{
+public:
+	SimController(const SimNet *net) : comsIssued(0),_net(net) {}
+	virtual NetworkController::ResultCode doNetworkConfigRequest(const InetAddress &fromAddr,const Identity &signingId,const Identity &identity,uint64_t nwid,const Dictionary<ZT_NETWORKCONFIG_DICT_CAPACITY> &metaData,NetworkConfig &nc)
 	{
-		++phyTestUdpPacketCount;
+		nc.networkId = nwid;
+		nc.timestamp = _net->now;
+		nc.revision = 1;
+		nc.issuedTo = identity.address();
+		nc.type = ZT_NETWORK_TYPE_PRIVATE;
+		nc.multicastLimit = 32;
+		nc.rules[0].t = ZT_NETWORK_RULE_ACTION_ACCEPT;
+		nc.ruleCount = 1;
+		strcpy(nc.name,"multipath");
+		CertificateOfMembership com(_net->now,ZT_NETWORK_COM_DEFAULT_REVISION_MAX_DELTA,nwid,identity.address());
+		if (!com.sign(signingId))
+			return NetworkController::NETCONF_QUERY_INTERNAL_SERVER_ERROR;
+		nc.com = com;
+		++comsIssued;
+		return NetworkController::NETCONF_QUERY_OK;
+	}
+	unsigned long comsIssued;
+private:
+	const SimNet *_net;
+};
+static long simDataStoreGet(ZT_Node *node,void *uptr,const char *name,void *buf,unsigned long bufSize,unsigned long readIndex,unsigned long *totalSize)
+{
+	const SimNodeRef *const r = reinterpret_cast<const SimNodeRef *>(uptr);
+	std::map<std::string,std::string>::const_iterator o(r->net->store[r->n].find(std::string(name)));
+	if ((o == r->net->store[r->n].end())||(readIndex >= o->second.length()))
+		return -1;
+	*totalSize = (unsigned long)o->second.length();
+	const unsigned long n = std::min(bufSize,(unsigned long)o->second.length() - readIndex);
+	memcpy(buf,o->second.data() + readIndex,n);
+	return (long)n;
+}
+static int simDataStorePut(ZT_Node *node,void *uptr,const char *name,const void *data,unsigned long len,int secure)
+{
+	const SimNodeRef *const r = reinterpret_cast<const SimNodeRef *>(uptr);
+	if (data)
+		r->net->store[r->n][std::string(name)].assign(reinterpret_cast<const char *>(data),len);
+	else r->net->store[r->n].erase(std::string(name));
+	return 0;
+}
+static int simWirePacketSend(ZT_Node *node,void *uptr,const struct sockaddr_storage *localAddr,const struct sockaddr_storage *remoteAddr,const void *data,unsigned int len,unsigned int ttl)
+{
+	const SimNodeRef *const r = reinterpret_cast<const SimNodeRef *>(uptr);
+	SimNet &net = *(r->net);
+	const InetAddress &to = *(reinterpret_cast<const InetAddress *>(remoteAddr));
+	for(unsigned int l=0;l<2;++l) {
+		SimLink &link = net.links[l];
+		if (link.addr[r->n ^ 1] == to) {
+			++link.sent[r->n];
+			net.lossPrng = (net.lossPrng * 1103515245) + 12345;
+			if ((len <= link.maxPacketSize)&&(((net.lossPrng >> 16) % 1000) >= link.lossPerMille)) {
+				unsigned int copies = 1;
+				if ((link.duplicatePerMille)&&(((net.lossPrng >> 4) % 1000) < link.duplicatePerMille))
+					++copies;
+				while (copies--) {
+					net.lossPrng = (net.lossPrng * 1103515245) + 12345;
+					const uint64_t at = net.now + link.latency + ((link.jitter) ? ((net.lossPrng >> 16) % link.jitter) : 0);
+					SimPacket &p = net.inFlight.insert(std::pair< uint64_t,SimPacket >(at,SimPacket()))->second;
+					p.to = r->n ^ 1;
+					p.localAddr = to;
+					p.remoteAddr = link.addr[r->n];
+					p.data.assign(reinterpret_cast<const char *>(data),len);
+				}
+			}
+			return 0;
+		}
 	}
+	return -1;
+}
+static void simVirtualNetworkFrame(ZT_Node *node,void *uptr,uint64_t nwid,void **nuptr,uint64_t sourceMac,uint64_t destMac,unsigned int etherType,unsigned int vlanId,const void *data,unsigned int len)
+{
+	const SimNodeRef *const r = reinterpret_cast<const SimNodeRef *>(uptr);
+	const uint8_t *const b = reinterpret_cast<const uint8_t *>(data);
+	if ((etherType != ZT_ETHERTYPE_IPV4)||(len < 34))
+		return;
+	const unsigned int flow = (((unsigned int)b[28] << 8) | (unsigned int)b[29]) % ZT_TEST_SIM_FLOWS;
+	const uint32_t seq = ((uint32_t)b[30] << 24) | ((uint32_t)b[31] << 16) | ((uint32_t)b[32] << 8) | (uint32_t)b[33];
+	++r->net->framesReceived;
+	r->net->framesSeen.insert(((uint64_t)flow << 32) | (uint64_t)seq);
+	if (seq <= r->net->lastSeq[flow])
+		++r->net->framesReordered;
+	else r->net->lastSeq[flow] = seq;
+}
+static int simVirtualNetworkConfig(ZT_Node *node,void *uptr,uint64_t nwid,void **nuptr,enum ZT_VirtualNetworkConfigOperation op,const ZT_VirtualNetworkConfig *nc) { return 0; }
+static void simEvent(ZT_Node *node,void *uptr,enum ZT_Event event,const void *metaData) {}
+static std::string simWorld(const Identity &root,const SimLink *links,unsigned int rootNode,uint64_t ts)
+{
+	// Cached worlds aren't signature checked, so the key and signature can be left zero
+	const unsigned char zeros[ZT_C25519_PUBLIC_KEY_LEN + ZT_C25519_SIGNATURE_LEN] = { 0 };
+	Buffer<ZT_WORLD_MAX_SERIALIZED_LENGTH> b;
+	b.append((uint8_t)0x01);
+	b.append((uint64_t)ZT_TEST_SIM_WORLD_ID);
+	b.append((uint64_t)ts);
+	b.append(zeros,sizeof(zeros));
+	b.append((uint8_t)1);
+	root.serialize(b,false);
+	b.append((uint8_t)2);
+	links[0].addr[rootNode].serialize(b);
+	links[1].addr[rootNode].serialize(b);
+	return std::string(reinterpret_cast<const char *>(b.data()),b.size());
+}
+static void simRun(SimNet &net,uint64_t until)
+{
+	for(;;) {
+		uint64_t next = std::min(net.deadline[0],net.deadline[1]);
+		if ((!net.inFlight.empty())&&(net.inFlight.begin()->first < next))
+			next = net.inFlight.begin()->first;
+		if (next > until) {
+			net.now = until;
+			return;
+		}
+		if (next > net.now)
+			net.now = next;
 
-	inline void phyOnTcpConnect(PhySocket *sock,void **uptr,bool success)
-	{
-		if (success) {
-			++phyTestTcpConnectSuccessCount;
+		if ((!net.inFlight.empty())&&(net.inFlight.begin()->first <= net.now)) {
+			const SimPacket p(net.inFlight.begin()->second);
+			net.inFlight.erase(net.inFlight.begin());
+			ZT_Node_processWirePacket(net.nodes[p.to],net.now,reinterpret_cast<const struct sockaddr_storage *>(&(p.localAddr)),reinterpret_cast<const struct sockaddr_storage *>(&(p.remoteAddr)),p.data.data(),(unsigned int)p.data.length(),&(net.deadline[p.to]));
 		} else {
-			++phyTestTcpConnectFailCount;
+			for(unsigned int i=0;i<2;++i) {
+				if (net.deadline[i] <= net.now) {
+					ZT_Node_processBackgroundTasks(net.nodes[i],net.now,&(net.deadline[i]));
+					if (net.deadline[i] <= net.now)
+						net.deadline[i] = net.now + 1;
+				}
+			}
 		}
 	}
-
-	inline void phyOnTcpAccept(PhySocket *sockL,PhySocket *sockN,void **uptrL,void **uptrN,const struct sockaddr *from)
-	{
-		++phyTestTcpAcceptCount;
-		*uptrN = new std::string(ZT_TEST_PHY_TCP_MESSAGE_SIZE,(char)0xff);
-		testPhyInstance->setNotifyWritable(sockN,true);
+}
+static void simSendFrames(SimNet &net,uint64_t nwid,const MAC &from,const MAC &to,unsigned int frameSize)
+{
+	uint8_t frame[ZT_MAX_MTU];
+	for(unsigned int i=0;i<frameSize;++i)
+		frame[i] = (uint8_t)rand();
+	frame[0] = 0x45; // IPv4, 20 byte header
+	frame[1] = 0;
+	frame[2] = (uint8_t)(frameSize >> 8);
+	frame[3] = (uint8_t)frameSize;
+	frame[6] = 0x40; // don't fragment
+	frame[7] = 0;
+	frame[8] = 64;
+	frame[9] = 17; // UDP
+	frame[12] = 192; frame[13] = 168; frame[14] = 77; frame[15] = 1;
+	frame[16] = 192; frame[17] = 168; frame[18] = 77; frame[19] = 2;
+	frame[22] = 0x27; frame[23] = 0x09;
+	for(unsigned int k=0;k<ZT_TEST_SIM_FRAMES;++k) {
+		const unsigned int flow = k % ZT_TEST_SIM_FLOWS;
+		const uint32_t seq = ++net.lastSeq[flow] + 0x10000; // keep ahead of what node 1 has seen
+		frame[20] = (uint8_t)((10000 + flow) >> 8); // UDP source port identifies the flow
+		frame[21] = (uint8_t)(10000 + flow);
+		frame[28] = (uint8_t)(flow >> 8);
+		frame[29] = (uint8_t)flow;
+		frame[30] = (uint8_t)(seq >> 24);
+		frame[31] = (uint8_t)(seq >> 16);
+		frame[32] = (uint8_t)(seq >> 8);
+		frame[33] = (uint8_t)seq;
+		ZT_Node_processVirtualNetworkFrame(net.nodes[0],net.now,nwid,from.toInt(),to.toInt(),ZT_ETHERTYPE_IPV4,0,frame,frameSize,&(net.deadline[0]));
+		simRun(net,net.now + 1);
 	}
-
-	inline void phyOnTcpClose(PhySocket *sock,void **uptr)
-	{
-		delete (std::string *)*uptr; // delete testMessage if any
+	simRun(net,net.now + 1000);
+}
+static int testMultipath()
+{
+	std::cout << "[multipath] Starting two nodes joined by simulated IPv4 and IPv6 links... "; std::cout.flush();
+
+	SimNet *const net = new SimNet();
+	SimController controller(net);
+	net->now = 1500000000000ULL;
+	net->lossPrng = 1;
+	net->links[0].addr[0] = InetAddress("10.1.0.1/9993");
+	net->links[0].addr[1] = InetAddress("10.1.0.2/9993");
+	net->links[0].latency = 10;
+	net->links[0].lossPerMille = 10;
+	net->links[0].maxPacketSize = 65507; // LAN or jumbo frame path where big datagrams get through
+	net->links[1].addr[0] = InetAddress("fd00:1::1/9993");
+	net->links[1].addr[1] = InetAddress("fd00:1::2/9993");
+	net->links[1].latency = 14;
+	net->links[1].lossPerMille = 20;
+	net->links[1].maxPacketSize = 1452; // 1500 byte MTU, fragments dropped
+
+	Identity ids[2];
+	for(unsigned int i=0;i<2;++i)
+		ids[i].generate();
+	for(unsigned int i=0;i<2;++i) {
+		net->refs[i].net = net;
+		net->refs[i].n = i;
+		net->store[i]["identity.secret"] = ids[i].toString(true);
+		net->store[i]["world"] = simWorld(ids[i ^ 1],net->links,i ^ 1,net->now);
+		if (ZT_Node_new(&(net->nodes[i]),&(net->refs[i]),net->now,&simDataStoreGet,&simDataStorePut,&simWirePacketSend,&simVirtualNetworkFrame,&simVirtualNetworkConfig,(ZT_PathCheckFunction)0,&simEvent) != ZT_RESULT_OK) {
+			std::cout << "FAILED! (ZT_Node_new)" << std::endl;
+			return -1;
+		}
+		net->deadline[i] = net->now;
+		ZT_Node_setPathMtuDiscovery(net->nodes[i],1); // links drop oversized datagrams, as if DF were set
 	}
-
-	inline void phyOnTcpData(PhySocket *sock,void **uptr,void *data,unsigned long len)
-	{
-		phyTestTcpByteCount += len;
+	ZT_Node_setNetconfMaster(net->nodes[0],(void *)&controller);
+	const uint64_t nwid = (ids[0].address().toInt() << 24) | 0x000001ULL;
+	for(unsigned int i=0;i<2;++i)
+		ZT_Node_join(net->nodes[i],nwid,(void *)0);
+
+	// Wait for both nodes to be configured and for node 0 to have measured both paths to node 1
+	unsigned int measuredPaths = 0;
+	for(unsigned int t=0;((t<60)&&(measuredPaths < 2));++t) {
+		simRun(*net,net->now + 10000);
+		ZT_VirtualNetworkConfig *nc = ZT_Node_networkConfig(net->nodes[1],nwid);
+		const bool configured = ((nc)&&(nc->status == ZT_NETWORK_STATUS_OK));
+		if (nc)
+			ZT_Node_freeQueryResult(net->nodes[1],nc);
+		measuredPaths = 0;
+		ZT_PeerList *pl = ZT_Node_peers(net->nodes[0]);
+		for(unsigned long p=0;((configured)&&(p<pl->peerCount));++p) {
+			if (pl->peers[p].address == ids[1].address().toInt()) {
+				for(unsigned int k=0;k<pl->peers[p].pathCount;++k) {
+					if ((pl->peers[p].paths[k].active)&&(pl->peers[p].paths[k].latency))
+						++measuredPaths;
+				}
+			}
+		}
+		ZT_Node_freeQueryResult(net->nodes[0],pl);
+	}
+	if (measuredPaths < 2) {
+		std::cout << "FAILED! (only " << measuredPaths << " measured paths after " << ((net->now - 1500000000000ULL) / 1000) << "s)" << std::endl;
+		return -1;
+	}
+	std::cout << "PASS (" << ((net->now - 1500000000000ULL) / 1000) << "s simulated)" << std::endl;
+
+	const MAC fromMac(ids[0].address(),nwid);
+	const MAC toMac(ids[1].address(),nwid);
+	for(unsigned int multipath=0;multipath<2;++multipath) {
+		std::cout << "[multipath] Sending " << ZT_TEST_SIM_FRAMES << " frames in " << ZT_TEST_SIM_FLOWS << " flows with multipath " << ((multipath) ? "on" : "off") << "... "; std::cout.flush();
+		ZT_Node_setMultipathMode(net->nodes[0],(int)multipath);
+		net->links[0].sent[0] = 0;
+		net->links[1].sent[0] = 0;
+		net->framesReceived = 0;
+		net->framesReordered = 0;
+		simSendFrames(*net,nwid,fromMac,toMac,ZT_TEST_SIM_FRAME_SIZE);
+		const unsigned long total = net->links[0].sent[0] + net->links[1].sent[0];
+		const unsigned long least = std::min(net->links[0].sent[0],net->links[1].sent[0]);
+		std::cout << "IPv4 " << net->links[0].sent[0] << " / IPv6 " << net->links[1].sent[0] << " packets, " << net->framesReceived << " received, " << net->framesReordered << " reordered ";
+		if ( (net->framesReceived < ((ZT_TEST_SIM_FRAMES * 9) / 10)) || (net->framesReordered) || ((multipath) ? (least < (total / 5)) : (least > (total / 20))) ) {
+			std::cout << "FAILED!" << std::endl;
+			return -1;
+		}
+		std::cout << "PASS" << std::endl;
 	}
 
-	inline void phyOnTcpWritable(PhySocket *sock,void **uptr)
+	std::cout << "[multipath] Checking per-path counters... "; std::cout.flush();
 	{
-		std::string *testMessage = (std::string *)*uptr;
+		ZT_PeerList *pl = ZT_Node_peers(net->nodes[0]);
+		unsigned int busyPaths = 0;
+		for(unsigned long p=0;p<pl->peerCount;++p) {
+			if (pl->peers[p].address == ids[1].address().toInt()) {
+				for(unsigned int k=0;k<pl->peers[p].pathCount;++k) {
+					std::cout << reinterpret_cast<const InetAddress *>(&(pl->peers[p].paths[k].address))->toString() << " " << pl->peers[p].paths[k].latency << "ms " << pl->peers[p].paths[k].packetsSent << " packets " << pl->peers[p].paths[k].bytesSent << " bytes, ";
+					if (pl->peers[p].paths[k].packetsSent >= (ZT_TEST_SIM_FRAMES / 5))
+						++busyPaths;
+				}
+			}
+		}
+		ZT_Node_freeQueryResult(net->nodes[0],pl);
+		if (busyPaths != 2) {
+			std::cout << "FAILED!" << std::endl;
+			return -1;
+		}
+	}
+	std::cout << "PASS" << std::endl;
+
+	std::cout << "[multipath] Checking certificate of membership verification counters... "; std::cout.flush();
+	{
+		// Node 1 gets frames and so must check node 0's certificate, but each
+		// certificate revision is only checked once however often it's pushed.
+		for(unsigned int i=0;i<2;++i) {
+			ZT_NodeStatus status;
+			ZT_Node_status(net->nodes[i],&status);
+			std::cout << "node " << i << " " << status.verifiedComCacheMisses << " verified " << status.verifiedComCacheHits << " cached, ";
+			if (((i == 1)&&(!status.verifiedComCacheMisses))||(status.verifiedComCacheMisses > controller.comsIssued)) {
+				std::cout << "FAILED! (" << controller.comsIssued << " issued)" << std::endl;
+				return -1;
+			}
+		}
+	}
+	std::cout << "PASS" << std::endl;
+
+	std::cout << "[multipath] Re-checking one certificate of membership through two fresh peers... "; std::cout.flush();
+	{
+		// Node 0 is the controller, so it checks its own signature. Only the
+		// first check is computed, whether the same or a re-created Peer repeats it.
+		RuntimeEnvironment *const rr = new RuntimeEnvironment(reinterpret_cast<Node *>(net->nodes[0]));
+		rr->identity = ids[0];
+		rr->topology = new Topology(rr);
+		Identity member;
+		member.generate();
+		CertificateOfMembership com(net->now,ZT_NETWORK_COM_DEFAULT_REVISION_MAX_DELTA,nwid,member.address());
+		com.sign(ids[0]);
+		uint64_t hits[3],misses[3];
+		bool ok = true;
+		{
+			SharedPtr<Peer> p(new Peer(rr,ids[0],member));
+			ok &= p->validateAndSetNetworkMembershipCertificate(nwid,com);
+			rr->topology->verifiedComCacheCounters(hits[0],misses[0]);
+			ok &= p->validateAndSetNetworkMembershipCertificate(nwid,com);
+			rr->topology->verifiedComCacheCounters(hits[1],misses[1]);
+		}
+		{
+			SharedPtr<Peer> p(new Peer(rr,ids[0],member));
+			ok &= p->validateAndSetNetworkMembershipCertificate(nwid,com);
+			rr->topology->verifiedComCacheCounters(hits[2],misses[2]);
+		}
+		delete rr->topology;
+		delete rr;
+		std::cout << misses[2] << " verified " << hits[2] << " cached ";
+		if ((!ok)||(misses[0] != 1)||(hits[0] != 0)||(hits[1] != 1)||(misses[1] != 1)||(hits[2] != 2)||(misses[2] != 1)) {
+			std::cout << "FAILED!" << std::endl;
+			return -1;
+		}
+	}
+	std::cout << "PASS" << std::endl;
+
+	std::cout << "[multipath] Waiting for path MTU discovery... "; std::cout.flush();
+	{
+		unsigned int mtu4 = 0,mtu6 = 0;
+		// Long enough for a path whose MTU was reset by dead path detection to be probed again
+		for(unsigned int t=0;t<((ZT_PATH_MTU_REPROBE_INTERVAL / 10000) * 2);++t) {
+			simRun(*net,net->now + 10000);
+			ZT_PeerList *pl = ZT_Node_peers(net->nodes[0]);
+			for(unsigned long p=0;p<pl->peerCount;++p) {
+				if (pl->peers[p].address == ids[1].address().toInt()) {
+					for(unsigned int k=0;k<pl->peers[p].pathCount;++k) {
+						if (pl->peers[p].paths[k].address.ss_family == AF_INET)
+							mtu4 = pl->peers[p].paths[k].mtu;
+						else mtu6 = pl->peers[p].paths[k].mtu;
+					}
+				}
+			}
+			ZT_Node_freeQueryResult(net->nodes[0],pl);
+			if ((mtu4 == ZT_PATH_MTU_PROBE_MAX)&&(mtu6 == (ZT_PATH_MTU_ETHERNET - ZT_PATH_MTU_IPV6_UDP_OVERHEAD)))
+				break;
+		}
+		std::cout << "IPv4 " << mtu4 << " / IPv6 " << mtu6 << " after " << ((net->now - 1500000000000ULL) / 1000) << "s simulated ";
+		if ((mtu4 != ZT_PATH_MTU_PROBE_MAX)||(mtu6 != (ZT_PATH_MTU_ETHERNET - ZT_PATH_MTU_IPV6_UDP_OVERHEAD))) {
+			std::cout << "FAILED!" << std::endl;
+			return -1;
+		}
+	}
+	std::cout << "PASS" << std::endl;
+
+	for(unsigned int multipath=0;multipath<2;++multipath) {
+		std::cout << "[multipath] Sending " << ZT_TEST_SIM_FRAMES << " " << ZT_MAX_MTU << " byte frames with multipath " << ((multipath) ? "on" : "off") << "... "; std::cout.flush();
+		ZT_Node_setMultipathMode(net->nodes[0],(int)multipath);
+		net->links[0].sent[0] = 0;
+		net->links[1].sent[0] = 0;
+		net->framesReceived = 0;
+		net->framesReordered = 0;
+		simSendFrames(*net,nwid,fromMac,toMac,ZT_MAX_MTU);
+		std::cout << "IPv4 " << net->links[0].sent[0] << " / IPv6 " << net->links[1].sent[0] << " packets, " << net->framesReceived << " received, " << net->framesReordered << " reordered ";
+		// Frames take one datagram over the IPv4 path and are fragmented over the IPv6 one
+		const bool fragmentedAsExpected = (multipath) ? (net->links[1].sent[0] > (net->links[0].sent[0] / 2)) : (net->links[0].sent[0] < ((ZT_TEST_SIM_FRAMES * 21) / 20));
+		if ((net->framesReceived < ((ZT_TEST_SIM_FRAMES * 9) / 10))||(net->framesReordered)||(!fragmentedAsExpected)) {
+			std::cout << "FAILED!" << std::endl;
+			return -1;
+		}
+		std::cout << "PASS" << std::endl;
+	}
+
+	std::cout << "[multipath] Benchmarking reassembly of " << ZT_TEST_SIM_FRAMES << " " << ZT_MAX_MTU << " byte frames with out of order and duplicate fragments... "; std::cout.flush();
+	{
+		// Multipath fragments about half the frames over the IPv6 link, which
+		// now delivers datagrams in random order and repeats one in ten
+		ZT_Node_setMultipathMode(net->nodes[0],1);
+		net->links[1].jitter = 40;
+		net->links[1].duplicatePerMille = 100;
+		net->framesReceived = 0;
+		net->framesSeen.clear();
+		const uint64_t start = OSUtils::now();
+		simSendFrames(*net,nwid,fromMac,toMac,ZT_MAX_MTU);
+		const uint64_t end = OSUtils::now();
+		net->links[1].jitter = 0;
+		net->links[1].duplicatePerMille = 0;
+		std::cout << net->framesReceived << " received, " << net->framesSeen.size() << " distinct, " << (unsigned long)(((double)ZT_TEST_SIM_FRAMES / ((double)std::max(end - start,(uint64_t)1) / 1000.0))) << " frames/second ";
+		if (net->framesSeen.size() < ((ZT_TEST_SIM_FRAMES * 9) / 10)) {
+			std::cout << "FAILED!" << std::endl;
+			return -1;
+		}
+	}
+	std::cout << "PASS" << std::endl;
+
+	for(unsigned int i=0;i<2;++i)
+		ZT_Node_delete(net->nodes[i]);
+	delete net;
+
+	return 0;
+}
+
+#ifdef ZT_ENABLE_CLUSTER
+#define ZT_TEST_CLUSTER_REMOTE_PEERS 1000000
+#define ZT_TEST_CLUSTER_MEMBERS 16
+#define ZT_TEST_CLUSTER_HAVE_PEERS 64
+
+/* Two nodes sharing one identity as members 0 and 1 of a cluster. Member 0
+ * has a background sender thread and member 1 flushes from its periodic
+ * tasks. State messages are queued here and handed over by the test loop. */
+struct SimCluster;
+struct SimClusterRef
+{
+	SimCluster *c;
+	unsigned int n;
+};
+struct SimCluster
+{
+	SimClusterRef refs[2];
+	std::vector<std::string> queued[2]; // messages for each member
+	Mutex queued_m;
+	unsigned long messages;
+	unsigned long bytes;
+};
+static void simClusterSend(void *uptr,unsigned int toMemberId,const void *data,unsigned int len)
+{
+	SimClusterRef *const r = reinterpret_cast<SimClusterRef *>(uptr);
+	Mutex::Lock _l(r->c->queued_m);
+	r->c->queued[r->n ^ 1].push_back(std::string(reinterpret_cast<const char *>(data),len));
+	++r->c->messages;
+	r->c->bytes += len;
+}
+static int testCluster()
+{
+	std::cout << "[cluster] Exchanging state messages between two members... "; std::cout.flush();
+
+	SimNet *const net = new SimNet();
+	SimCluster *const cluster = new SimCluster();
+	net->now = 1500000000000ULL;
+	Identity id,root;
+	id.generate();
+	root.generate();
+	net->links[0].addr[0] = InetAddress("10.2.0.1/9993");
+	net->links[0].addr[1] = InetAddress("10.2.0.1/9993");
+	net->links[1].addr[0] = InetAddress("fd00:2::1/9993");
+	net->links[1].addr[1] = InetAddress("fd00:2::1/9993");
+	for(unsigned int i=0;i<2;++i) {
+		net->refs[i].net = net;
+		net->refs[i].n = i;
+		net->store[i]["identity.secret"] = id.toString(true);
+		net->store[i]["world"] = simWorld(root,net->links,0,net->now); // nobody is home at the root's addresses
+		if (ZT_Node_new(&(net->nodes[i]),&(net->refs[i]),net->now,&simDataStoreGet,&simDataStorePut,&simWirePacketSend,&simVirtualNetworkFrame,&simVirtualNetworkConfig,(ZT_PathCheckFunction)0,&simEvent) != ZT_RESULT_OK) {
+			std::cout << "FAILED! (ZT_Node_new)" << std::endl;
+			return -1;
+		}
+		net->deadline[i] = net->now;
+
+		InetAddress endpoints[4];
+		for(unsigned int k=0;k<4;++k)
+			endpoints[k] = InetAddress(std::string("10.3.0.") + (char)('1' + k) + "/" + (char)('5' + i) + "993");
+		cluster->refs[i].c = cluster;
+		cluster->refs[i].n = i;
+		if ((ZT_Node_clusterInit(net->nodes[i],i,reinterpret_cast<const struct sockaddr_storage *>(endpoints),4,0,0,0,&simClusterSend,&(cluster->refs[i]),(int (*)(void *,const struct sockaddr_storage *,int *,int *,int *))0,(void *)0) != ZT_RESULT_OK)||(ZT_Node_clusterAddMember(net->nodes[i],i ^ 1) != ZT_RESULT_OK)) {
+			std::cout << "FAILED! (ZT_Node_clusterInit)" << std::endl;
+			return -1;
+		}
+	}
+	Thread sender = Thread::start(reinterpret_cast<Node *>(net->nodes[0]));
+
+	ZT_ClusterStatus *const cs = new ZT_ClusterStatus;
+	unsigned int alive = 0;
+	for(unsigned int t=0;((t<100)&&(alive < 2));++t) {
+		simRun(*net,net->now + 100);
+		Thread::sleep(ZT_CLUSTER_FLUSH_PERIOD); // let the sender thread's flush deadline pass
+		for(unsigned int i=0;i<2;++i) {
+			std::vector<std::string> q;
+			{
+				Mutex::Lock _l(cluster->queued_m);
+				q.swap(cluster->queued[i]);
+			}
+			for(std::vector<std::string>::iterator m(q.begin());m!=q.end();++m)
+				ZT_Node_clusterHandleIncomingMessage(net->nodes[i],m->data(),(unsigned int)m->length());
+		}
+		alive = 0;
+		for(unsigned int i=0;i<2;++i) {
+			ZT_Node_clusterStatus(net->nodes[i],cs);
+			for(unsigned int k=0;k<cs->clusterSize;++k) {
+				if ((cs->members[k].id == (i ^ 1))&&(cs->members[k].alive)&&(cs->members[k].numZeroTierPhysicalEndpoints == 4))
+					++alive;
+			}
+		}
+	}
+	delete cs;
+
+	for(unsigned int i=0;i<2;++i)
+		ZT_Node_delete(net->nodes[i]);
+	Thread::join(sender);
+	std::cout << cluster->messages << " messages, " << cluster->bytes << " bytes ";
+	delete cluster;
+	delete net;
+
+	if (alive < 2) {
+		std::cout << "FAILED!" << std::endl;
+		return -1;
+	}
+	std::cout << "PASS" << std::endl;
+
+	std::cout << "[cluster] Round-tripping a compressed batch of " << ZT_TEST_CLUSTER_HAVE_PEERS << " HAVE_PEER messages... "; std::cout.flush();
+	{
+		// Two members built directly on one simulated node's topology, so the
+		// batch can be checked on the wire and the identities in the data store
+		SimNet *const cnet = new SimNet();
+		SimCluster *const sc = new SimCluster();
+		cnet->now = 1500000000000ULL;
+		Identity id,root;
+		id.generate();
+		root.generate();
+		cnet->refs[0].net = cnet;
+		cnet->refs[0].n = 0;
+		cnet->store[0]["identity.secret"] = id.toString(true);
+		cnet->store[0]["world"] = simWorld(root,cnet->links,0,cnet->now);
+		if (ZT_Node_new(&(cnet->nodes[0]),&(cnet->refs[0]),cnet->now,&simDataStoreGet,&simDataStorePut,&simWirePacketSend,&simVirtualNetworkFrame,&simVirtualNetworkConfig,(ZT_PathCheckFunction)0,&simEvent) != ZT_RESULT_OK) {
+			std::cout << "FAILED! (ZT_Node_new)" << std::endl;
+			return -1;
+		}
+		RuntimeEnvironment *rr[2];
+		Cluster *c[2];
+		for(unsigned int i=0;i<2;++i) {
+			rr[i] = new RuntimeEnvironment(reinterpret_cast<Node *>(cnet->nodes[0]));
+			rr[i]->identity = id;
+			rr[i]->topology = new Topology(rr[i]);
+			sc->refs[i].c = sc;
+			sc->refs[i].n = i;
+			c[i] = new Cluster(rr[i],(uint16_t)i,std::vector<InetAddress>(),0,0,0,&simClusterSend,&(sc->refs[i]),(int (*)(void *,const struct sockaddr_storage *,int *,int *,int *))0,(void *)0);
+			c[i]->addMember((uint16_t)(i ^ 1));
+		}
+
+		// Distinct addresses sharing one public key, so the batch compresses well
+		const std::string pub(root.toString(false).substr(ZT_ADDRESS_LENGTH_HEX + 3));
+		unsigned long rawBytes = 0;
+		for(unsigned int k=0;k<ZT_TEST_CLUSTER_HAVE_PEERS;++k) {
+			char tmp[256];
+			Utils::snprintf(tmp,sizeof(tmp),"%.10llx:0:%s",0x1000000000ULL + (unsigned long long)k,pub.c_str());
+			Identity peer;
+			if (!peer.fromString(tmp)) {
+				std::cout << "FAILED! (identity)" << std::endl;
+				return -1;
+			}
+			Buffer<1024> tmpb;
+			peer.serialize(tmpb);
+			rawBytes += 3 + tmpb.size();
+			c[1]->broadcastHavePeer(peer);
+		}
+		c[1]->doPeriodicTasks(); // no sender thread, so this flushes
+
+		std::vector<std::string> q;
+		{
+			Mutex::Lock _l(sc->queued_m);
+			q.swap(sc->queued[0]);
+		}
+		for(std::vector<std::string>::iterator m(q.begin());m!=q.end();++m)
+			c[0]->handleIncomingStateMessage(m->data(),(unsigned int)m->length());
+		unsigned int received = 0;
+		for(unsigned int k=0;k<ZT_TEST_CLUSTER_HAVE_PEERS;++k) {
+			char tmp[64];
+			Utils::snprintf(tmp,sizeof(tmp),"iddb.d/%.10llx",0x1000000000ULL + (unsigned long long)k);
+			if (cnet->store[0].count(std::string(tmp)))
+				++received;
+		}
+		const unsigned long wireBytes = sc->bytes;
+		std::cout << q.size() << " batches, " << wireBytes << " bytes on the wire for " << rawBytes << " bytes of messages, " << received << " received ";
+
+		for(unsigned int i=0;i<2;++i) {
+			delete c[i];
+			delete rr[i]->topology;
+			delete rr[i];
+		}
+		ZT_Node_delete(cnet->nodes[0]);
+		delete cnet;
+		delete sc;
+
+		// Batch headers and MACs only add to the total, so getting under half takes LZ4
+		if ((received != ZT_TEST_CLUSTER_HAVE_PEERS)||(wireBytes >= (rawBytes / 2))) {
+			std::cout << "FAILED!" << std::endl;
+			return -1;
+		}
+	}
+	std::cout << "PASS" << std::endl;
+
+	// Without -b this checks correctness on a hundredth of the peers
+	const unsigned long remotePeers = (benchmarks) ? ZT_TEST_CLUSTER_REMOTE_PEERS : (ZT_TEST_CLUSTER_REMOTE_PEERS / 100);
+	std::cout << "[cluster] " << ((benchmarks) ? "Benchmarking" : "Testing") << " remote peer locations with " << remotePeers << " peers across " << ZT_TEST_CLUSTER_MEMBERS << " members... "; std::cout.flush();
+	{
+		ClusterPeerLocations *const loc = new ClusterPeerLocations();
+		std::vector<uint64_t> peers(remotePeers);
+		for(unsigned long i=0;i<remotePeers;++i)
+			peers[i] = ((uint64_t)(i + 1) * 0x5851f42d4c957f2dULL) & 0xffffffffffULL; // odd multiplier, so distinct and well scattered
+
+		// Each peer is reported by one member, and one in eight later moves to the next member
+		const uint64_t now = 1500000000000ULL;
+		uint64_t start = OSUtils::now();
+		for(unsigned long i=0;i<remotePeers;++i)
+			loc->update(Address(peers[i]),(uint16_t)(i % ZT_TEST_CLUSTER_MEMBERS),now + (i / 1000));
+		for(unsigned long i=0;i<remotePeers;i+=8)
+			loc->update(Address(peers[i]),(uint16_t)((i + 1) % ZT_TEST_CLUSTER_MEMBERS),now + 10000);
+		uint64_t end = OSUtils::now();
+		std::cout << (unsigned long)((double)(remotePeers + (remotePeers / 8)) / ((double)std::max(end - start,(uint64_t)1) / 1000.0)) << " updates/second, ";
+
+		unsigned long wrong = 0;
+		start = OSUtils::now();
+		for(unsigned long i=0;i<remotePeers;++i) {
+			uint16_t mid = 0xffff;
+			uint64_t ts = 0;
+			if ((!loc->mostRecent(Address(peers[i]),mid,ts))||(mid != (uint16_t)(((i & 7) ? i : (i + 1)) % ZT_TEST_CLUSTER_MEMBERS)))
+				++wrong;
+		}
+		end = OSUtils::now();
+		std::cout << (unsigned long)((double)remotePeers / ((double)std::max(end - start,(uint64_t)1) / 1000.0)) << " lookups/second, ";
+
+		// Everything except the moved peers is older than this
+		loc->clean(now + 10000 + 1000,2000);
+		const unsigned long remaining = loc->size();
+		std::cout << remaining << " left after cleaning ";
+		delete loc;
+		if ((wrong)||(remaining != (remotePeers / 8))) {
+			std::cout << "FAILED! (" << wrong << " wrong)" << std::endl;
+			return -1;
+		}
+	}
+	std::cout << "PASS" << std::endl;
+
+	return 0;
+}
+#endif // ZT_ENABLE_CLUSTER
+
+#ifdef ZT_ENABLE_NETWORK_CONTROLLER
+#define ZT_TEST_CONTROLLER_NETWORKS 100
+#define ZT_TEST_CONTROLLER_MEMBERS 500
+#define ZT_TEST_CONTROLLER_BENCHMARK_MEMBERS 10000 // per network, with -b (a hundredth of this otherwise)
+#define ZT_TEST_CONTROLLER_POOL_MEMBERS 62000
+#define ZT_TEST_CONTROLLER_DB_PATH "zt-selftest-controller.db"
+
+/* Collects replies from the controller's request threads. Request packet
+ * IDs are indexes into the list of requests being replayed. */
+class TestControllerSender : public NetworkController::Sender
+{
+public:
+	TestControllerSender(unsigned long n) : answered(n,false),configs(0),errors(0) {}
+	virtual void ncSendConfig(uint64_t nwid,uint64_t requestPacketId,const Address &destination,const Dictionary<ZT_NETWORKCONFIG_DICT_CAPACITY> &config)
+	{
+		NetworkConfig nc;
+		const bool ok = nc.fromDictionary(config);
+		Mutex::Lock _l(lock);
+		if ((ok)&&(nc.networkId == nwid)&&(nc.issuedTo == destination)&&(requestPacketId < answered.size())) {
+			answered[(unsigned long)requestPacketId] = true;
+			++configs;
+		} else ++errors;
+	}
+	virtual void ncSendError(uint64_t nwid,uint64_t requestPacketId,const Address &destination,NetworkController::ResultCode rc)
+	{
+		Mutex::Lock _l(lock);
+		++errors;
+	}
+	std::vector<bool> answered;
+	unsigned long configs;
+	unsigned long errors;
+	Mutex lock;
+};
+
+/* Makes API changes to members of the test networks until told to stop, like
+ * a script or admin UI working on a busy controller. Each one bumps the
+ * network's revision, so members' cached configs have to be rebuilt. */
+class TestControllerApiWriter
+{
+public:
+	TestControllerApiWriter(SqliteNetworkController *c,const Identity &cid,const std::vector<Identity> &m) : controller(c),controllerId(cid),members(m),run(true),writes(0),reads(0),errors(0) {}
+	void threadMain()
+		throw()
+	{
+		for(unsigned long i=0;run;++i) {
+			char nwids[24];
+			Utils::snprintf(nwids,sizeof(nwids),"%.16llx",(unsigned long long)((controllerId.address().toInt() << 24) | (uint64_t)((i % ZT_TEST_CONTROLLER_NETWORKS) + 1)));
+			std::vector<std::string> path;
+			path.push_back("network");
+			path.push_back(nwids);
+			std::string responseBody,responseContentType;
+			if ((i % 4) == 3) {
+				if (controller->handleControlPlaneHttpGET(path,std::map<std::string,std::string>(),std::map<std::string,std::string>(),"",responseBody,responseContentType) == 200)
+					++reads;
+				else ++errors;
+			} else {
+				path.push_back("member");
+				path.push_back(members[(i / ZT_TEST_CONTROLLER_NETWORKS) % members.size()].address().toString());
+				if (controller->handleControlPlaneHttpPOST(path,std::map<std::string,std::string>(),std::map<std::string,std::string>(),"{\"authorized\":true}",responseBody,responseContentType) == 200)
+					++writes;
+				else ++errors;
+			}
+		}
+	}
+	SqliteNetworkController *const controller;
+	const Identity controllerId;
+	const std::vector<Identity> &members;
+	volatile bool run;
+	unsigned long writes;
+	unsigned long reads;
+	unsigned long errors;
+};
+
+/* Queue a config request from every member of every test network through
+ * the request threads, re-asking for dropped ones until all are answered.
+ * Prints the results and returns requests/second, or 0 on failure. */
+static unsigned long testControllerReplay(SqliteNetworkController *controller,const Identity &controllerId,const std::vector<Identity> &members,const Dictionary<ZT_NETWORKCONFIG_DICT_CAPACITY> &metaData)
+{
+	const unsigned long total = ZT_TEST_CONTROLLER_NETWORKS * (unsigned long)members.size();
+	TestControllerSender sender(total);
+	SqliteNetworkController::RequestQueueStats rqs;
+	controller->requestQueueStats(rqs);
+	const uint64_t receivedBefore = rqs.received;
+	const uint64_t droppedBefore = rqs.dropped;
+	const uint64_t start = OSUtils::now();
+	uint64_t queueTime = 0;
+	unsigned int rounds = 0;
+	for(;;) {
+		// Each round every member that hasn't gotten a config yet asks again,
+		// just as real members retry requests the controller dropped.
+		const uint64_t qstart = OSUtils::now();
+		unsigned long asked = 0;
+		for(unsigned long i=0;i<total;++i) {
+			if (!sender.answered[i]) {
+				const uint64_t nwid = (controllerId.address().toInt() << 24) | (uint64_t)((i % ZT_TEST_CONTROLLER_NETWORKS) + 1);
+				controller->request(&sender,(uint64_t)i,InetAddress(),controllerId,members[i / ZT_TEST_CONTROLLER_NETWORKS],nwid,metaData);
+				++asked;
+			}
+		}
+		queueTime += OSUtils::now() - qstart;
+		if (!asked)
+			break;
+		if (++rounds > 16) {
+			std::cout << "FAILED! (" << (total - sender.configs) << " never answered)" << std::endl;
+			return 0;
+		}
+		for(;;) {
+			controller->requestQueueStats(rqs);
+			if (rqs.completed == rqs.received)
+				break;
+			Thread::sleep(10);
+		}
+	}
+	const uint64_t end = OSUtils::now();
+	controller->requestQueueStats(rqs);
+	const unsigned long rate = (unsigned long)((double)total / ((double)std::max(end - start,(uint64_t)1) / 1000.0));
+	std::cout << rounds << " rounds, " << (rqs.dropped - droppedBefore) << " dropped and retried, max queue " << rqs.maxQueued << ", " << queueTime << "ms to queue, " << rate << " requests/second ";
+	if ((sender.configs != total)||(sender.errors)||((rqs.received - receivedBefore) != total)||(rqs.maxQueued > ZT_SQLITENETWORKCONTROLLER_MAX_QUEUED_REQUESTS)) {
+		std::cout << "FAILED!" << std::endl;
+		return 0;
+	}
+	return std::max(rate,1UL);
+}
+
+static int testController()
+{
+	// Without -b requests are replayed from a tenth of the members
+	const unsigned int memberCount = (benchmarks) ? ZT_TEST_CONTROLLER_MEMBERS : (ZT_TEST_CONTROLLER_MEMBERS / 10);
+	const unsigned long total = ZT_TEST_CONTROLLER_NETWORKS * memberCount;
+
+	std::cout << "[controller] Creating " << ZT_TEST_CONTROLLER_NETWORKS << " networks in an in-memory database... "; std::cout.flush();
+	Identity controllerId(KNOWN_GOOD_IDENTITY);
+	SqliteNetworkController *const controller = new SqliteNetworkController((Node *)0,":memory:","");
+	for(unsigned int n=0;n<ZT_TEST_CONTROLLER_NETWORKS;++n) {
+		char nwids[24];
+		Utils::snprintf(nwids,sizeof(nwids),"%.16llx",(unsigned long long)((controllerId.address().toInt() << 24) | (uint64_t)(n + 1)));
+		std::vector<std::string> path;
+		path.push_back("network");
+		path.push_back(nwids);
+		std::string responseBody,responseContentType;
+		if (controller->handleControlPlaneHttpPOST(path,std::map<std::string,std::string>(),std::map<std::string,std::string>(),"{\"name\":\"test\",\"private\":false}",responseBody,responseContentType) != 200) {
+			std::cout << "FAILED! (POST " << nwids << ")" << std::endl;
+			return -1;
+		}
+	}
+	std::cout << "PASS" << std::endl;
+
+	// Members only need distinct addresses, so they share one public key
+	std::vector<Identity> members;
+	{
+		const std::string pub(controllerId.toString(false).substr(10));
+		for(unsigned int m=0;m<memberCount;++m) {
+			char addr[16];
+			Utils::snprintf(addr,sizeof(addr),"%.10llx",(unsigned long long)(0x1000000000ULL + m));
+			members.push_back(Identity((std::string(addr) + pub).c_str()));
+		}
+	}
+	Dictionary<ZT_NETWORKCONFIG_DICT_CAPACITY> metaData;
+	metaData.add(ZT_NETWORKCONFIG_REQUEST_METADATA_KEY_VERSION,(uint64_t)ZT_NETWORKCONFIG_VERSION);
+	metaData.add(ZT_NETWORKCONFIG_REQUEST_METADATA_KEY_PROTOCOL_VERSION,(uint64_t)ZT_PROTO_VERSION);
+
+	// The second time around nothing has changed, so every config should come from the cache
+	for(unsigned int replay=0;replay<2;++replay) {
+		if (replay) {
+			Thread::sleep(1100); // members may only ask once per second
+			std::cout << "[controller] Replaying them again... ";
+		} else {
+			std::cout << "[controller] Replaying " << total << " config requests from " << memberCount << " members of each network... ";
+		}
+		std::cout.flush();
+		if (!testControllerReplay(controller,controllerId,members,metaData))
+			return -1;
+		std::cout << "PASS" << std::endl;
+	}
+	SqliteNetworkController::ConfigCacheStats ccs;
+	controller->configCacheStats(ccs);
+	std::cout << "[controller] Config cache: " << ccs.configHits << " hits, " << ccs.configMisses << " misses ";
+	if ((ccs.configHits != total)||(ccs.configMisses != total)) {
+		std::cout << "FAILED!" << std::endl;
+		return -1;
+	}
+	std::cout << "PASS" << std::endl;
+
+	// Benchmark doNetworkConfigRequest() itself: first requests create members in the
+	// database, refreshes after that should be answered from the in-memory cache.
+	const unsigned int benchMembers = (benchmarks) ? ZT_TEST_CONTROLLER_BENCHMARK_MEMBERS : (ZT_TEST_CONTROLLER_BENCHMARK_MEMBERS / 100);
+	members.clear();
+	{
+		const std::string pub(controllerId.toString(false).substr(10));
+		for(unsigned int m=0;m<benchMembers;++m) {
+			char addr[16];
+			Utils::snprintf(addr,sizeof(addr),"%.10llx",(unsigned long long)(0x2000000000ULL + m));
+			members.push_back(Identity((std::string(addr) + pub).c_str()));
+		}
+	}
+	const unsigned long benchTotal = ZT_TEST_CONTROLLER_NETWORKS * benchMembers;
+	for(unsigned int pass=0;pass<2;++pass) {
+		std::cout << "[controller] " << ((pass) ? "Refreshing " : "Requesting ") << ZT_TEST_CONTROLLER_NETWORKS << " networks x " << benchMembers << " members" << ((pass) ? " (cached)... " : " (creating members)... "); std::cout.flush();
+		unsigned long ok = 0;
+		const uint64_t start = OSUtils::now();
+		for(unsigned long i=0;i<benchTotal;++i) {
+			const uint64_t nwid = (controllerId.address().toInt() << 24) | (uint64_t)((i % ZT_TEST_CONTROLLER_NETWORKS) + 1);
+			NetworkConfig nc;
+			if (controller->doNetworkConfigRequest(InetAddress(),controllerId,members[i / ZT_TEST_CONTROLLER_NETWORKS],nwid,metaData,nc) == NetworkController::NETCONF_QUERY_OK)
+				++ok;
+		}
+		const uint64_t end = OSUtils::now();
+		std::cout << (unsigned long)((double)benchTotal / ((double)std::max(end - start,(uint64_t)1) / 1000.0)) << " requests/second ";
+		if (ok != benchTotal) {
+			std::cout << "FAILED! (" << (benchTotal - ok) << " not answered)" << std::endl;
+			return -1;
+		}
+		std::cout << "PASS" << std::endl;
+		Thread::sleep(1100); // members may only ask once per second
+	}
+
+	std::cout << "[controller] Checking that API changes reach cached members... "; std::cout.flush();
+	{
+		const uint64_t nwid = (controllerId.address().toInt() << 24) | 1ULL;
+		char nwids[24];
+		Utils::snprintf(nwids,sizeof(nwids),"%.16llx",(unsigned long long)nwid);
+		std::vector<std::string> path;
+		path.push_back("network");
+		path.push_back(nwids);
+		path.push_back("member");
+		path.push_back(members[0].address().toString());
+		std::string responseBody,responseContentType;
+		if (controller->handleControlPlaneHttpGET(path,std::map<std::string,std::string>(),std::map<std::string,std::string>(),"",responseBody,responseContentType) != 200) {
+			std::cout << "FAILED! (GET member)" << std::endl;
+			return -1;
+		}
+		if (responseBody.find("\"ts\"") == std::string::npos) {
+			std::cout << "FAILED! (member request history not written)" << std::endl;
+			return -1;
+		}
+		if (controller->handleControlPlaneHttpPOST(path,std::map<std::string,std::string>(),std::map<std::string,std::string>(),"{\"authorized\":false}",responseBody,responseContentType) != 200) {
+			std::cout << "FAILED! (POST member)" << std::endl;
+			return -1;
+		}
+		path.resize(2);
+		if (controller->handleControlPlaneHttpPOST(path,std::map<std::string,std::string>(),std::map<std::string,std::string>(),"{\"name\":\"renamed\"}",responseBody,responseContentType) != 200) {
+			std::cout << "FAILED! (POST network)" << std::endl;
+			return -1;
+		}
+		NetworkConfig nc;
+		if (controller->doNetworkConfigRequest(InetAddress(),controllerId,members[0],nwid,metaData,nc) != NetworkController::NETCONF_QUERY_ACCESS_DENIED) {
+			std::cout << "FAILED! (deauthorized member still gets config)" << std::endl;
+			return -1;
+		}
+		if ((controller->doNetworkConfigRequest(InetAddress(),controllerId,members[1],nwid,metaData,nc) != NetworkController::NETCONF_QUERY_OK)||(strcmp(nc.name,"renamed"))) {
+			std::cout << "FAILED! (network change not seen)" << std::endl;
+			return -1;
+		}
+	}
+	std::cout << "PASS" << std::endl;
+
+	std::cout << "[controller] Checking that members get the same signed COM until it's due to be renewed... "; std::cout.flush();
+	{
+		const uint64_t nwid = (controllerId.address().toInt() << 24) | 0x20000ULL;
+		char nwids[24];
+		Utils::snprintf(nwids,sizeof(nwids),"%.16llx",(unsigned long long)nwid);
+		std::vector<std::string> path;
+		path.push_back("network");
+		path.push_back(nwids);
+		std::string responseBody,responseContentType;
+		if (controller->handleControlPlaneHttpPOST(path,std::map<std::string,std::string>(),std::map<std::string,std::string>(),"{\"name\":\"private\",\"private\":true}",responseBody,responseContentType) != 200) {
+			std::cout << "FAILED! (POST " << nwids << ")" << std::endl;
+			return -1;
+		}
+		path.push_back("member");
+		path.push_back(members[0].address().toString());
+		if (controller->handleControlPlaneHttpPOST(path,std::map<std::string,std::string>(),std::map<std::string,std::string>(),"{\"authorized\":true}",responseBody,responseContentType) != 200) {
+			std::cout << "FAILED! (POST member)" << std::endl;
+			return -1;
+		}
+		controller->configCacheStats(ccs);
+		const uint64_t comMissesBefore = ccs.comMisses;
+		NetworkConfig nc1,nc2;
+		if (controller->doNetworkConfigRequest(InetAddress(),controllerId,members[0],nwid,metaData,nc1) != NetworkController::NETCONF_QUERY_OK) {
+			std::cout << "FAILED! (first request)" << std::endl;
+			return -1;
+		}
+		Thread::sleep(1100); // members may only ask once per second
+		if (controller->doNetworkConfigRequest(InetAddress(),controllerId,members[0],nwid,metaData,nc2) != NetworkController::NETCONF_QUERY_OK) {
+			std::cout << "FAILED! (second request)" << std::endl;
+			return -1;
+		}
+		controller->configCacheStats(ccs);
+		if ((!nc1.com)||(!nc1.com.verify(controllerId))||(nc1.com != nc2.com)||((ccs.comMisses - comMissesBefore) != 1)) {
+			std::cout << "FAILED!" << std::endl;
+			return -1;
+		}
+	}
+	std::cout << "PASS" << std::endl;
+
+	// Fill most of a /16 auto-assign pool (65280 usable addresses, .255s excluded)
+	{
+		const uint64_t nwid = (controllerId.address().toInt() << 24) | 0x10000ULL;
+		char nwids[24];
+		Utils::snprintf(nwids,sizeof(nwids),"%.16llx",(unsigned long long)nwid);
+		std::vector<std::string> path;
+		path.push_back("network");
+		path.push_back(nwids);
+		std::string responseBody,responseContentType;
+		if (controller->handleControlPlaneHttpPOST(path,std::map<std::string,std::string>(),std::map<std::string,std::string>(),"{\"name\":\"pool\",\"private\":false,\"v4AssignMode\":\"zt\",\"routes\":[{\"target\":\"10.1.0.0/16\"}],\"ipAssignmentPools\":[{\"ipRangeStart\":\"10.1.0.0\",\"ipRangeEnd\":\"10.1.255.255\"}]}",responseBody,responseContentType) != 200) {
+			std::cout << "[controller] FAILED! (POST " << nwids << ")" << std::endl;
+			return -1;
+		}
+
+		const std::string pub(controllerId.toString(false).substr(10));
+		std::vector<bool> assigned(65536,false);
+		unsigned long count = 0;
+		for(unsigned int phase=0;phase<2;++phase) {
+			const unsigned int first = (phase) ? ZT_TEST_CONTROLLER_POOL_MEMBERS : 0;
+			const unsigned int last = (phase) ? (ZT_TEST_CONTROLLER_POOL_MEMBERS + 1000) : ZT_TEST_CONTROLLER_POOL_MEMBERS;
+			if (phase) {
+				std::cout << "[controller] Reloading pool index from database and assigning 1000 more... "; std::cout.flush();
+				if (controller->handleControlPlaneHttpPOST(path,std::map<std::string,std::string>(),std::map<std::string,std::string>(),"{\"name\":\"pool2\"}",responseBody,responseContentType) != 200) {
+					std::cout << "FAILED! (POST " << nwids << ")" << std::endl;
+					return -1;
+				}
+			} else {
+				std::cout << "[controller] Auto-assigning IPv4 addresses from a /16 pool to " << ZT_TEST_CONTROLLER_POOL_MEMBERS << " members... "; std::cout.flush();
+			}
+			uint64_t start90 = 0,end90 = 0;
+			unsigned long count90 = 0;
+			for(unsigned int m=first;m<last;++m) {
+				char addr[16];
+				Utils::snprintf(addr,sizeof(addr),"%.10llx",(unsigned long long)(0x3000000000ULL + m));
+				const Identity id((std::string(addr) + pub).c_str());
+				if ((!start90)&&(count >= (65280 * 9 / 10)))
+					start90 = OSUtils::now();
+				NetworkConfig nc;
+				if (controller->doNetworkConfigRequest(InetAddress(),controllerId,id,nwid,metaData,nc) != NetworkController::NETCONF_QUERY_OK) {
+					std::cout << "FAILED! (request " << m << ")" << std::endl;
+					return -1;
+				}
+				uint32_t ip = 0;
+				for(unsigned int i=0;i<nc.staticIpCount;++i) {
+					if (nc.staticIps[i].ss_family == AF_INET)
+						ip = Utils::ntoh((uint32_t)reinterpret_cast<const struct sockaddr_in *>(&(nc.staticIps[i]))->sin_addr.s_addr);
+				}
+				if (((ip & 0xffff0000) != 0x0a010000)||((ip & 0xff) == 0xff)||(assigned[ip & 0xffff])) {
+					std::cout << "FAILED! (member " << m << " got bad or duplicate address " << InetAddress(Utils::hton(ip),0).toIpString() << ")" << std::endl;
+					return -1;
+				}
+				assigned[ip & 0xffff] = true;
+				++count;
+				if (start90)
+					++count90;
+			}
+			if (start90)
+				end90 = OSUtils::now();
+			std::cout << (count * 100 / 65280) << "% used";
+			if (count90)
+				std::cout << ", " << (unsigned long)((double)count90 / ((double)std::max(end90 - start90,(uint64_t)1) / 1000.0)) << " assignments/second past 90%";
+			std::cout << " PASS" << std::endl;
+		}
+	}
+
+	std::cout << "[controller] Checking that member changes update a cached network without reloading it... "; std::cout.flush();
+	{
+		// A /24 pool has 255 addresses (.255 excluded), so once it's full the only address a new
+		// member can get is one freed by deleting a member
+		const uint64_t nwid = (controllerId.address().toInt() << 24) | 0x30000ULL;
+		char nwids[24];
+		Utils::snprintf(nwids,sizeof(nwids),"%.16llx",(unsigned long long)nwid);
+		std::vector<std::string> path;
+		path.push_back("network");
+		path.push_back(nwids);
+		std::string responseBody,responseContentType;
+		if (controller->handleControlPlaneHttpPOST(path,std::map<std::string,std::string>(),std::map<std::string,std::string>(),"{\"name\":\"small\",\"private\":false,\"v4AssignMode\":\"zt\",\"routes\":[{\"target\":\"10.2.0.0/24\"}],\"ipAssignmentPools\":[{\"ipRangeStart\":\"10.2.0.0\",\"ipRangeEnd\":\"10.2.0.255\"}]}",responseBody,responseContentType) != 200) {
+			std::cout << "FAILED! (POST " << nwids << ")" << std::endl;
+			return -1;
+		}
+
+		const std::string pub(controllerId.toString(false).substr(10));
+		std::vector<Identity> ids;
+		std::vector<uint32_t> ips;
+		uint64_t revision = 0;
+		for(unsigned int m=0;m<257;++m) {
+			char addr[16];
+			Utils::snprintf(addr,sizeof(addr),"%.10llx",(unsigned long long)(0x4000000000ULL + m));
+			ids.push_back(Identity((std::string(addr) + pub).c_str()));
+		}
+		for(unsigned int m=0;m<255;++m) {
+			NetworkConfig nc;
+			if (controller->doNetworkConfigRequest(InetAddress(),controllerId,ids[m],nwid,metaData,nc) != NetworkController::NETCONF_QUERY_OK) {
+				std::cout << "FAILED! (request " << m << ")" << std::endl;
+				return -1;
+			}
+			uint32_t ip = 0;
+			for(unsigned int i=0;i<nc.staticIpCount;++i) {
+				if (nc.staticIps[i].ss_family == AF_INET)
+					ip = Utils::ntoh((uint32_t)reinterpret_cast<const struct sockaddr_in *>(&(nc.staticIps[i]))->sin_addr.s_addr);
+			}
+			ips.push_back(ip);
+			revision = nc.revision;
+		}
+		controller->configCacheStats(ccs);
+		const uint64_t networkLoadsBefore = ccs.networkLoads;
+
+		path.push_back("member");
+		path.push_back(ids[7].address().toString());
+		if (controller->handleControlPlaneHttpDELETE(path,std::map<std::string,std::string>(),std::map<std::string,std::string>(),"",responseBody,responseContentType) != 200) {
+			std::cout << "FAILED! (DELETE member)" << std::endl;
+			return -1;
+		}
+		path[3] = ids[8].address().toString();
+		if (controller->handleControlPlaneHttpPOST(path,std::map<std::string,std::string>(),std::map<std::string,std::string>(),"{\"activeBridge\":true}",responseBody,responseContentType) != 200) {
+			std::cout << "FAILED! (POST member)" << std::endl;
+			return -1;
+		}
+
+		NetworkConfig nc1,nc2;
+		if ((controller->doNetworkConfigRequest(InetAddress(),controllerId,ids[255],nwid,metaData,nc1) != NetworkController::NETCONF_QUERY_OK)||(controller->doNetworkConfigRequest(InetAddress(),controllerId,ids[256],nwid,metaData,nc2) != NetworkController::NETCONF_QUERY_OK)) {
+			std::cout << "FAILED! (request after changes)" << std::endl;
+			return -1;
+		}
+		uint32_t ip = 0;
+		for(unsigned int i=0;i<nc1.staticIpCount;++i) {
+			if (nc1.staticIps[i].ss_family == AF_INET)
+				ip = Utils::ntoh((uint32_t)reinterpret_cast<const struct sockaddr_in *>(&(nc1.staticIps[i]))->sin_addr.s_addr);
+		}
+		const std::vector<Address> bridges(nc2.activeBridges());
+		controller->configCacheStats(ccs);
+		std::cout << "freed " << InetAddress(Utils::hton(ips[7]),0).toIpString() << " went to " << InetAddress(Utils::hton(ip),0).toIpString() << ", revision " << revision << " -> " << nc2.revision << ", " << (ccs.networkLoads - networkLoadsBefore) << " reloads ";
+		if ((!ips[7])||(ip != ips[7])||(bridges.size() != 1)||(bridges[0] != ids[8].address())||(nc2.revision <= revision)||(ccs.networkLoads != networkLoadsBefore)) {
+			std::cout << "FAILED!" << std::endl;
+			return -1;
+		}
+	}
+	std::cout << "PASS" << std::endl;
+
+	delete controller;
+
+	// Contention benchmark: with a database file in WAL mode request threads fill their caches
+	// through their own read connections while API calls write through the main one.
+	{
+		static const char *const dbFiles[4] = { ZT_TEST_CONTROLLER_DB_PATH,ZT_TEST_CONTROLLER_DB_PATH "-wal",ZT_TEST_CONTROLLER_DB_PATH "-shm",ZT_TEST_CONTROLLER_DB_PATH ".backup" };
+		for(unsigned int f=0;f<4;++f)
+			OSUtils::rm(dbFiles[f]);
+
+		std::cout << "[controller] Creating " << ZT_TEST_CONTROLLER_NETWORKS << " networks in " << ZT_TEST_CONTROLLER_DB_PATH << "... "; std::cout.flush();
+		SqliteNetworkController *const fileController = new SqliteNetworkController((Node *)0,ZT_TEST_CONTROLLER_DB_PATH,"");
+		for(unsigned int n=0;n<ZT_TEST_CONTROLLER_NETWORKS;++n) {
+			char nwids[24];
+			Utils::snprintf(nwids,sizeof(nwids),"%.16llx",(unsigned long long)((controllerId.address().toInt() << 24) | (uint64_t)(n + 1)));
+			std::vector<std::string> path;
+			path.push_back("network");
+			path.push_back(nwids);
+			std::string responseBody,responseContentType;
+			if (fileController->handleControlPlaneHttpPOST(path,std::map<std::string,std::string>(),std::map<std::string,std::string>(),"{\"name\":\"test\",\"private\":false}",responseBody,responseContentType) != 200) {
+				std::cout << "FAILED! (POST " << nwids << ")" << std::endl;
+				return -1;
+			}
+		}
+		std::cout << "PASS" << std::endl;
+
+		members.clear();
+		{
+			const std::string pub(controllerId.toString(false).substr(10));
+			for(unsigned int m=0;m<memberCount;++m) {
+				char addr[16];
+				Utils::snprintf(addr,sizeof(addr),"%.10llx",(unsigned long long)(0x4000000000ULL + m));
+				members.push_back(Identity((std::string(addr) + pub).c_str()));
+			}
+		}
+
+		unsigned long quietRate = 0;
+		for(unsigned int pass=0;pass<3;++pass) {
+			if (pass)
+				Thread::sleep(1100); // members may only ask once per second
+			switch(pass) {
+				case 0: std::cout << "[controller] Replaying " << total << " config requests (creating members)... "; break;
+				case 1: std::cout << "[controller] Replaying them again with no API calls... "; break;
+				default: std::cout << "[controller] Replaying them again with API calls changing members... "; break;
+			}
+			std::cout.flush();
+
+			TestControllerApiWriter writer(fileController,controllerId,members);
+			Thread writerThread;
+			if (pass == 2)
+				writerThread = Thread::start(&writer);
+			const uint64_t start = OSUtils::now();
+			const unsigned long rate = testControllerReplay(fileController,controllerId,members,metaData);
+			const uint64_t end = OSUtils::now();
+			if (pass == 2) {
+				writer.run = false;
+				Thread::join(writerThread);
+			}
+			if (!rate)
+				return -1;
+
+			if (pass == 1)
+				quietRate = rate;
+			if (pass == 2) {
+				std::cout << "(" << (rate * 100 / quietRate) << "% of quiet), " << (unsigned long)((double)writer.writes / ((double)std::max(end - start,(uint64_t)1) / 1000.0)) << " API writes/second, " << writer.reads << " GETs ";
+				if ((writer.errors)||(!writer.writes)) {
+					std::cout << "FAILED! (" << writer.errors << " API errors)" << std::endl;
+					return -1;
+				}
+			}
+			std::cout << "PASS" << std::endl;
+		}
+
+		// Every network's configs must reflect its last API change even though they were being
+		// built from cached state and read connections while the changes were being made
+		std::cout << "[controller] Checking that configs match the database after concurrent changes... "; std::cout.flush();
+		Thread::sleep(1100);
+		for(unsigned int n=0;n<ZT_TEST_CONTROLLER_NETWORKS;++n) {
+			const uint64_t nwid = (controllerId.address().toInt() << 24) | (uint64_t)(n + 1);
+			char nwids[24];
+			Utils::snprintf(nwids,sizeof(nwids),"%.16llx",(unsigned long long)nwid);
+			std::vector<std::string> path;
+			path.push_back("network");
+			path.push_back(nwids);
+			std::string responseBody,responseContentType;
+			if (fileController->handleControlPlaneHttpGET(path,std::map<std::string,std::string>(),std::map<std::string,std::string>(),"",responseBody,responseContentType) != 200) {
+				std::cout << "FAILED! (GET " << nwids << ")" << std::endl;
+				return -1;
+			}
+			const std::string::size_type rev = responseBody.find("\"revision\": ");
+			NetworkConfig nc;
+			if ((rev == std::string::npos)||(fileController->doNetworkConfigRequest(InetAddress(),controllerId,members[0],nwid,metaData,nc) != NetworkController::NETCONF_QUERY_OK)||(nc.revision != Utils::strToU64(responseBody.c_str() + rev + 12))) {
+				std::cout << "FAILED! (" << nwids << " config revision " << nc.revision << ")" << std::endl;
+				return -1;
+			}
+		}
+		std::cout << "PASS" << std::endl;
+
+		delete fileController;
+		for(unsigned int f=0;f<4;++f)
+			OSUtils::rm(dbFiles[f]);
+	}
+
+	return 0;
+}
+#endif // ZT_ENABLE_NETWORK_CONTROLLER
+
+#define ZT_TEST_PHY_NUM_UDP_PACKETS 10000
+#define ZT_TEST_PHY_UDP_PACKET_SIZE 1000
+#define ZT_TEST_PHY_NUM_VALID_TCP_CONNECTS 10
+#define ZT_TEST_PHY_NUM_INVALID_TCP_CONNECTS 2
+#define ZT_TEST_PHY_TCP_MESSAGE_SIZE 1000000
+#define ZT_TEST_PHY_TIMEOUT_MS 20000
+static unsigned long phyTestUdpPacketCount = 0;
+static unsigned long phyTestTcpByteCount = 0;
+static unsigned long phyTestTcpConnectSuccessCount = 0;
+static unsigned long phyTestTcpConnectFailCount = 0;
+static unsigned long phyTestTcpAcceptCount = 0;
+struct TestPhyHandlers;
+static Phy<TestPhyHandlers *> *testPhyInstance = (Phy<TestPhyHandlers *> *)0;
+struct TestPhyHandlers
+{
+	inline void phyOnDatagram(PhySocket *sock,void **uptr,const struct sockaddr *localAddr,const struct sockaddr *from,void *data,unsigned long len)
+	{
+		++phyTestUdpPacketCount;
+	}
+
+	inline void phyOnDatagramBatch(PhySocket *sock,void **uptr,const struct sockaddr *localAddr,const PhyDatagram *datagrams,unsigned int count)
+	{
+		phyTestUdpPacketCount += count;
+	}
+
+	inline void phyOnTcpConnect(PhySocket *sock,void **uptr,bool success)
+	{
+		if (success) {
+			++phyTestTcpConnectSuccessCount;
+		} else {
+			++phyTestTcpConnectFailCount;
+		}
+	}
+
+	inline void phyOnTcpAccept(PhySocket *sockL,PhySocket *sockN,void **uptrL,void **uptrN,const struct sockaddr *from)
+	{
+		++phyTestTcpAcceptCount;
+		*uptrN = new std::string(ZT_TEST_PHY_TCP_MESSAGE_SIZE,(char)0xff);
+		testPhyInstance->setNotifyWritable(sockN,true);
+	}
+
+	inline void phyOnTcpClose(PhySocket *sock,void **uptr)
+	{
+		delete (std::string *)*uptr; // delete testMessage if any
+	}
+
+	inline void phyOnTcpData(PhySocket *sock,void **uptr,void *data,unsigned long len)
+	{
+		phyTestTcpByteCount += len;
+	}
+
+	inline void phyOnTcpWritable(PhySocket *sock,void **uptr)
+	{
+		std::string *testMessage = (std::string *)*uptr;
 		if ((testMessage)&&(testMessage->length() > 0)) {
 			long sent = testPhyInstance->streamSend(sock,(const void *)testMessage->data(),(unsigned long)testMessage->length(),true);
 			if (sent > 0)
@@ -948,6 +2804,47 @@ static int testPhy()
 	}
 	std::cout << "got " << phyTestUdpPacketCount << " packets, OK" << std::endl;
 
+	std::cout << "[phy] Testing batched UDP send/receive... "; std::cout.flush();
+	{
+		PhyDatagram batch[16];
+		for(unsigned int i=0;i<16;++i) {
+			batch[i].addr = (const struct sockaddr *)&bindaddr;
+			batch[i].data = udpTestPayload;
+			batch[i].len = sizeof(udpTestPayload);
+		}
+		const unsigned long receivedBefore = phyTestUdpPacketCount;
+		unsigned long batchesSent = 0;
+		timeoutAt = OSUtils::now() + ZT_TEST_PHY_TIMEOUT_MS;
+		while ((OSUtils::now() < timeoutAt)&&((phyTestUdpPacketCount - receivedBefore) < (64 * 16))) {
+			if (batchesSent < 64) {
+				if (testPhyInstance->udpSendBatch(udpListenSock,batch,16) != 16) {
+					std::cout << "FAILED." << std::endl;
+					return -1;
+				} else ++batchesSent;
+			}
+			testPhyInstance->poll(100);
+		}
+		std::cout << "got " << (phyTestUdpPacketCount - receivedBefore) << " packets, OK" << std::endl;
+	}
+
+#ifdef SO_REUSEPORT
+	std::cout << "[phy] Binding two UDP sockets to 127.0.0.1/60006 with SO_REUSEPORT... "; std::cout.flush();
+	{
+		struct sockaddr_in rpaddr;
+		memcpy(&rpaddr,&bindaddr,sizeof(rpaddr));
+		rpaddr.sin_port = Utils::hton((uint16_t)60006);
+		PhySocket *rp1 = testPhyInstance->udpBind((const struct sockaddr *)&rpaddr,(void *)0,0,true);
+		PhySocket *rp2 = testPhyInstance->udpBind((const struct sockaddr *)&rpaddr,(void *)0,0,true);
+		if ((!rp1)||(!rp2)) {
+			std::cout << "FAILED." << std::endl;
+			return -1;
+		}
+		testPhyInstance->close(rp1,false);
+		testPhyInstance->close(rp2,false);
+		std::cout << "OK" << std::endl;
+	}
+#endif
+
 	std::cout << "[phy] Testing TCP... "; std::cout.flush();
 	timeoutAt = OSUtils::now() + ZT_TEST_PHY_TIMEOUT_MS;
 	while ((OSUtils::now() < timeoutAt)&&(phyTestTcpByteCount < (ZT_TEST_PHY_NUM_VALID_TCP_CONNECTS * ZT_TEST_PHY_TCP_MESSAGE_SIZE))) {
@@ -1087,6 +2984,11 @@ int main(int argc,char **argv)
 	exit(0);
 	*/
 
+	for(int i=1;i<argc;++i) {
+		if ((argv[i][0] == '-')&&(argv[i][1] == 'b')&&(!argv[i][2]))
+			benchmarks = true;
+	}
+
 	std::cout << "[info] sizeof(void *) == " << sizeof(void *) << std::endl;
 	std::cout << "[info] sizeof(NetworkConfig) == " << sizeof(ZeroTier::NetworkConfig) << std::endl;
 
@@ -1098,6 +3000,13 @@ int main(int argc,char **argv)
 	r |= testPacket();
 	r |= testIdentity();
 	r |= testCertificate();
+	r |= testMultipath();
+#ifdef ZT_ENABLE_CLUSTER
+	r |= testCluster();
+#endif
+#ifdef ZT_ENABLE_NETWORK_CONTROLLER
+	r |= testController();
+#endif
 	r |= testPhy();
 	r |= testResolver();
 	//r |= testHttp();
@@ -1105,6 +3014,8 @@ int main(int argc,char **argv)
 
 	if (r)
 		std::cout << std::endl << "SOMETHING FAILED!" << std::endl;
+	else if (!benchmarks)
+		std::cout << std::endl << "(run with -b to include the slower benchmarks)" << std::endl;
 
 	/*
 #ifdef ZT_USE_MINIUPNPC
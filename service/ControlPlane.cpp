@@ -191,7 +191,12 @@ static std::string _jsonEnumerate(unsigned int depth,const ZT_PeerPhysicalPath *
 			"%s\t\"lastReceive\": %llu,\n"
 			"%s\t\"active\": %s,\n"
 			"%s\t\"preferred\": %s,\n"
-			"%s\t\"trustedPathId\": %llu\n"
+			"%s\t\"trustedPathId\": %llu,\n"
+			"%s\t\"latency\": %u,\n"
+			"%s\t\"packetLoss\": %.4f,\n"
+			"%s\t\"packetsSent\": %llu,\n"
+			"%s\t\"bytesSent\": %llu,\n"
+			"%s\t\"mtu\": %u\n"
 			"%s}",
 			prefix,_jsonEscape(reinterpret_cast<const InetAddress *>(&(pp[i].address))->toString()).c_str(),
 			prefix,pp[i].lastSend,
@@ -199,6 +204,11 @@ static std::string _jsonEnumerate(unsigned int depth,const ZT_PeerPhysicalPath *
 			prefix,(pp[i].active == 0) ? "false" : "true",
 			prefix,(pp[i].preferred == 0) ? "false" : "true",
 			prefix,pp[i].trustedPathId,
+			prefix,pp[i].latency,
+			prefix,(double)pp[i].packetLoss,
+			prefix,pp[i].packetsSent,
+			prefix,pp[i].bytesSent,
+			prefix,pp[i].mtu,
 			prefix);
 		buf.append(json);
 	}
@@ -403,6 +413,10 @@ unsigned int ControlPlane::handleRequest(
 					"\t\"worldTimestamp\": %llu,\n"
 					"\t\"online\": %s,\n"
 					"\t\"tcpFallbackActive\": %s,\n"
+					"\t\"deferredPacketQueueDepth\": %lu,\n"
+					"\t\"deferredPacketsDropped\": %llu,\n"
+					"\t\"verifiedComCacheHits\": %llu,\n"
+					"\t\"verifiedComCacheMisses\": %llu,\n"
 					"\t\"versionMajor\": %d,\n"
 					"\t\"versionMinor\": %d,\n"
 					"\t\"versionRev\": %d,\n"
@@ -416,6 +430,10 @@ unsigned int ControlPlane::handleRequest(
 					status.worldTimestamp,
 					(status.online) ? "true" : "false",
 					(_svc->tcpFallbackActive()) ? "true" : "false",
+					status.deferredPacketQueueDepth,
+					(unsigned long long)status.deferredPacketsDropped,
+					(unsigned long long)status.verifiedComCacheHits,
+					(unsigned long long)status.verifiedComCacheMisses,
 					ZEROTIER_ONE_VERSION_MAJOR,
 					ZEROTIER_ONE_VERSION_MINOR,
 					ZEROTIER_ONE_VERSION_REVISION,
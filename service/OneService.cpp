@@ -144,6 +144,21 @@ namespace ZeroTier { typedef BSDEthernetTap EthernetTap; }
 // How often to check for local interface addresses
 #define ZT_LOCAL_INTERFACE_CHECK_INTERVAL 60000
 
+// Background threads for expensive work like validating new peers' identities, one per core (at least two) up to this many
+#ifndef ZT_BACKGROUND_THREADS_MAX
+#define ZT_BACKGROUND_THREADS_MAX 8
+#endif
+
+// On Linux extra threads receive UDP on their own SO_REUSEPORT sockets, one per core up to this many (0 to disable)
+#if defined(__LINUX__) && defined(SO_REUSEPORT)
+#ifndef ZT_UDP_WORKER_THREADS_MAX
+#define ZT_UDP_WORKER_THREADS_MAX 4
+#endif
+#if ZT_UDP_WORKER_THREADS_MAX > 0
+#define ZT_USE_UDP_WORKERS 1
+#endif
+#endif
+
 namespace ZeroTier {
 
 namespace {
@@ -509,6 +524,80 @@ public:
 	unsigned int _ports[3];
 	uint16_t _portsBE[3]; // ports in big-endian network byte order as in sockaddr
 
+	// UDP sends staged by the main thread; worker and tap threads have their own
+	Binder::SendBatch _sendBatch;
+
+#ifdef ZT_USE_UDP_WORKERS
+	/*
+	 * Additional UDP receive threads
+	 *
+	 * Each worker has its own Phy<> and binds the same ports as _bindings with
+	 * SO_REUSEPORT. The kernel hashes each remote endpoint to one socket, so a
+	 * given path's traffic is received by one thread while different peers
+	 * are decoded in parallel. A peer with several paths may still be handled
+	 * by several workers and the main thread at once, which is why Peer locks
+	 * its paths. Replies go out via the main _bindings, staged in the worker's
+	 * own send batch. The worker is its Phy<>'s handler so it can pass that
+	 * batch along; its Phy<> only ever holds UDP sockets.
+	 */
+	struct UdpWorker
+	{
+		UdpWorker(OneServiceImpl *p) :
+			parent(p),
+			phy(this,false,true),
+			run(true),
+			refreshNow(true)
+		{
+			for(int i=0;i<3;++i)
+				bindings[i].setReusePort(true);
+		}
+
+		void threadMain()
+			throw()
+		{
+			try {
+				uint64_t lastBindRefresh = 0;
+				while (run) {
+					const uint64_t now = OSUtils::now();
+					if ((refreshNow)||((now - lastBindRefresh) >= ZT_BINDER_REFRESH_PERIOD)) {
+						refreshNow = false;
+						lastBindRefresh = now;
+						for(int i=0;i<3;++i) {
+							if (parent->_ports[i])
+								bindings[i].refresh(phy,parent->_ports[i],*parent);
+						}
+					}
+					phy.poll(ZT_BINDER_REFRESH_PERIOD);
+				}
+			} catch ( ... ) {}
+			for(int i=0;i<3;++i)
+				bindings[i].closeAll(phy);
+		}
+
+		inline void phyOnDatagram(PhySocket *sock,void **uptr,const struct sockaddr *localAddr,const struct sockaddr *from,void *data,unsigned long len) { parent->phyOnDatagram(sock,uptr,localAddr,from,data,len); }
+		inline void phyOnDatagramBatch(PhySocket *sock,void **uptr,const struct sockaddr *localAddr,const PhyDatagram *datagrams,unsigned int count) { parent->_processDatagramBatch(localAddr,datagrams,count,sendBatch); }
+		inline void phyOnTcpConnect(PhySocket *sock,void **uptr,bool success) {}
+		inline void phyOnTcpAccept(PhySocket *sockL,PhySocket *sockN,void **uptrL,void **uptrN,const struct sockaddr *from) {}
+		inline void phyOnTcpClose(PhySocket *sock,void **uptr) {}
+		inline void phyOnTcpData(PhySocket *sock,void **uptr,void *data,unsigned long len) {}
+		inline void phyOnTcpWritable(PhySocket *sock,void **uptr) {}
+		inline void phyOnFileDescriptorActivity(PhySocket *sock,void **uptr,bool readable,bool writable) {}
+		inline void phyOnUnixAccept(PhySocket *sockL,PhySocket *sockN,void **uptrL,void **uptrN) {}
+		inline void phyOnUnixClose(PhySocket *sock,void **uptr) {}
+		inline void phyOnUnixData(PhySocket *sock,void **uptr,void *data,unsigned long len) {}
+		inline void phyOnUnixWritable(PhySocket *sock,void **uptr,bool lwip_invoked) {}
+
+		OneServiceImpl *const parent;
+		Phy<UdpWorker *> phy;
+		Binder bindings[3];
+		Binder::SendBatch sendBatch;
+		Thread thread;
+		volatile bool run;
+		volatile bool refreshNow;
+	};
+	std::vector<UdpWorker *> _udpWorkers; // started and stopped by run()
+#endif
+
 	// Sockets for JSON API -- bound only to V4 and V6 localhost
 	PhySocket *_v4TcpControlSocket;
 	PhySocket *_v6TcpControlSocket;
@@ -516,7 +605,7 @@ public:
 	// JSON API handler
 	ControlPlane *_controlPlane;
 
-	// Time we last received a packet from a global address
+	// Time we last received a packet from a global address (guarded by _timers_m)
 	uint64_t _lastDirectReceiveFromGlobal;
 #ifdef ZT_TCP_FALLBACK_RELAY
 	uint64_t _lastSendToGlobalV4;
@@ -525,13 +614,17 @@ public:
 	// Last potential sleep/wake event
 	uint64_t _lastRestart;
 
-	// Deadline for the next background task service function
+	// Deadline for the next background task service function (guarded by _timers_m)
 	volatile uint64_t _nextBackgroundTaskDeadline;
 
+	// UDP worker and tap threads update the two timers above too
+	Mutex _timers_m;
+
 	// Configured networks
 	struct NetworkState
 	{
 		NetworkState() :
+			service((OneServiceImpl *)0),
 			tap((EthernetTap *)0)
 		{
 			// Real defaults are in network 'up' code in network event handler
@@ -540,7 +633,9 @@ public:
 			settings.allowDefault = false;
 		}
 
+		OneServiceImpl *service;
 		EthernetTap *tap;
+		Binder::SendBatch sendBatch; // UDP sends staged by this tap's thread
 		ZT_VirtualNetworkConfig config; // memcpy() of raw config from core
 		std::vector<InetAddress> managedIps;
 		std::list<ManagedRoute> managedRoutes;
@@ -791,6 +886,13 @@ public:
 				}
 			}
 
+			// Spread traffic over all of each peer's paths if a "multipath" file exists
+			if (OSUtils::fileExists((_homePath + ZT_PATH_SEPARATOR_S + "multipath").c_str()))
+				_node->setMultipathMode(true);
+
+			// Binder sends ZT_WIRE_PACKET_FLAG_DONT_FRAGMENT packets with DF or not at all
+			_node->setPathMtuDiscovery(true);
+
 #ifdef ZT_ENABLE_NETWORK_CONTROLLER
 			_controller = new SqliteNetworkController(_node,(_homePath + ZT_PATH_SEPARATOR_S + ZT_CONTROLLER_DB_PATH).c_str(),(_homePath + ZT_PATH_SEPARATOR_S + "circuitTestResults.d").c_str());
 			_node->setNetconfMaster((void *)_controller);
@@ -861,11 +963,40 @@ public:
 				}
 			}
 
-			// Start two background threads to handle expensive ops out of line
-			Thread::start(_node);
-			Thread::start(_node);
+			// Start background threads to handle expensive ops out of line
+			{
+				long nbg = 2;
+#ifdef __UNIX_LIKE__
+				nbg = sysconf(_SC_NPROCESSORS_ONLN);
+				if (nbg < 2)
+					nbg = 2;
+				else if (nbg > ZT_BACKGROUND_THREADS_MAX)
+					nbg = ZT_BACKGROUND_THREADS_MAX;
+#endif
+				for(long t=0;t<nbg;++t)
+					Thread::start(_node);
+			}
+
+#ifdef ZT_USE_UDP_WORKERS
+			{
+				long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+				if (ncpus > (ZT_UDP_WORKER_THREADS_MAX + 1))
+					ncpus = ZT_UDP_WORKER_THREADS_MAX + 1;
+				if (ncpus > 1) {
+					for(int i=0;i<3;++i)
+						_bindings[i].setReusePort(true);
+					for(long w=1;w<ncpus;++w) {
+						_udpWorkers.push_back(new UdpWorker(this));
+						_udpWorkers.back()->thread = Thread::start(_udpWorkers.back());
+					}
+				}
+			}
+#endif
 
-			_nextBackgroundTaskDeadline = 0;
+			{
+				Mutex::Lock _l(_timers_m);
+				_nextBackgroundTaskDeadline = 0;
+			}
 			uint64_t clockShouldBe = OSUtils::now();
 			_lastRestart = clockShouldBe;
 			uint64_t lastTapMulticastGroupCheck = 0;
@@ -904,6 +1035,14 @@ public:
 							_bindings[i].refresh(_phy,_ports[i],*this);
 						}
 					}
+#ifdef ZT_USE_UDP_WORKERS
+					if (restarted) {
+						for(std::vector<UdpWorker *>::const_iterator w(_udpWorkers.begin());w!=_udpWorkers.end();++w) {
+							(*w)->refreshNow = true;
+							(*w)->phy.whack();
+						}
+					}
+#endif
 					{
 						Mutex::Lock _l(_nets_m);
 						for(std::map<uint64_t,NetworkState>::iterator n(_nets.begin());n!=_nets.end();++n) {
@@ -913,10 +1052,13 @@ public:
 					}
 				}
 
-				uint64_t dl = _nextBackgroundTaskDeadline;
+				uint64_t dl = _backgroundTaskDeadline();
 				if (dl <= now) {
-					_node->processBackgroundTasks(now,&_nextBackgroundTaskDeadline);
-					dl = _nextBackgroundTaskDeadline;
+					Binder::beginSendBatch(_sendBatch);
+					_node->processBackgroundTasks(now,&dl);
+					Binder::flushSendBatch(_phy,_sendBatch);
+					Mutex::Lock _l(_timers_m);
+					_nextBackgroundTaskDeadline = dl;
 				}
 
 #ifdef ZT_AUTO_UPDATE
@@ -931,7 +1073,7 @@ public:
 					_tcpFallbackResolver.resolveNow();
 				}
 
-				if ((_tcpFallbackTunnel)&&((now - _lastDirectReceiveFromGlobal) < (ZT_TCP_FALLBACK_AFTER / 2)))
+				if ((_tcpFallbackTunnel)&&((now - _lastDirectReceive()) < (ZT_TCP_FALLBACK_AFTER / 2)))
 					_phy.close(_tcpFallbackTunnel->sock);
 
 				if ((now - lastTapMulticastGroupCheck) >= ZT_TAP_CHECK_MULTICAST_INTERVAL) {
@@ -981,6 +1123,16 @@ public:
 			_fatalErrorMessage = "unexpected exception in main thread";
 		}
 
+#ifdef ZT_USE_UDP_WORKERS
+		for(std::vector<UdpWorker *>::const_iterator w(_udpWorkers.begin());w!=_udpWorkers.end();++w) {
+			(*w)->run = false;
+			(*w)->phy.whack();
+			Thread::join((*w)->thread);
+			delete *w;
+		}
+		_udpWorkers.clear();
+#endif
+
 		try {
 			while (!_tcpConnections.empty())
 				_phy.close((*_tcpConnections.begin())->sock);
@@ -995,6 +1147,12 @@ public:
 
 		delete _controlPlane;
 		_controlPlane = (ControlPlane *)0;
+#ifdef ZT_ENABLE_NETWORK_CONTROLLER
+		// Controller request threads reply through the node, so stop them first
+		_node->setNetconfMaster((void *)0);
+		delete _controller;
+		_controller = (SqliteNetworkController *)0;
+#endif
 		delete _node;
 		_node = (Node *)0;
 
@@ -1206,7 +1364,7 @@ public:
 	{
 #ifdef ZT_ENABLE_CLUSTER
 		if (sock == _clusterMessageSocket) {
-			_lastDirectReceiveFromGlobal = OSUtils::now();
+			_receivedDirectFromGlobal(OSUtils::now());
 			_node->clusterHandleIncomingMessage(data,len);
 			return;
 		}
@@ -1218,15 +1376,17 @@ public:
 #endif
 
 		if ((len >= 16)&&(reinterpret_cast<const InetAddress *>(from)->ipScope() == InetAddress::IP_SCOPE_GLOBAL))
-			_lastDirectReceiveFromGlobal = OSUtils::now();
+			_receivedDirectFromGlobal(OSUtils::now());
 
+		uint64_t dl = _backgroundTaskDeadline();
 		const ZT_ResultCode rc = _node->processWirePacket(
 			OSUtils::now(),
 			reinterpret_cast<const struct sockaddr_storage *>(localAddr),
 			(const struct sockaddr_storage *)from, // Phy<> uses sockaddr_storage, so it'll always be that big
 			data,
 			len,
-			&_nextBackgroundTaskDeadline);
+			&dl);
+		_mergeBackgroundTaskDeadline(dl);
 		if (ZT_ResultCode_isFatal(rc)) {
 			char tmp[256];
 			Utils::snprintf(tmp,sizeof(tmp),"fatal error code from processWirePacket: %d",(int)rc);
@@ -1237,6 +1397,60 @@ public:
 		}
 	}
 
+	inline void phyOnDatagramBatch(PhySocket *sock,void **uptr,const struct sockaddr *localAddr,const PhyDatagram *datagrams,unsigned int count)
+	{
+#ifdef ZT_ENABLE_CLUSTER
+		if (sock == _clusterMessageSocket) {
+			for(unsigned int i=0;i<count;++i)
+				phyOnDatagram(sock,uptr,localAddr,datagrams[i].addr,datagrams[i].data,datagrams[i].len);
+			return;
+		}
+#endif
+
+		_processDatagramBatch(localAddr,datagrams,count,_sendBatch);
+	}
+
+	// Called by the main thread and by UDP workers, each with its own send batch
+	inline void _processDatagramBatch(const struct sockaddr *localAddr,const PhyDatagram *datagrams,unsigned int count,Binder::SendBatch &sendBatch)
+	{
+#ifdef ZT_BREAK_UDP
+		if (OSUtils::fileExists("/tmp/ZT_BREAK_UDP"))
+			return;
+#endif
+
+		const uint64_t now = OSUtils::now();
+		uint64_t dl = _backgroundTaskDeadline();
+		bool fromGlobal = false;
+		ZT_WirePacket packets[ZT_PHY_UDP_RECV_BATCH_SIZE];
+		unsigned int np = 0;
+		Binder::beginSendBatch(sendBatch);
+		for(unsigned int i=0;i<count;++i) {
+			if ((datagrams[i].len >= 16)&&(reinterpret_cast<const InetAddress *>(datagrams[i].addr)->ipScope() == InetAddress::IP_SCOPE_GLOBAL))
+				fromGlobal = true;
+			packets[np].localAddress = reinterpret_cast<const struct sockaddr_storage *>(localAddr);
+			packets[np].remoteAddress = reinterpret_cast<const struct sockaddr_storage *>(datagrams[i].addr); // Phy<> uses sockaddr_storage, so it'll always be that big
+			packets[np].packetData = datagrams[i].data;
+			packets[np].packetLength = (unsigned int)datagrams[i].len;
+			if ((++np == ZT_PHY_UDP_RECV_BATCH_SIZE)||((i + 1) == count)) {
+				const ZT_ResultCode rc = _node->processWirePackets(now,packets,np,&dl);
+				np = 0;
+				if (ZT_ResultCode_isFatal(rc)) {
+					char tmp[256];
+					Utils::snprintf(tmp,sizeof(tmp),"fatal error code from processWirePackets: %d",(int)rc);
+					Mutex::Lock _l(_termReason_m);
+					_termReason = ONE_UNRECOVERABLE_ERROR;
+					_fatalErrorMessage = tmp;
+					this->terminate();
+					break;
+				}
+			}
+		}
+		Binder::flushSendBatch(_phy,sendBatch);
+		if (fromGlobal)
+			_receivedDirectFromGlobal(now);
+		_mergeBackgroundTaskDeadline(dl);
+	}
+
 	inline void phyOnTcpConnect(PhySocket *sock,void **uptr,bool success)
 	{
 		if (!success)
@@ -1374,13 +1588,15 @@ public:
 
 							if (from) {
 								InetAddress fakeTcpLocalInterfaceAddress((uint32_t)0xffffffff,0xffff);
+								uint64_t dl = _backgroundTaskDeadline();
 								const ZT_ResultCode rc = _node->processWirePacket(
 									OSUtils::now(),
 									reinterpret_cast<struct sockaddr_storage *>(&fakeTcpLocalInterfaceAddress),
 									reinterpret_cast<struct sockaddr_storage *>(&from),
 									data,
 									plen,
-									&_nextBackgroundTaskDeadline);
+									&dl);
+								_mergeBackgroundTaskDeadline(dl);
 								if (ZT_ResultCode_isFatal(rc)) {
 									char tmp[256];
 									Utils::snprintf(tmp,sizeof(tmp),"fatal error code from processWirePacket: %d",(int)rc);
@@ -1452,7 +1668,8 @@ public:
 							nwid,
 							friendlyName,
 							StapFrameHandler,
-							(void *)this);
+							(void *)&n);
+						n.service = this;
 						*nuptr = (void *)&n;
 
 						char nlcpath[256];
@@ -1616,13 +1833,13 @@ public:
 			}
 
 #ifdef ZT_TCP_FALLBACK_RELAY
-			// TCP fallback tunnel support, currently IPv4 only
-			if ((len >= 16)&&(reinterpret_cast<const InetAddress *>(addr)->ipScope() == InetAddress::IP_SCOPE_GLOBAL)) {
+			// TCP fallback tunnel support, currently IPv4 only (MTU probes stay off it since it would carry any size)
+			if ((len >= 16)&&((ttl & ZT_WIRE_PACKET_FLAG_DONT_FRAGMENT) == 0)&&(reinterpret_cast<const InetAddress *>(addr)->ipScope() == InetAddress::IP_SCOPE_GLOBAL)) {
 				// Engage TCP tunnel fallback if we haven't received anything valid from a global
 				// IP address in ZT_TCP_FALLBACK_AFTER milliseconds. If we do start getting
 				// valid direct traffic we'll stop using it and close the socket after a while.
 				const uint64_t now = OSUtils::now();
-				if (((now - _lastDirectReceiveFromGlobal) > ZT_TCP_FALLBACK_AFTER)&&((now - _lastRestart) > ZT_TCP_FALLBACK_AFTER)) {
+				if (((now - _lastDirectReceive()) > ZT_TCP_FALLBACK_AFTER)&&((now - _lastRestart) > ZT_TCP_FALLBACK_AFTER)) {
 					if (_tcpFallbackTunnel) {
 						Mutex::Lock _l(_tcpFallbackTunnel->writeBuf_m);
 						if (!_tcpFallbackTunnel->writeBuf.length())
@@ -1670,7 +1887,7 @@ public:
 			return 0; // silently break UDP
 #endif
 
-		return (_bindings[fromBindingNo].udpSend(_phy,*(reinterpret_cast<const InetAddress *>(localAddr)),*(reinterpret_cast<const InetAddress *>(addr)),data,len,ttl)) ? 0 : -1;
+		return (_bindings[fromBindingNo].udpSend(_phy,*(reinterpret_cast<const InetAddress *>(localAddr)),*(reinterpret_cast<const InetAddress *>(addr)),data,len,ttl & 0xff,((ttl & ZT_WIRE_PACKET_FLAG_DONT_FRAGMENT) != 0))) ? 0 : -1;
 	}
 
 	inline void nodeVirtualNetworkFrameFunction(uint64_t nwid,void **nuptr,uint64_t sourceMac,uint64_t destMac,unsigned int etherType,unsigned int vlanId,const void *data,unsigned int len)
@@ -1705,9 +1922,13 @@ public:
 		return 1;
 	}
 
-	inline void tapFrameHandler(uint64_t nwid,const MAC &from,const MAC &to,unsigned int etherType,unsigned int vlanId,const void *data,unsigned int len)
+	inline void tapFrameHandler(uint64_t nwid,const MAC &from,const MAC &to,unsigned int etherType,unsigned int vlanId,const void *data,unsigned int len,Binder::SendBatch &sendBatch)
 	{
-		_node->processVirtualNetworkFrame(OSUtils::now(),nwid,from.toInt(),to.toInt(),etherType,vlanId,data,len,&_nextBackgroundTaskDeadline);
+		uint64_t dl = _backgroundTaskDeadline();
+		Binder::beginSendBatch(sendBatch);
+		_node->processVirtualNetworkFrame(OSUtils::now(),nwid,from.toInt(),to.toInt(),etherType,vlanId,data,len,&dl);
+		Binder::flushSendBatch(_phy,sendBatch);
+		_mergeBackgroundTaskDeadline(dl);
 	}
 
 	inline void onHttpRequestToServer(TcpConnection *tc)
@@ -1798,6 +2019,29 @@ public:
 		return p;
 	}
 
+	inline uint64_t _backgroundTaskDeadline()
+	{
+		Mutex::Lock _l(_timers_m);
+		return _nextBackgroundTaskDeadline;
+	}
+	inline void _mergeBackgroundTaskDeadline(uint64_t dl)
+	{
+		Mutex::Lock _l(_timers_m);
+		if (dl < _nextBackgroundTaskDeadline)
+			_nextBackgroundTaskDeadline = dl;
+	}
+	inline uint64_t _lastDirectReceive()
+	{
+		Mutex::Lock _l(_timers_m);
+		return _lastDirectReceiveFromGlobal;
+	}
+	inline void _receivedDirectFromGlobal(uint64_t now)
+	{
+		Mutex::Lock _l(_timers_m);
+		if (now > _lastDirectReceiveFromGlobal)
+			_lastDirectReceiveFromGlobal = now;
+	}
+
 	bool _trialBind(unsigned int port)
 	{
 		struct sockaddr_in in4;
@@ -1865,7 +2109,10 @@ static int SclusterGeoIpFunction(void *uptr,const struct sockaddr_storage *addr,
 #endif
 
 static void StapFrameHandler(void *uptr,uint64_t nwid,const MAC &from,const MAC &to,unsigned int etherType,unsigned int vlanId,const void *data,unsigned int len)
-{ reinterpret_cast<OneServiceImpl *>(uptr)->tapFrameHandler(nwid,from,to,etherType,vlanId,data,len); }
+{
+	OneServiceImpl::NetworkState *const n = reinterpret_cast<OneServiceImpl::NetworkState *>(uptr);
+	n->service->tapFrameHandler(nwid,from,to,etherType,vlanId,data,len,n->sendBatch);
+}
 
 static int ShttpOnMessageBegin(http_parser *parser)
 {
@@ -159,6 +159,12 @@ struct TcpProxyService
 		}
 	}
 
+	void phyOnDatagramBatch(PhySocket *sock,void **uptr,const struct sockaddr *localAddr,const PhyDatagram *datagrams,unsigned int count)
+	{
+		for(unsigned int i=0;i<count;++i)
+			phyOnDatagram(sock,uptr,datagrams[i].addr,datagrams[i].data,datagrams[i].len);
+	}
+
 	void phyOnTcpConnect(PhySocket *sock,void **uptr,bool success)
 	{
 		// unused, we don't initiate outbound connections